@@ -1,19 +1,34 @@
 #!/usr/bin/env python3
 # -*- coding: utf-8 -*-
 
+import sys
 from setuptools import Extension, setup
 
 __version__ = '0.4.2'
 
-huffman_src = ['src/hufflib.c',
+huffman_src = ['src/canonical.c',
+               'src/cl_parse.c',
+               'src/demo.c',
+               'src/hufflib.c',
                'src/huffman.c',
                'src/msg.c',
-               'src/q_shared.c']
+               'src/net_batch.c',
+               'src/netchan.c',
+               'src/q_shared.c',
+               'src/snapshot.c',
+               'src/sys_thread.c']
 huffman_dep = ['src/qcommon.h',
                'src/q_shared.h']
 
+huffman_cflags = ['-std=c99']
+huffman_ldflags = []
+if sys.platform != 'win32':
+    huffman_cflags.append('-pthread')
+    huffman_ldflags.append('-pthread')
+
 huffman_ext = Extension('q3huff', huffman_src, depends=huffman_dep,
-                        extra_compile_args=['-std=c99'])
+                        extra_compile_args=huffman_cflags,
+                        extra_link_args=huffman_ldflags)
 
 setup(name='q3huff', version = __version__,
       ext_modules = [huffman_ext],
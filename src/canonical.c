@@ -0,0 +1,596 @@
+// canonical.c -- static canonical huffman coding, not Quake 3 compatible
+
+/*
+ * A two pass alternative to the adaptive coder for data both ends control.
+ * The whole input is counted first, code lengths are built from the counts
+ * and limited to HUFF_CANON_MAX_LEN bits, and only the lengths are sent:
+ *
+ *   tag (1)  uncompressed size (4, little endian)  lengths (128)  bits
+ *
+ * with the length of byte 2i in the low nibble of length byte i and that of
+ * 2i+1 in the high one, 0 for bytes that don't occur.  Codes are assigned
+ * canonically (shorter first, then by byte value) and, like the rest of the
+ * bitstreams here, are packed least significant bit first.
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "q_shared.h"
+#include "qcommon.h"
+
+#define	CANON_TABLE_SIZE	(1 << HUFF_CANON_MAX_LEN)
+
+static int CompareKeys( const void *a, const void *b ) {
+	uint64_t	ka = *(const uint64_t *)a, kb = *(const uint64_t *)b;
+
+	return ka < kb ? -1 : ka > kb;
+}
+
+/*
+==================
+Huff_CanonicalLengths
+
+Code lengths of at most HUFF_CANON_MAX_LEN bits for bytes occurring counts[i]
+times.  Built as a normal huffman tree; when it comes out too deep the counts
+are flattened and it is built again.
+==================
+*/
+static void Huff_CanonicalLengths( const unsigned *counts, byte *lens ) {
+	uint64_t	keys[256];
+	unsigned	weight[511], scaled[256];
+	int			symbols[256], parent[511], depth[511];
+	int			i, n, leaf, inner, next, pick, maxLen;
+
+	memset( lens, 0, 256 );
+	n = 0;
+	for ( i = 0 ; i < 256 ; i++ ) {
+		scaled[i] = counts[i];
+		if ( counts[i] ) {
+			symbols[n++] = i;
+		}
+	}
+	if ( n == 0 ) {
+		return;
+	}
+	if ( n == 1 ) {
+		lens[symbols[0]] = 1;
+		return;
+	}
+
+	while ( 1 ) {
+		// leaves sorted by count, then merged with the internal nodes, which
+		// are made in order of weight, so the two lightest are always in front
+		for ( i = 0 ; i < n ; i++ ) {
+			keys[i] = (uint64_t)scaled[symbols[i]] << 8 | symbols[i];
+		}
+		qsort( keys, n, sizeof( keys[0] ), CompareKeys );
+		for ( i = 0 ; i < n ; i++ ) {
+			symbols[i] = (int)( keys[i] & 0xff );
+			weight[i] = scaled[symbols[i]];
+		}
+		leaf = 0;
+		inner = n;
+		for ( next = n ; next < 2*n - 1 ; next++ ) {
+			weight[next] = 0;
+			for ( i = 0 ; i < 2 ; i++ ) {
+				if ( leaf < n && ( inner >= next || weight[leaf] <= weight[inner] ) ) {
+					pick = leaf++;
+				} else {
+					pick = inner++;
+				}
+				weight[next] += weight[pick];
+				parent[pick] = next;
+			}
+		}
+
+		depth[2*n - 2] = 0;
+		maxLen = 0;
+		for ( i = 2*n - 3 ; i >= 0 ; i-- ) {
+			depth[i] = depth[parent[i]] + 1;
+			if ( depth[i] > maxLen ) {
+				maxLen = depth[i];
+			}
+		}
+		if ( maxLen <= HUFF_CANON_MAX_LEN ) {
+			break;
+		}
+		for ( i = 0 ; i < n ; i++ ) {
+			scaled[symbols[i]] = ( scaled[symbols[i]] >> 1 ) + 1;
+		}
+	}
+
+	for ( i = 0 ; i < n ; i++ ) {
+		lens[symbols[i]] = depth[i];
+	}
+}
+
+/*
+==================
+Huff_CanonicalCodes
+
+Canonical codes for lens, bit reversed so they can be or'ed into a least
+significant bit first stream.  Returns qfalse if the lengths over-subscribe
+the code space.
+==================
+*/
+static qboolean Huff_CanonicalCodes( const byte *lens, unsigned *codes ) {
+	int			count[HUFF_CANON_MAX_LEN + 1], nextCode[HUFF_CANON_MAX_LEN + 1];
+	int			i, len, code, space;
+	unsigned	c, r;
+
+	memset( count, 0, sizeof( count ) );
+	for ( i = 0 ; i < 256 ; i++ ) {
+		if ( lens[i] > HUFF_CANON_MAX_LEN ) {
+			return qfalse;
+		}
+		count[lens[i]]++;
+	}
+
+	count[0] = 0;
+	code = 0;
+	space = 1;
+	for ( len = 1 ; len <= HUFF_CANON_MAX_LEN ; len++ ) {
+		code = ( code + count[len - 1] ) << 1;
+		nextCode[len] = code;
+		space = ( space << 1 ) - count[len];
+		if ( space < 0 ) {
+			return qfalse;
+		}
+	}
+
+	for ( i = 0 ; i < 256 ; i++ ) {
+		len = lens[i];
+		codes[i] = 0;
+		if ( !len ) {
+			continue;
+		}
+		c = nextCode[len]++;
+		for ( r = 0 ; len-- ; c >>= 1 ) {
+			r = ( r << 1 ) | ( c & 1 );
+		}
+		codes[i] = r;
+	}
+	return qtrue;
+}
+
+/*
+==================
+Huff_CanonicalTable
+
+Decoding table indexed by the next HUFF_CANON_MAX_LEN bits of the stream,
+each entry the byte in its low 8 bits and the code length above them, 0
+where no code matches.
+==================
+*/
+static qboolean Huff_CanonicalTable( const byte *lens, unsigned short *table ) {
+	unsigned	codes[256];
+	int			i, j;
+
+	if ( !Huff_CanonicalCodes( lens, codes ) ) {
+		return qfalse;
+	}
+	memset( table, 0, CANON_TABLE_SIZE * sizeof( table[0] ) );
+	for ( i = 0 ; i < 256 ; i++ ) {
+		if ( !lens[i] ) {
+			continue;
+		}
+		for ( j = codes[i] ; j < CANON_TABLE_SIZE ; j += 1 << lens[i] ) {
+			table[j] = (unsigned short)( i | ( lens[i] << 8 ) );
+		}
+	}
+	return qtrue;
+}
+
+static void Huff_CanonicalCount( const byte *data, int size, unsigned *counts ) {
+	int		i;
+
+	memset( counts, 0, 256 * sizeof( counts[0] ) );
+	for ( i = 0 ; i < size ; i++ ) {
+		counts[data[i]]++;
+	}
+}
+
+/* Bytes the coded data takes, without the header */
+static int64_t Huff_CanonicalBytes( const unsigned *counts, const byte *lens ) {
+	int64_t	bits;
+	int		i;
+
+	bits = 0;
+	for ( i = 0 ; i < 256 ; i++ ) {
+		bits += (int64_t)counts[i] * lens[i];
+	}
+	return ( bits + 7 ) >> 3;
+}
+
+/*
+==================
+Huff_CanonicalCompressedSize
+
+Length of the Huff_CanonicalCompress output for data, without producing it.
+-1 if it would not fit in an int.
+==================
+*/
+int Huff_CanonicalCompressedSize( const byte *data, int size ) {
+	unsigned	counts[256];
+	byte		lens[256];
+
+	int64_t		length;
+
+	Huff_CanonicalCount( data, size, counts );
+	Huff_CanonicalLengths( counts, lens );
+	length = HUFF_CANON_HEADER + Huff_CanonicalBytes( counts, lens );
+	return length > INT_MAX ? -1 : (int)length;
+}
+
+static void Huff_CanonicalPutHeader( byte *out, byte tag, int size, const byte *lens ) {
+	int		i;
+
+	out[0] = tag;
+	out[1] = size & 0xff;
+	out[2] = ( size >> 8 ) & 0xff;
+	out[3] = ( size >> 16 ) & 0xff;
+	out[4] = ( size >> 24 ) & 0xff;
+	for ( i = 0 ; i < 128 ; i++ ) {
+		out[5 + i] = lens[2*i] | ( lens[2*i + 1] << 4 );
+	}
+}
+
+/*
+==================
+Huff_CanonicalEncode
+
+Writes the codes of size bytes of data to out, returns the bytes written.
+The codes are gathered into a 64 bit word and stored 32 bits at a time.
+==================
+*/
+static int Huff_CanonicalEncode( const unsigned *codes, const byte *lens, const byte *data, int size, byte *out ) {
+	uint64_t	acc;
+	int			i, pos, n;
+
+	acc = 0;
+	n = 0;
+	pos = 0;
+	for ( i = 0 ; i < size ; i++ ) {
+		acc |= (uint64_t)codes[data[i]] << n;
+		n += lens[data[i]];
+		if ( n >= 32 ) {
+			out[pos] = (byte)acc;
+			out[pos + 1] = (byte)( acc >> 8 );
+			out[pos + 2] = (byte)( acc >> 16 );
+			out[pos + 3] = (byte)( acc >> 24 );
+			pos += 4;
+			acc >>= 32;
+			n -= 32;
+		}
+	}
+	for ( ; n > 0 ; n -= 8 ) {
+		out[pos++] = (byte)acc;
+		acc >>= 8;
+	}
+	return pos;
+}
+
+/*
+==================
+Huff_CanonicalCompress
+
+Compresses size bytes of data into out, returns the length written or -1 if
+it needs more than maxsize bytes.
+==================
+*/
+int Huff_CanonicalCompress( const byte *data, int size, byte *out, int maxsize ) {
+	unsigned	counts[256], codes[256];
+	byte		lens[256];
+
+	Huff_CanonicalCount( data, size, counts );
+	Huff_CanonicalLengths( counts, lens );
+	if ( HUFF_CANON_HEADER + Huff_CanonicalBytes( counts, lens ) > maxsize ) {
+		return -1;
+	}
+	Huff_CanonicalCodes( lens, codes );
+	Huff_CanonicalPutHeader( out, HUFF_CANON_TAG, size, lens );
+	return HUFF_CANON_HEADER + Huff_CanonicalEncode( codes, lens, data, size, out + HUFF_CANON_HEADER );
+}
+
+/*
+==================
+Huff_CanonicalSize
+
+Uncompressed length of canonical data with the given tag, -1 if data can't
+be one.  Every byte takes at least a bit, which bounds what a valid header
+may claim.
+==================
+*/
+int Huff_CanonicalSize( const byte *data, int size, byte tag ) {
+	int64_t	length;
+
+	if ( size < HUFF_CANON_HEADER || data[0] != tag ) {
+		return -1;
+	}
+	length = (int64_t)data[1] | (int64_t)data[2] << 8 | (int64_t)data[3] << 16 | (int64_t)data[4] << 24;
+	if ( length > (int64_t)( size - HUFF_CANON_HEADER ) * 8 ) {
+		return -1;
+	}
+	return (int)length;
+}
+
+static void Huff_CanonicalGetLengths( const byte *data, byte *lens ) {
+	int		i;
+
+	for ( i = 0 ; i < 128 ; i++ ) {
+		lens[2*i] = data[5 + i] & 15;
+		lens[2*i + 1] = data[5 + i] >> 4;
+	}
+}
+
+typedef struct {
+	const byte	*data;
+	int			pos, size;
+	uint64_t	acc;		// next bits of the stream, lowest first
+	int			n;			// bits in acc
+} bitReader_t;
+
+static void Huff_InitReader( bitReader_t *br, const byte *data, int size ) {
+	br->data = data;
+	br->pos = 0;
+	br->size = size;
+	br->acc = 0;
+	br->n = 0;
+}
+
+/* Tops acc up to at least 56 bits while the stream lasts; eight bytes are
+ * loaded at once and the bits of the last partly used one come in again,
+ * the same, next time */
+static void Huff_Refill( bitReader_t *br ) {
+	const byte	*p;
+
+	if ( br->pos + 8 <= br->size ) {
+		p = br->data + br->pos;
+		br->acc |= ( (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+			(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56 ) << br->n;
+		br->pos += ( 63 - br->n ) >> 3;
+		br->n |= 56;
+	} else {
+		for ( ; br->n <= 56 && br->pos < br->size ; br->n += 8 ) {
+			br->acc |= (uint64_t)br->data[br->pos++] << br->n;
+		}
+	}
+}
+
+/*
+==================
+Huff_CanonicalDecode
+
+Decodes count bytes from a stream.  Returns qfalse on a bad code or if the
+stream runs out.
+==================
+*/
+static qboolean Huff_CanonicalDecode( const unsigned short *table, bitReader_t *br, byte *out, int count ) {
+	int		i, len, entry;
+
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( br->n < HUFF_CANON_MAX_LEN ) {
+			Huff_Refill( br );
+		}
+		entry = table[br->acc & ( CANON_TABLE_SIZE - 1 )];
+		len = entry >> 8;
+		if ( !len || len > br->n ) {
+			return qfalse;
+		}
+		out[i] = (byte)entry;
+		br->acc >>= len;
+		br->n -= len;
+	}
+	return qtrue;
+}
+
+/*
+==================
+Huff_CanonicalDecompress
+
+Decompresses Huff_CanonicalCompress output into out, which must hold the
+Huff_CanonicalSize bytes.  Returns that length, or -1 if data is corrupt.
+==================
+*/
+int Huff_CanonicalDecompress( const byte *data, int size, byte *out, int maxsize ) {
+	unsigned short	table[CANON_TABLE_SIZE];
+	bitReader_t		br;
+	byte			lens[256];
+	int				length;
+
+	length = Huff_CanonicalSize( data, size, HUFF_CANON_TAG );
+	if ( length < 0 || length > maxsize ) {
+		return -1;
+	}
+	Huff_CanonicalGetLengths( data, lens );
+	if ( !Huff_CanonicalTable( lens, table ) ) {
+		return -1;
+	}
+	Huff_InitReader( &br, data + HUFF_CANON_HEADER, size - HUFF_CANON_HEADER );
+	if ( !Huff_CanonicalDecode( table, &br, out, length ) ) {
+		return -1;
+	}
+	return length;
+}
+
+/*
+==============================================================================
+
+INTERLEAVED STREAMS
+
+The input is cut into HUFF_STREAMS equal parts, the last one shorter, each
+coded into its own stream with one shared canonical code.  The canonical
+header is followed by the byte lengths of all streams but the last, as 4
+byte little endian values, then the streams.  The decoder advances all of
+them in lockstep, so their table lookups and shifts don't wait on each
+other.
+
+==============================================================================
+*/
+
+static int Huff_StreamPart( int size ) {
+	return ( size + HUFF_STREAMS - 1 ) / HUFF_STREAMS;
+}
+
+/* Code lengths for data and the length of its interleaved output */
+static int64_t Huff_InterleavedLengths( const byte *data, int size, byte *lens ) {
+	unsigned	counts[HUFF_STREAMS][256], total[256];
+	int64_t		length;
+	int			i, k, part, start;
+
+	part = Huff_StreamPart( size );
+	memset( total, 0, sizeof( total ) );
+	for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+		start = k * part < size ? k * part : size;
+		Huff_CanonicalCount( data + start, start + part < size ? part : size - start, counts[k] );
+		for ( i = 0 ; i < 256 ; i++ ) {
+			total[i] += counts[k][i];
+		}
+	}
+	Huff_CanonicalLengths( total, lens );
+
+	length = HUFF_INTERLEAVED_HEADER;
+	for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+		length += Huff_CanonicalBytes( counts[k], lens );
+	}
+	return length;
+}
+
+/*
+==================
+Huff_InterleavedCompressedSize
+
+Length of the Huff_InterleavedCompress output for data, -1 if it would not
+fit in an int.
+==================
+*/
+int Huff_InterleavedCompressedSize( const byte *data, int size ) {
+	byte		lens[256];
+	int64_t		length;
+
+	length = Huff_InterleavedLengths( data, size, lens );
+	return length > INT_MAX ? -1 : (int)length;
+}
+
+/*
+==================
+Huff_InterleavedCompress
+
+Huff_CanonicalCompress into HUFF_STREAMS interleavable streams.  Returns the
+length written, or -1 if it needs more than maxsize bytes.
+==================
+*/
+int Huff_InterleavedCompress( const byte *data, int size, byte *out, int maxsize ) {
+	unsigned	codes[256];
+	byte		lens[256];
+	int			k, part, start, pos, len;
+
+	if ( Huff_InterleavedLengths( data, size, lens ) > maxsize ) {
+		return -1;
+	}
+	Huff_CanonicalCodes( lens, codes );
+	Huff_CanonicalPutHeader( out, HUFF_INTERLEAVED_TAG, size, lens );
+
+	part = Huff_StreamPart( size );
+	pos = HUFF_INTERLEAVED_HEADER;
+	for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+		start = k * part < size ? k * part : size;
+		len = Huff_CanonicalEncode( codes, lens, data + start, start + part < size ? part : size - start, out + pos );
+		if ( k < HUFF_STREAMS - 1 ) {
+			out[HUFF_CANON_HEADER + 4*k] = len & 0xff;
+			out[HUFF_CANON_HEADER + 4*k + 1] = ( len >> 8 ) & 0xff;
+			out[HUFF_CANON_HEADER + 4*k + 2] = ( len >> 16 ) & 0xff;
+			out[HUFF_CANON_HEADER + 4*k + 3] = ( len >> 24 ) & 0xff;
+		}
+		pos += len;
+	}
+	return pos;
+}
+
+/*
+==================
+Huff_InterleavedDecompress
+
+Decompresses Huff_InterleavedCompress output into out, which must hold the
+Huff_CanonicalSize bytes.  Returns that length, or -1 if data is corrupt.
+
+While every stream has four bytes to go and eight to read, each is refilled
+to 56 bits and gives four codes of at most 12 bits without further checks;
+a bad code is only noted, and the streams finish one at a time.
+==================
+*/
+int Huff_InterleavedDecompress( const byte *data, int size, byte *out, int maxsize ) {
+	unsigned short	table[CANON_TABLE_SIZE];
+	bitReader_t		br[HUFF_STREAMS];
+	byte			lens[256], *dst[HUFF_STREAMS];
+	int				left[HUFF_STREAMS];
+	int				i, j, k, length, part, pos, len, entry, bad;
+
+	length = Huff_CanonicalSize( data, size, HUFF_INTERLEAVED_TAG );
+	if ( length < 0 || length > maxsize || size < HUFF_INTERLEAVED_HEADER ) {
+		return -1;
+	}
+	Huff_CanonicalGetLengths( data, lens );
+	if ( !Huff_CanonicalTable( lens, table ) ) {
+		return -1;
+	}
+
+	part = Huff_StreamPart( length );
+	pos = HUFF_INTERLEAVED_HEADER;
+	for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+		if ( k < HUFF_STREAMS - 1 ) {
+			i = HUFF_CANON_HEADER + 4*k;
+			len = data[i] | data[i + 1] << 8 | data[i + 2] << 16 | ( data[i + 3] & 0x7f ) << 24;
+			if ( data[i + 3] & 0x80 || len > size - pos ) {
+				return -1;
+			}
+		} else {
+			len = size - pos;
+		}
+		Huff_InitReader( &br[k], data + pos, len );
+		pos += len;
+
+		i = k * part < length ? k * part : length;
+		dst[k] = out + i;
+		left[k] = i + part < length ? part : length - i;
+	}
+
+	bad = 0;
+	while ( 1 ) {
+		for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+			if ( left[k] < 4 || br[k].pos + 8 > br[k].size ) {
+				break;
+			}
+		}
+		if ( k < HUFF_STREAMS ) {
+			break;
+		}
+
+		for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+			Huff_Refill( &br[k] );
+		}
+		for ( j = 0 ; j < 4 ; j++ ) {
+			for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+				entry = table[br[k].acc & ( CANON_TABLE_SIZE - 1 )];
+				bad |= entry < 256;
+				*dst[k]++ = (byte)entry;
+				br[k].acc >>= entry >> 8;
+				br[k].n -= entry >> 8;
+			}
+		}
+		for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+			left[k] -= 4;
+		}
+	}
+	if ( bad ) {
+		return -1;
+	}
+
+	for ( k = 0 ; k < HUFF_STREAMS ; k++ ) {
+		if ( !Huff_CanonicalDecode( table, &br[k], dst[k], left[k] ) ) {
+			return -1;
+		}
+	}
+	return length;
+}
@@ -0,0 +1,1566 @@
+// cl_parse.c -- parse a message received from the server, for demo processing
+
+/*
+ * A cut down CL_ParseServerMessage that keeps the client state the parse
+ * needs in a private clParse_t instead of the cl/clc globals, so any number
+ * of demos (or pieces of one) can be parsed on different threads at once.
+ * A gamestate clears all of that state, so a demo split at its gamestates
+ * parses to the same snapshots piece by piece as it does in one go.
+ */
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "q_shared.h"
+#include "qcommon.h"
+
+#define	PACKET_MASK			(PACKET_BACKUP-1)
+#define	MAX_PARSE_ENTITIES	( PACKET_BACKUP * MAX_SNAPSHOT_ENTITIES )
+#define	MAX_MAP_AREA_BYTES	32
+
+// server to client ops, as in ioquake3's qcommon.h
+enum svc_ops_e {
+	svc_bad,
+	svc_nop,
+	svc_gamestate,
+	svc_configstring,			// [short] [string] only in gamestate messages
+	svc_baseline,				// only in gamestate messages
+	svc_serverCommand,			// [string] to be executed by client game module
+	svc_download,				// [short] size [size bytes]
+	svc_snapshot,
+	svc_EOF
+};
+
+typedef struct {
+	qboolean		valid;			// cleared if delta parsing was invalid
+	int				messageNum;		// copied from netchan->incoming_sequence
+	int				deltaNum;		// messageNum the delta is from
+	int				serverTime;		// server time the message is valid for (in msec)
+	int				snapFlags;		// SNAPFLAG_RATE_DELAYED, etc
+	int				areamaskLen;
+	byte			areamask[MAX_MAP_AREA_BYTES];	// portalarea visibility bits
+	playerState_t	ps;
+	int				numEntities;	// all of the entities that need to be presented
+	int				parseEntitiesNum;	// at the time of this snapshot
+} clSnapshot_t;
+
+typedef struct {
+	clSnapshot_t	snap;			// latest received from server
+	clSnapshot_t	snapshots[PACKET_BACKUP];
+	entityState_t	entityBaselines[MAX_GENTITIES];	// for delta compression when not in previous frame
+	entityState_t	parseEntities[MAX_PARSE_ENTITIES];
+	int				parseEntitiesNum;	// index (not anded off) into parseEntities[]
+	int				serverMessageSequence;
+	int				reliableAcknowledge;	// of the message being parsed
+	int				serverCommandSequence;	// of the last command parsed
+	qboolean		newSnapshot;	// the message had a valid snapshot
+	demoGamestate_t	gamestate;
+	gameState_t		gameState;		// configstrings, kept up to date when cutting
+	char			bigConfigString[BIG_INFO_STRING];
+	demoParse_t		*out;
+	const char		*error;			// set to stop the parse
+	qboolean		stop;			// set to stop without an error
+
+	qboolean		collect;		// append what is parsed to out
+	qboolean		restoring;		// replaying the gamestate of a keyframe
+	int				startTime;		// snapshots before it aren't kept
+	int				endTime;		// the parse stops at a snapshot this late
+
+	// cutting
+	qboolean		cutting;		// apply configstring changes, keep commands
+	growBuf_t		commands;		// int sequence and string of the message's commands
+
+	// keyframe index
+	int				interval;		// server msec between keyframes, 0 if not indexing
+	size_t			messageOffset;	// of the message being parsed
+	size_t			gamestateOffset;	// of the last gamestate, or DEMO_NO_GAMESTATE
+	int				keyTime;		// of the last keyframe
+	qboolean		keyPending;		// its time is the next snapshot's
+	size_t			keyRecord;		// where its time goes in out->keyframes
+	byte			*scratch;		// checkpoints are written here first
+	int				scratchSize;
+} clParse_t;
+
+/*
+=============================================================================
+
+output buffers
+
+=============================================================================
+*/
+
+static qboolean CL_Append( growBuf_t *buf, const void *data, size_t size ) {
+	size_t	capacity;
+	byte	*p;
+
+	if ( buf->size + size > buf->capacity ) {
+		capacity = buf->capacity ? buf->capacity : 4096;
+		while ( capacity < buf->size + size ) {
+			capacity *= 2;
+		}
+		p = realloc( buf->data, capacity );
+		if ( !p ) {
+			return qfalse;
+		}
+		buf->data = p;
+		buf->capacity = capacity;
+	}
+	memcpy( buf->data + buf->size, data, size );
+	buf->size += size;
+	return qtrue;
+}
+
+static void CL_AppendInt( clParse_t *cl, growBuf_t *buf, int value ) {
+	if ( !CL_Append( buf, &value, sizeof( value ) ) ) {
+		cl->error = "out of memory";
+	}
+}
+
+static void CL_AppendString( clParse_t *cl, growBuf_t *buf, const char *s ) {
+	if ( !CL_Append( buf, s, strlen( s ) + 1 ) ) {
+		cl->error = "out of memory";
+	}
+}
+
+static void CL_PutLong( byte *p, int value ) {
+	p[0] = value & 0xff;
+	p[1] = ( value >> 8 ) & 0xff;
+	p[2] = ( value >> 16 ) & 0xff;
+	p[3] = ( value >> 24 ) & 0xff;
+}
+
+static int CL_GetLong( const byte *p ) {
+	return (int)( (unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24 );
+}
+
+static void CL_PutOffset( byte *p, size_t offset ) {
+	CL_PutLong( p, (int)( (unsigned long long)offset & 0xffffffff ) );
+	CL_PutLong( p + 4, (int)( (unsigned long long)offset >> 32 ) );
+}
+
+static size_t CL_GetOffset( const byte *p ) {
+	return (size_t)( (unsigned long long)(unsigned)CL_GetLong( p ) |
+		(unsigned long long)(unsigned)CL_GetLong( p + 4 ) << 32 );
+}
+
+static void CL_FreeBuf( growBuf_t *buf ) {
+	free( buf->data );
+	memset( buf, 0, sizeof( *buf ) );
+}
+
+void CL_FreeDemoParse( demoParse_t *out ) {
+	CL_FreeBuf( &out->serverTimes );
+	CL_FreeBuf( &out->playerStates );
+	CL_FreeBuf( &out->entityCounts );
+	CL_FreeBuf( &out->entities );
+	CL_FreeBuf( &out->commands );
+	CL_FreeBuf( &out->gamestates );
+	CL_FreeBuf( &out->configstrings );
+	CL_FreeBuf( &out->keyframes );
+	CL_FreeBuf( &out->records );
+	out->numSnapshots = 0;
+	out->numGamestates = 0;
+	out->numKeyframes = 0;
+	out->numRecords = 0;
+	out->truncated = qfalse;
+	out->error[0] = 0;
+}
+
+/*
+=========================================================================
+
+MESSAGE PARSING
+
+=========================================================================
+*/
+
+/*
+==================
+CL_DeltaEntity
+
+Parses deltas from the given base and adds the resulting entity
+to the current frame
+==================
+*/
+static void CL_DeltaEntity( clParse_t *cl, msg_t *msg, clSnapshot_t *frame, int newnum, entityState_t *old,
+							qboolean unchanged ) {
+	entityState_t	*state;
+
+	// save the parsed entity state into the big circular buffer so
+	// it can be used as the source for a later delta
+	state = &cl->parseEntities[cl->parseEntitiesNum & (MAX_PARSE_ENTITIES-1)];
+
+	if ( unchanged ) {
+		*state = *old;
+	} else {
+		MSG_ReadDeltaEntity( msg, old, state, newnum );
+	}
+
+	if ( state->number == (MAX_GENTITIES-1) ) {
+		return;		// entity was delta removed
+	}
+	cl->parseEntitiesNum++;
+	frame->numEntities++;
+}
+
+/*
+==================
+CL_ParsePacketEntities
+==================
+*/
+static void CL_ParsePacketEntities( clParse_t *cl, msg_t *msg, clSnapshot_t *oldframe, clSnapshot_t *newframe ) {
+	int			newnum;
+	entityState_t	*oldstate;
+	int			oldindex, oldnum;
+
+	newframe->parseEntitiesNum = cl->parseEntitiesNum;
+	newframe->numEntities = 0;
+
+	// delta from the entities present in oldframe
+	oldindex = 0;
+	oldstate = NULL;
+	if ( !oldframe || oldindex >= oldframe->numEntities ) {
+		oldnum = 99999;
+	} else {
+		oldstate = &cl->parseEntities[
+			(oldframe->parseEntitiesNum + oldindex) & (MAX_PARSE_ENTITIES-1)];
+		oldnum = oldstate->number;
+	}
+
+#define	NEXT_OLD_ENTITY() \
+	oldindex++; \
+	if ( oldindex >= oldframe->numEntities ) { \
+		oldnum = 99999; \
+	} else { \
+		oldstate = &cl->parseEntities[ \
+			(oldframe->parseEntitiesNum + oldindex) & (MAX_PARSE_ENTITIES-1)]; \
+		oldnum = oldstate->number; \
+	}
+
+	while ( 1 ) {
+		// read the entity index number
+		newnum = MSG_ReadBits( msg, GENTITYNUM_BITS );
+
+		if ( newnum == (MAX_GENTITIES-1) ) {
+			break;
+		}
+
+		if ( msg->readcount > msg->cursize ) {
+			cl->error = "end of message in packet entities";
+			return;
+		}
+
+		while ( oldnum < newnum ) {
+			// one or more entities from the old packet are unchanged
+			CL_DeltaEntity( cl, msg, newframe, oldnum, oldstate, qtrue );
+			NEXT_OLD_ENTITY();
+		}
+		if ( oldnum == newnum ) {
+			// delta from previous state
+			CL_DeltaEntity( cl, msg, newframe, newnum, oldstate, qfalse );
+			NEXT_OLD_ENTITY();
+			continue;
+		}
+
+		if ( oldnum > newnum ) {
+			// delta from baseline
+			CL_DeltaEntity( cl, msg, newframe, newnum, &cl->entityBaselines[newnum], qfalse );
+			continue;
+		}
+	}
+
+	// any remaining entities in the old frame are copied over
+	while ( oldnum != 99999 ) {
+		// one or more entities from the old packet are unchanged
+		CL_DeltaEntity( cl, msg, newframe, oldnum, oldstate, qtrue );
+		NEXT_OLD_ENTITY();
+	}
+
+#undef NEXT_OLD_ENTITY
+}
+
+/*
+================
+CL_EmitSnapshot
+
+Appends a valid snapshot to the output.
+================
+*/
+static void CL_EmitSnapshot( clParse_t *cl, const clSnapshot_t *snap ) {
+	demoParse_t	*out = cl->out;
+	int			i;
+
+	if ( cl->keyPending ) {
+		CL_PutLong( out->keyframes.data + cl->keyRecord, snap->serverTime );
+		cl->keyTime = snap->serverTime;
+		cl->keyPending = qfalse;
+	}
+	if ( snap->serverTime >= cl->endTime ) {
+		cl->stop = qtrue;
+		return;
+	}
+	if ( !cl->collect || snap->serverTime < cl->startTime ) {
+		return;
+	}
+
+	CL_AppendInt( cl, &out->serverTimes, snap->serverTime );
+	CL_AppendInt( cl, &out->entityCounts, snap->numEntities );
+	if ( !CL_Append( &out->playerStates, &snap->ps, sizeof( snap->ps ) ) ) {
+		cl->error = "out of memory";
+	}
+	for ( i = 0 ; i < snap->numEntities ; i++ ) {
+		if ( !CL_Append( &out->entities,
+				&cl->parseEntities[(snap->parseEntitiesNum + i) & (MAX_PARSE_ENTITIES-1)],
+				sizeof( entityState_t ) ) ) {
+			cl->error = "out of memory";
+			return;
+		}
+	}
+	out->numSnapshots++;
+}
+
+/*
+================
+CL_ParseSnapshot
+
+If the snapshot is parsed properly, it will be copied to
+cl->snap and saved in cl->snapshots[].  If the snapshot is invalid
+for any reason, no changes to the state will be made at all.
+================
+*/
+static void CL_ParseSnapshot( clParse_t *cl, msg_t *msg ) {
+	int			len;
+	clSnapshot_t	*old;
+	clSnapshot_t	newSnap;
+	int			deltaNum;
+	int			oldMessageNum;
+
+	// read in the new snapshot to a temporary buffer
+	// we will only copy to cl->snap if it is valid
+	memset( &newSnap, 0, sizeof( newSnap ) );
+
+	// we will have read any new server commands in this
+	// message before we got to svc_snapshot
+	newSnap.serverTime = MSG_ReadLong( msg );
+	newSnap.messageNum = cl->serverMessageSequence;
+
+	deltaNum = MSG_ReadByte( msg );
+	if ( !deltaNum ) {
+		newSnap.deltaNum = -1;
+	} else {
+		newSnap.deltaNum = newSnap.messageNum - deltaNum;
+	}
+	newSnap.snapFlags = MSG_ReadByte( msg );
+
+	// If the frame is delta compressed from data that we
+	// no longer have available, we must suck up the rest of
+	// the frame, but not use it, then ask for a non-compressed
+	// message
+	if ( newSnap.deltaNum <= 0 ) {
+		newSnap.valid = qtrue;		// uncompressed frame
+		old = NULL;
+	} else {
+		old = &cl->snapshots[newSnap.deltaNum & PACKET_MASK];
+		if ( !old->valid ) {
+			// should never happen
+		} else if ( old->messageNum != newSnap.deltaNum ) {
+			// The frame that the server did the delta from
+			// is too old, so we can't reconstruct it properly.
+		} else if ( cl->parseEntitiesNum - old->parseEntitiesNum > MAX_PARSE_ENTITIES - MAX_SNAPSHOT_ENTITIES ) {
+			// the parse entities it refers to were overwritten
+		} else {
+			newSnap.valid = qtrue;	// valid delta parse
+		}
+	}
+
+	// read areamask
+	len = MSG_ReadByte( msg );
+	if ( len < 0 || len > (int)sizeof( newSnap.areamask ) ) {
+		cl->error = "invalid size for areamask";
+		return;
+	}
+	newSnap.areamaskLen = len;
+	MSG_ReadData( msg, newSnap.areamask, len );
+
+	// read playerinfo
+	if ( old ) {
+		MSG_ReadDeltaPlayerstate( msg, &old->ps, &newSnap.ps );
+	} else {
+		MSG_ReadDeltaPlayerstate( msg, NULL, &newSnap.ps );
+	}
+
+	// read packet entities
+	CL_ParsePacketEntities( cl, msg, old, &newSnap );
+
+	// if not valid, dump the entire thing now that it has
+	// been properly read
+	if ( !newSnap.valid || cl->error ) {
+		return;
+	}
+
+	// clear the valid flags of any snapshots between the last
+	// received and this one, so if there was a dropped packet
+	// it won't look like something valid to delta from next
+	// time we wrap around in the buffer
+	oldMessageNum = cl->snap.messageNum + 1;
+
+	if ( newSnap.messageNum - oldMessageNum >= PACKET_BACKUP ) {
+		oldMessageNum = newSnap.messageNum - ( PACKET_BACKUP - 1 );
+	}
+	for ( ; oldMessageNum < newSnap.messageNum ; oldMessageNum++ ) {
+		cl->snapshots[oldMessageNum & PACKET_MASK].valid = qfalse;
+	}
+
+	// copy to the current good spot
+	cl->snap = newSnap;
+
+	// save the frame off in the backup array for later delta comparisons
+	cl->snapshots[cl->snap.messageNum & PACKET_MASK] = cl->snap;
+	cl->newSnapshot = qtrue;
+
+	CL_EmitSnapshot( cl, &cl->snap );
+}
+
+/*
+==================
+CL_ParseGamestate
+==================
+*/
+static void CL_ParseGamestate( clParse_t *cl, msg_t *msg ) {
+	demoParse_t		*out = cl->out;
+	demoGamestate_t	*gs = &cl->gamestate;
+	entityState_t	*es;
+	int				newnum;
+	entityState_t	nullstate;
+	int				cmd;
+	int				i;
+	char			*s;
+	int				len;
+
+	// wipe local client state
+	memset( &cl->snap, 0, sizeof( cl->snap ) );
+	memset( cl->snapshots, 0, sizeof( cl->snapshots ) );
+	memset( cl->entityBaselines, 0, sizeof( cl->entityBaselines ) );
+	cl->parseEntitiesNum = 0;
+	cl->gamestateOffset = cl->messageOffset;
+
+	memset( gs, 0, sizeof( *gs ) );
+	gs->firstSnapshot = out->numSnapshots;
+	memset( &cl->gameState, 0, sizeof( cl->gameState ) );
+	cl->gameState.dataCount = 1;	// leave a 0 at the beginning for uninitialized configstrings
+
+	// a gamestate always marks a server command sequence
+	gs->serverCommandSequence = MSG_ReadLong( msg );
+	cl->serverCommandSequence = gs->serverCommandSequence;
+
+	// parse all the configstrings and baselines
+	while ( 1 ) {
+		cmd = MSG_ReadByte( msg );
+
+		if ( cmd == svc_EOF ) {
+			break;
+		}
+
+		if ( cmd == svc_configstring ) {
+			i = MSG_ReadShort( msg );
+			if ( i < 0 || i >= MAX_CONFIGSTRINGS ) {
+				cl->error = "configstring > MAX_CONFIGSTRINGS";
+				return;
+			}
+			s = MSG_ReadBigString( msg );
+			if ( cl->collect ) {
+				CL_AppendInt( cl, &out->configstrings, out->numGamestates );
+				CL_AppendInt( cl, &out->configstrings, i );
+				CL_AppendString( cl, &out->configstrings, s );
+			}
+			if ( cl->cutting ) {
+				len = strlen( s );
+				if ( len + 1 + cl->gameState.dataCount > MAX_GAMESTATE_CHARS ) {
+					cl->error = "MAX_GAMESTATE_CHARS exceeded";
+					return;
+				}
+				// append it to the gameState string buffer
+				cl->gameState.stringOffsets[ i ] = cl->gameState.dataCount;
+				memcpy( cl->gameState.stringData + cl->gameState.dataCount, s, len + 1 );
+				cl->gameState.dataCount += len + 1;
+			}
+		} else if ( cmd == svc_baseline ) {
+			newnum = MSG_ReadBits( msg, GENTITYNUM_BITS );
+			if ( newnum < 0 || newnum >= MAX_GENTITIES ) {
+				cl->error = "baseline number out of range";
+				return;
+			}
+			memset( &nullstate, 0, sizeof( nullstate ) );
+			es = &cl->entityBaselines[ newnum ];
+			MSG_ReadDeltaEntity( msg, &nullstate, es, newnum );
+		} else {
+			cl->error = "bad command byte in gamestate";
+			return;
+		}
+
+		if ( msg->readcount > msg->cursize ) {
+			cl->error = "read past end of gamestate";
+			return;
+		}
+		if ( cl->error ) {
+			return;
+		}
+	}
+
+	gs->clientNum = MSG_ReadLong( msg );
+	// read the checksum feed
+	gs->checksumFeed = MSG_ReadLong( msg );
+
+	if ( !cl->collect ) {
+		return;
+	}
+	if ( !CL_Append( &out->gamestates, gs, sizeof( *gs ) ) ) {
+		cl->error = "out of memory";
+		return;
+	}
+	out->numGamestates++;
+}
+
+/*
+==================
+CL_Token
+
+Reads the next argument of a command, whole if it is quoted, like
+Cmd_TokenizeString.
+==================
+*/
+static const char *CL_Token( const char *s, char *token, int size ) {
+	int		len;
+
+	len = 0;
+	while ( *s && *s <= ' ' ) {
+		s++;
+	}
+	if ( *s == '"' ) {
+		s++;
+		while ( *s && *s != '"' ) {
+			if ( len < size - 1 ) {
+				token[len++] = *s;
+			}
+			s++;
+		}
+		if ( *s ) {
+			s++;
+		}
+	} else {
+		while ( *s > ' ' ) {
+			if ( len < size - 1 ) {
+				token[len++] = *s;
+			}
+			s++;
+		}
+	}
+	token[len] = 0;
+	return s;
+}
+
+/*
+=====================
+CL_ConfigstringModified
+=====================
+*/
+static void CL_ConfigstringModified( clParse_t *cl, int index, const char *s ) {
+	char		*old;
+	const char	*dup;
+	gameState_t	oldGs;
+	int			i, len;
+
+	if ( index < 0 || index >= MAX_CONFIGSTRINGS ) {
+		cl->error = "configstring > MAX_CONFIGSTRINGS";
+		return;
+	}
+	old = cl->gameState.stringData + cl->gameState.stringOffsets[ index ];
+	if ( !strcmp( old, s ) ) {
+		return;		// unchanged
+	}
+
+	// build the new gameState_t
+	oldGs = cl->gameState;
+
+	memset( &cl->gameState, 0, sizeof( cl->gameState ) );
+
+	// leave the first 0 for uninitialized strings
+	cl->gameState.dataCount = 1;
+
+	for ( i = 0 ; i < MAX_CONFIGSTRINGS ; i++ ) {
+		if ( i == index ) {
+			dup = s;
+		} else {
+			dup = oldGs.stringData + oldGs.stringOffsets[ i ];
+		}
+		if ( !dup[0] ) {
+			continue;		// leave with the default empty string
+		}
+
+		len = strlen( dup );
+
+		if ( len + 1 + cl->gameState.dataCount > MAX_GAMESTATE_CHARS ) {
+			cl->error = "MAX_GAMESTATE_CHARS exceeded";
+			return;
+		}
+
+		// append it to the gameState string buffer
+		cl->gameState.stringOffsets[ i ] = cl->gameState.dataCount;
+		memcpy( cl->gameState.stringData + cl->gameState.dataCount, dup, len + 1 );
+		cl->gameState.dataCount += len + 1;
+	}
+}
+
+/*
+=====================
+CL_ServerCommand
+
+Keeps the configstrings up to date with the "cs" commands, and big ones sent
+in pieces with "bcs0", "bcs1" and "bcs2", as CL_GetServerCommand does.
+=====================
+*/
+static void CL_ServerCommand( clParse_t *cl, const char *s ) {
+	char	cmd[16], arg1[16], arg2[BIG_INFO_STRING];
+	char	*big = cl->bigConfigString;
+	size_t	len;
+
+	s = CL_Token( s, cmd, sizeof( cmd ) );
+	s = CL_Token( s, arg1, sizeof( arg1 ) );
+
+	if ( !strcmp( cmd, "bcs0" ) ) {
+		CL_Token( s, arg2, sizeof( arg2 ) );
+		snprintf( big, BIG_INFO_STRING, "cs %s \"%s", arg1, arg2 );
+		return;
+	}
+	if ( !strcmp( cmd, "bcs1" ) || !strcmp( cmd, "bcs2" ) ) {
+		CL_Token( s, arg2, sizeof( arg2 ) );
+		len = strlen( big );
+		snprintf( big + len, BIG_INFO_STRING - len, "%s%s", arg2, cmd[3] == '2' ? "\"" : "" );
+		if ( cmd[3] == '1' ) {
+			return;
+		}
+		s = CL_Token( big, cmd, sizeof( cmd ) );
+		s = CL_Token( s, arg1, sizeof( arg1 ) );
+	}
+	if ( strcmp( cmd, "cs" ) ) {
+		return;
+	}
+
+	// the rest of the arguments, as Cmd_ArgsFrom( 2 )
+	len = 0;
+	arg2[0] = 0;
+	while ( 1 ) {
+		while ( *s && *s <= ' ' ) {
+			s++;
+		}
+		if ( !*s ) {
+			break;
+		}
+		if ( len && len < sizeof( arg2 ) - 1 ) {
+			arg2[len++] = ' ';
+		}
+		s = CL_Token( s, arg2 + len, sizeof( arg2 ) - len );
+		len += strlen( arg2 + len );
+	}
+	CL_ConfigstringModified( cl, atoi( arg1 ), arg2 );
+}
+
+/*
+=====================
+CL_ParseCommandString
+
+Command strings are just saved off until cgame asks for them
+when it transitions a snapshot
+=====================
+*/
+static void CL_ParseCommandString( clParse_t *cl, msg_t *msg ) {
+	char	*s;
+	int		seq;
+
+	seq = MSG_ReadLong( msg );
+	s = MSG_ReadString( msg );
+
+	// see if we have already executed stored it off
+	if ( cl->serverCommandSequence >= seq ) {
+		return;
+	}
+	cl->serverCommandSequence = seq;
+
+	if ( cl->cutting ) {
+		CL_AppendInt( cl, &cl->commands, seq );
+		CL_AppendString( cl, &cl->commands, s );
+		CL_ServerCommand( cl, s );
+	}
+	if ( !cl->collect || cl->restoring ) {
+		return;
+	}
+	CL_AppendInt( cl, &cl->out->commands, seq );
+	CL_AppendString( cl, &cl->out->commands, s );
+}
+
+/*
+=====================
+CL_ParseServerMessage
+=====================
+*/
+static void CL_ParseServerMessage( clParse_t *cl, msg_t *msg ) {
+	int			cmd;
+	size_t		configstrings;
+
+	MSG_Bitstream( msg );
+
+	// get the reliable sequence acknowledge number
+	cl->reliableAcknowledge = MSG_ReadLong( msg );
+	cl->newSnapshot = qfalse;
+
+	//
+	// parse the message
+	//
+	while ( !cl->error && !cl->stop ) {
+		if ( msg->readcount > msg->cursize ) {
+			cl->error = "read past end of server message";
+			break;
+		}
+
+		cmd = MSG_ReadByte( msg );
+
+		if ( cmd == svc_EOF ) {
+			break;
+		}
+
+		// other commands
+		switch ( cmd ) {
+		default:
+			cl->error = "illegible server message";
+			break;
+		case svc_nop:
+			break;
+		case svc_serverCommand:
+			CL_ParseCommandString( cl, msg );
+			break;
+		case svc_gamestate:
+			configstrings = cl->out->configstrings.size;
+			CL_ParseGamestate( cl, msg );
+			if ( cl->error ) {
+				// the gamestate was not kept, so neither are its configstrings
+				cl->out->configstrings.size = configstrings;
+			}
+			break;
+		case svc_snapshot:
+			CL_ParseSnapshot( cl, msg );
+			break;
+		}
+	}
+}
+
+/*
+=============================================================================
+
+demo segments
+
+=============================================================================
+*/
+
+/*
+==================
+CL_FirstCommand
+
+Starts reading a message, and returns the first command in it after the
+server commands sent ahead of the rest, or -1 at the end of the message.
+==================
+*/
+static int CL_FirstCommand( msg_t *msg, const byte *data, int length ) {
+	int		cmd;
+
+	MSG_Init( msg, (byte *)data, length );
+	msg->cursize = length;
+	MSG_Bitstream( msg );
+	MSG_ReadLong( msg );
+	while ( msg->readcount <= msg->cursize ) {
+		cmd = MSG_ReadByte( msg );
+		if ( cmd == svc_serverCommand ) {
+			MSG_ReadLong( msg );
+			MSG_ReadString( msg );
+		} else if ( cmd != svc_nop ) {
+			return cmd;
+		}
+	}
+	return -1;
+}
+
+static qboolean CL_StartsGamestate( const byte *data, int length ) {
+	msg_t	msg;
+
+	return CL_FirstCommand( &msg, data, length ) == svc_gamestate;
+}
+
+/*
+==================
+CL_DemoSegments
+
+Finds the offsets of the messages starting a gamestate, which are where the
+demo can be split for CL_ParseDemo.  The first segment always starts at 0.
+*end is where the readable messages stop, and *status the Demo_NextMessage
+result there.  Returns the number of segments, or -1 if out of memory.
+==================
+*/
+int CL_DemoSegments( const demoFile_t *demo, size_t **segments, size_t *end, demoRecord_t *status ) {
+	growBuf_t	buf;
+	size_t		offset, start;
+	const byte	*data;
+	int			sequence, length;
+
+	memset( &buf, 0, sizeof( buf ) );
+	offset = 0;
+	if ( !CL_Append( &buf, &offset, sizeof( offset ) ) ) {
+		return -1;
+	}
+
+	while ( 1 ) {
+		start = offset;
+		*status = Demo_NextMessage( demo, &offset, &sequence, &data, &length );
+		if ( *status != DEMO_MESSAGE ) {
+			break;
+		}
+		if ( start && CL_StartsGamestate( data, length ) ) {
+			if ( !CL_Append( &buf, &start, sizeof( start ) ) ) {
+				CL_FreeBuf( &buf );
+				return -1;
+			}
+		}
+	}
+
+	*end = start;
+	*segments = (size_t *)buf.data;
+	return (int)( buf.size / sizeof( size_t ) );
+}
+
+/*
+=============================================================================
+
+keyframes
+
+A keyframe is where parsing can resume part way through a demo.  The start
+of a segment is one with nothing to restore; the others carry a checkpoint
+of the snapshots later messages may delta from, and point back at the
+gamestate whose baselines the checkpoint is coded against.  Each is stored
+in the index as
+
+  time (4)  offset (8)  gamestate (8)  length (4)  checkpoint (length)
+
+little endian, time being the server time of the first snapshot after it.
+
+=============================================================================
+*/
+
+#define	KEYFRAME_HEADER		24
+#define	INDEX_VERSION		2
+
+/*
+==================
+CL_CheckpointBase
+
+Entities in a checkpoint are coded against the same entity in the snapshot
+before, where there is one, as most of them barely change between snapshots.
+*index walks prev along with the entities asked for, which are in order.
+==================
+*/
+static entityState_t *CL_CheckpointBase( clParse_t *cl, const clSnapshot_t *prev, int *index, int number ) {
+	entityState_t	*es;
+
+	while ( prev && *index < prev->numEntities ) {
+		es = &cl->parseEntities[(prev->parseEntitiesNum + *index) & (MAX_PARSE_ENTITIES-1)];
+		if ( es->number == number ) {
+			return es;
+		}
+		if ( es->number > number ) {
+			break;
+		}
+		(*index)++;
+	}
+	return &cl->entityBaselines[number];
+}
+
+/*
+==================
+CL_WriteCheckpoint
+
+Writes every snapshot a later delta could still use.
+==================
+*/
+static void CL_WriteCheckpoint( clParse_t *cl, msg_t *msg ) {
+	clSnapshot_t	*snap, *prev;
+	entityState_t	*es;
+	int				i, j, k;
+
+	MSG_WriteLong( msg, cl->parseEntitiesNum );
+	MSG_WriteLong( msg, cl->snap.messageNum );
+	MSG_WriteLong( msg, cl->serverCommandSequence );
+
+	prev = NULL;
+	for ( i = 0 ; i < PACKET_BACKUP ; i++ ) {
+		snap = &cl->snapshots[i];
+		if ( !snap->valid || cl->parseEntitiesNum - snap->parseEntitiesNum > MAX_PARSE_ENTITIES - MAX_SNAPSHOT_ENTITIES ) {
+			continue;
+		}
+		MSG_WriteBits( msg, 1, 1 );
+		MSG_WriteLong( msg, snap->messageNum );
+		MSG_WriteLong( msg, snap->deltaNum );
+		MSG_WriteLong( msg, snap->serverTime );
+		MSG_WriteLong( msg, snap->parseEntitiesNum );
+		MSG_WriteLong( msg, snap->numEntities );
+		MSG_WriteDeltaPlayerstate( msg, prev ? &prev->ps : NULL, &snap->ps );
+		for ( j = 0, k = 0 ; j < snap->numEntities ; j++ ) {
+			es = &cl->parseEntities[(snap->parseEntitiesNum + j) & (MAX_PARSE_ENTITIES-1)];
+			MSG_WriteDeltaEntity( msg, CL_CheckpointBase( cl, prev, &k, es->number ), es, qtrue );
+		}
+		prev = snap;
+	}
+	MSG_WriteBits( msg, 0, 1 );
+}
+
+/*
+==================
+CL_ReadCheckpoint
+==================
+*/
+static qboolean CL_ReadCheckpoint( clParse_t *cl, const byte *data, int length ) {
+	clSnapshot_t	*snap, *prev;
+	clSnapshot_t	s;
+	msg_t			msg;
+	int				i, k, number, messageNum;
+
+	MSG_Init( &msg, (byte *)data, length );
+	msg.cursize = length;
+
+	memset( cl->snapshots, 0, sizeof( cl->snapshots ) );
+	cl->parseEntitiesNum = MSG_ReadLong( &msg );
+	messageNum = MSG_ReadLong( &msg );
+	cl->serverCommandSequence = MSG_ReadLong( &msg );
+
+	prev = NULL;
+	while ( MSG_ReadBits( &msg, 1 ) ) {
+		memset( &s, 0, sizeof( s ) );
+		s.valid = qtrue;
+		s.messageNum = MSG_ReadLong( &msg );
+		s.deltaNum = MSG_ReadLong( &msg );
+		s.serverTime = MSG_ReadLong( &msg );
+		s.parseEntitiesNum = MSG_ReadLong( &msg );
+		s.numEntities = MSG_ReadLong( &msg );
+		if ( s.numEntities < 0 || s.numEntities > MAX_PARSE_ENTITIES - MAX_SNAPSHOT_ENTITIES ||
+			msg.readcount > msg.cursize ) {
+			return qfalse;
+		}
+		MSG_ReadDeltaPlayerstate( &msg, prev ? &prev->ps : NULL, &s.ps );
+		for ( i = 0, k = 0 ; i < s.numEntities ; i++ ) {
+			number = MSG_ReadBits( &msg, GENTITYNUM_BITS );
+			if ( number >= MAX_GENTITIES - 1 || msg.readcount > msg.cursize ) {
+				return qfalse;
+			}
+			MSG_ReadDeltaEntity( &msg, CL_CheckpointBase( cl, prev, &k, number ),
+				&cl->parseEntities[(s.parseEntitiesNum + i) & (MAX_PARSE_ENTITIES-1)], number );
+		}
+		snap = &cl->snapshots[s.messageNum & PACKET_MASK];
+		*snap = s;
+		prev = snap;
+	}
+	if ( msg.readcount > msg.cursize ) {
+		return qfalse;
+	}
+
+	// only the message number of the latest snapshot matters to the parse
+	cl->snap = cl->snapshots[messageNum & PACKET_MASK];
+	if ( !cl->snap.valid || cl->snap.messageNum != messageNum ) {
+		memset( &cl->snap, 0, sizeof( cl->snap ) );
+		cl->snap.messageNum = messageNum;
+	}
+	return qtrue;
+}
+
+/*
+==================
+CL_AddKeyframe
+
+Adds a keyframe before the message at cl->messageOffset, with a checkpoint
+unless the parse is only starting.
+==================
+*/
+static void CL_AddKeyframe( clParse_t *cl, qboolean checkpoint ) {
+	growBuf_t	*keyframes = &cl->out->keyframes;
+	byte		record[KEYFRAME_HEADER];
+	msg_t		msg;
+	byte		*p;
+	int			size;
+
+	memset( &msg, 0, sizeof( msg ) );
+	while ( checkpoint ) {
+		if ( cl->scratch ) {
+			MSG_Init( &msg, cl->scratch, cl->scratchSize );
+			CL_WriteCheckpoint( cl, &msg );
+			if ( !msg.overflowed ) {
+				break;
+			}
+		}
+		// a full window of big deltas doesn't fit any message, grow as needed
+		size = cl->scratchSize ? cl->scratchSize * 2 : 4 * MAX_MSGLEN;
+		p = realloc( cl->scratch, size );
+		if ( !p ) {
+			cl->error = "out of memory";
+			return;
+		}
+		cl->scratch = p;
+		cl->scratchSize = size;
+	}
+
+	CL_PutLong( record, 0 );
+	CL_PutOffset( record + 4, cl->messageOffset );
+	CL_PutOffset( record + 12, checkpoint ? cl->gamestateOffset : DEMO_NO_GAMESTATE );
+	CL_PutLong( record + 20, msg.cursize );
+
+	cl->keyRecord = keyframes->size;
+	if ( !CL_Append( keyframes, record, sizeof( record ) ) ||
+		( msg.cursize && !CL_Append( keyframes, cl->scratch, msg.cursize ) ) ) {
+		cl->error = "out of memory";
+		return;
+	}
+	cl->keyPending = qtrue;
+	cl->out->numKeyframes++;
+}
+
+/*
+=============================================================================
+
+demo parsing
+
+=============================================================================
+*/
+
+static clParse_t *CL_NewParse( demoParse_t *out ) {
+	clParse_t	*cl;
+
+	memset( out, 0, sizeof( *out ) );
+
+	// too big for a worker's stack
+	cl = calloc( 1, sizeof( *cl ) );
+	if ( !cl ) {
+		snprintf( out->error, sizeof( out->error ), "out of memory" );
+		return NULL;
+	}
+	cl->out = out;
+	cl->collect = qtrue;
+	cl->startTime = INT_MIN;
+	cl->endTime = INT_MAX;
+	cl->gamestateOffset = DEMO_NO_GAMESTATE;
+	return cl;
+}
+
+static void CL_FreeParse( clParse_t *cl ) {
+	CL_FreeBuf( &cl->commands );
+	free( cl->scratch );
+	free( cl );
+}
+
+/*
+==================
+CL_RunDemo
+
+Parses the messages from offset start up to end, or to the end of the demo.
+==================
+*/
+static void CL_RunDemo( clParse_t *cl, const demoFile_t *demo, size_t start, size_t end ) {
+	demoParse_t		*out = cl->out;
+	demoRecord_t	status;
+	msg_t			msg;
+	size_t			offset, next;
+	const byte		*data;
+	int				sequence, length;
+
+	for ( offset = start ; offset < end && !cl->stop ; offset = next ) {
+		next = offset;
+		status = Demo_NextMessage( demo, &next, &sequence, &data, &length );
+		if ( status != DEMO_MESSAGE ) {
+			out->truncated = status == DEMO_TRUNCATED;
+			if ( status == DEMO_ERROR ) {
+				snprintf( out->error, sizeof( out->error ), "demo message at offset %lu is longer than %d bytes",
+					(unsigned long)offset, MAX_MSGLEN );
+			}
+			break;
+		}
+		cl->serverMessageSequence = sequence;
+		cl->messageOffset = offset;
+
+		if ( cl->interval ) {
+			if ( offset == start ) {
+				CL_AddKeyframe( cl, qfalse );
+			} else if ( !cl->keyPending && cl->snap.valid && cl->snap.serverTime - cl->keyTime >= cl->interval ) {
+				CL_AddKeyframe( cl, qtrue );
+			}
+		}
+
+		if ( !cl->error ) {
+			MSG_Init( &msg, (byte *)data, length );
+			msg.cursize = length;
+			CL_ParseServerMessage( cl, &msg );
+		}
+		if ( cl->error ) {
+			snprintf( out->error, sizeof( out->error ), "demo message at offset %lu: %s",
+				(unsigned long)offset, cl->error );
+			break;
+		}
+	}
+
+	// nothing to seek to after the last snapshot
+	if ( cl->keyPending ) {
+		out->keyframes.size = cl->keyRecord;
+		out->numKeyframes--;
+		cl->keyPending = qfalse;
+	}
+}
+
+/*
+==================
+CL_ParseDemo
+
+Parses the messages from offset start up to end into out.  Returns qfalse,
+with out->error set, if it had to stop early.
+==================
+*/
+qboolean CL_ParseDemo( const demoFile_t *demo, size_t start, size_t end, demoParse_t *out ) {
+	clParse_t	*cl;
+
+	if ( !( cl = CL_NewParse( out ) ) ) {
+		return qfalse;
+	}
+	CL_RunDemo( cl, demo, start, end );
+	CL_FreeParse( cl );
+	return out->error[0] == 0;
+}
+
+/*
+==================
+CL_IndexDemo
+
+Parses like CL_ParseDemo, but only collects keyframes, one at start and then
+one for every interval msec of server time.
+==================
+*/
+qboolean CL_IndexDemo( const demoFile_t *demo, size_t start, size_t end, int interval, demoParse_t *out ) {
+	clParse_t	*cl;
+
+	if ( !( cl = CL_NewParse( out ) ) ) {
+		return qfalse;
+	}
+	cl->collect = qfalse;
+	cl->interval = interval > 0 ? interval : 1;
+	CL_RunDemo( cl, demo, start, end );
+	CL_FreeParse( cl );
+	return out->error[0] == 0;
+}
+
+/*
+==================
+CL_IndexHeader
+
+Fills in the DEMO_INDEX_HEADER bytes that go before the keyframes of every
+segment of a demo, in order.
+==================
+*/
+void CL_IndexHeader( byte *header, size_t demoSize, int numKeyframes ) {
+	memcpy( header, "Q3KI", 4 );
+	CL_PutLong( header + 4, INDEX_VERSION );
+	CL_PutOffset( header + 8, demoSize );
+	CL_PutLong( header + 16, numKeyframes );
+}
+
+/*
+==================
+CL_FindKeyframe
+
+Finds the last keyframe at or before server time in an index, or the first
+one if they are all later.  Returns qfalse if the index is malformed or was
+built for a demo of another size.
+==================
+*/
+qboolean CL_FindKeyframe( const byte *index, size_t size, size_t demoSize, int time, demoKeyframe_t *key ) {
+	demoKeyframe_t	k;
+	size_t			offset;
+	int				i, count;
+
+	if ( size < DEMO_INDEX_HEADER || memcmp( index, "Q3KI", 4 ) ||
+		CL_GetLong( index + 4 ) != INDEX_VERSION || CL_GetOffset( index + 8 ) != demoSize ) {
+		return qfalse;
+	}
+	count = CL_GetLong( index + 16 );
+
+	// an empty demo has no keyframes, start from the top
+	memset( key, 0, sizeof( *key ) );
+	key->gamestate = DEMO_NO_GAMESTATE;
+
+	offset = DEMO_INDEX_HEADER;
+	for ( i = 0 ; i < count ; i++ ) {
+		if ( size - offset < KEYFRAME_HEADER ) {
+			return qfalse;
+		}
+		k.time = CL_GetLong( index + offset );
+		k.offset = CL_GetOffset( index + offset + 4 );
+		k.gamestate = CL_GetOffset( index + offset + 12 );
+		k.checkpointLength = CL_GetLong( index + offset + 20 );
+		k.checkpoint = index + offset + KEYFRAME_HEADER;
+		offset += KEYFRAME_HEADER;
+		if ( k.checkpointLength < 0 || (size_t)k.checkpointLength > size - offset || k.offset >= demoSize ||
+			( k.gamestate != DEMO_NO_GAMESTATE && k.gamestate >= k.offset ) ) {
+			return qfalse;
+		}
+		offset += k.checkpointLength;
+		if ( i == 0 || k.time <= time ) {
+			*key = k;
+		}
+	}
+	return offset == size;
+}
+
+/*
+==================
+CL_ResumeDemo
+
+Parses from a keyframe to the end of the demo, keeping the snapshots from
+startTime until the first one at or after endTime.  Returns qfalse, with
+out->error set, if it had to stop early.
+==================
+*/
+qboolean CL_ResumeDemo( const demoFile_t *demo, const demoKeyframe_t *key, int startTime, int endTime, demoParse_t *out ) {
+	clParse_t	*cl;
+
+	if ( !( cl = CL_NewParse( out ) ) ) {
+		return qfalse;
+	}
+	cl->startTime = startTime;
+	cl->endTime = endTime;
+
+	if ( key->checkpointLength ) {
+		// the gamestate has the baselines the checkpoint is coded against,
+		// and the configstrings that are in effect
+		if ( key->gamestate != DEMO_NO_GAMESTATE ) {
+			cl->restoring = qtrue;
+			CL_RunDemo( cl, demo, key->gamestate, key->gamestate + 1 );
+			cl->restoring = qfalse;
+		}
+		if ( !out->error[0] && !CL_ReadCheckpoint( cl, key->checkpoint, key->checkpointLength ) ) {
+			snprintf( out->error, sizeof( out->error ), "bad checkpoint for the keyframe at offset %lu",
+				(unsigned long)key->offset );
+		}
+	}
+
+	if ( !out->error[0] ) {
+		CL_RunDemo( cl, demo, key->offset, demo->size );
+	}
+	CL_FreeParse( cl );
+	return out->error[0] == 0;
+}
+
+/*
+=============================================================================
+
+cutting and joining demos
+
+Records are copied as they are wherever that still plays the same.  A cut
+starts with a gamestate built from the client state at the cut, then the
+first snapshot after it rebased to a non-delta one.  The messages that
+follow are copied, except for the snapshots still delta compressed from
+before the cut, which are rebased too; after PACKET_BACKUP messages there
+can be none.
+
+=============================================================================
+*/
+
+static qboolean CL_AppendRecord( growBuf_t *records, int sequence, const byte *data, int length ) {
+	byte	header[8];
+
+	CL_PutLong( header, sequence );
+	CL_PutLong( header + 4, length );
+	return CL_Append( records, header, sizeof( header ) ) &&
+		( length <= 0 || CL_Append( records, data, length ) );
+}
+
+/*
+==================
+CL_SnapshotTime
+
+Finds the server time of the snapshot in a message, without parsing the
+rest.  Returns qfalse if the message has no snapshot.
+==================
+*/
+static qboolean CL_SnapshotTime( const byte *data, int length, int *serverTime ) {
+	msg_t	msg;
+
+	if ( CL_FirstCommand( &msg, data, length ) != svc_snapshot ) {
+		return qfalse;
+	}
+	*serverTime = MSG_ReadLong( &msg );
+	return msg.readcount <= msg.cursize;
+}
+
+/*
+==================
+CL_WriteGamestate
+
+Writes the gamestate the client has, with the configstrings as changed
+since, like SV_SendClientGameState.
+==================
+*/
+static void CL_WriteGamestate( clParse_t *cl, msg_t *msg, int serverCommandSequence ) {
+	entityState_t	nullstate;
+	const char		*s;
+	int				i;
+
+	MSG_WriteByte( msg, svc_gamestate );
+	MSG_WriteLong( msg, serverCommandSequence );
+
+	// write the configstrings
+	for ( i = 0 ; i < MAX_CONFIGSTRINGS ; i++ ) {
+		s = cl->gameState.stringData + cl->gameState.stringOffsets[i];
+		if ( *s ) {
+			MSG_WriteByte( msg, svc_configstring );
+			MSG_WriteShort( msg, i );
+			MSG_WriteBigString( msg, s );
+		}
+	}
+
+	// write the baselines
+	memset( &nullstate, 0, sizeof( nullstate ) );
+	for ( i = 0 ; i < MAX_GENTITIES ; i++ ) {
+		if ( !cl->entityBaselines[i].number ) {
+			continue;
+		}
+		MSG_WriteByte( msg, svc_baseline );
+		MSG_WriteDeltaEntity( msg, &nullstate, &cl->entityBaselines[i], qtrue );
+	}
+
+	MSG_WriteByte( msg, svc_EOF );
+
+	MSG_WriteLong( msg, cl->gamestate.clientNum );
+	MSG_WriteLong( msg, cl->gamestate.checksumFeed );
+}
+
+/*
+==================
+CL_WriteSnapshot
+
+Writes the server commands of the message just parsed and its snapshot,
+not delta compressed.
+==================
+*/
+static void CL_WriteSnapshot( clParse_t *cl, msg_t *msg ) {
+	const clSnapshot_t	*snap = &cl->snap;
+	entityState_t		*es;
+	size_t				offset;
+	int					i, seq;
+
+	for ( offset = 0 ; offset < cl->commands.size ; offset += strlen( (char *)cl->commands.data + offset ) + 1 ) {
+		memcpy( &seq, cl->commands.data + offset, sizeof( seq ) );
+		offset += sizeof( seq );
+		MSG_WriteByte( msg, svc_serverCommand );
+		MSG_WriteLong( msg, seq );
+		MSG_WriteString( msg, (char *)cl->commands.data + offset );
+	}
+
+	MSG_WriteByte( msg, svc_snapshot );
+	MSG_WriteLong( msg, snap->serverTime );
+	MSG_WriteByte( msg, 0 );		// what we are delta'ing from
+	MSG_WriteByte( msg, snap->snapFlags );
+	MSG_WriteByte( msg, snap->areamaskLen );
+	MSG_WriteData( msg, snap->areamask, snap->areamaskLen );
+	MSG_WriteDeltaPlayerstate( msg, NULL, (playerState_t *)&snap->ps );
+
+	// every entity from its baseline, as CL_ParsePacketEntities reads them
+	for ( i = 0 ; i < snap->numEntities ; i++ ) {
+		es = &cl->parseEntities[(snap->parseEntitiesNum + i) & (MAX_PARSE_ENTITIES-1)];
+		MSG_WriteDeltaEntity( msg, &cl->entityBaselines[es->number], es, qtrue );
+	}
+	MSG_WriteBits( msg, (MAX_GENTITIES-1), GENTITYNUM_BITS );	// end of packetentities
+}
+
+/*
+==================
+CL_WriteMessage
+
+Appends a message re-encoded by CL_WriteGamestate or CL_WriteSnapshot.
+==================
+*/
+static void CL_WriteMessage( clParse_t *cl, int sequence, qboolean gamestate, int serverCommandSequence ) {
+	byte	data[MAX_MSGLEN];
+	msg_t	msg;
+
+	MSG_Init( &msg, data, sizeof( data ) );
+	MSG_Bitstream( &msg );
+
+	MSG_WriteLong( &msg, cl->reliableAcknowledge );
+	if ( gamestate ) {
+		CL_WriteGamestate( cl, &msg, serverCommandSequence );
+	} else {
+		CL_WriteSnapshot( cl, &msg );
+	}
+	MSG_WriteByte( &msg, svc_EOF );
+
+	if ( msg.overflowed ) {
+		cl->error = "rebased message is longer than MAX_MSGLEN";
+	} else if ( !CL_AppendRecord( &cl->out->records, sequence, msg.data, msg.cursize ) ) {
+		cl->error = "out of memory";
+	}
+	cl->out->numRecords++;
+}
+
+/*
+==================
+CL_CutDemo
+
+Cuts out the part of a demo from the first valid snapshot at or after
+startTime, to before the first snapshot at or after endTime, into
+out->records as a demo file of its own.  Parsing starts at offset start,
+which has to be the top of the demo or a message with a gamestate.
+==================
+*/
+qboolean CL_CutDemo( const demoFile_t *demo, size_t start, int startTime, int endTime, demoParse_t *out ) {
+	clParse_t		*cl;
+	demoRecord_t	status;
+	msg_t			msg;
+	size_t			offset, next;
+	const byte		*data;
+	int				sequence, length, serverTime, commandSequence;
+	int				cutSequence;
+	qboolean		cut;
+
+	if ( !( cl = CL_NewParse( out ) ) ) {
+		return qfalse;
+	}
+	cl->collect = qfalse;
+	cl->cutting = qtrue;
+
+	cut = qfalse;
+	cutSequence = 0;
+	for ( offset = start ; !cl->error ; offset = next ) {
+		next = offset;
+		status = Demo_NextMessage( demo, &next, &sequence, &data, &length );
+		if ( status != DEMO_MESSAGE ) {
+			if ( status == DEMO_ERROR ) {
+				snprintf( out->error, sizeof( out->error ), "demo message at offset %lu is longer than %d bytes",
+					(unsigned long)offset, MAX_MSGLEN );
+			}
+			break;
+		}
+
+		if ( cut && CL_SnapshotTime( data, length, &serverTime ) && serverTime >= endTime ) {
+			break;
+		}
+
+		// past any delta from before the cut, the rest is copied
+		if ( cut && sequence - cutSequence >= PACKET_BACKUP ) {
+			if ( !CL_AppendRecord( &out->records, sequence, data, length ) ) {
+				cl->error = "out of memory";
+			}
+			out->numRecords++;
+			continue;
+		}
+
+		cl->serverMessageSequence = sequence;
+		cl->messageOffset = offset;
+		cl->commands.size = 0;
+		commandSequence = cl->serverCommandSequence;
+
+		MSG_Init( &msg, (byte *)data, length );
+		msg.cursize = length;
+		CL_ParseServerMessage( cl, &msg );
+		if ( cl->error ) {
+			break;
+		}
+
+		if ( !cut ) {
+			if ( !cl->newSnapshot || cl->snap.serverTime < startTime ) {
+				continue;
+			}
+			if ( cl->snap.serverTime >= endTime ) {
+				break;
+			}
+			// the commands of this message are sent again after the gamestate
+			CL_WriteMessage( cl, sequence - 1, qtrue, commandSequence );
+			CL_WriteMessage( cl, sequence, qfalse, 0 );
+			cut = qtrue;
+			cutSequence = sequence;
+		} else if ( cl->newSnapshot && cl->snap.deltaNum > 0 && cl->snap.deltaNum < cutSequence ) {
+			CL_WriteMessage( cl, sequence, qfalse, 0 );
+		} else {
+			if ( !CL_AppendRecord( &out->records, sequence, data, length ) ) {
+				cl->error = "out of memory";
+			}
+			out->numRecords++;
+		}
+	}
+
+	if ( cl->error ) {
+		snprintf( out->error, sizeof( out->error ), "demo message at offset %lu: %s",
+			(unsigned long)offset, cl->error );
+	} else if ( !cut && !out->error[0] ) {
+		snprintf( out->error, sizeof( out->error ), "no snapshots between the times" );
+	} else if ( !CL_AppendRecord( &out->records, -1, NULL, -1 ) ) {
+		snprintf( out->error, sizeof( out->error ), "out of memory" );
+	}
+
+	CL_FreeParse( cl );
+	return out->error[0] == 0;
+}
+
+/*
+==================
+CL_ConcatDemos
+
+Joins demos that each start with a gamestate into out->records, as they
+are but for the sequence numbers of a demo being moved past those of the
+one before, where needed.
+==================
+*/
+qboolean CL_ConcatDemos( const demoFile_t *demos, int count, demoParse_t *out ) {
+	demoRecord_t	status;
+	size_t			offset;
+	const byte		*data;
+	int				i, sequence, length, shift, last;
+	qboolean		first;
+
+	memset( out, 0, sizeof( *out ) );
+
+	last = 0;
+	for ( i = 0 ; i < count && !out->error[0] ; i++ ) {
+		shift = 0;
+		for ( offset = 0 ; ; ) {
+			first = offset == 0;
+			status = Demo_NextMessage( &demos[i], &offset, &sequence, &data, &length );
+			if ( status != DEMO_MESSAGE ) {
+				if ( status == DEMO_ERROR ) {
+					snprintf( out->error, sizeof( out->error ), "demo %d has a message longer than %d bytes",
+						i, MAX_MSGLEN );
+				}
+				break;
+			}
+			if ( first ) {
+				if ( !CL_StartsGamestate( data, length ) ) {
+					snprintf( out->error, sizeof( out->error ), "demo %d does not start with a gamestate", i );
+					break;
+				}
+				if ( out->numRecords && sequence <= last ) {
+					shift = last + 1 - sequence;
+				}
+			}
+			last = sequence + shift;
+			if ( !CL_AppendRecord( &out->records, last, data, length ) ) {
+				snprintf( out->error, sizeof( out->error ), "out of memory" );
+				break;
+			}
+			out->numRecords++;
+		}
+	}
+
+	if ( !out->error[0] && !CL_AppendRecord( &out->records, -1, NULL, -1 ) ) {
+		snprintf( out->error, sizeof( out->error ), "out of memory" );
+	}
+	return out->error[0] == 0;
+}
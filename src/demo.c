@@ -0,0 +1,406 @@
+// demo.c -- memory mapped demo files
+
+/*
+ * A demo is the server messages a client received, each stored as
+ *
+ *   sequence (4)  length (4)  message (length)
+ *
+ * with little endian ints, ended by a record whose sequence and length are
+ * both -1, or just by the end of the file.  The messages are huffman coded
+ * bitstreams, read straight from the mapping.
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "q_shared.h"
+#include "qcommon.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+/*
+==================
+Demo_Map
+
+Maps the whole of path read only.  Returns qfalse, with errno (or the
+Windows last error) set, if it can't be opened or mapped.
+==================
+*/
+qboolean Demo_Map( demoFile_t *demo, const char *path ) {
+#ifdef _WIN32
+	HANDLE			file;
+	LARGE_INTEGER	size;
+
+	memset( demo, 0, sizeof( *demo ) );
+	file = CreateFileA( path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( file == INVALID_HANDLE_VALUE ) {
+		return qfalse;
+	}
+	if ( !GetFileSizeEx( file, &size ) ) {
+		CloseHandle( file );
+		return qfalse;
+	}
+	demo->size = (size_t)size.QuadPart;
+	if ( demo->size ) {
+		demo->mapping = CreateFileMappingA( file, NULL, PAGE_READONLY, 0, 0, NULL );
+		if ( demo->mapping ) {
+			demo->data = MapViewOfFile( demo->mapping, FILE_MAP_READ, 0, 0, 0 );
+		}
+		if ( !demo->data ) {
+			if ( demo->mapping ) {
+				CloseHandle( demo->mapping );
+			}
+			CloseHandle( file );
+			return qfalse;
+		}
+	}
+	CloseHandle( file );
+	return qtrue;
+#else
+	struct stat	st;
+	void		*p;
+	int			fd;
+
+	memset( demo, 0, sizeof( *demo ) );
+	fd = open( path, O_RDONLY );
+	if ( fd < 0 ) {
+		return qfalse;
+	}
+	if ( fstat( fd, &st ) < 0 ) {
+		close( fd );
+		return qfalse;
+	}
+	demo->size = (size_t)st.st_size;
+	if ( demo->size ) {
+		p = mmap( NULL, demo->size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		if ( p == MAP_FAILED ) {
+			close( fd );
+			return qfalse;
+		}
+#ifdef POSIX_MADV_SEQUENTIAL
+		posix_madvise( p, demo->size, POSIX_MADV_SEQUENTIAL );
+#endif
+		demo->data = p;
+	}
+	// the mapping stays valid without the descriptor
+	close( fd );
+	return qtrue;
+#endif
+}
+
+void Demo_Unmap( demoFile_t *demo ) {
+	if ( demo->data ) {
+#ifdef _WIN32
+		UnmapViewOfFile( demo->data );
+		CloseHandle( demo->mapping );
+#else
+		munmap( (void *)demo->data, demo->size );
+#endif
+	}
+	memset( demo, 0, sizeof( *demo ) );
+}
+
+static int Demo_GetLong( const byte *p ) {
+	return (int)( (unsigned)p[0] | (unsigned)p[1] << 8 | (unsigned)p[2] << 16 | (unsigned)p[3] << 24 );
+}
+
+static void Demo_PutLong( byte *p, int value ) {
+	p[0] = (byte)value;
+	p[1] = (byte)( (unsigned)value >> 8 );
+	p[2] = (byte)( (unsigned)value >> 16 );
+	p[3] = (byte)( (unsigned)value >> 24 );
+}
+
+/*
+==================
+Demo_NextMessage
+
+Reads the record at *offset and moves *offset past it.  Returns DEMO_MESSAGE
+with the message in place, or DEMO_END at the end marker or the end of the
+file.  Like CL_ReadDemoMessage, a record cut short also ends the demo, as
+DEMO_TRUNCATED, and one longer than MAX_MSGLEN is DEMO_ERROR.
+==================
+*/
+demoRecord_t Demo_NextMessage( const demoFile_t *demo, size_t *offset, int *sequence, const byte **data, int *length ) {
+	const byte	*p;
+	size_t		left;
+
+	left = demo->size - *offset;
+	if ( left == 0 ) {
+		return DEMO_END;
+	}
+	if ( left < 8 ) {
+		return DEMO_TRUNCATED;
+	}
+	p = demo->data + *offset;
+	*sequence = Demo_GetLong( p );
+	*length = Demo_GetLong( p + 4 );
+	if ( *length == -1 ) {
+		return DEMO_END;
+	}
+	if ( *length < 0 || *length > MAX_MSGLEN ) {
+		return DEMO_ERROR;
+	}
+	if ( (size_t)*length > left - 8 ) {
+		return DEMO_TRUNCATED;
+	}
+	*data = p + 8;
+	*offset += 8 + *length;
+	return DEMO_MESSAGE;
+}
+
+/*
+==================
+Demo_WriteFile
+
+Writes a whole file, like the index kept next to a demo.  Returns qfalse,
+with errno set, on failure.
+==================
+*/
+qboolean Demo_WriteFile( const char *path, const byte *data, size_t size ) {
+	FILE	*f;
+	size_t	written;
+
+	f = fopen( path, "wb" );
+	if ( !f ) {
+		return qfalse;
+	}
+	written = fwrite( data, 1, size, f );
+	if ( fclose( f ) != 0 || written != size ) {
+		return qfalse;
+	}
+	return qtrue;
+}
+
+/*
+=============================================================================
+
+demo writer
+
+Records are gathered in a buffer and written when it fills, so recording
+costs a write call per buffer rather than per message.  A message that
+does not fit goes out together with what is buffered, in one writev, and
+isn't copied.
+
+=============================================================================
+*/
+
+#ifdef _WIN32
+typedef struct {
+	void	*iov_base;
+	size_t	iov_len;
+} demoIovec_t;
+#else
+typedef struct iovec demoIovec_t;
+#endif
+
+/*
+==================
+Demo_WriteAll
+
+Writes the pieces in order, going on after short writes.
+==================
+*/
+static qboolean Demo_WriteAll( demoWriter_t *w, demoIovec_t *iov, int count ) {
+	size_t	total;
+	long	written;
+	int		i;
+
+	for ( total = 0, i = 0 ; i < count ; i++ ) {
+		total += iov[i].iov_len;
+	}
+
+	while ( count ) {
+#ifdef _WIN32
+		written = _write( w->fd, iov->iov_base, (unsigned)( iov->iov_len > INT_MAX ? INT_MAX : iov->iov_len ) );
+#else
+		written = writev( w->fd, iov, count );
+		if ( written < 0 && errno == EINTR ) {
+			continue;
+		}
+#endif
+		if ( written < 0 ) {
+			return qfalse;
+		}
+		// drop what was written, pieces may be left half done
+		while ( count && (size_t)written >= iov->iov_len ) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if ( count ) {
+			iov->iov_base = (byte *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	w->unsynced += total;
+	if ( w->syncBytes && w->unsynced >= w->syncBytes ) {
+		return Demo_FlushWriter( w, qtrue );
+	}
+	return qtrue;
+}
+
+/*
+==================
+Demo_OpenWriter
+
+Creates or truncates path, or appends to it, with a buffer of bufferSize
+bytes.  Returns qfalse, with errno set, on failure.
+==================
+*/
+qboolean Demo_OpenWriter( demoWriter_t *w, const char *path, size_t bufferSize, size_t syncBytes, qboolean append ) {
+	int		flags;
+
+	memset( w, 0, sizeof( *w ) );
+	w->fd = -1;
+
+	w->size = bufferSize;
+	if ( w->size && !( w->buffer = malloc( w->size ) ) ) {
+		errno = ENOMEM;
+		return qfalse;
+	}
+
+	flags = O_WRONLY | O_CREAT | ( append ? O_APPEND : O_TRUNC );
+#ifdef _WIN32
+	w->fd = _open( path, flags | _O_BINARY, _S_IREAD | _S_IWRITE );
+#else
+	w->fd = open( path, flags, 0666 );
+#endif
+	if ( w->fd < 0 ) {
+		free( w->buffer );
+		w->buffer = NULL;
+		return qfalse;
+	}
+	w->syncBytes = syncBytes;
+	return qtrue;
+}
+
+/*
+==================
+Demo_WriteMessage
+
+Adds a record, or the end marker for a length of -1.
+==================
+*/
+qboolean Demo_WriteMessage( demoWriter_t *w, int sequence, const byte *data, int length ) {
+	demoIovec_t	iov[3];
+	byte		header[8];
+	size_t		size;
+	int			count;
+
+	Demo_PutLong( header, sequence );
+	Demo_PutLong( header + 4, length );
+	size = length > 0 ? (size_t)length : 0;
+
+	if ( w->used + sizeof( header ) + size <= w->size ) {
+		memcpy( w->buffer + w->used, header, sizeof( header ) );
+		if ( size ) {
+			memcpy( w->buffer + w->used + sizeof( header ), data, size );
+		}
+		w->used += sizeof( header ) + size;
+		w->offset += sizeof( header ) + size;
+		return qtrue;
+	}
+
+	// too big to buffer, so it goes out right behind the buffer
+	count = 0;
+	if ( w->used ) {
+		iov[count].iov_base = w->buffer;
+		iov[count++].iov_len = w->used;
+		w->used = 0;
+	}
+	iov[count].iov_base = header;
+	iov[count++].iov_len = sizeof( header );
+	if ( size ) {
+		iov[count].iov_base = (void *)data;
+		iov[count++].iov_len = size;
+	}
+	if ( !Demo_WriteAll( w, iov, count ) ) {
+		return qfalse;
+	}
+	w->offset += sizeof( header ) + size;
+	return qtrue;
+}
+
+/*
+==================
+Demo_FlushWriter
+
+Writes out the buffer, and with sync, gets everything written so far to
+the disk.
+==================
+*/
+qboolean Demo_FlushWriter( demoWriter_t *w, qboolean sync ) {
+	demoIovec_t	iov[1];
+	int			result;
+
+	if ( w->used ) {
+		iov[0].iov_base = w->buffer;
+		iov[0].iov_len = w->used;
+		w->used = 0;
+		if ( !Demo_WriteAll( w, iov, 1 ) ) {
+			return qfalse;
+		}
+	}
+	if ( !sync || !w->unsynced ) {
+		return qtrue;
+	}
+
+#ifdef _WIN32
+	result = _commit( w->fd );
+#else
+	result = fsync( w->fd );
+#endif
+	if ( result < 0 ) {
+		return qfalse;
+	}
+	w->unsynced = 0;
+	return qtrue;
+}
+
+/*
+==================
+Demo_CloseWriter
+
+Flushes, with the end marker first if asked, and closes the file.  It is
+closed even on failure.
+==================
+*/
+qboolean Demo_CloseWriter( demoWriter_t *w, qboolean end ) {
+	qboolean	ok;
+
+	if ( w->fd < 0 ) {
+		return qtrue;
+	}
+	ok = ( !end || Demo_WriteMessage( w, -1, NULL, -1 ) ) && Demo_FlushWriter( w, w->syncBytes != 0 );
+#ifdef _WIN32
+	if ( _close( w->fd ) < 0 ) {
+#else
+	if ( close( w->fd ) < 0 ) {
+#endif
+		ok = qfalse;
+	}
+	free( w->buffer );
+	w->buffer = NULL;
+	w->fd = -1;
+	return ok;
+}
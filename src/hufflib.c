@@ -1,13 +1,352 @@
 #include <Python.h>
 #include <structmember.h>
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <time.h>
+#endif
 #include "q_shared.h"
 #include "qcommon.h"
 
+/*
+ * Helpers
+ */
+
+static int
+q3huff_GetStruct(PyObject *obj, void *dst, Py_ssize_t size, const char *what)
+{
+  Py_buffer view;
+
+  if (obj == Py_None) {
+    memset(dst, 0, size);
+    return 0;
+  }
+
+  if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0) {
+    return -1;
+  }
+
+  if (view.len != size) {
+    PyBuffer_Release(&view);
+    PyErr_Format(PyExc_ValueError, "%s must be %d bytes", what, (int) size);
+    return -1;
+  }
+
+  memcpy(dst, view.buf, size);
+  PyBuffer_Release(&view);
+  return 0;
+}
+
+#define q3huff_GetEntityState(obj, es) q3huff_GetStruct(obj, es, sizeof(entityState_t), "entity state")
+#define q3huff_GetPlayerState(obj, ps) q3huff_GetStruct(obj, ps, sizeof(playerState_t), "player state")
+
+/*
+ * HuffmanTable Object
+ */
+PyDoc_STRVAR(HuffmanTable__doc__, "HuffmanTable(histogram)");
+PyDoc_STRVAR(HuffmanTable_code_lengths__doc__, "code_lengths() -> tuple");
+
+typedef struct {
+  PyObject_HEAD
+  msgHuffTable_t table;
+} q3huff_HuffmanTableObject;
+
+/*
+ * Reads 256 non-negative byte counts from a sequence, returns -1 with an
+ * exception set if it is not one.
+ */
+static int
+q3huff_GetHistogram(PyObject *histogramObj, int *histogram)
+{
+  PyObject *seq;
+  long count;
+  int i;
+
+  if (!(seq = PySequence_Fast(histogramObj, "histogram must be a sequence"))) {
+    return -1;
+  }
+
+  if (PySequence_Fast_GET_SIZE(seq) != 256) {
+    Py_DECREF(seq);
+    PyErr_SetString(PyExc_ValueError, "histogram must have 256 counts");
+    return -1;
+  }
+
+  for (i = 0; i < 256; i++) {
+    count = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    if (count == -1 && PyErr_Occurred()) {
+      Py_DECREF(seq);
+      return -1;
+    }
+    if (count < 0) {
+      Py_DECREF(seq);
+      PyErr_SetString(PyExc_ValueError, "histogram counts must be >= 0");
+      return -1;
+    }
+    histogram[i] = count > INT_MAX ? INT_MAX : count;
+  }
+  Py_DECREF(seq);
+  return 0;
+}
+
+static int
+HuffmanTable_init(q3huff_HuffmanTableObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"histogram", NULL};
+  PyObject *histogramObj;
+  int histogram[256];
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &histogramObj)) {
+    return -1;
+  }
+
+  if (q3huff_GetHistogram(histogramObj, histogram) < 0) {
+    return -1;
+  }
+
+  MSG_InitHuffTable(&self->table, histogram);
+  return 0;
+}
+
+static void
+HuffmanTable_dealloc(q3huff_HuffmanTableObject *self)
+{
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+HuffmanTable_CodeLengths(q3huff_HuffmanTableObject *self)
+{
+  PyObject *result;
+  int i;
+
+  if (!(result = PyTuple_New(256))) {
+    return NULL;
+  }
+  for (i = 0; i < 256; i++) {
+    PyTuple_SET_ITEM(result, i, PyLong_FromLong(self->table.codeLen[i]));
+  }
+  return result;
+}
+
+static PyMethodDef HuffmanTable_methods[] = {
+  {"code_lengths", (PyCFunction)HuffmanTable_CodeLengths, METH_NOARGS, HuffmanTable_code_lengths__doc__},
+  {NULL}
+};
+
+static PyTypeObject q3huff_HuffmanTableType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "q3huff.HuffmanTable",
+  .tp_basicsize = sizeof(q3huff_HuffmanTableObject),
+  .tp_dealloc   = (destructor)HuffmanTable_dealloc,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc       = HuffmanTable__doc__,
+  .tp_methods   = HuffmanTable_methods,
+  .tp_init      = (initproc)HuffmanTable_init,
+  .tp_new       = PyType_GenericNew,
+};
+
+/*
+ * HuffmanDictionary Object
+ */
+PyDoc_STRVAR(HuffmanDictionary__doc__, "HuffmanDictionary(histogram)");
+PyDoc_STRVAR(HuffmanDictionary_serialize__doc__, "serialize() -> bytes");
+PyDoc_STRVAR(HuffmanDictionary_deserialize__doc__, "deserialize(bytes) -> HuffmanDictionary");
+PyDoc_STRVAR(HuffmanDictionary_update__doc__, "update(bytes)");
+PyDoc_STRVAR(HuffmanDictionary_copy__doc__, "copy() -> HuffmanDictionary");
+
+typedef struct {
+  PyObject_HEAD
+  huff_t huff;
+} q3huff_HuffmanDictionaryObject;
+
+static int
+HuffmanDictionary_init(q3huff_HuffmanDictionaryObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"histogram", NULL};
+  PyObject *histogramObj;
+  int histogram[256];
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &histogramObj)) {
+    return -1;
+  }
+
+  if (q3huff_GetHistogram(histogramObj, histogram) < 0) {
+    return -1;
+  }
+
+  Huff_InitDictionary(&self->huff, histogram);
+  return 0;
+}
+
+static void
+HuffmanDictionary_dealloc(q3huff_HuffmanDictionaryObject *self)
+{
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+HuffmanDictionary_Serialize(q3huff_HuffmanDictionaryObject *self)
+{
+  byte data[HUFF_STATE_MAX_SIZE];
+  int size;
+
+  size = Huff_Serialize(&self->huff, data, sizeof(data));
+  if (size < 0) {
+    PyErr_SetString(PyExc_RuntimeError, "invalid adaptive state");
+    return NULL;
+  }
+  return PyBytes_FromStringAndSize((char *)data, size);
+}
+
+static PyObject *
+HuffmanDictionary_Deserialize(PyTypeObject *type, PyObject *args)
+{
+  q3huff_HuffmanDictionaryObject *result;
+  Py_buffer data;
+  qboolean ok;
+
+  if (!PyArg_ParseTuple(args, "y*", &data)) {
+    return NULL;
+  }
+
+  if (!(result = (q3huff_HuffmanDictionaryObject *)type->tp_alloc(type, 0))) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  ok = data.len <= HUFF_STATE_MAX_SIZE && Huff_Deserialize(&result->huff, data.buf, data.len);
+  PyBuffer_Release(&data);
+  if (!ok) {
+    Py_DECREF(result);
+    PyErr_SetString(PyExc_ValueError, "invalid adaptive state");
+    return NULL;
+  }
+  return (PyObject *)result;
+}
+
+static PyObject *
+HuffmanDictionary_Update(q3huff_HuffmanDictionaryObject *self, PyObject *args)
+{
+  Py_buffer data;
+  const byte *p;
+  Py_ssize_t i;
+
+  if (!PyArg_ParseTuple(args, "y*", &data)) {
+    return NULL;
+  }
+
+  p = data.buf;
+  for (i = 0; i < data.len; i++) {
+    Huff_addRef(&self->huff, p[i]);
+  }
+  PyBuffer_Release(&data);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+HuffmanDictionary_Copy(q3huff_HuffmanDictionaryObject *self)
+{
+  q3huff_HuffmanDictionaryObject *result;
+
+  if (!(result = (q3huff_HuffmanDictionaryObject *)Py_TYPE(self)->tp_alloc(Py_TYPE(self), 0))) {
+    return NULL;
+  }
+  Huff_Copy(&result->huff, &self->huff);
+  return (PyObject *)result;
+}
+
+static PyMethodDef HuffmanDictionary_methods[] = {
+  {"update", (PyCFunction)HuffmanDictionary_Update, METH_VARARGS, HuffmanDictionary_update__doc__},
+  {"copy", (PyCFunction)HuffmanDictionary_Copy, METH_NOARGS, HuffmanDictionary_copy__doc__},
+  {"__copy__", (PyCFunction)HuffmanDictionary_Copy, METH_NOARGS, HuffmanDictionary_copy__doc__},
+  {"serialize", (PyCFunction)HuffmanDictionary_Serialize, METH_NOARGS, HuffmanDictionary_serialize__doc__},
+  {"deserialize", (PyCFunction)HuffmanDictionary_Deserialize, METH_VARARGS | METH_CLASS, HuffmanDictionary_deserialize__doc__},
+  {NULL}
+};
+
+static PyTypeObject q3huff_HuffmanDictionaryType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "q3huff.HuffmanDictionary",
+  .tp_basicsize = sizeof(q3huff_HuffmanDictionaryObject),
+  .tp_dealloc   = (destructor)HuffmanDictionary_dealloc,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc       = HuffmanDictionary__doc__,
+  .tp_methods   = HuffmanDictionary_methods,
+  .tp_init      = (initproc)HuffmanDictionary_init,
+  .tp_new       = PyType_GenericNew,
+};
+
+/*
+ * Adaptive state of a HuffmanDictionary, NULL for None.  Returns -1 with
+ * an exception set for anything else.
+ */
+static int
+q3huff_GetDictionary(PyObject *obj, const huff_t **dictionary)
+{
+  if (obj == Py_None) {
+    *dictionary = NULL;
+    return 0;
+  }
+  if (!PyObject_TypeCheck(obj, &q3huff_HuffmanDictionaryType)) {
+    PyErr_SetString(PyExc_TypeError, "dictionary must be a HuffmanDictionary or None");
+    return -1;
+  }
+  *dictionary = &((q3huff_HuffmanDictionaryObject *)obj)->huff;
+  return 0;
+}
+
+/*
+ * Points msg at the tables of a HuffmanTable, or the default ones for None,
+ * keeping a reference in *tableObj
+ */
+static int
+q3huff_SetTable(msg_t *msg, PyObject **tableObj, PyObject *value)
+{
+  if (value == NULL || value == Py_None) {
+    Py_CLEAR(*tableObj);
+    msg->table = NULL;
+    return 0;
+  }
+
+  if (!PyObject_TypeCheck(value, &q3huff_HuffmanTableType)) {
+    PyErr_SetString(PyExc_TypeError, "table must be a HuffmanTable or None");
+    return -1;
+  }
+
+  Py_INCREF(value);
+  Py_XSETREF(*tableObj, value);
+  msg->table = &((q3huff_HuffmanTableObject *)value)->table;
+  return 0;
+}
+
+/*
+ * "O&" converter of a HuffmanTable, or None for the default tables, to the
+ * msgHuffTable_t * it holds.
+ */
+static int
+q3huff_TableConverter(PyObject *obj, void *addr)
+{
+  if (obj == Py_None) {
+    *(const msgHuffTable_t **)addr = NULL;
+    return 1;
+  }
+
+  if (!PyObject_TypeCheck(obj, &q3huff_HuffmanTableType)) {
+    PyErr_SetString(PyExc_TypeError, "table must be a HuffmanTable or None");
+    return 0;
+  }
+
+  *(const msgHuffTable_t **)addr = &((q3huff_HuffmanTableObject *)obj)->table;
+  return 1;
+}
+
 /*
  * Writer Object
  */
 
-PyDoc_STRVAR(Writer__doc__, "Writer()");
+PyDoc_STRVAR(Writer__doc__, "Writer(table=None)");
 PyDoc_STRVAR(Writer_reset__doc__, "reset()");
 PyDoc_STRVAR(Writer_write_bits__doc__, "write_bits(integer, num_bits)");
 PyDoc_STRVAR(Writer_write_char__doc__, "write_char(integer)");
@@ -24,27 +363,62 @@ PyDoc_STRVAR(Writer_write_delta__doc__, "write_delta(old_value, new_value, num_b
 PyDoc_STRVAR(Writer_write_delta_float__doc__, "write_delta_float(old_value, new_value)");
 PyDoc_STRVAR(Writer_write_delta_key__doc__, "write_delta_key(key, old_value, new_value, num_bits)");
 PyDoc_STRVAR(Writer_write_delta_key_float__doc__, "write_delta_key_float(key, old_value, new_value)");
+PyDoc_STRVAR(Writer_write_delta_entity__doc__, "write_delta_entity(from_state, to_state, force=False)");
+PyDoc_STRVAR(Writer_write_delta_playerstate__doc__, "write_delta_playerstate(from_state, to_state)");
+PyDoc_STRVAR(Writer_cost_of__doc__, "cost_of(integer, num_bits) -> integer");
+PyDoc_STRVAR(Writer_cost_of_data__doc__, "cost_of_data(bytes) -> integer");
+PyDoc_STRVAR(Writer_append_bits__doc__, "append_bits(writer_or_buffer, bit_length=None)");
+PyDoc_STRVAR(Writer_checkpoint__doc__, "checkpoint() -> token");
+PyDoc_STRVAR(Writer_rollback__doc__, "rollback(token)");
+PyDoc_STRVAR(Writer_bit_length__doc__, "number of bits written to the bitstream");
+PyDoc_STRVAR(Writer_remaining_bits__doc__, "number of bits that can still be written without overflowing");
 PyDoc_STRVAR(Writer_data__doc__, "output data from write_* functions");
 PyDoc_STRVAR(Writer_oob__doc__, "flag tells if data should be written as huffman compressed or not (oob)");
 PyDoc_STRVAR(Writer_overflow__doc__, "flag that indicates if the output bufer was overflowed");
+PyDoc_STRVAR(Writer_table__doc__, "HuffmanTable used for the bitstream, None for the default one");
 
 typedef struct {
   PyObject_HEAD
   msg_t msgBuf;
+  PyObject *table;
+  char busy;              // written by build_snapshots with the GIL released
   byte buf[MAX_MSGLEN];
 } q3huff_WriterObject;
 
+static PyTypeObject q3huff_WriterType;
+
+/*
+ * Raises if the writer is being written with the GIL released.
+ */
+static int
+Writer_CheckIdle(q3huff_WriterObject *self)
+{
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "writer is in use by another thread");
+    return -1;
+  }
+  return 0;
+}
+
 static int
 Writer_init(q3huff_WriterObject *self, PyObject *args, PyObject *kwds)
 {
+  static char *kwlist[] = {"table", NULL};
+  PyObject *tableObj = Py_None;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &tableObj)) {
+    return -1;
+  }
+
   memset(&self->msgBuf, 0, sizeof(self->msgBuf));
   MSG_Init(&self->msgBuf, self->buf, sizeof(self->buf));
-  return 0;
+  return q3huff_SetTable(&self->msgBuf, &self->table, tableObj);
 }
 
 static void
 Writer_dealloc(q3huff_WriterObject *self)
 {
+  Py_XDECREF(self->table);
   Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -53,6 +427,9 @@ Writer_Reset(q3huff_WriterObject *self)
 {
   memset(&self->msgBuf, 0, sizeof(self->msgBuf));
   MSG_Init(&self->msgBuf, self->buf, sizeof(self->buf));
+  if (self->table) {
+    self->msgBuf.table = &((q3huff_HuffmanTableObject *)self->table)->table;
+  }
   Py_RETURN_NONE;
 }
 
@@ -268,63 +645,282 @@ Writer_WriteDeltaKeyFloat(q3huff_WriterObject *self, PyObject *args)
 }
 
 static PyObject *
-Writer_getattro(q3huff_WriterObject *self, PyObject *name)
+Writer_WriteDeltaEntity(q3huff_WriterObject *self, PyObject *args)
 {
-  PyObject *result = NULL;
+  PyObject *fromObj, *toObj;
+  entityState_t from, to;
+  int force = 0;
 
-  Py_INCREF(name);
-  const char *cname = PyUnicode_AsUTF8(name);
+  if (!PyArg_ParseTuple(args, "OO|p", &fromObj, &toObj, &force)) {
+    return NULL;
+  }
 
-  if (strcmp(cname, "data") == 0) {
-    result = PyBytes_FromStringAndSize((char *)self->msgBuf.data, self->msgBuf.cursize);
+  if (q3huff_GetEntityState(fromObj, &from) < 0) {
+    return NULL;
   }
-  else if (strcmp(cname, "oob") == 0) {
-    result = PyBool_FromLong(self->msgBuf.oob);
+
+  if (toObj == Py_None) {
+    if (fromObj != Py_None) {
+      MSG_WriteDeltaEntity(&self->msgBuf, &from, NULL, force);
+    }
+    Py_RETURN_NONE;
   }
-  else if (strcmp(cname, "overflow") == 0) {
-    result = PyBool_FromLong(self->msgBuf.overflowed);
+
+  if (q3huff_GetEntityState(toObj, &to) < 0) {
+    return NULL;
   }
-  else {
-    result = PyObject_GenericGetAttr((PyObject *)self, name);
+
+  if (to.number < 0 || to.number >= MAX_GENTITIES) {
+    PyErr_SetString(PyExc_ValueError, "entity number out of range");
+    return NULL;
   }
-  Py_DECREF(name);
 
-  return result;
+  MSG_WriteDeltaEntity(&self->msgBuf, &from, &to, force);
+  Py_RETURN_NONE;
 }
 
-static int
-Writer_setattro(q3huff_WriterObject *self, PyObject *name, PyObject *value)
+static PyObject *
+Writer_WriteDeltaPlayerstate(q3huff_WriterObject *self, PyObject *args)
 {
-  int result = 0;
+  PyObject *fromObj, *toObj;
+  playerState_t from, to;
 
-  Py_INCREF(name);
-  const char *cname = PyUnicode_AsUTF8(name);
+  if (!PyArg_ParseTuple(args, "OO", &fromObj, &toObj)) {
+    return NULL;
+  }
 
-  if (strcmp(cname, "oob") == 0) {
-    if (PyObject_IsTrue(value)) {
-      self->msgBuf.oob = qtrue;
-    }
-    else {
-      self->msgBuf.oob = qfalse;
-    }
+  if (q3huff_GetPlayerState(fromObj, &from) < 0) {
+    return NULL;
   }
-  else {
-    result = PyObject_GenericSetAttr((PyObject *)self, name, value);
+
+  if (q3huff_GetPlayerState(toObj, &to) < 0) {
+    return NULL;
   }
-  Py_DECREF(name);
 
-  return result;
+  MSG_WriteDeltaPlayerstate(&self->msgBuf, fromObj == Py_None ? NULL : &from, &to);
+  Py_RETURN_NONE;
 }
 
-static PyMemberDef Writer_members[] = {
-  {"data", -1, 0, READONLY|RESTRICTED, Writer_data__doc__},
-  {"oob", -1, 0, RESTRICTED, Writer_oob__doc__},
-  {"overflow", -1, 0, READONLY|RESTRICTED, Writer_overflow__doc__},
-  {NULL}
-};
+static PyObject *
+Writer_CostOf(q3huff_WriterObject *self, PyObject *args)
+{
+  int value, bits;
 
-static PyMethodDef Writer_methods[] = {
-  {"reset", (PyCFunction)Writer_Reset, METH_NOARGS, Writer_reset__doc__},
+  if (!PyArg_ParseTuple(args, "Ii", &value, &bits)) {
+    return NULL;
+  }
+
+  if (bits == 0 || bits < -31 || bits > 32) {
+    PyErr_SetString(PyExc_OverflowError, "num_bits must be => -31 and <= 32, but not 0");
+    return NULL;
+  }
+
+  if (self->msgBuf.oob) {
+    bits = abs(bits);
+    return PyLong_FromLong(bits == 8 || bits == 16 || bits == 32 ? bits : 0);
+  }
+  if (self->msgBuf.table) {
+    return PyLong_FromLong(MSG_TableBitsCost(self->msgBuf.table, value, bits));
+  }
+  return PyLong_FromLong(MSG_BitsCost(value, bits));
+}
+
+static PyObject *
+Writer_CostOfData(q3huff_WriterObject *self, PyObject *args)
+{
+  Py_buffer data;
+  int cost;
+
+  if (!PyArg_ParseTuple(args, "y*", &data)) {
+    return NULL;
+  }
+
+  if (self->msgBuf.oob) {
+    cost = data.len * 8;
+  } else {
+    cost = MSG_DataCost(self->msgBuf.table, data.buf, data.len);
+  }
+  PyBuffer_Release(&data);
+  return PyLong_FromLong(cost);
+}
+
+static PyObject *
+Writer_AppendBits(q3huff_WriterObject *self, PyObject *args)
+{
+  PyObject *srcObj, *bitsObj = Py_None;
+  Py_buffer view = {NULL};
+  const byte *data;
+  byte *copy = NULL;
+  long bits, available;
+
+  if (!PyArg_ParseTuple(args, "O|O", &srcObj, &bitsObj)) {
+    return NULL;
+  }
+
+  if (self->msgBuf.oob) {
+    PyErr_SetString(PyExc_ValueError, "bits can only be appended to a bitstream writer");
+    return NULL;
+  }
+
+  if (PyObject_TypeCheck(srcObj, &q3huff_WriterType)) {
+    if (Writer_CheckIdle((q3huff_WriterObject *)srcObj) < 0) {
+      return NULL;
+    }
+    data = ((q3huff_WriterObject *)srcObj)->msgBuf.data;
+    available = ((q3huff_WriterObject *)srcObj)->msgBuf.bit;
+  } else {
+    if (PyObject_GetBuffer(srcObj, &view, PyBUF_SIMPLE) < 0) {
+      return NULL;
+    }
+    data = view.buf;
+    available = view.len > MAX_MSGLEN ? MAX_MSGLEN * 8 : view.len * 8;
+  }
+
+  if (bitsObj == Py_None) {
+    bits = available;
+  } else {
+    bits = PyLong_AsLong(bitsObj);
+    if (bits == -1 && PyErr_Occurred()) {
+      goto done;
+    }
+    if (bits < 0 || bits > available) {
+      PyErr_SetString(PyExc_ValueError, "bit_length must be >= 0 and at most the length of the source");
+      goto done;
+    }
+  }
+
+  // appending a writer to itself would read what is being written
+  if (srcObj == (PyObject *)self) {
+    if (!(copy = PyMem_Malloc((bits + 7) / 8 + 1))) {
+      PyErr_NoMemory();
+      goto done;
+    }
+    memcpy(copy, data, (bits + 7) / 8);
+    data = copy;
+  }
+
+  MSG_AppendBits(&self->msgBuf, data, bits);
+
+done:
+  PyMem_Free(copy);
+  if (view.obj) {
+    PyBuffer_Release(&view);
+  }
+  if (PyErr_Occurred()) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Writer_Checkpoint(q3huff_WriterObject *self)
+{
+  return Py_BuildValue("iiO", self->msgBuf.bit, self->msgBuf.cursize,
+                       self->msgBuf.overflowed ? Py_True : Py_False);
+}
+
+static PyObject *
+Writer_Rollback(q3huff_WriterObject *self, PyObject *args)
+{
+  int bit, cursize, overflowed;
+
+  if (!PyArg_ParseTuple(args, "(iip)", &bit, &cursize, &overflowed)) {
+    return NULL;
+  }
+
+  if (bit < 0 || cursize < 0 || bit > self->msgBuf.bit || cursize > self->msgBuf.cursize) {
+    PyErr_SetString(PyExc_ValueError, "token is not from an earlier position of this writer");
+    return NULL;
+  }
+
+  MSG_Truncate(&self->msgBuf, bit, cursize);
+  self->msgBuf.overflowed = overflowed;
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Writer_getattro(q3huff_WriterObject *self, PyObject *name)
+{
+  PyObject *result = NULL;
+
+  // every method is looked up here first
+  if (Writer_CheckIdle(self) < 0) {
+    return NULL;
+  }
+
+  Py_INCREF(name);
+  const char *cname = PyUnicode_AsUTF8(name);
+
+  if (strcmp(cname, "data") == 0) {
+    result = PyBytes_FromStringAndSize((char *)self->msgBuf.data, self->msgBuf.cursize);
+  }
+  else if (strcmp(cname, "oob") == 0) {
+    result = PyBool_FromLong(self->msgBuf.oob);
+  }
+  else if (strcmp(cname, "overflow") == 0) {
+    result = PyBool_FromLong(self->msgBuf.overflowed);
+  }
+  else if (strcmp(cname, "table") == 0) {
+    result = self->table ? self->table : Py_None;
+    Py_INCREF(result);
+  }
+  else if (strcmp(cname, "bit_length") == 0) {
+    result = PyLong_FromLong(self->msgBuf.bit);
+  }
+  else if (strcmp(cname, "remaining_bits") == 0) {
+    result = PyLong_FromLong(MSG_RemainingBits(&self->msgBuf));
+  }
+  else {
+    result = PyObject_GenericGetAttr((PyObject *)self, name);
+  }
+  Py_DECREF(name);
+
+  return result;
+}
+
+static int
+Writer_setattro(q3huff_WriterObject *self, PyObject *name, PyObject *value)
+{
+  int result = 0;
+
+  if (Writer_CheckIdle(self) < 0) {
+    return -1;
+  }
+
+  Py_INCREF(name);
+  const char *cname = PyUnicode_AsUTF8(name);
+
+  if (strcmp(cname, "oob") == 0) {
+    if (PyObject_IsTrue(value)) {
+      self->msgBuf.oob = qtrue;
+    }
+    else {
+      self->msgBuf.oob = qfalse;
+    }
+  }
+  else if (strcmp(cname, "table") == 0) {
+    result = q3huff_SetTable(&self->msgBuf, &self->table, value);
+  }
+  else {
+    result = PyObject_GenericSetAttr((PyObject *)self, name, value);
+  }
+  Py_DECREF(name);
+
+  return result;
+}
+
+static PyMemberDef Writer_members[] = {
+  {"data", -1, 0, READONLY|RESTRICTED, Writer_data__doc__},
+  {"oob", -1, 0, RESTRICTED, Writer_oob__doc__},
+  {"overflow", -1, 0, READONLY|RESTRICTED, Writer_overflow__doc__},
+  {"table", -1, 0, RESTRICTED, Writer_table__doc__},
+  {"bit_length", -1, 0, READONLY|RESTRICTED, Writer_bit_length__doc__},
+  {"remaining_bits", -1, 0, READONLY|RESTRICTED, Writer_remaining_bits__doc__},
+  {NULL}
+};
+
+static PyMethodDef Writer_methods[] = {
+  {"reset", (PyCFunction)Writer_Reset, METH_NOARGS, Writer_reset__doc__},
   {"write_bits", (PyCFunction)Writer_WriteBits, METH_VARARGS, Writer_write_bits__doc__},
   {"write_char", (PyCFunction)Writer_WriteChar, METH_VARARGS, Writer_write_char__doc__},
   {"write_byte", (PyCFunction)Writer_WriteByte, METH_VARARGS, Writer_write_byte__doc__},
@@ -340,6 +936,13 @@ static PyMethodDef Writer_methods[] = {
   {"write_delta_float", (PyCFunction)Writer_WriteDeltaFloat, METH_VARARGS, Writer_write_delta_float__doc__},
   {"write_delta_key", (PyCFunction)Writer_WriteDeltaKey, METH_VARARGS, Writer_write_delta_key__doc__},
   {"write_delta_key_float", (PyCFunction)Writer_WriteDeltaKeyFloat, METH_VARARGS, Writer_write_delta_key_float__doc__},
+  {"write_delta_entity", (PyCFunction)Writer_WriteDeltaEntity, METH_VARARGS, Writer_write_delta_entity__doc__},
+  {"write_delta_playerstate", (PyCFunction)Writer_WriteDeltaPlayerstate, METH_VARARGS, Writer_write_delta_playerstate__doc__},
+  {"append_bits", (PyCFunction)Writer_AppendBits, METH_VARARGS, Writer_append_bits__doc__},
+  {"checkpoint", (PyCFunction)Writer_Checkpoint, METH_NOARGS, Writer_checkpoint__doc__},
+  {"rollback", (PyCFunction)Writer_Rollback, METH_VARARGS, Writer_rollback__doc__},
+  {"cost_of", (PyCFunction)Writer_CostOf, METH_VARARGS, Writer_cost_of__doc__},
+  {"cost_of_data", (PyCFunction)Writer_CostOfData, METH_VARARGS, Writer_cost_of_data__doc__},
   {NULL}
 };
 
@@ -362,7 +965,7 @@ static PyTypeObject q3huff_WriterType = {
  * Reader Object
  */
 
-PyDoc_STRVAR(Reader__doc__, "Reader(bytes)");
+PyDoc_STRVAR(Reader__doc__, "Reader(bytes, table=None)");
 PyDoc_STRVAR(Reader_reset__doc__, "reset(bytes)");
 PyDoc_STRVAR(Reader_read_bits__doc__, "read_bits(num_bits) -> integer");
 PyDoc_STRVAR(Reader_read_char__doc__, "read_char() -> integer");
@@ -381,37 +984,70 @@ PyDoc_STRVAR(Reader_read_delta__doc__, "read_delta(old_value, num_bits) -> integ
 PyDoc_STRVAR(Reader_read_delta_float__doc__, "read_delta_float(old_value) -> float");
 PyDoc_STRVAR(Reader_read_delta_key__doc__, "read_delta_key(key, old_value, num_bits) -> integer");
 PyDoc_STRVAR(Reader_read_delta_key_float__doc__, "read_delta_key_float(key, old_value) -> float");
+PyDoc_STRVAR(Reader_read_delta_entity__doc__, "read_delta_entity(from_state, number) -> bytes");
+PyDoc_STRVAR(Reader_read_delta_playerstate__doc__, "read_delta_playerstate(from_state) -> bytes");
 PyDoc_STRVAR(Reader_oob__doc__, "flag tells if data should be read as huffman compressed or not (oob)");
+PyDoc_STRVAR(Reader_table__doc__, "HuffmanTable used for the bitstream, None for the default one");
 
 typedef struct {
   PyObject_HEAD
   msg_t msgBuf;
-  byte buf[MAX_MSGLEN];
+  PyObject *table;
+  PyObject *owner;  // object whose memory msgBuf reads in place, or NULL
+  byte *buf;        // copy of the data when not in place
 } q3huff_ReaderObject;
 
+/*
+ * Points the reader at a copy of data, at most MAX_MSGLEN bytes of it.
+ * Returns -1 with an exception set if out of memory.
+ */
 static int
-Reader_init(q3huff_ReaderObject *self, PyObject *args, PyObject *kwds)
+Reader_SetData(q3huff_ReaderObject *self, Py_buffer *data)
 {
-  Py_buffer data;
+  byte *buf;
   int len;
 
-  if (!PyArg_ParseTuple(args, "y*", &data)) {
+  len = data->len > MAX_MSGLEN ? MAX_MSGLEN : data->len;
+  if (!(buf = PyMem_Malloc(len ? len : 1))) {
+    PyErr_NoMemory();
     return -1;
   }
+  memcpy(buf, data->buf, len);
+  PyMem_Free(self->buf);
+  Py_CLEAR(self->owner);
+  self->buf = buf;
 
-  memset(&self->msgBuf, 0, sizeof(self->msgBuf));
-  len = data.len > (int) sizeof(self->buf) ? (int) sizeof(self->buf) : data.len;
-  memcpy(self->buf, data.buf, len);
   MSG_Init(&self->msgBuf, self->buf, len);
-  PyBuffer_Release(&data);
-
   self->msgBuf.cursize = len;
   return 0;
 }
 
+static int
+Reader_init(q3huff_ReaderObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"data", "table", NULL};
+  PyObject *tableObj = Py_None;
+  Py_buffer data;
+  int result;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|O", kwlist, &data, &tableObj)) {
+    return -1;
+  }
+
+  result = Reader_SetData(self, &data);
+  PyBuffer_Release(&data);
+  if (result < 0) {
+    return -1;
+  }
+  return q3huff_SetTable(&self->msgBuf, &self->table, tableObj);
+}
+
 static void
 Reader_dealloc(q3huff_ReaderObject *self)
 {
+  Py_XDECREF(self->table);
+  Py_XDECREF(self->owner);
+  PyMem_Free(self->buf);
   Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
@@ -419,19 +1055,21 @@ static PyObject *
 Reader_Reset(q3huff_ReaderObject *self, PyObject *args)
 {
   Py_buffer data;
-  int len;
+  int result;
 
   if (!PyArg_ParseTuple(args, "y*", &data)) {
     return NULL;
   }
 
-  memset(&self->msgBuf, 0, sizeof(self->msgBuf));
-  len = data.len > (int) sizeof(self->buf) ? (int) sizeof(self->buf) : data.len;
-  memcpy(self->buf, data.buf, len);
-  MSG_Init(&self->msgBuf, self->buf, len);
+  result = Reader_SetData(self, &data);
   PyBuffer_Release(&data);
+  if (result < 0) {
+    return NULL;
+  }
 
-  self->msgBuf.cursize = len;
+  if (self->table) {
+    self->msgBuf.table = &((q3huff_HuffmanTableObject *)self->table)->table;
+  }
   Py_RETURN_NONE;
 }
 
@@ -596,6 +1234,49 @@ Reader_ReadDeltaKeyFloat(q3huff_ReaderObject *self, PyObject *args)
   return PyLong_FromLong(MSG_ReadDeltaKeyFloat(&self->msgBuf, key, oldV));
 }
 
+static PyObject *
+Reader_ReadDeltaEntity(q3huff_ReaderObject *self, PyObject *args)
+{
+  PyObject *fromObj;
+  entityState_t from, to;
+  int number;
+
+  if (!PyArg_ParseTuple(args, "Oi", &fromObj, &number)) {
+    return NULL;
+  }
+
+  if (number < 0 || number >= MAX_GENTITIES) {
+    PyErr_SetString(PyExc_ValueError, "entity number out of range");
+    return NULL;
+  }
+
+  if (q3huff_GetEntityState(fromObj, &from) < 0) {
+    return NULL;
+  }
+
+  memset(&to, 0, sizeof(to));
+  MSG_ReadDeltaEntity(&self->msgBuf, &from, &to, number);
+  return PyBytes_FromStringAndSize((char *)&to, sizeof(to));
+}
+
+static PyObject *
+Reader_ReadDeltaPlayerstate(q3huff_ReaderObject *self, PyObject *args)
+{
+  PyObject *fromObj;
+  playerState_t from, to;
+
+  if (!PyArg_ParseTuple(args, "O", &fromObj)) {
+    return NULL;
+  }
+
+  if (q3huff_GetPlayerState(fromObj, &from) < 0) {
+    return NULL;
+  }
+
+  MSG_ReadDeltaPlayerstate(&self->msgBuf, &from, &to);
+  return PyBytes_FromStringAndSize((char *)&to, sizeof(to));
+}
+
 static PyObject *
 Reader_getattro(q3huff_ReaderObject *self, PyObject *name)
 {
@@ -607,6 +1288,10 @@ Reader_getattro(q3huff_ReaderObject *self, PyObject *name)
   if (strcmp(cname, "oob") == 0) {
     result = PyBool_FromLong(self->msgBuf.oob);
   }
+  else if (strcmp(cname, "table") == 0) {
+    result = self->table ? self->table : Py_None;
+    Py_INCREF(result);
+  }
   else {
     result = PyObject_GenericGetAttr((PyObject *)self, name);
   }
@@ -616,7 +1301,7 @@ Reader_getattro(q3huff_ReaderObject *self, PyObject *name)
 }
 
 static int
-Reader_setattro(q3huff_WriterObject *self, PyObject *name, PyObject *value)
+Reader_setattro(q3huff_ReaderObject *self, PyObject *name, PyObject *value)
 {
   int result = 0;
 
@@ -631,6 +1316,9 @@ Reader_setattro(q3huff_WriterObject *self, PyObject *name, PyObject *value)
       self->msgBuf.oob = qfalse;
     }
   }
+  else if (strcmp(cname, "table") == 0) {
+    result = q3huff_SetTable(&self->msgBuf, &self->table, value);
+  }
   else {
     result = PyObject_GenericSetAttr((PyObject *)self, name, value);
   }
@@ -641,11 +1329,12 @@ Reader_setattro(q3huff_WriterObject *self, PyObject *name, PyObject *value)
 
 static PyMemberDef Reader_members[] = {
   {"oob", -1, 0, RESTRICTED, Reader_oob__doc__},
+  {"table", -1, 0, RESTRICTED, Reader_table__doc__},
   {NULL}
 };
 
 static PyMethodDef Reader_methods[] = {
-  {"reset", (PyCFunction)Reader_Reset, METH_NOARGS, Reader_reset__doc__},
+  {"reset", (PyCFunction)Reader_Reset, METH_VARARGS, Reader_reset__doc__},
   {"read_bits", (PyCFunction)Reader_ReadBits, METH_VARARGS, Reader_read_bits__doc__},
   {"read_char", (PyCFunction)Reader_ReadChar, METH_NOARGS, Reader_read_char__doc__},
   {"read_byte", (PyCFunction)Reader_ReadByte, METH_NOARGS, Reader_read_byte__doc__},
@@ -663,6 +1352,8 @@ static PyMethodDef Reader_methods[] = {
   {"read_delta_float", (PyCFunction)Reader_ReadDeltaFloat, METH_VARARGS, Reader_read_delta_float__doc__},
   {"read_delta_key", (PyCFunction)Reader_ReadDeltaKey, METH_VARARGS, Reader_read_delta_key__doc__},
   {"read_delta_key_float", (PyCFunction)Reader_ReadDeltaKeyFloat, METH_VARARGS, Reader_read_delta_key_float__doc__},
+  {"read_delta_entity", (PyCFunction)Reader_ReadDeltaEntity, METH_VARARGS, Reader_read_delta_entity__doc__},
+  {"read_delta_playerstate", (PyCFunction)Reader_ReadDeltaPlayerstate, METH_VARARGS, Reader_read_delta_playerstate__doc__},
   {NULL}
 };
 
@@ -682,67 +1373,3473 @@ static PyTypeObject q3huff_ReaderType = {
 };
 
 /*
- *  Free functions
+ * Makes a Reader of length bytes at data without copying them.  owner is
+ * kept alive for as long as the reader is.
+ */
+static PyObject *
+q3huff_NewReaderInPlace(PyObject *owner, const byte *data, int length)
+{
+  q3huff_ReaderObject *reader;
+
+  reader = (q3huff_ReaderObject *)q3huff_ReaderType.tp_alloc(&q3huff_ReaderType, 0);
+  if (!reader) {
+    return NULL;
+  }
+  // reads are bounded by cursize and never write
+  MSG_Init(&reader->msgBuf, (byte *)data, length);
+  reader->msgBuf.cursize = length;
+  Py_INCREF(owner);
+  reader->owner = owner;
+  return (PyObject *)reader;
+}
+
+/*
+ * Maps the demo at path, a bytes object from PyUnicode_FSConverter, with the
+ * GIL released.  Returns -1 with OSError set on failure.
+ */
+static int
+q3huff_MapDemo(PyObject *path, demoFile_t *demo)
+{
+  qboolean ok;
+
+  Py_BEGIN_ALLOW_THREADS
+  ok = Demo_Map(demo, PyBytes_AS_STRING(path));
+  Py_END_ALLOW_THREADS
+  if (!ok) {
+#ifdef _WIN32
+    PyErr_SetExcFromWindowsErrWithFilenameObject(PyExc_OSError, 0, path);
+#else
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+#endif
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * DemoReader Object
  */
 
-PyDoc_STRVAR(compress__doc__, "compress(bytes) -> bytes");
-PyDoc_STRVAR(decompress__doc__, "decompress(bytes) -> bytes");
+PyDoc_STRVAR(DemoReader__doc__, "DemoReader(path)");
+PyDoc_STRVAR(DemoReader_offset__doc__, "byte offset of the next record");
+PyDoc_STRVAR(DemoReader_size__doc__, "size of the demo file in bytes");
+PyDoc_STRVAR(DemoReader_truncated__doc__, "whether the demo ended in a record cut short");
+
+typedef struct {
+  PyObject_HEAD
+  demoFile_t demo;
+  Py_ssize_t offset;
+  Py_ssize_t size;
+  char truncated;
+  char done;
+} q3huff_DemoReaderObject;
 
 static PyObject *
-q3huff_Compress(PyObject *self, PyObject *args)
+DemoReader_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
-  Py_buffer data;
-  msg_t msgBuf = {0};
-  byte buf[MAX_MSGLEN];
+  static char *kwlist[] = {"path", NULL};
+  q3huff_DemoReaderObject *self;
+  PyObject *path;
 
-  if (!PyArg_ParseTuple(args, "y*", &data)) {
+  // mapped once here rather than in tp_init, readers point into the mapping
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&", kwlist, PyUnicode_FSConverter, &path)) {
     return NULL;
   }
 
-  msgBuf.cursize = data.len;
-  if (msgBuf.cursize > (int) sizeof(buf)) {
-    msgBuf.cursize = sizeof(buf);
+  if (!(self = (q3huff_DemoReaderObject *)type->tp_alloc(type, 0))) {
+    Py_DECREF(path);
+    return NULL;
   }
-  memcpy(buf, data.buf, msgBuf.cursize);
-  PyBuffer_Release(&data);
-  msgBuf.data = buf;
-  msgBuf.maxsize = sizeof(buf);
-  Huff_Compress(&msgBuf, 0);
-  return PyBytes_FromStringAndSize((char*)msgBuf.data, msgBuf.cursize);
+
+  if (q3huff_MapDemo(path, &self->demo) < 0) {
+    Py_DECREF(path);
+    Py_DECREF(self);
+    return NULL;
+  }
+  Py_DECREF(path);
+
+  self->size = self->demo.size;
+  return (PyObject *)self;
+}
+
+static void
+DemoReader_dealloc(q3huff_DemoReaderObject *self)
+{
+  Demo_Unmap(&self->demo);
+  Py_TYPE(self)->tp_free((PyObject*)self);
 }
 
 static PyObject *
-q3huff_Decompress(PyObject *self, PyObject *args)
+DemoReader_iternext(q3huff_DemoReaderObject *self)
 {
-  Py_buffer data;
-  msg_t msgBuf = {0};
-  byte buf[MAX_MSGLEN];
+  PyObject *reader, *result;
+  const byte *data;
+  size_t offset;
+  int sequence, length;
 
-  if (!PyArg_ParseTuple(args, "y*", &data)) {
+  if (self->done) {
     return NULL;
   }
 
-  memset(&msgBuf, 0, sizeof(msgBuf));
-  msgBuf.cursize = data.len;
-  if (msgBuf.cursize > (int) sizeof(buf)) {
-    msgBuf.cursize = sizeof(buf);
+  offset = self->offset;
+  switch (Demo_NextMessage(&self->demo, &offset, &sequence, &data, &length)) {
+  case DEMO_MESSAGE:
+    break;
+  case DEMO_TRUNCATED:
+    self->truncated = 1;
+    /* fall through */
+  case DEMO_END:
+    self->done = 1;
+    return NULL;
+  default:
+    PyErr_Format(PyExc_ValueError, "demo message at offset %zd is longer than %d bytes", self->offset, MAX_MSGLEN);
+    return NULL;
   }
-  memcpy(buf, data.buf, msgBuf.cursize);
-  PyBuffer_Release(&data);
-  msgBuf.maxsize = sizeof(buf);
-  msgBuf.data = buf;
-  Huff_Decompress(&msgBuf, 0);
-  return PyBytes_FromStringAndSize((char*)msgBuf.data, msgBuf.cursize);;
+
+  if (!(reader = q3huff_NewReaderInPlace((PyObject *)self, data, length))) {
+    return NULL;
+  }
+  result = Py_BuildValue("(iN)", sequence, reader);
+  if (result) {
+    self->offset = offset;
+  }
+  return result;
 }
 
-static PyMethodDef q3huff_methods[] = {
-  {"compress", (PyCFunction)q3huff_Compress, METH_VARARGS, compress__doc__},
-  {"decompress", (PyCFunction)q3huff_Decompress, METH_VARARGS, decompress__doc__},
+static PyMemberDef DemoReader_members[] = {
+  {"offset", T_PYSSIZET, offsetof(q3huff_DemoReaderObject, offset), READONLY, DemoReader_offset__doc__},
+  {"size", T_PYSSIZET, offsetof(q3huff_DemoReaderObject, size), READONLY, DemoReader_size__doc__},
+  {"truncated", T_BOOL, offsetof(q3huff_DemoReaderObject, truncated), READONLY, DemoReader_truncated__doc__},
   {NULL}
 };
 
-static PyModuleDef HuffmanModule = {
-  PyModuleDef_HEAD_INIT,
+static PyTypeObject q3huff_DemoReaderType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "q3huff.DemoReader",
+  .tp_basicsize = sizeof(q3huff_DemoReaderObject),
+  .tp_dealloc   = (destructor)DemoReader_dealloc,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc       = DemoReader__doc__,
+  .tp_iter      = PyObject_SelfIter,
+  .tp_iternext  = (iternextfunc)DemoReader_iternext,
+  .tp_members   = DemoReader_members,
+  .tp_new       = DemoReader_new,
+};
+
+/*
+ * DemoWriter Object
+ */
+
+PyDoc_STRVAR(DemoWriter__doc__, "DemoWriter(path, buffer_size=1048576, sync_bytes=0, append=False)");
+PyDoc_STRVAR(DemoWriter_write__doc__, "write(sequence, message)");
+PyDoc_STRVAR(DemoWriter_flush__doc__, "flush(sync=False)");
+PyDoc_STRVAR(DemoWriter_close__doc__, "close(end=True)");
+PyDoc_STRVAR(DemoWriter_offset__doc__, "bytes written to the demo, buffered ones included");
+PyDoc_STRVAR(DemoWriter_closed__doc__, "whether the demo has been closed");
+
+typedef struct {
+  PyObject_HEAD
+  demoWriter_t writer;
+  PyObject *path;
+  Py_ssize_t offset;
+  char closed;
+  char busy;
+} q3huff_DemoWriterObject;
+
+static PyObject *
+DemoWriter_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"path", "buffer_size", "sync_bytes", "append", NULL};
+  q3huff_DemoWriterObject *self;
+  PyObject *path;
+  Py_ssize_t bufferSize = 1 << 20, syncBytes = 0;
+  int append = 0;
+  qboolean ok;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|nnp", kwlist, PyUnicode_FSConverter, &path,
+                                   &bufferSize, &syncBytes, &append)) {
+    return NULL;
+  }
+
+  if (bufferSize < 0 || syncBytes < 0) {
+    PyErr_SetString(PyExc_ValueError, "buffer_size and sync_bytes must be >= 0");
+    Py_DECREF(path);
+    return NULL;
+  }
+
+  if (!(self = (q3huff_DemoWriterObject *)type->tp_alloc(type, 0))) {
+    Py_DECREF(path);
+    return NULL;
+  }
+  self->path = path;
+  self->closed = 1;
+
+  Py_BEGIN_ALLOW_THREADS
+  ok = Demo_OpenWriter(&self->writer, PyBytes_AS_STRING(path), bufferSize, syncBytes, append);
+  Py_END_ALLOW_THREADS
+  if (!ok) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    Py_DECREF(self);
+    return NULL;
+  }
+  self->closed = 0;
+  return (PyObject *)self;
+}
+
+static void
+DemoWriter_dealloc(q3huff_DemoWriterObject *self)
+{
+  // like a file object, whatever is buffered still gets written
+  if (!self->closed) {
+    Demo_CloseWriter(&self->writer, qtrue);
+  }
+  Py_XDECREF(self->path);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * Checks the writer can be used, and marks it used by the calling thread
+ * while the GIL is released.
+ */
+static int
+DemoWriter_Acquire(q3huff_DemoWriterObject *self)
+{
+  if (self->closed) {
+    PyErr_SetString(PyExc_ValueError, "demo writer is closed");
+    return -1;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "demo writer is in use by another thread");
+    return -1;
+  }
+  self->busy = 1;
+  return 0;
+}
+
+static PyObject *
+DemoWriter_Release(q3huff_DemoWriterObject *self, qboolean ok)
+{
+  self->busy = 0;
+  self->offset = self->writer.offset;
+  if (!ok) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, self->path);
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+DemoWriter_Write(q3huff_DemoWriterObject *self, PyObject *args)
+{
+  PyObject *messageObj, *result;
+  q3huff_WriterObject *writer = NULL;
+  Py_buffer view = {NULL};
+  const byte *data;
+  Py_ssize_t length;
+  int sequence;
+  qboolean ok;
+
+  if (!PyArg_ParseTuple(args, "iO", &sequence, &messageObj)) {
+    return NULL;
+  }
+
+  // a Writer is written straight from its buffer
+  if (PyObject_TypeCheck(messageObj, &q3huff_WriterType)) {
+    writer = (q3huff_WriterObject *)messageObj;
+    if (Writer_CheckIdle(writer) < 0) {
+      return NULL;
+    }
+    if (writer->msgBuf.overflowed) {
+      PyErr_SetString(PyExc_ValueError, "writer has overflowed");
+      return NULL;
+    }
+    data = writer->msgBuf.data;
+    length = writer->msgBuf.cursize;
+  } else {
+    if (PyObject_GetBuffer(messageObj, &view, PyBUF_SIMPLE) < 0) {
+      return NULL;
+    }
+    data = view.buf;
+    length = view.len;
+    if (length > MAX_MSGLEN) {
+      PyErr_Format(PyExc_ValueError, "message is longer than %d bytes", MAX_MSGLEN);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+  }
+
+  if (DemoWriter_Acquire(self) < 0) {
+    PyBuffer_Release(&view);
+    return NULL;
+  }
+
+  // only going to the file is worth releasing the GIL for
+  if (self->writer.used + 8 + length <= self->writer.size) {
+    ok = Demo_WriteMessage(&self->writer, sequence, data, (int)length);
+  } else {
+    // the Writer's buffer is read without the GIL, keep other threads off it
+    if (writer) {
+      writer->busy = 1;
+    }
+    Py_INCREF(messageObj);
+    Py_BEGIN_ALLOW_THREADS
+    ok = Demo_WriteMessage(&self->writer, sequence, data, (int)length);
+    Py_END_ALLOW_THREADS
+    if (writer) {
+      writer->busy = 0;
+    }
+    Py_DECREF(messageObj);
+  }
+
+  result = DemoWriter_Release(self, ok);
+  PyBuffer_Release(&view);
+  return result;
+}
+
+static PyObject *
+DemoWriter_Flush(q3huff_DemoWriterObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"sync", NULL};
+  int sync = 0;
+  qboolean ok;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &sync)) {
+    return NULL;
+  }
+
+  if (DemoWriter_Acquire(self) < 0) {
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  ok = Demo_FlushWriter(&self->writer, sync);
+  Py_END_ALLOW_THREADS
+
+  return DemoWriter_Release(self, ok);
+}
+
+static PyObject *
+DemoWriter_CloseWriter(q3huff_DemoWriterObject *self, qboolean end)
+{
+  qboolean ok;
+
+  if (self->closed) {
+    Py_RETURN_NONE;
+  }
+  if (DemoWriter_Acquire(self) < 0) {
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  ok = Demo_CloseWriter(&self->writer, end);
+  Py_END_ALLOW_THREADS
+
+  self->closed = 1;
+  return DemoWriter_Release(self, ok);
+}
+
+static PyObject *
+DemoWriter_Close(q3huff_DemoWriterObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"end", NULL};
+  int end = 1;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &end)) {
+    return NULL;
+  }
+  return DemoWriter_CloseWriter(self, end);
+}
+
+static PyObject *
+DemoWriter_Enter(q3huff_DemoWriterObject *self)
+{
+  if (self->closed) {
+    PyErr_SetString(PyExc_ValueError, "demo writer is closed");
+    return NULL;
+  }
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+static PyObject *
+DemoWriter_Exit(q3huff_DemoWriterObject *self, PyObject *args)
+{
+  return DemoWriter_CloseWriter(self, qtrue);
+}
+
+static PyMemberDef DemoWriter_members[] = {
+  {"offset", T_PYSSIZET, offsetof(q3huff_DemoWriterObject, offset), READONLY, DemoWriter_offset__doc__},
+  {"closed", T_BOOL, offsetof(q3huff_DemoWriterObject, closed), READONLY, DemoWriter_closed__doc__},
+  {NULL}
+};
+
+static PyMethodDef DemoWriter_methods[] = {
+  {"write", (PyCFunction)DemoWriter_Write, METH_VARARGS, DemoWriter_write__doc__},
+  {"flush", (PyCFunction)DemoWriter_Flush, METH_VARARGS|METH_KEYWORDS, DemoWriter_flush__doc__},
+  {"close", (PyCFunction)DemoWriter_Close, METH_VARARGS|METH_KEYWORDS, DemoWriter_close__doc__},
+  {"__enter__", (PyCFunction)DemoWriter_Enter, METH_NOARGS, NULL},
+  {"__exit__", (PyCFunction)DemoWriter_Exit, METH_VARARGS, NULL},
+  {NULL}
+};
+
+static PyTypeObject q3huff_DemoWriterType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "q3huff.DemoWriter",
+  .tp_basicsize = sizeof(q3huff_DemoWriterObject),
+  .tp_dealloc   = (destructor)DemoWriter_dealloc,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc       = DemoWriter__doc__,
+  .tp_methods   = DemoWriter_methods,
+  .tp_members   = DemoWriter_members,
+  .tp_new       = DemoWriter_new,
+};
+
+/*
+ * DeltaCache Object
+ */
+
+PyDoc_STRVAR(DeltaCache__doc__, "DeltaCache(max_entries=4096)");
+PyDoc_STRVAR(DeltaCache_write_delta_entity__doc__, "write_delta_entity(writer, from_frame, to_frame, from_state, to_state, force=False)");
+PyDoc_STRVAR(DeltaCache_clear__doc__, "clear()");
+PyDoc_STRVAR(DeltaCache_hits__doc__, "number of deltas appended from the cache");
+PyDoc_STRVAR(DeltaCache_misses__doc__, "number of deltas that had to be encoded");
+PyDoc_STRVAR(DeltaCache_evictions__doc__, "number of times the cache was full and flushed");
+
+typedef struct {
+  PyObject_HEAD
+  deltaCache_t cache;
+} q3huff_DeltaCacheObject;
+
+static int
+DeltaCache_init(q3huff_DeltaCacheObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"max_entries", NULL};
+  int maxEntries = 4096;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i", kwlist, &maxEntries)) {
+    return -1;
+  }
+
+  if (maxEntries < 1) {
+    PyErr_SetString(PyExc_ValueError, "max_entries must be >= 1");
+    return -1;
+  }
+
+  SV_DeltaCacheFree(&self->cache);
+  if (!SV_DeltaCacheInit(&self->cache, maxEntries)) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  return 0;
+}
+
+static void
+DeltaCache_dealloc(q3huff_DeltaCacheObject *self)
+{
+  SV_DeltaCacheFree(&self->cache);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+DeltaCache_WriteDeltaEntity(q3huff_DeltaCacheObject *self, PyObject *args)
+{
+  PyObject *writerObj, *fromObj, *toObj;
+  q3huff_WriterObject *writer;
+  entityState_t from, to;
+  int fromFrame, toFrame, force = 0;
+
+  if (!PyArg_ParseTuple(args, "O!iiOO|p", &q3huff_WriterType, &writerObj,
+                        &fromFrame, &toFrame, &fromObj, &toObj, &force)) {
+    return NULL;
+  }
+  writer = (q3huff_WriterObject *)writerObj;
+  if (Writer_CheckIdle(writer) < 0) {
+    return NULL;
+  }
+
+  if (!self->cache.entries) {
+    PyErr_SetString(PyExc_RuntimeError, "cache is not initialized");
+    return NULL;
+  }
+
+  if (writer->msgBuf.oob) {
+    PyErr_SetString(PyExc_ValueError, "cached deltas can only be appended to a bitstream writer");
+    return NULL;
+  }
+
+  if (q3huff_GetEntityState(fromObj, &from) < 0) {
+    return NULL;
+  }
+
+  if (toObj == Py_None) {
+    if (fromObj != Py_None) {
+      SV_DeltaCacheWriteEntity(&self->cache, &writer->msgBuf, fromFrame, toFrame, &from, NULL, force);
+    }
+    Py_RETURN_NONE;
+  }
+
+  if (q3huff_GetEntityState(toObj, &to) < 0) {
+    return NULL;
+  }
+
+  if (to.number < 0 || to.number >= MAX_GENTITIES) {
+    PyErr_SetString(PyExc_ValueError, "entity number out of range");
+    return NULL;
+  }
+
+  SV_DeltaCacheWriteEntity(&self->cache, &writer->msgBuf, fromFrame, toFrame, &from, &to, force);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+DeltaCache_Clear(q3huff_DeltaCacheObject *self)
+{
+  if (self->cache.entries) {
+    SV_DeltaCacheClear(&self->cache);
+  }
+  Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+DeltaCache_length(q3huff_DeltaCacheObject *self)
+{
+  return self->cache.numEntries;
+}
+
+static PyMemberDef DeltaCache_members[] = {
+  {"hits", T_INT, offsetof(q3huff_DeltaCacheObject, cache.hits), READONLY, DeltaCache_hits__doc__},
+  {"misses", T_INT, offsetof(q3huff_DeltaCacheObject, cache.misses), READONLY, DeltaCache_misses__doc__},
+  {"evictions", T_INT, offsetof(q3huff_DeltaCacheObject, cache.evictions), READONLY, DeltaCache_evictions__doc__},
+  {NULL}
+};
+
+static PyMethodDef DeltaCache_methods[] = {
+  {"write_delta_entity", (PyCFunction)DeltaCache_WriteDeltaEntity, METH_VARARGS, DeltaCache_write_delta_entity__doc__},
+  {"clear", (PyCFunction)DeltaCache_Clear, METH_NOARGS, DeltaCache_clear__doc__},
+  {NULL}
+};
+
+static PySequenceMethods DeltaCache_as_sequence = {
+  .sq_length    = (lenfunc)DeltaCache_length,
+};
+
+static PyTypeObject q3huff_DeltaCacheType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name        = "q3huff.DeltaCache",
+  .tp_basicsize   = sizeof(q3huff_DeltaCacheObject),
+  .tp_dealloc     = (destructor)DeltaCache_dealloc,
+  .tp_as_sequence = &DeltaCache_as_sequence,
+  .tp_flags       = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc         = DeltaCache__doc__,
+  .tp_methods     = DeltaCache_methods,
+  .tp_members     = DeltaCache_members,
+  .tp_init        = (initproc)DeltaCache_init,
+  .tp_new         = PyType_GenericNew,
+};
+
+/*
+ * SnapshotRing Object
+ */
+
+PyDoc_STRVAR(SnapshotRing__doc__, "SnapshotRing(num_frames=32, max_entities=256)");
+PyDoc_STRVAR(SnapshotRing_store__doc__, "store(frame, playerstate=None, entities=b'')");
+PyDoc_STRVAR(SnapshotRing_get_playerstate__doc__, "get_playerstate(frame) -> bytes");
+PyDoc_STRVAR(SnapshotRing_set_playerstate__doc__, "set_playerstate(frame, playerstate)");
+PyDoc_STRVAR(SnapshotRing_get_entities__doc__, "get_entities(frame) -> bytes");
+PyDoc_STRVAR(SnapshotRing_get_entity__doc__, "get_entity(frame, number) -> bytes or None");
+PyDoc_STRVAR(SnapshotRing_set_entity__doc__, "set_entity(frame, state)");
+PyDoc_STRVAR(SnapshotRing_remove_entity__doc__, "remove_entity(frame, number) -> bool");
+PyDoc_STRVAR(SnapshotRing_get_baseline__doc__, "get_baseline(number) -> bytes");
+PyDoc_STRVAR(SnapshotRing_set_baseline__doc__, "set_baseline(state)");
+PyDoc_STRVAR(SnapshotRing_write_packet_entities__doc__, "write_packet_entities(writer, from_frame, to_frame)");
+PyDoc_STRVAR(SnapshotRing_delta_cost__doc__, "delta_cost(from_frame, to_frame, table=None) -> integer");
+PyDoc_STRVAR(SnapshotRing_best_delta_frame__doc__, "best_delta_frame(to_frame, candidates, table=None) -> (frame, bits)");
+PyDoc_STRVAR(SnapshotRing_schedule__doc__, "schedule(from_frame, to_frame, budget_bytes, priorities=None, table=None) -> list");
+
+typedef struct {
+  PyObject_HEAD
+  snapshotRing_t ring;
+  char busy;              // read by build_snapshots with the GIL released
+} q3huff_SnapshotRingObject;
+
+/*
+ * Raises if the ring is being read with the GIL released.
+ */
+static int
+SnapshotRing_CheckIdle(q3huff_SnapshotRingObject *self)
+{
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "ring is in use by another thread");
+    return -1;
+  }
+  return 0;
+}
+
+static int
+SnapshotRing_init(q3huff_SnapshotRingObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"num_frames", "max_entities", NULL};
+  int numFrames = PACKET_BACKUP, maxEntities = MAX_SNAPSHOT_ENTITIES;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii", kwlist, &numFrames, &maxEntities)) {
+    return -1;
+  }
+
+  if (numFrames < 1 || maxEntities < 1 || maxEntities > MAX_GENTITIES) {
+    PyErr_SetString(PyExc_ValueError, "num_frames must be >= 1 and max_entities between 1 and MAX_GENTITIES");
+    return -1;
+  }
+
+  SV_RingFree(&self->ring);
+  if (!SV_RingInit(&self->ring, numFrames, maxEntities)) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  return 0;
+}
+
+static void
+SnapshotRing_dealloc(q3huff_SnapshotRingObject *self)
+{
+  SV_RingFree(&self->ring);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static snapshotFrame_t *
+SnapshotRing_GetFrame(q3huff_SnapshotRingObject *self, int frame)
+{
+  snapshotFrame_t *f;
+
+  if (!self->ring.frames) {
+    PyErr_SetString(PyExc_RuntimeError, "ring is not initialized");
+    return NULL;
+  }
+
+  f = SV_RingFrame(&self->ring, frame);
+  if (!f) {
+    PyErr_Format(PyExc_KeyError, "frame %d is not in the ring", frame);
+  }
+  return f;
+}
+
+static int
+SnapshotRing_CheckEntities(q3huff_SnapshotRingObject *self, PyObject *obj, Py_buffer *view)
+{
+  const char *p;
+  int i, count, number, previous;
+
+  if (PyObject_GetBuffer(obj, view, PyBUF_SIMPLE) < 0) {
+    return -1;
+  }
+
+  if (view->len % sizeof(entityState_t) != 0) {
+    PyBuffer_Release(view);
+    PyErr_Format(PyExc_ValueError, "entities must be a multiple of %d bytes", (int) sizeof(entityState_t));
+    return -1;
+  }
+
+  count = view->len / sizeof(entityState_t);
+  if (count > self->ring.maxEntities) {
+    PyBuffer_Release(view);
+    PyErr_SetString(PyExc_ValueError, "too many entities for the ring");
+    return -1;
+  }
+
+  // the buffer need not be aligned for entityState_t
+  previous = -1;
+  for (i = 0, p = view->buf; i < count; i++, p += sizeof(entityState_t)) {
+    memcpy(&number, p + offsetof(entityState_t, number), sizeof(number));
+    if (number < 0 || number >= MAX_GENTITIES - 1 || number <= previous) {
+      PyBuffer_Release(view);
+      PyErr_SetString(PyExc_ValueError, "entities must be sorted by unique, valid numbers");
+      return -1;
+    }
+    previous = number;
+  }
+  return count;
+}
+
+static PyObject *
+SnapshotRing_Store(q3huff_SnapshotRingObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"frame", "playerstate", "entities", NULL};
+  PyObject *psObj = Py_None, *entitiesObj = NULL;
+  playerState_t ps;
+  snapshotFrame_t *f;
+  Py_buffer view;
+  int frame, count;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "i|OO", kwlist, &frame, &psObj, &entitiesObj)) {
+    return NULL;
+  }
+
+  if (!self->ring.frames) {
+    PyErr_SetString(PyExc_RuntimeError, "ring is not initialized");
+    return NULL;
+  }
+
+  if (frame < 0) {
+    PyErr_SetString(PyExc_ValueError, "frame must be >= 0");
+    return NULL;
+  }
+
+  if (q3huff_GetPlayerState(psObj, &ps) < 0) {
+    return NULL;
+  }
+
+  // validate everything before the slot, and the frame it held, is replaced
+  count = 0;
+  if (entitiesObj && (count = SnapshotRing_CheckEntities(self, entitiesObj, &view)) < 0) {
+    return NULL;
+  }
+
+  f = SV_RingStore(&self->ring, frame);
+  f->ps = ps;
+  if (entitiesObj) {
+    memcpy(f->entities, view.buf, view.len);
+    f->numEntities = count;
+    PyBuffer_Release(&view);
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+SnapshotRing_GetPlayerState(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  snapshotFrame_t *f;
+  int frame;
+
+  if (!PyArg_ParseTuple(args, "i", &frame)) {
+    return NULL;
+  }
+
+  if (!(f = SnapshotRing_GetFrame(self, frame))) {
+    return NULL;
+  }
+  return PyBytes_FromStringAndSize((char *)&f->ps, sizeof(f->ps));
+}
+
+static PyObject *
+SnapshotRing_SetPlayerState(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  PyObject *psObj;
+  snapshotFrame_t *f;
+  int frame;
+
+  if (!PyArg_ParseTuple(args, "iO", &frame, &psObj)) {
+    return NULL;
+  }
+
+  if (!(f = SnapshotRing_GetFrame(self, frame))) {
+    return NULL;
+  }
+
+  if (q3huff_GetPlayerState(psObj, &f->ps) < 0) {
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+SnapshotRing_GetEntities(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  snapshotFrame_t *f;
+  int frame;
+
+  if (!PyArg_ParseTuple(args, "i", &frame)) {
+    return NULL;
+  }
+
+  if (!(f = SnapshotRing_GetFrame(self, frame))) {
+    return NULL;
+  }
+  return PyBytes_FromStringAndSize((char *)f->entities, f->numEntities * sizeof(entityState_t));
+}
+
+static PyObject *
+SnapshotRing_GetEntity(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  snapshotFrame_t *f;
+  entityState_t *es;
+  int frame, number;
+
+  if (!PyArg_ParseTuple(args, "ii", &frame, &number)) {
+    return NULL;
+  }
+
+  if (!(f = SnapshotRing_GetFrame(self, frame))) {
+    return NULL;
+  }
+
+  es = SV_RingFindEntity(f, number);
+  if (!es) {
+    Py_RETURN_NONE;
+  }
+  return PyBytes_FromStringAndSize((char *)es, sizeof(*es));
+}
+
+static PyObject *
+SnapshotRing_SetEntity(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  PyObject *esObj;
+  entityState_t es;
+  snapshotFrame_t *f;
+  int frame;
+
+  if (!PyArg_ParseTuple(args, "iO", &frame, &esObj)) {
+    return NULL;
+  }
+
+  if (!(f = SnapshotRing_GetFrame(self, frame))) {
+    return NULL;
+  }
+
+  if (q3huff_GetEntityState(esObj, &es) < 0) {
+    return NULL;
+  }
+
+  if (es.number < 0 || es.number >= MAX_GENTITIES - 1) {
+    PyErr_SetString(PyExc_ValueError, "entity number out of range");
+    return NULL;
+  }
+
+  if (!SV_RingSetEntity(&self->ring, f, &es)) {
+    PyErr_SetString(PyExc_ValueError, "too many entities for the ring");
+    return NULL;
+  }
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+SnapshotRing_RemoveEntity(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  snapshotFrame_t *f;
+  int frame, number;
+
+  if (!PyArg_ParseTuple(args, "ii", &frame, &number)) {
+    return NULL;
+  }
+
+  if (!(f = SnapshotRing_GetFrame(self, frame))) {
+    return NULL;
+  }
+  return PyBool_FromLong(SV_RingRemoveEntity(f, number));
+}
+
+static PyObject *
+SnapshotRing_GetBaseline(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  int number;
+
+  if (!PyArg_ParseTuple(args, "i", &number)) {
+    return NULL;
+  }
+
+  if (number < 0 || number >= MAX_GENTITIES) {
+    PyErr_SetString(PyExc_ValueError, "entity number out of range");
+    return NULL;
+  }
+  return PyBytes_FromStringAndSize((char *)&self->ring.baselines[number], sizeof(entityState_t));
+}
+
+static PyObject *
+SnapshotRing_SetBaseline(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  PyObject *esObj;
+  entityState_t es;
+
+  if (!PyArg_ParseTuple(args, "O", &esObj)) {
+    return NULL;
+  }
+
+  if (q3huff_GetEntityState(esObj, &es) < 0) {
+    return NULL;
+  }
+
+  if (es.number < 0 || es.number >= MAX_GENTITIES) {
+    PyErr_SetString(PyExc_ValueError, "entity number out of range");
+    return NULL;
+  }
+  self->ring.baselines[es.number] = es;
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+SnapshotRing_WritePacketEntities(q3huff_SnapshotRingObject *self, PyObject *args)
+{
+  PyObject *writerObj;
+  snapshotFrame_t *from = NULL, *to;
+  int fromFrame, toFrame;
+
+  if (!PyArg_ParseTuple(args, "O!ii", &q3huff_WriterType, &writerObj, &fromFrame, &toFrame)) {
+    return NULL;
+  }
+
+  if (Writer_CheckIdle((q3huff_WriterObject *)writerObj) < 0) {
+    return NULL;
+  }
+
+  if (fromFrame >= 0 && !(from = SnapshotRing_GetFrame(self, fromFrame))) {
+    return NULL;
+  }
+
+  if (!(to = SnapshotRing_GetFrame(self, toFrame))) {
+    return NULL;
+  }
+
+  SV_EmitPacketEntities(&self->ring, from, to, &((q3huff_WriterObject *)writerObj)->msgBuf);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+SnapshotRing_DeltaCost(q3huff_SnapshotRingObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"from_frame", "to_frame", "table", NULL};
+  const msgHuffTable_t *table = NULL;
+  snapshotFrame_t *from = NULL, *to;
+  int fromFrame, toFrame;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "ii|O&", kwlist, &fromFrame, &toFrame,
+                                   q3huff_TableConverter, &table)) {
+    return NULL;
+  }
+
+  if (fromFrame >= 0 && !(from = SnapshotRing_GetFrame(self, fromFrame))) {
+    return NULL;
+  }
+
+  if (!(to = SnapshotRing_GetFrame(self, toFrame))) {
+    return NULL;
+  }
+  return PyLong_FromLong(SV_SnapshotCost(&self->ring, from, to, table));
+}
+
+static PyObject *
+SnapshotRing_BestDeltaFrame(q3huff_SnapshotRingObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"to_frame", "candidates", "table", NULL};
+  PyObject *candidatesObj, *seq, *result = NULL;
+  const msgHuffTable_t *table = NULL;
+  snapshotFrame_t *to;
+  int *candidates;
+  int toFrame, i, count, best, cost;
+  long frame;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iO|O&", kwlist, &toFrame, &candidatesObj,
+                                   q3huff_TableConverter, &table)) {
+    return NULL;
+  }
+
+  if (!(to = SnapshotRing_GetFrame(self, toFrame))) {
+    return NULL;
+  }
+
+  if (!(seq = PySequence_Fast(candidatesObj, "candidates must be a sequence"))) {
+    return NULL;
+  }
+
+  count = PySequence_Fast_GET_SIZE(seq);
+  if (!(candidates = PyMem_Malloc((count + 1) * sizeof(*candidates)))) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  for (i = 0; i < count; i++) {
+    frame = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    if (frame == -1 && PyErr_Occurred()) {
+      goto done;
+    }
+    candidates[i] = frame < 0 ? -1 : frame > INT_MAX ? INT_MAX : frame;
+  }
+
+  best = SV_BestDeltaFrame(&self->ring, to, candidates, count, table, &cost);
+  if (best == -2) {
+    PyErr_SetString(PyExc_KeyError, "none of the candidate frames are in the ring");
+    goto done;
+  }
+  result = Py_BuildValue("ii", best, cost);
+
+done:
+  PyMem_Free(candidates);
+  Py_DECREF(seq);
+  return result;
+}
+
+static PyObject *
+SnapshotRing_Schedule(q3huff_SnapshotRingObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"from_frame", "to_frame", "budget_bytes", "priorities", "table", NULL};
+  PyObject *prioritiesObj = Py_None, *items = NULL, *result = NULL;
+  const msgHuffTable_t *table = NULL;
+  snapshotFrame_t *from = NULL, *to;
+  float *priorities = NULL;
+  int *deferred = NULL;
+  int fromFrame, toFrame, budget, i, count;
+  long number;
+  double priority;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iii|OO&", kwlist, &fromFrame, &toFrame, &budget, &prioritiesObj,
+                                   q3huff_TableConverter, &table)) {
+    return NULL;
+  }
+
+  if (fromFrame >= 0 && !(from = SnapshotRing_GetFrame(self, fromFrame))) {
+    return NULL;
+  }
+
+  if (!(to = SnapshotRing_GetFrame(self, toFrame))) {
+    return NULL;
+  }
+
+  if (from == to) {
+    PyErr_SetString(PyExc_ValueError, "from_frame and to_frame must differ");
+    return NULL;
+  }
+
+  if (budget < 0) {
+    PyErr_SetString(PyExc_ValueError, "budget_bytes must be >= 0");
+    return NULL;
+  }
+
+  if (prioritiesObj != Py_None) {
+    if (!(priorities = PyMem_Calloc(MAX_GENTITIES, sizeof(*priorities)))) {
+      PyErr_NoMemory();
+      goto done;
+    }
+    if (!(items = PyMapping_Items(prioritiesObj))) {
+      goto done;
+    }
+    for (i = 0; i < PyList_GET_SIZE(items); i++) {
+      if (!PyArg_ParseTuple(PyList_GET_ITEM(items, i), "ld", &number, &priority)) {
+        goto done;
+      }
+      if (number < 0 || number >= MAX_GENTITIES) {
+        PyErr_SetString(PyExc_ValueError, "entity number out of range");
+        goto done;
+      }
+      priorities[number] = priority;
+    }
+  }
+
+  deferred = PyMem_Malloc(((from ? from->numEntities : 0) + to->numEntities + 1) * sizeof(*deferred));
+  if (!deferred) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  count = SV_ScheduleEntities(&self->ring, from, to, budget > INT_MAX / 8 ? INT_MAX : budget * 8, priorities, table, deferred);
+  if (count < 0) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  if (!(result = PyList_New(count))) {
+    goto done;
+  }
+  for (i = 0; i < count; i++) {
+    PyList_SET_ITEM(result, i, PyLong_FromLong(deferred[i]));
+  }
+
+done:
+  Py_XDECREF(items);
+  PyMem_Free(priorities);
+  PyMem_Free(deferred);
+  return result;
+}
+
+static int
+SnapshotRing_contains(q3huff_SnapshotRingObject *self, PyObject *value)
+{
+  long frame = PyLong_AsLong(value);
+
+  if (frame == -1 && PyErr_Occurred()) {
+    return -1;
+  }
+  if (SnapshotRing_CheckIdle(self) < 0) {
+    return -1;
+  }
+  return self->ring.frames && frame >= 0 && frame <= INT_MAX && SV_RingFrame(&self->ring, frame) != NULL;
+}
+
+// every method is looked up here first
+static PyObject *
+SnapshotRing_getattro(q3huff_SnapshotRingObject *self, PyObject *name)
+{
+  if (SnapshotRing_CheckIdle(self) < 0) {
+    return NULL;
+  }
+  return PyObject_GenericGetAttr((PyObject *)self, name);
+}
+
+static PyMethodDef SnapshotRing_methods[] = {
+  {"store", (PyCFunction)SnapshotRing_Store, METH_VARARGS|METH_KEYWORDS, SnapshotRing_store__doc__},
+  {"get_playerstate", (PyCFunction)SnapshotRing_GetPlayerState, METH_VARARGS, SnapshotRing_get_playerstate__doc__},
+  {"set_playerstate", (PyCFunction)SnapshotRing_SetPlayerState, METH_VARARGS, SnapshotRing_set_playerstate__doc__},
+  {"get_entities", (PyCFunction)SnapshotRing_GetEntities, METH_VARARGS, SnapshotRing_get_entities__doc__},
+  {"get_entity", (PyCFunction)SnapshotRing_GetEntity, METH_VARARGS, SnapshotRing_get_entity__doc__},
+  {"set_entity", (PyCFunction)SnapshotRing_SetEntity, METH_VARARGS, SnapshotRing_set_entity__doc__},
+  {"remove_entity", (PyCFunction)SnapshotRing_RemoveEntity, METH_VARARGS, SnapshotRing_remove_entity__doc__},
+  {"get_baseline", (PyCFunction)SnapshotRing_GetBaseline, METH_VARARGS, SnapshotRing_get_baseline__doc__},
+  {"set_baseline", (PyCFunction)SnapshotRing_SetBaseline, METH_VARARGS, SnapshotRing_set_baseline__doc__},
+  {"write_packet_entities", (PyCFunction)SnapshotRing_WritePacketEntities, METH_VARARGS, SnapshotRing_write_packet_entities__doc__},
+  {"delta_cost", (PyCFunction)SnapshotRing_DeltaCost, METH_VARARGS|METH_KEYWORDS, SnapshotRing_delta_cost__doc__},
+  {"best_delta_frame", (PyCFunction)SnapshotRing_BestDeltaFrame, METH_VARARGS|METH_KEYWORDS, SnapshotRing_best_delta_frame__doc__},
+  {"schedule", (PyCFunction)SnapshotRing_Schedule, METH_VARARGS|METH_KEYWORDS, SnapshotRing_schedule__doc__},
+  {NULL}
+};
+
+static PySequenceMethods SnapshotRing_as_sequence = {
+  .sq_contains  = (objobjproc)SnapshotRing_contains,
+};
+
+static PyTypeObject q3huff_SnapshotRingType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name        = "q3huff.SnapshotRing",
+  .tp_basicsize   = sizeof(q3huff_SnapshotRingObject),
+  .tp_dealloc     = (destructor)SnapshotRing_dealloc,
+  .tp_as_sequence = &SnapshotRing_as_sequence,
+  .tp_getattro    = (getattrofunc)SnapshotRing_getattro,
+  .tp_flags       = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc         = SnapshotRing__doc__,
+  .tp_methods     = SnapshotRing_methods,
+  .tp_init        = (initproc)SnapshotRing_init,
+  .tp_new         = PyType_GenericNew,
+};
+
+/*
+ * Netchan Object
+ */
+
+PyDoc_STRVAR(Netchan__doc__, "Netchan(server=False, qport=0, table=None)");
+PyDoc_STRVAR(Netchan_process__doc__, "process(datagram) -> reader or None");
+PyDoc_STRVAR(Netchan_transmit__doc__, "transmit(message, buffer=None, fragments=1) -> list");
+PyDoc_STRVAR(Netchan_transmit_next_fragment__doc__, "transmit_next_fragment(buffer=None) -> datagram or None");
+PyDoc_STRVAR(Netchan_unsent_fragments__doc__, "whether fragments of the last message are still to be sent");
+PyDoc_STRVAR(Netchan_server__doc__, "whether this is the server end, whose incoming packets carry a qport");
+PyDoc_STRVAR(Netchan_qport__doc__, "qport of the client end");
+PyDoc_STRVAR(Netchan_incoming_sequence__doc__, "sequence of the last message received");
+PyDoc_STRVAR(Netchan_outgoing_sequence__doc__, "sequence of the next message to send");
+PyDoc_STRVAR(Netchan_dropped__doc__, "packets lost before the last message received");
+PyDoc_STRVAR(Netchan_table__doc__, "HuffmanTable given to the readers, None for the default one");
+
+typedef struct {
+  PyObject_HEAD
+  netchan_t chan;
+  PyObject *table;
+  PyObject *fragments;  // bytes that chan.fragmentBuffer points into, or NULL
+  char server;
+} q3huff_NetchanObject;
+
+static int
+Netchan_init(q3huff_NetchanObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"server", "qport", "table", NULL};
+  PyObject *tableObj = Py_None;
+  int server = 0, qport = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|piO", kwlist, &server, &qport, &tableObj)) {
+    return -1;
+  }
+
+  Py_CLEAR(self->fragments);
+  Netchan_Setup(server ? NS_SERVER : NS_CLIENT, &self->chan, qport & 0xffff);
+  self->server = server;
+  Py_CLEAR(self->table);
+  if (tableObj != Py_None) {
+    if (!PyObject_TypeCheck(tableObj, &q3huff_HuffmanTableType)) {
+      PyErr_SetString(PyExc_TypeError, "table must be a HuffmanTable or None");
+      return -1;
+    }
+    Py_INCREF(tableObj);
+    self->table = tableObj;
+  }
+  return 0;
+}
+
+static void
+Netchan_dealloc(q3huff_NetchanObject *self)
+{
+  Py_XDECREF(self->table);
+  Py_XDECREF(self->fragments);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject *
+Netchan_ProcessDatagram(q3huff_NetchanObject *self, PyObject *args)
+{
+  PyObject *datagramObj, *owner, *reader;
+  Py_buffer view;
+  msg_t msg;
+
+  if (!PyArg_ParseTuple(args, "O", &datagramObj)) {
+    return NULL;
+  }
+
+  // bytes are read in place, anything else is copied once so it can't change
+  // under the reader
+  if (PyBytes_Check(datagramObj)) {
+    Py_INCREF(datagramObj);
+    owner = datagramObj;
+  } else {
+    if (PyObject_GetBuffer(datagramObj, &view, PyBUF_SIMPLE) < 0) {
+      return NULL;
+    }
+    owner = PyBytes_FromStringAndSize(view.buf, view.len);
+    PyBuffer_Release(&view);
+    if (!owner) {
+      return NULL;
+    }
+  }
+  if (PyBytes_GET_SIZE(owner) > MAX_MSGLEN + PACKET_HEADER) {
+    Py_DECREF(owner);
+    PyErr_Format(PyExc_ValueError, "datagram is longer than %d bytes", MAX_MSGLEN + PACKET_HEADER);
+    return NULL;
+  }
+
+  // the buffer fragments are put together in goes to the reader of the
+  // whole message, so each message gets a new one
+  if (!self->fragments) {
+    if (!(self->fragments = PyBytes_FromStringAndSize(NULL, 4 + MAX_MSGLEN))) {
+      Py_DECREF(owner);
+      return NULL;
+    }
+    self->chan.fragmentBuffer = (byte *)PyBytes_AS_STRING(self->fragments);
+  }
+
+  MSG_Init(&msg, (byte *)PyBytes_AS_STRING(owner), (int)PyBytes_GET_SIZE(owner));
+  msg.cursize = (int)PyBytes_GET_SIZE(owner);
+  if (!Netchan_Process(&self->chan, &msg)) {
+    Py_DECREF(owner);
+    Py_RETURN_NONE;
+  }
+
+  if (msg.data == self->chan.fragmentBuffer) {
+    Py_SETREF(owner, self->fragments);
+    self->fragments = NULL;
+    self->chan.fragmentBuffer = NULL;
+  }
+
+  reader = q3huff_NewReaderInPlace(owner, msg.data, msg.cursize);
+  Py_DECREF(owner);
+  if (!reader) {
+    return NULL;
+  }
+  ((q3huff_ReaderObject *)reader)->msgBuf.readcount = msg.readcount;
+  ((q3huff_ReaderObject *)reader)->msgBuf.bit = msg.bit;
+  if (q3huff_SetTable(&((q3huff_ReaderObject *)reader)->msgBuf, &((q3huff_ReaderObject *)reader)->table, self->table) < 0) {
+    Py_DECREF(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+/*
+ * Writes packets for the message, or for unsent fragments when data is NULL,
+ * and returns them in a list.  They go back to back into buffer if there is
+ * one, as memoryviews of it, and otherwise each into bytes of its own.
+ */
+static PyObject *
+Netchan_Packets(q3huff_NetchanObject *self, const byte *data, int length, PyObject *bufferObj, Py_ssize_t count)
+{
+  PyObject *result, *view = NULL, *item;
+  Py_buffer buffer = {NULL};
+  byte packet[MAX_PACKETLEN], *p;
+  Py_ssize_t offset = 0, needed;
+  int size;
+
+  // the last fragment is shorter than the others, even if that means empty
+  if (data) {
+    needed = length < FRAGMENT_SIZE ? 1 : length / FRAGMENT_SIZE + 1;
+  } else if (self->chan.unsentFragments) {
+    needed = (self->chan.unsentLength - self->chan.unsentFragmentStart) / FRAGMENT_SIZE + 1;
+  } else {
+    needed = 0;
+  }
+  if (needed > count) {
+    needed = count;
+  }
+
+  if (bufferObj != Py_None) {
+    if (PyObject_GetBuffer(bufferObj, &buffer, PyBUF_WRITABLE) < 0) {
+      return NULL;
+    }
+    // checked before the channel moves on, or the datagrams would be lost
+    if (buffer.len < needed * MAX_PACKETLEN) {
+      PyErr_Format(PyExc_ValueError, "buffer needs room for %d bytes per datagram", MAX_PACKETLEN);
+      PyBuffer_Release(&buffer);
+      return NULL;
+    }
+    if (!(view = PyMemoryView_FromObject(bufferObj))) {
+      PyBuffer_Release(&buffer);
+      return NULL;
+    }
+  }
+
+  if (!(result = PyList_New(0))) {
+    goto fail;
+  }
+
+  while (count-- && (data || self->chan.unsentFragments)) {
+    if (buffer.buf) {
+      p = (byte *)buffer.buf + offset;
+    } else {
+      p = packet;
+    }
+
+    if (data) {
+      size = Netchan_Transmit(&self->chan, length, data, p);
+      data = NULL;
+    } else {
+      size = Netchan_TransmitNextFragment(&self->chan, p);
+    }
+
+    if (view) {
+      item = PySequence_GetSlice(view, offset, offset + size);
+    } else {
+      item = PyBytes_FromStringAndSize((char *)packet, size);
+    }
+    offset += size;
+    if (!item || PyList_Append(result, item) < 0) {
+      Py_XDECREF(item);
+      goto fail;
+    }
+    Py_DECREF(item);
+  }
+
+  Py_XDECREF(view);
+  PyBuffer_Release(&buffer);
+  return result;
+
+fail:
+  Py_XDECREF(result);
+  Py_XDECREF(view);
+  PyBuffer_Release(&buffer);
+  return NULL;
+}
+
+static PyObject *
+Netchan_TransmitMessage(q3huff_NetchanObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"message", "buffer", "fragments", NULL};
+  PyObject *messageObj, *bufferObj = Py_None, *fragmentsObj = NULL, *result;
+  Py_buffer view = {NULL};
+  const byte *data;
+  Py_ssize_t length, count = 1;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist, &messageObj, &bufferObj, &fragmentsObj)) {
+    return NULL;
+  }
+
+  if (!fragmentsObj) {
+    count = 1;
+  } else if (fragmentsObj != Py_None) {
+    count = PyLong_AsSsize_t(fragmentsObj);
+    if (count == -1 && PyErr_Occurred()) {
+      return NULL;
+    }
+    if (count < 1) {
+      PyErr_SetString(PyExc_ValueError, "fragments must be >= 1 or None");
+      return NULL;
+    }
+  } else {
+    count = PY_SSIZE_T_MAX;
+  }
+
+  // the game would drop the unsent fragments, and the message with them
+  if (self->chan.unsentFragments) {
+    PyErr_SetString(PyExc_ValueError, "fragments of the last message are still unsent");
+    return NULL;
+  }
+
+  if (PyObject_TypeCheck(messageObj, &q3huff_WriterType)) {
+    if (Writer_CheckIdle((q3huff_WriterObject *)messageObj) < 0) {
+      return NULL;
+    }
+    if (((q3huff_WriterObject *)messageObj)->msgBuf.overflowed) {
+      PyErr_SetString(PyExc_ValueError, "writer has overflowed");
+      return NULL;
+    }
+    data = ((q3huff_WriterObject *)messageObj)->msgBuf.data;
+    length = ((q3huff_WriterObject *)messageObj)->msgBuf.cursize;
+  } else {
+    if (PyObject_GetBuffer(messageObj, &view, PyBUF_SIMPLE) < 0) {
+      return NULL;
+    }
+    data = view.buf;
+    length = view.len;
+    if (length > MAX_MSGLEN) {
+      PyErr_Format(PyExc_ValueError, "message is longer than %d bytes", MAX_MSGLEN);
+      PyBuffer_Release(&view);
+      return NULL;
+    }
+  }
+
+  result = Netchan_Packets(self, data, (int)length, bufferObj, count);
+  PyBuffer_Release(&view);
+  return result;
+}
+
+static PyObject *
+Netchan_TransmitFragment(q3huff_NetchanObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"buffer", NULL};
+  PyObject *bufferObj = Py_None, *packets, *result;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &bufferObj)) {
+    return NULL;
+  }
+
+  if (!(packets = Netchan_Packets(self, NULL, 0, bufferObj, 1))) {
+    return NULL;
+  }
+  result = PyList_GET_SIZE(packets) ? PyList_GET_ITEM(packets, 0) : Py_None;
+  Py_INCREF(result);
+  Py_DECREF(packets);
+  return result;
+}
+
+static PyMemberDef Netchan_members[] = {
+  {"server", T_BOOL, offsetof(q3huff_NetchanObject, server), READONLY, Netchan_server__doc__},
+  {"qport", T_INT, offsetof(q3huff_NetchanObject, chan.qport), READONLY, Netchan_qport__doc__},
+  {"incoming_sequence", T_INT, offsetof(q3huff_NetchanObject, chan.incomingSequence), READONLY, Netchan_incoming_sequence__doc__},
+  {"outgoing_sequence", T_INT, offsetof(q3huff_NetchanObject, chan.outgoingSequence), READONLY, Netchan_outgoing_sequence__doc__},
+  {"dropped", T_INT, offsetof(q3huff_NetchanObject, chan.dropped), READONLY, Netchan_dropped__doc__},
+  {"table", T_OBJECT, offsetof(q3huff_NetchanObject, table), READONLY, Netchan_table__doc__},
+  {NULL}
+};
+
+static PyObject *
+Netchan_GetUnsentFragments(q3huff_NetchanObject *self, void *closure)
+{
+  return PyBool_FromLong(self->chan.unsentFragments);
+}
+
+static PyGetSetDef Netchan_getset[] = {
+  {"unsent_fragments", (getter)Netchan_GetUnsentFragments, NULL, Netchan_unsent_fragments__doc__},
+  {NULL}
+};
+
+static PyMethodDef Netchan_methods[] = {
+  {"process", (PyCFunction)Netchan_ProcessDatagram, METH_VARARGS, Netchan_process__doc__},
+  {"transmit", (PyCFunction)Netchan_TransmitMessage, METH_VARARGS|METH_KEYWORDS, Netchan_transmit__doc__},
+  {"transmit_next_fragment", (PyCFunction)Netchan_TransmitFragment, METH_VARARGS|METH_KEYWORDS, Netchan_transmit_next_fragment__doc__},
+  {NULL}
+};
+
+static PyTypeObject q3huff_NetchanType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "q3huff.Netchan",
+  .tp_basicsize = sizeof(q3huff_NetchanObject),
+  .tp_dealloc   = (destructor)Netchan_dealloc,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc       = Netchan__doc__,
+  .tp_methods   = Netchan_methods,
+  .tp_members   = Netchan_members,
+  .tp_getset    = Netchan_getset,
+  .tp_init      = (initproc)Netchan_init,
+  .tp_new       = PyType_GenericNew,
+};
+
+#ifdef __linux__
+
+/*
+ * Receiver Object
+ */
+
+PyDoc_STRVAR(Receiver__doc__, "Receiver(sock, server=False, batch=64, slots=1024, packet_size=MAX_PACKETLEN, max_channels=64, table=None)");
+PyDoc_STRVAR(Receiver_get__doc__, "get(timeout=None) -> (address, qport, sequence, reader) or None");
+PyDoc_STRVAR(Receiver_get_batch__doc__, "get_batch(max_count=64, timeout=None) -> list");
+PyDoc_STRVAR(Receiver_fileno__doc__, "fileno() -> integer");
+PyDoc_STRVAR(Receiver_close__doc__, "close()");
+PyDoc_STRVAR(Receiver_server__doc__, "whether packets come from clients and carry their qport");
+PyDoc_STRVAR(Receiver_closed__doc__, "whether the receiver has been closed");
+PyDoc_STRVAR(Receiver_table__doc__, "HuffmanTable given to the readers, None for the default one");
+PyDoc_STRVAR(Receiver_received__doc__, "datagrams read from the socket");
+PyDoc_STRVAR(Receiver_dropped__doc__, "datagrams thrown away for being truncated or for lack of room");
+
+#define RECEIVER_MESSAGE "q3huff.Receiver.message"
+
+typedef struct {
+  PyObject_HEAD
+  netReceiver_t *receiver;
+  PyObject *sock;
+  PyObject *table;
+  char server;
+  char closed;
+  char busy;
+} q3huff_ReceiverObject;
+
+static PyObject *
+Receiver_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"sock", "server", "batch", "slots", "packet_size", "max_channels", "table", NULL};
+  q3huff_ReceiverObject *self;
+  PyObject *sockObj, *tableObj = Py_None;
+  int server = 0, batch = 64, slots = 1024, packetSize = MAX_PACKETLEN, maxChannels = 64;
+  int fd;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|piiiiO", kwlist, &sockObj, &server, &batch, &slots,
+                                   &packetSize, &maxChannels, &tableObj)) {
+    return NULL;
+  }
+
+  if ((fd = PyObject_AsFileDescriptor(sockObj)) < 0) {
+    return NULL;
+  }
+  if (batch < 1 || batch > NET_MAX_BATCH) {
+    PyErr_Format(PyExc_ValueError, "batch must be between 1 and %d", NET_MAX_BATCH);
+    return NULL;
+  }
+  if (slots < 1 || slots > (1 << 20) || maxChannels < 1) {
+    PyErr_SetString(PyExc_ValueError, "slots and max_channels must be >= 1");
+    return NULL;
+  }
+  if (packetSize < PACKET_HEADER || packetSize > MAX_MSGLEN + PACKET_HEADER) {
+    PyErr_Format(PyExc_ValueError, "packet_size must be between %d and %d", PACKET_HEADER, MAX_MSGLEN + PACKET_HEADER);
+    return NULL;
+  }
+  if (tableObj != Py_None && !PyObject_TypeCheck(tableObj, &q3huff_HuffmanTableType)) {
+    PyErr_SetString(PyExc_TypeError, "table must be a HuffmanTable or None");
+    return NULL;
+  }
+
+  if (!(self = (q3huff_ReceiverObject *)type->tp_alloc(type, 0))) {
+    return NULL;
+  }
+  Py_INCREF(sockObj);
+  self->sock = sockObj;
+  if (tableObj != Py_None) {
+    Py_INCREF(tableObj);
+    self->table = tableObj;
+  }
+  self->server = server;
+
+  self->receiver = NET_OpenReceiver(fd, server ? NS_SERVER : NS_CLIENT, batch, slots, packetSize, maxChannels);
+  if (!self->receiver) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    self->closed = 1;
+    Py_DECREF(self);
+    return NULL;
+  }
+  return (PyObject *)self;
+}
+
+static void
+Receiver_dealloc(q3huff_ReceiverObject *self)
+{
+  // every reader holds the receiver, so none is left to read the slots
+  if (self->receiver) {
+    Py_BEGIN_ALLOW_THREADS
+    NET_FreeReceiver(self->receiver);
+    Py_END_ALLOW_THREADS
+  }
+  Py_XDECREF(self->sock);
+  Py_XDECREF(self->table);
+  Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+/*
+ * Gives a message's memory back when the last reader of it goes away.
+ */
+static void
+Receiver_ReleaseMessage(PyObject *capsule)
+{
+  q3huff_ReceiverObject *self = PyCapsule_GetContext(capsule);
+
+  NET_ReleaseMessage(self->receiver, PyCapsule_GetPointer(capsule, RECEIVER_MESSAGE));
+  Py_DECREF(self);
+}
+
+static PyObject *
+Receiver_Address(const netMessage_t *m)
+{
+  const struct sockaddr *sa = (const struct sockaddr *)m->address;
+  char host[INET6_ADDRSTRLEN];
+
+  if (sa->sa_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)sa;
+    inet_ntop(AF_INET, &sin->sin_addr, host, sizeof(host));
+    return Py_BuildValue("(si)", host, ntohs(sin->sin_port));
+  }
+  if (sa->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)sa;
+    inet_ntop(AF_INET6, &sin6->sin6_addr, host, sizeof(host));
+    return Py_BuildValue("(siII)", host, ntohs(sin6->sin6_port), ntohl(sin6->sin6_flowinfo), sin6->sin6_scope_id);
+  }
+  return PyBytes_FromStringAndSize((const char *)m->address, m->addressLength);
+}
+
+/*
+ * Makes the (address, qport, sequence, reader) tuple of a message.  Its
+ * memory is released even if that fails.
+ */
+static PyObject *
+Receiver_Message(q3huff_ReceiverObject *self, netMessage_t *m)
+{
+  PyObject *capsule, *reader, *address, *qport;
+  q3huff_ReaderObject *r;
+
+  if (!(capsule = PyCapsule_New(m->msg.data, RECEIVER_MESSAGE, Receiver_ReleaseMessage))) {
+    NET_ReleaseMessage(self->receiver, m->msg.data);
+    return NULL;
+  }
+  Py_INCREF(self);
+  PyCapsule_SetContext(capsule, self);
+
+  reader = q3huff_NewReaderInPlace(capsule, m->msg.data, m->msg.cursize);
+  Py_DECREF(capsule);
+  if (!reader) {
+    return NULL;
+  }
+  r = (q3huff_ReaderObject *)reader;
+  r->msgBuf.readcount = m->msg.readcount;
+  r->msgBuf.bit = m->msg.bit;
+  r->msgBuf.oob = m->oob;
+  if (q3huff_SetTable(&r->msgBuf, &r->table, self->table) < 0) {
+    Py_DECREF(reader);
+    return NULL;
+  }
+
+  if (!(address = Receiver_Address(m))) {
+    Py_DECREF(reader);
+    return NULL;
+  }
+  if (m->qport >= 0) {
+    qport = PyLong_FromLong(m->qport);
+  } else {
+    Py_INCREF(Py_None);
+    qport = Py_None;
+  }
+  return Py_BuildValue("(NNiN)", address, qport, m->sequence, reader);
+}
+
+static int
+Receiver_Acquire(q3huff_ReceiverObject *self)
+{
+  if (self->closed) {
+    PyErr_SetString(PyExc_ValueError, "receiver is closed");
+    return -1;
+  }
+  if (self->busy) {
+    PyErr_SetString(PyExc_RuntimeError, "receiver is in use by another thread");
+    return -1;
+  }
+  self->busy = 1;
+  return 0;
+}
+
+/*
+ * Converts a timeout in seconds, None for no limit, to milliseconds.
+ */
+static int
+Receiver_Timeout(PyObject *timeoutObj, int *msec)
+{
+  double timeout;
+
+  if (timeoutObj == Py_None) {
+    *msec = -1;
+    return 0;
+  }
+  timeout = PyFloat_AsDouble(timeoutObj);
+  if (timeout == -1.0 && PyErr_Occurred()) {
+    return -1;
+  }
+  if (timeout < 0) {
+    PyErr_SetString(PyExc_ValueError, "timeout must be >= 0 or None");
+    return -1;
+  }
+  *msec = timeout * 1000 >= INT_MAX ? INT_MAX : (int)ceil(timeout * 1000);
+  return 0;
+}
+
+static long long
+Receiver_Now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Waits up to msec for a message, with the GIL released.  Returns 1 with m
+ * filled in, 0 on timeout, or -1 with an exception set.
+ */
+static int
+Receiver_Wait(q3huff_ReceiverObject *self, netMessage_t *m, int msec)
+{
+  long long deadline = msec > 0 ? Receiver_Now() + msec : 0;
+  int status;
+
+  if (NET_NextMessage(self->receiver, m)) {
+    return 1;
+  }
+
+  for (;;) {
+    if (msec) {
+      Py_BEGIN_ALLOW_THREADS
+      status = NET_WaitMessage(self->receiver, m, msec);
+      Py_END_ALLOW_THREADS
+    } else {
+      status = NET_WaitMessage(self->receiver, m, 0);
+    }
+    if (status >= 0) {
+      return status;
+    }
+    if (status == -2) {
+      errno = NET_ReceiverError(self->receiver);
+      PyErr_SetFromErrno(PyExc_OSError);
+      return -1;
+    }
+    if (PyErr_CheckSignals() < 0) {
+      return -1;
+    }
+    if (msec > 0 && (msec = (int)(deadline - Receiver_Now())) <= 0) {
+      return 0;
+    }
+  }
+}
+
+static PyObject *
+Receiver_Get(q3huff_ReceiverObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"timeout", NULL};
+  PyObject *timeoutObj = Py_None;
+  netMessage_t m;
+  int msec, status;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &timeoutObj)) {
+    return NULL;
+  }
+  if (Receiver_Timeout(timeoutObj, &msec) < 0 || Receiver_Acquire(self) < 0) {
+    return NULL;
+  }
+
+  status = Receiver_Wait(self, &m, msec);
+  self->busy = 0;
+  if (status < 0) {
+    return NULL;
+  }
+  if (!status) {
+    Py_RETURN_NONE;
+  }
+  return Receiver_Message(self, &m);
+}
+
+static PyObject *
+Receiver_GetBatch(q3huff_ReceiverObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"max_count", "timeout", NULL};
+  PyObject *timeoutObj = Py_None, *result, *item;
+  Py_ssize_t maxCount = 64, count;
+  netMessage_t m;
+  int msec, status;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nO", kwlist, &maxCount, &timeoutObj)) {
+    return NULL;
+  }
+  if (maxCount < 1) {
+    PyErr_SetString(PyExc_ValueError, "max_count must be >= 1");
+    return NULL;
+  }
+  if (Receiver_Timeout(timeoutObj, &msec) < 0 || Receiver_Acquire(self) < 0) {
+    return NULL;
+  }
+
+  status = Receiver_Wait(self, &m, msec);
+  self->busy = 0;
+  if (status < 0 || !(result = PyList_New(0))) {
+    if (status > 0) {
+      NET_ReleaseMessage(self->receiver, m.msg.data);
+    }
+    return NULL;
+  }
+
+  // only the first one is waited for, the rest are whatever is ready
+  for (count = 0; status > 0; ) {
+    item = Receiver_Message(self, &m);
+    if (!item || PyList_Append(result, item) < 0) {
+      Py_XDECREF(item);
+      Py_DECREF(result);
+      return NULL;
+    }
+    Py_DECREF(item);
+    if (++count == maxCount) {
+      break;
+    }
+    status = NET_NextMessage(self->receiver, &m);
+  }
+  return result;
+}
+
+static PyObject *
+Receiver_Fileno(q3huff_ReceiverObject *self)
+{
+  if (self->closed) {
+    PyErr_SetString(PyExc_ValueError, "receiver is closed");
+    return NULL;
+  }
+  return PyLong_FromLong(NET_ReceiverFd(self->receiver));
+}
+
+static PyObject *
+Receiver_Close(q3huff_ReceiverObject *self)
+{
+  if (self->closed) {
+    Py_RETURN_NONE;
+  }
+  if (Receiver_Acquire(self) < 0) {
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  NET_StopReceiver(self->receiver);
+  Py_END_ALLOW_THREADS
+
+  self->busy = 0;
+  self->closed = 1;
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+Receiver_Enter(q3huff_ReceiverObject *self)
+{
+  if (self->closed) {
+    PyErr_SetString(PyExc_ValueError, "receiver is closed");
+    return NULL;
+  }
+  Py_INCREF(self);
+  return (PyObject *)self;
+}
+
+static PyObject *
+Receiver_Exit(q3huff_ReceiverObject *self, PyObject *args)
+{
+  return Receiver_Close(self);
+}
+
+static PyObject *
+Receiver_GetStat(q3huff_ReceiverObject *self, void *closure)
+{
+  int received, dropped;
+
+  NET_ReceiverStats(self->receiver, &received, &dropped);
+  return PyLong_FromLong(closure ? dropped : received);
+}
+
+static PyMemberDef Receiver_members[] = {
+  {"server", T_BOOL, offsetof(q3huff_ReceiverObject, server), READONLY, Receiver_server__doc__},
+  {"closed", T_BOOL, offsetof(q3huff_ReceiverObject, closed), READONLY, Receiver_closed__doc__},
+  {"table", T_OBJECT, offsetof(q3huff_ReceiverObject, table), READONLY, Receiver_table__doc__},
+  {NULL}
+};
+
+static PyGetSetDef Receiver_getset[] = {
+  {"received", (getter)Receiver_GetStat, NULL, Receiver_received__doc__, NULL},
+  {"dropped", (getter)Receiver_GetStat, NULL, Receiver_dropped__doc__, (void *)1},
+  {NULL}
+};
+
+static PyMethodDef Receiver_methods[] = {
+  {"get", (PyCFunction)Receiver_Get, METH_VARARGS|METH_KEYWORDS, Receiver_get__doc__},
+  {"get_batch", (PyCFunction)Receiver_GetBatch, METH_VARARGS|METH_KEYWORDS, Receiver_get_batch__doc__},
+  {"fileno", (PyCFunction)Receiver_Fileno, METH_NOARGS, Receiver_fileno__doc__},
+  {"close", (PyCFunction)Receiver_Close, METH_NOARGS, Receiver_close__doc__},
+  {"__enter__", (PyCFunction)Receiver_Enter, METH_NOARGS, NULL},
+  {"__exit__", (PyCFunction)Receiver_Exit, METH_VARARGS, NULL},
+  {NULL}
+};
+
+static PyTypeObject q3huff_ReceiverType = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name      = "q3huff.Receiver",
+  .tp_basicsize = sizeof(q3huff_ReceiverObject),
+  .tp_dealloc   = (destructor)Receiver_dealloc,
+  .tp_flags     = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+  .tp_doc       = Receiver__doc__,
+  .tp_methods   = Receiver_methods,
+  .tp_members   = Receiver_members,
+  .tp_getset    = Receiver_getset,
+  .tp_new       = Receiver_new,
+};
+
+#endif // __linux__
+
+/*
+ *  Free functions
+ */
+
+PyDoc_STRVAR(compress__doc__, "compress(bytes, dictionary=None, mode=MODE_Q3) -> bytes");
+PyDoc_STRVAR(decompress__doc__, "decompress(bytes, dictionary=None, mode=MODE_Q3) -> bytes");
+PyDoc_STRVAR(compressed_size__doc__, "compressed_size(bytes, dictionary=None, mode=MODE_Q3) -> integer");
+
+// compress/decompress engines
+enum {
+  MODE_Q3,          // adaptive, what the game sends
+  MODE_CANONICAL,   // static canonical huffman, see canonical.c
+  MODE_INTERLEAVED  // canonical huffman in interleaved streams
+};
+PyDoc_STRVAR(train_histogram__doc__, "train_histogram(payloads, histogram=None) -> list");
+PyDoc_STRVAR(entity_change_masks__doc__, "entity_change_masks(from_states, to_states) -> (masks, last_changed)");
+PyDoc_STRVAR(build_snapshots__doc__, "build_snapshots(frame, entities, jobs, threads=0)");
+PyDoc_STRVAR(process_demos__doc__, "process_demos(paths, threads=0) -> list");
+PyDoc_STRVAR(index_demo__doc__, "index_demo(path, index_path=None, interval=10000, threads=0) -> integer");
+PyDoc_STRVAR(read_demo__doc__, "read_demo(path, start_time, end_time=None, index_path=None) -> dict");
+PyDoc_STRVAR(cut_demo__doc__, "cut_demo(path, out_path, start_time, end_time=None, index_path=None) -> integer");
+PyDoc_STRVAR(concat_demos__doc__, "concat_demos(paths, out_path) -> integer");
+PyDoc_STRVAR(client_encode__doc__, "client_encode(writer, challenge, server_commands)");
+PyDoc_STRVAR(client_decode__doc__, "client_decode(reader, challenge, reliable_commands)");
+PyDoc_STRVAR(server_encode__doc__, "server_encode(writer, challenge, sequence, last_command)");
+PyDoc_STRVAR(server_decode__doc__, "server_decode(reader, challenge, reliable_commands)");
+PyDoc_STRVAR(send_batch__doc__, "send_batch(sock, packets) -> integer");
+
+/*
+ * Checks a compress/decompress mode and its arguments, returns -1 with an
+ * exception set if they don't go together.
+ */
+static int
+q3huff_CheckMode(int mode, const huff_t *dictionary, Py_buffer *data)
+{
+  if (mode == MODE_Q3) {
+    return 0;
+  }
+  if (mode != MODE_CANONICAL && mode != MODE_INTERLEAVED) {
+    PyErr_Format(PyExc_ValueError, "unknown mode %d", mode);
+    return -1;
+  }
+  if (dictionary) {
+    PyErr_SetString(PyExc_ValueError, "dictionary only applies to MODE_Q3");
+    return -1;
+  }
+  if (data->len > INT_MAX - HUFF_INTERLEAVED_HEADER) {
+    PyErr_SetString(PyExc_OverflowError, "data is too large");
+    return -1;
+  }
+  return 0;
+}
+
+static PyObject *
+q3huff_CanonicalCompress(Py_buffer *data, int mode)
+{
+  PyObject *result;
+  int size, length;
+
+  Py_BEGIN_ALLOW_THREADS
+  if (mode == MODE_INTERLEAVED) {
+    size = Huff_InterleavedCompressedSize(data->buf, data->len);
+  } else {
+    size = Huff_CanonicalCompressedSize(data->buf, data->len);
+  }
+  Py_END_ALLOW_THREADS
+  if (size < 0) {
+    PyErr_SetString(PyExc_OverflowError, "data is too large");
+    return NULL;
+  }
+
+  if (!(result = PyBytes_FromStringAndSize(NULL, size))) {
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  if (mode == MODE_INTERLEAVED) {
+    length = Huff_InterleavedCompress(data->buf, data->len, (byte *)PyBytes_AS_STRING(result), size);
+  } else {
+    length = Huff_CanonicalCompress(data->buf, data->len, (byte *)PyBytes_AS_STRING(result), size);
+  }
+  Py_END_ALLOW_THREADS
+  if (length != size) {
+    Py_DECREF(result);
+    PyErr_SetString(PyExc_RuntimeError, "canonical compression failed");
+    return NULL;
+  }
+  return result;
+}
+
+static PyObject *
+q3huff_CanonicalDecompress(Py_buffer *data, int mode)
+{
+  PyObject *result;
+  int size, length;
+
+  size = Huff_CanonicalSize(data->buf, data->len, mode == MODE_INTERLEAVED ? HUFF_INTERLEAVED_TAG : HUFF_CANON_TAG);
+  if (size < 0) {
+    PyErr_SetString(PyExc_ValueError, "not canonical huffman data of this mode");
+    return NULL;
+  }
+
+  if (!(result = PyBytes_FromStringAndSize(NULL, size))) {
+    return NULL;
+  }
+  Py_BEGIN_ALLOW_THREADS
+  if (mode == MODE_INTERLEAVED) {
+    length = Huff_InterleavedDecompress(data->buf, data->len, (byte *)PyBytes_AS_STRING(result), size);
+  } else {
+    length = Huff_CanonicalDecompress(data->buf, data->len, (byte *)PyBytes_AS_STRING(result), size);
+  }
+  Py_END_ALLOW_THREADS
+  if (length != size) {
+    Py_DECREF(result);
+    PyErr_SetString(PyExc_ValueError, "corrupt canonical huffman data");
+    return NULL;
+  }
+  return result;
+}
+
+static PyObject *
+q3huff_Compress(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"data", "dictionary", "mode", NULL};
+  PyObject *dictionaryObj = Py_None, *result;
+  const huff_t *dictionary;
+  Py_buffer data;
+  msg_t msgBuf = {0};
+  byte buf[MAX_MSGLEN];
+  int mode = MODE_Q3;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|Oi", kwlist, &data, &dictionaryObj, &mode)) {
+    return NULL;
+  }
+
+  if (q3huff_GetDictionary(dictionaryObj, &dictionary) < 0 ||
+      q3huff_CheckMode(mode, dictionary, &data) < 0) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  if (mode != MODE_Q3) {
+    result = q3huff_CanonicalCompress(&data, mode);
+    PyBuffer_Release(&data);
+    return result;
+  }
+
+  msgBuf.cursize = data.len;
+  if (msgBuf.cursize > (int) sizeof(buf)) {
+    msgBuf.cursize = sizeof(buf);
+  }
+  memcpy(buf, data.buf, msgBuf.cursize);
+  PyBuffer_Release(&data);
+  msgBuf.data = buf;
+  msgBuf.maxsize = sizeof(buf);
+  Huff_CompressFrom(&msgBuf, 0, dictionary);
+  return PyBytes_FromStringAndSize((char*)msgBuf.data, msgBuf.cursize);
+}
+
+static PyObject *
+q3huff_Decompress(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"data", "dictionary", "mode", NULL};
+  PyObject *dictionaryObj = Py_None, *result;
+  const huff_t *dictionary;
+  Py_buffer data;
+  msg_t msgBuf = {0};
+  byte buf[MAX_MSGLEN];
+  int mode = MODE_Q3;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|Oi", kwlist, &data, &dictionaryObj, &mode)) {
+    return NULL;
+  }
+
+  if (q3huff_GetDictionary(dictionaryObj, &dictionary) < 0 ||
+      q3huff_CheckMode(mode, dictionary, &data) < 0) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  if (mode != MODE_Q3) {
+    result = q3huff_CanonicalDecompress(&data, mode);
+    PyBuffer_Release(&data);
+    return result;
+  }
+
+  memset(&msgBuf, 0, sizeof(msgBuf));
+  msgBuf.cursize = data.len;
+  if (msgBuf.cursize > (int) sizeof(buf)) {
+    msgBuf.cursize = sizeof(buf);
+  }
+  memcpy(buf, data.buf, msgBuf.cursize);
+  PyBuffer_Release(&data);
+  msgBuf.maxsize = sizeof(buf);
+  msgBuf.data = buf;
+  Huff_DecompressFrom(&msgBuf, 0, dictionary);
+  return PyBytes_FromStringAndSize((char*)msgBuf.data, msgBuf.cursize);;
+}
+
+static PyObject *
+q3huff_CompressedSize(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"data", "dictionary", "mode", NULL};
+  PyObject *dictionaryObj = Py_None;
+  const huff_t *dictionary;
+  Py_buffer data;
+  int size, mode = MODE_Q3;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|Oi", kwlist, &data, &dictionaryObj, &mode)) {
+    return NULL;
+  }
+
+  if (q3huff_GetDictionary(dictionaryObj, &dictionary) < 0 ||
+      q3huff_CheckMode(mode, dictionary, &data) < 0) {
+    PyBuffer_Release(&data);
+    return NULL;
+  }
+
+  if (mode != MODE_Q3) {
+    Py_BEGIN_ALLOW_THREADS
+    if (mode == MODE_INTERLEAVED) {
+      size = Huff_InterleavedCompressedSize(data.buf, data.len);
+    } else {
+      size = Huff_CanonicalCompressedSize(data.buf, data.len);
+    }
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&data);
+    if (size < 0) {
+      PyErr_SetString(PyExc_OverflowError, "data is too large");
+      return NULL;
+    }
+    return PyLong_FromLong(size);
+  }
+
+  size = data.len > MAX_MSGLEN ? MAX_MSGLEN : data.len;
+  size = Huff_CompressedSize(data.buf, size, dictionary);
+  PyBuffer_Release(&data);
+  return PyLong_FromLong(size);
+}
+
+static PyObject *
+q3huff_TrainHistogram(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"payloads", "histogram", NULL};
+  PyObject *payloadsObj, *histogramObj = Py_None, *iter = NULL, *item, *seq, *result = NULL;
+  unsigned long long counts[256];
+  const byte *p;
+  Py_buffer view;
+  Py_ssize_t j;
+  int i;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &payloadsObj, &histogramObj)) {
+    return NULL;
+  }
+
+  memset(counts, 0, sizeof(counts));
+  if (histogramObj != Py_None) {
+    if (!(seq = PySequence_Fast(histogramObj, "histogram must be a sequence"))) {
+      return NULL;
+    }
+    if (PySequence_Fast_GET_SIZE(seq) != 256) {
+      Py_DECREF(seq);
+      PyErr_SetString(PyExc_ValueError, "histogram must have 256 counts");
+      return NULL;
+    }
+    for (i = 0; i < 256; i++) {
+      counts[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+      if (PyErr_Occurred()) {
+        Py_DECREF(seq);
+        return NULL;
+      }
+    }
+    Py_DECREF(seq);
+  }
+
+  if (!(iter = PyObject_GetIter(payloadsObj))) {
+    return NULL;
+  }
+
+  while ((item = PyIter_Next(iter))) {
+    if (PyObject_GetBuffer(item, &view, PyBUF_SIMPLE) < 0) {
+      Py_DECREF(item);
+      goto done;
+    }
+    for (j = 0, p = view.buf; j < view.len; j++) {
+      counts[p[j]]++;
+    }
+    PyBuffer_Release(&view);
+    Py_DECREF(item);
+  }
+  if (PyErr_Occurred()) {
+    goto done;
+  }
+
+  if (!(result = PyList_New(256))) {
+    goto done;
+  }
+  for (i = 0; i < 256; i++) {
+    PyList_SET_ITEM(result, i, PyLong_FromUnsignedLongLong(counts[i]));
+  }
+
+done:
+  Py_DECREF(iter);
+  return result;
+}
+
+static PyObject *
+q3huff_EntityChangeMasks(PyObject *self, PyObject *args)
+{
+  Py_buffer from, to;
+  PyObject *masks = NULL, *lastChanged = NULL, *result = NULL;
+  uint64_t *maskBuf = NULL;
+  int *lcBuf = NULL;
+  int i, count;
+
+  if (!PyArg_ParseTuple(args, "y*y*", &from, &to)) {
+    return NULL;
+  }
+
+  if (from.len != to.len || from.len % sizeof(entityState_t) != 0) {
+    PyErr_Format(PyExc_ValueError, "entity states must be equal length multiples of %d bytes", (int) sizeof(entityState_t));
+    goto done;
+  }
+
+  count = from.len / sizeof(entityState_t);
+  maskBuf = malloc(count * sizeof(*maskBuf) + 1);
+  lcBuf = malloc(count * sizeof(*lcBuf) + 1);
+  if (!maskBuf || !lcBuf) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  MSG_EntityChangeMasks(from.buf, to.buf, count, maskBuf, lcBuf);
+
+  masks = PyList_New(count);
+  lastChanged = PyList_New(count);
+  if (!masks || !lastChanged) {
+    goto done;
+  }
+  for (i = 0; i < count; i++) {
+    PyList_SET_ITEM(masks, i, PyLong_FromUnsignedLongLong(maskBuf[i]));
+    PyList_SET_ITEM(lastChanged, i, PyLong_FromLong(lcBuf[i]));
+  }
+  result = PyTuple_Pack(2, masks, lastChanged);
+
+done:
+  Py_XDECREF(masks);
+  Py_XDECREF(lastChanged);
+  free(maskBuf);
+  free(lcBuf);
+  PyBuffer_Release(&from);
+  PyBuffer_Release(&to);
+  return result;
+}
+
+typedef struct {
+  PyObject *ringObj;
+  PyObject *writerObj;
+  int deltaFrame;
+  qboolean allVisible;
+  byte visible[MAX_GENTITIES / 8];
+  playerState_t ps;
+} q3huff_SnapshotJob;
+
+typedef struct {
+  int frame;
+  const entityState_t *world;
+  int numWorld;
+  q3huff_SnapshotJob *jobs;
+} q3huff_SnapshotWork;
+
+static void
+q3huff_BuildSnapshot(void *data, int index)
+{
+  q3huff_SnapshotWork *work = data;
+  q3huff_SnapshotJob *job = &work->jobs[index];
+
+  SV_BuildClientSnapshot(&((q3huff_SnapshotRingObject *)job->ringObj)->ring, work->frame,
+                         job->deltaFrame, work->world, work->numWorld,
+                         job->allVisible ? NULL : job->visible, &job->ps,
+                         &((q3huff_WriterObject *)job->writerObj)->msgBuf);
+}
+
+static int
+q3huff_GetVisible(PyObject *obj, q3huff_SnapshotJob *job)
+{
+  PyObject *iter, *item;
+  long number;
+
+  memset(job->visible, 0, sizeof(job->visible));
+  job->allVisible = obj == Py_None;
+  if (job->allVisible) {
+    return 0;
+  }
+
+  if (!(iter = PyObject_GetIter(obj))) {
+    return -1;
+  }
+
+  while ((item = PyIter_Next(iter))) {
+    number = PyLong_AsLong(item);
+    Py_DECREF(item);
+    if (number == -1 && PyErr_Occurred()) {
+      break;
+    }
+    if (number < 0 || number >= MAX_GENTITIES - 1) {
+      PyErr_SetString(PyExc_ValueError, "entity number out of range");
+      break;
+    }
+    job->visible[number >> 3] |= 1 << (number & 7);
+  }
+  Py_DECREF(iter);
+  return PyErr_Occurred() ? -1 : 0;
+}
+
+static int
+q3huff_GetSnapshotJob(PyObject *obj, int frame, q3huff_SnapshotJob *job)
+{
+  PyObject *visibleObj, *psObj;
+  q3huff_SnapshotRingObject *ring;
+
+  if (!PyArg_ParseTuple(obj, "O!iOOO!", &q3huff_SnapshotRingType, &job->ringObj, &job->deltaFrame,
+                        &visibleObj, &psObj, &q3huff_WriterType, &job->writerObj)) {
+    return -1;
+  }
+
+  ring = (q3huff_SnapshotRingObject *)job->ringObj;
+  if (SnapshotRing_CheckIdle(ring) < 0 || Writer_CheckIdle((q3huff_WriterObject *)job->writerObj) < 0) {
+    return -1;
+  }
+
+  if (job->deltaFrame >= 0) {
+    if (!SnapshotRing_GetFrame(ring, job->deltaFrame)) {
+      return -1;
+    }
+    if (job->deltaFrame >= frame || frame - job->deltaFrame >= ring->ring.numFrames) {
+      PyErr_Format(PyExc_ValueError, "frame %d can not be delta compressed from frame %d", frame, job->deltaFrame);
+      return -1;
+    }
+  } else if (!ring->ring.frames) {
+    PyErr_SetString(PyExc_RuntimeError, "ring is not initialized");
+    return -1;
+  }
+
+  if (q3huff_GetVisible(visibleObj, job) < 0) {
+    return -1;
+  }
+  return q3huff_GetPlayerState(psObj, &job->ps);
+}
+
+static PyObject *
+q3huff_BuildSnapshots(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"frame", "entities", "jobs", "threads", NULL};
+  Py_buffer entities;
+  PyObject *jobsObj, *seq = NULL, *result = NULL;
+  q3huff_SnapshotWork work;
+  q3huff_SnapshotJob *jobs = NULL;
+  entityState_t *aligned = NULL;
+  int i, j, count = 0, threads = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "iy*O|i", kwlist, &work.frame, &entities, &jobsObj, &threads)) {
+    return NULL;
+  }
+
+  if (work.frame < 0) {
+    PyErr_SetString(PyExc_ValueError, "frame must be >= 0");
+    goto done;
+  }
+
+  if (entities.len % sizeof(entityState_t) != 0) {
+    PyErr_Format(PyExc_ValueError, "entities must be a multiple of %d bytes", (int) sizeof(entityState_t));
+    goto done;
+  }
+
+  // the world is read as entity states, which the caller's buffer need not
+  // be aligned for
+  work.world = entities.buf;
+  if ((uintptr_t)entities.buf % sizeof(int) != 0) {
+    if (!(aligned = PyMem_Malloc(entities.len))) {
+      PyErr_NoMemory();
+      goto done;
+    }
+    memcpy(aligned, entities.buf, entities.len);
+    work.world = aligned;
+  }
+  work.numWorld = entities.len / sizeof(entityState_t);
+  for (i = 0; i < work.numWorld; i++) {
+    if (work.world[i].number < 0 || work.world[i].number >= MAX_GENTITIES - 1 ||
+        (i > 0 && work.world[i].number <= work.world[i - 1].number)) {
+      PyErr_SetString(PyExc_ValueError, "entities must be sorted by unique, valid numbers");
+      goto done;
+    }
+  }
+
+  if (!(seq = PySequence_Fast(jobsObj, "jobs must be a sequence"))) {
+    goto done;
+  }
+
+  count = PySequence_Fast_GET_SIZE(seq);
+  jobs = PyMem_Calloc(count + 1, sizeof(*jobs));
+  if (!jobs) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (q3huff_GetSnapshotJob(PySequence_Fast_GET_ITEM(seq, i), work.frame, &jobs[i]) < 0) {
+      count = i;
+      goto done;
+    }
+    for (j = 0; j < i; j++) {
+      if (jobs[j].ringObj == jobs[i].ringObj || jobs[j].writerObj == jobs[i].writerObj) {
+        PyErr_SetString(PyExc_ValueError, "each job needs its own ring and writer");
+        count = i;
+        goto done;
+      }
+    }
+    // keep them alive while the lock is released
+    Py_INCREF(jobs[i].ringObj);
+    Py_INCREF(jobs[i].writerObj);
+  }
+
+  // other threads get an error rather than a torn ring or message
+  for (i = 0; i < count; i++) {
+    ((q3huff_SnapshotRingObject *)jobs[i].ringObj)->busy = 1;
+    ((q3huff_WriterObject *)jobs[i].writerObj)->busy = 1;
+  }
+
+  work.jobs = jobs;
+  Py_BEGIN_ALLOW_THREADS
+  Sys_ParallelFor(threads, q3huff_BuildSnapshot, &work, count);
+  Py_END_ALLOW_THREADS
+
+  for (i = 0; i < count; i++) {
+    ((q3huff_SnapshotRingObject *)jobs[i].ringObj)->busy = 0;
+    ((q3huff_WriterObject *)jobs[i].writerObj)->busy = 0;
+  }
+
+  result = Py_None;
+  Py_INCREF(result);
+
+done:
+  for (i = 0; jobs && i < count; i++) {
+    Py_DECREF(jobs[i].ringObj);
+    Py_DECREF(jobs[i].writerObj);
+  }
+  PyMem_Free(jobs);
+  PyMem_Free(aligned);
+  Py_XDECREF(seq);
+  PyBuffer_Release(&entities);
+  return result;
+}
+
+typedef struct {
+  demoFile_t demo;
+  size_t *segments;       // offsets of the gamestates to split at
+  int numSegments;        // -1 if the scan ran out of memory
+  size_t end;
+  demoRecord_t status;
+  int firstJob;
+} q3huff_DemoFile;
+
+typedef struct {
+  const q3huff_DemoFile *file;
+  size_t start;
+  size_t end;
+  int interval;           // msec between keyframes when indexing, else 0
+  demoParse_t out;
+} q3huff_DemoJob;
+
+static void
+q3huff_ScanDemo(void *data, int index)
+{
+  q3huff_DemoFile *file = &((q3huff_DemoFile *)data)[index];
+
+  file->numSegments = CL_DemoSegments(&file->demo, &file->segments, &file->end, &file->status);
+}
+
+static void
+q3huff_ParseDemo(void *data, int index)
+{
+  q3huff_DemoJob *job = &((q3huff_DemoJob *)data)[index];
+
+  if (job->interval) {
+    CL_IndexDemo(&job->file->demo, job->start, job->end, job->interval, &job->out);
+  } else {
+    CL_ParseDemo(&job->file->demo, job->start, job->end, &job->out);
+  }
+}
+
+/*
+ * Finds the gamestates in every file, then makes a job for each segment
+ * between them.  Returns -1 with an exception set on failure.
+ */
+static int
+q3huff_SplitDemos(q3huff_DemoFile *files, int count, int threads, q3huff_DemoJob **jobs, int *numJobs)
+{
+  int i, j;
+
+  Py_BEGIN_ALLOW_THREADS
+  Sys_ParallelFor(threads, q3huff_ScanDemo, files, count);
+  Py_END_ALLOW_THREADS
+
+  *numJobs = 0;
+  for (i = 0; i < count; i++) {
+    if (files[i].numSegments < 0) {
+      PyErr_NoMemory();
+      return -1;
+    }
+    files[i].firstJob = *numJobs;
+    *numJobs += files[i].numSegments;
+  }
+
+  *jobs = PyMem_Calloc(*numJobs + 1, sizeof(**jobs));
+  if (!*jobs) {
+    PyErr_NoMemory();
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < files[i].numSegments; j++) {
+      (*jobs)[files[i].firstJob + j].file = &files[i];
+      (*jobs)[files[i].firstJob + j].start = files[i].segments[j];
+      (*jobs)[files[i].firstJob + j].end = j + 1 < files[i].numSegments ? files[i].segments[j + 1] : files[i].end;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Number of segments that count, nothing after the first with an error.
+ */
+static int
+q3huff_DemoJobCount(const q3huff_DemoFile *file, const q3huff_DemoJob *jobs)
+{
+  int count;
+
+  for (count = 0; count < file->numSegments; count++) {
+    if (jobs[count].out.error[0]) {
+      return count + 1;
+    }
+  }
+  return count;
+}
+
+#define q3huff_JobBuf(job, field) ((growBuf_t *)((char *)&(job)->out + (field)))
+
+static PyObject *
+q3huff_JoinDemoBufs(const q3huff_DemoJob *jobs, int count, size_t field)
+{
+  PyObject *result;
+  Py_ssize_t size = 0;
+  char *p;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    size += q3huff_JobBuf(&jobs[i], field)->size;
+  }
+
+  if (!(result = PyBytes_FromStringAndSize(NULL, size))) {
+    return NULL;
+  }
+
+  p = PyBytes_AS_STRING(result);
+  for (i = 0; i < count; i++) {
+    if (q3huff_JobBuf(&jobs[i], field)->size) {
+      memcpy(p, q3huff_JobBuf(&jobs[i], field)->data, q3huff_JobBuf(&jobs[i], field)->size);
+      p += q3huff_JobBuf(&jobs[i], field)->size;
+    }
+  }
+  return result;
+}
+
+static PyObject *
+q3huff_DemoCommands(const q3huff_DemoJob *jobs, int count)
+{
+  PyObject *result, *item;
+  const growBuf_t *buf;
+  size_t offset;
+  int i, sequence;
+
+  if (!(result = PyList_New(0))) {
+    return NULL;
+  }
+
+  for (i = 0; i < count; i++) {
+    buf = &jobs[i].out.commands;
+    for (offset = 0; offset < buf->size; offset += strlen((char *)buf->data + offset) + 1) {
+      memcpy(&sequence, buf->data + offset, sizeof(sequence));
+      offset += sizeof(sequence);
+      item = Py_BuildValue("(iN)", sequence, PyUnicode_FromString((char *)buf->data + offset));
+      if (!item || PyList_Append(result, item) < 0) {
+        Py_XDECREF(item);
+        Py_DECREF(result);
+        return NULL;
+      }
+      Py_DECREF(item);
+    }
+  }
+  return result;
+}
+
+static PyObject *
+q3huff_DemoGamestates(const q3huff_DemoJob *jobs, int count)
+{
+  PyObject *result, *item, *configstrings, *key, *value;
+  const demoGamestate_t *gs;
+  const growBuf_t *buf;
+  size_t offset;
+  int i, j, first, snapshots = 0, numGamestates = 0, index[2];
+
+  if (!(result = PyList_New(0))) {
+    return NULL;
+  }
+
+  for (i = 0; i < count; i++) {
+    gs = (const demoGamestate_t *)jobs[i].out.gamestates.data;
+    for (j = 0; j < jobs[i].out.numGamestates; j++) {
+      item = Py_BuildValue("(iiN)", snapshots + gs[j].firstSnapshot, gs[j].clientNum, PyDict_New());
+      if (!item || PyList_Append(result, item) < 0) {
+        Py_XDECREF(item);
+        goto fail;
+      }
+      Py_DECREF(item);
+    }
+
+    // configstrings refer to the gamestates of their own segment
+    buf = &jobs[i].out.configstrings;
+    for (offset = 0; offset < buf->size; offset += strlen((char *)buf->data + offset) + 1) {
+      memcpy(index, buf->data + offset, sizeof(index));
+      offset += sizeof(index);
+      if (index[0] < 0 || index[0] >= jobs[i].out.numGamestates) {
+        continue;
+      }
+      first = numGamestates + index[0];
+      configstrings = PyTuple_GET_ITEM(PyList_GET_ITEM(result, first), 2);
+      key = PyLong_FromLong(index[1]);
+      value = PyUnicode_FromString((char *)buf->data + offset);
+      if (!key || !value || PyDict_SetItem(configstrings, key, value) < 0) {
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        goto fail;
+      }
+      Py_DECREF(key);
+      Py_DECREF(value);
+    }
+
+    snapshots += jobs[i].out.numSnapshots;
+    numGamestates += jobs[i].out.numGamestates;
+  }
+  return result;
+
+fail:
+  Py_DECREF(result);
+  return NULL;
+}
+
+static PyObject *
+q3huff_DemoResult(const q3huff_DemoFile *file, const q3huff_DemoJob *jobs)
+{
+  PyObject *error;
+  int count;
+
+  // like reading it in one go, nothing after the first error counts
+  count = q3huff_DemoJobCount(file, jobs);
+  if (count && jobs[count - 1].out.error[0]) {
+    error = PyUnicode_FromString(jobs[count - 1].out.error);
+  } else if (file->status == DEMO_ERROR) {
+    error = PyUnicode_FromFormat("demo message at offset %zd is longer than %d bytes", (Py_ssize_t)file->end, MAX_MSGLEN);
+  } else {
+    error = Py_None;
+    Py_INCREF(error);
+  }
+
+  return Py_BuildValue("{s:N,s:N,s:N,s:N,s:N,s:N,s:N,s:N}",
+    "server_times", q3huff_JoinDemoBufs(jobs, count, offsetof(demoParse_t, serverTimes)),
+    "playerstates", q3huff_JoinDemoBufs(jobs, count, offsetof(demoParse_t, playerStates)),
+    "entity_counts", q3huff_JoinDemoBufs(jobs, count, offsetof(demoParse_t, entityCounts)),
+    "entities", q3huff_JoinDemoBufs(jobs, count, offsetof(demoParse_t, entities)),
+    "commands", q3huff_DemoCommands(jobs, count),
+    "gamestates", q3huff_DemoGamestates(jobs, count),
+    "truncated", PyBool_FromLong(file->status == DEMO_TRUNCATED),
+    "error", error);
+}
+
+static PyObject *
+q3huff_ProcessDemos(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"paths", "threads", NULL};
+  PyObject *pathsObj, *seq, *path, *item, *result = NULL;
+  q3huff_DemoFile *files = NULL;
+  q3huff_DemoJob *jobs = NULL;
+  int i, count = 0, numJobs = 0, threads = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist, &pathsObj, &threads)) {
+    return NULL;
+  }
+
+  if (!(seq = PySequence_Fast(pathsObj, "paths must be a sequence"))) {
+    return NULL;
+  }
+
+  files = PyMem_Calloc(PySequence_Fast_GET_SIZE(seq) + 1, sizeof(*files));
+  if (!files) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  for (count = 0; count < PySequence_Fast_GET_SIZE(seq); count++) {
+    if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(seq, count), &path)) {
+      goto done;
+    }
+    if (q3huff_MapDemo(path, &files[count].demo) < 0) {
+      Py_DECREF(path);
+      goto done;
+    }
+    Py_DECREF(path);
+  }
+
+  // parse all the pieces of all the files at once
+  if (q3huff_SplitDemos(files, count, threads, &jobs, &numJobs) < 0) {
+    goto done;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  Sys_ParallelFor(threads, q3huff_ParseDemo, jobs, numJobs);
+  Py_END_ALLOW_THREADS
+
+  if (!(result = PyList_New(count))) {
+    goto done;
+  }
+  for (i = 0; i < count; i++) {
+    if (!(item = q3huff_DemoResult(&files[i], jobs + files[i].firstJob))) {
+      Py_CLEAR(result);
+      goto done;
+    }
+    PyList_SET_ITEM(result, i, item);
+  }
+
+done:
+  for (i = 0; jobs && i < numJobs; i++) {
+    CL_FreeDemoParse(&jobs[i].out);
+  }
+  for (i = 0; files && i < count; i++) {
+    free(files[i].segments);
+    Demo_Unmap(&files[i].demo);
+  }
+  PyMem_Free(jobs);
+  PyMem_Free(files);
+  Py_DECREF(seq);
+  return result;
+}
+
+/*
+ * The index of a demo goes next to it unless a path is given.
+ */
+static PyObject *
+q3huff_IndexPath(PyObject *path, PyObject *indexObj)
+{
+  PyObject *indexPath;
+
+  if (indexObj == Py_None) {
+    return PyBytes_FromFormat("%s.idx", PyBytes_AS_STRING(path));
+  }
+  if (!PyUnicode_FSConverter(indexObj, &indexPath)) {
+    return NULL;
+  }
+  return indexPath;
+}
+
+static PyObject *
+q3huff_IndexDemo(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"path", "index_path", "interval", "threads", NULL};
+  PyObject *path, *indexObj = Py_None, *indexPath = NULL, *result = NULL;
+  q3huff_DemoFile file;
+  q3huff_DemoJob *jobs = NULL;
+  int i, count, numJobs = 0, numKeyframes = 0, interval = 10000, threads = 0;
+  byte *index = NULL, *p;
+  size_t size = DEMO_INDEX_HEADER;
+  qboolean ok;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Oii", kwlist, PyUnicode_FSConverter, &path,
+                                   &indexObj, &interval, &threads)) {
+    return NULL;
+  }
+
+  memset(&file, 0, sizeof(file));
+  if (interval <= 0) {
+    PyErr_SetString(PyExc_ValueError, "interval must be > 0");
+    goto done;
+  }
+  if (!(indexPath = q3huff_IndexPath(path, indexObj)) || q3huff_MapDemo(path, &file.demo) < 0) {
+    goto done;
+  }
+
+  if (q3huff_SplitDemos(&file, 1, threads, &jobs, &numJobs) < 0) {
+    goto done;
+  }
+  for (i = 0; i < numJobs; i++) {
+    jobs[i].interval = interval;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  Sys_ParallelFor(threads, q3huff_ParseDemo, jobs, numJobs);
+  Py_END_ALLOW_THREADS
+
+  // an index covers the demo up to the first error
+  count = q3huff_DemoJobCount(&file, jobs);
+  for (i = 0; i < count; i++) {
+    size += jobs[i].out.keyframes.size;
+    numKeyframes += jobs[i].out.numKeyframes;
+  }
+
+  if (!(index = PyMem_Malloc(size))) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  CL_IndexHeader(index, file.demo.size, numKeyframes);
+  p = index + DEMO_INDEX_HEADER;
+  for (i = 0; i < count; i++) {
+    if (jobs[i].out.keyframes.size) {
+      memcpy(p, jobs[i].out.keyframes.data, jobs[i].out.keyframes.size);
+      p += jobs[i].out.keyframes.size;
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  ok = Demo_WriteFile(PyBytes_AS_STRING(indexPath), index, size);
+  Py_END_ALLOW_THREADS
+  if (!ok) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, indexPath);
+    goto done;
+  }
+
+  result = PyLong_FromLong(numKeyframes);
+
+done:
+  for (i = 0; jobs && i < numJobs; i++) {
+    CL_FreeDemoParse(&jobs[i].out);
+  }
+  free(file.segments);
+  Demo_Unmap(&file.demo);
+  PyMem_Free(jobs);
+  PyMem_Free(index);
+  Py_XDECREF(indexPath);
+  Py_DECREF(path);
+  return result;
+}
+
+static PyObject *
+q3huff_ReadDemo(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"path", "start_time", "end_time", "index_path", NULL};
+  PyObject *path, *endObj = Py_None, *indexObj = Py_None, *indexPath = NULL, *result = NULL;
+  q3huff_DemoFile file;
+  q3huff_DemoJob job;
+  demoFile_t index;
+  demoKeyframe_t key;
+  int startTime, endTime = INT_MAX;
+  long value;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&i|OO", kwlist, PyUnicode_FSConverter, &path,
+                                   &startTime, &endObj, &indexObj)) {
+    return NULL;
+  }
+
+  memset(&file, 0, sizeof(file));
+  memset(&job, 0, sizeof(job));
+  memset(&index, 0, sizeof(index));
+  if (endObj != Py_None) {
+    value = PyLong_AsLong(endObj);
+    if (value == -1 && PyErr_Occurred()) {
+      goto done;
+    }
+    endTime = value < INT_MIN ? INT_MIN : value > INT_MAX ? INT_MAX : value;
+  }
+  if (!(indexPath = q3huff_IndexPath(path, indexObj)) || q3huff_MapDemo(path, &file.demo) < 0 ||
+      q3huff_MapDemo(indexPath, &index) < 0) {
+    goto done;
+  }
+
+  if (!CL_FindKeyframe(index.data, index.size, file.demo.size, startTime, &key)) {
+    PyErr_SetString(PyExc_ValueError, "index does not belong to the demo");
+    goto done;
+  }
+
+  // a parse error ends up in the result, like process_demos()
+  Py_BEGIN_ALLOW_THREADS
+  CL_ResumeDemo(&file.demo, &key, startTime, endTime, &job.out);
+  Py_END_ALLOW_THREADS
+
+  // one segment, ended where the parse ended
+  file.numSegments = 1;
+  file.status = job.out.truncated ? DEMO_TRUNCATED : DEMO_END;
+  result = q3huff_DemoResult(&file, &job);
+
+done:
+  CL_FreeDemoParse(&job.out);
+  Demo_Unmap(&index);
+  Demo_Unmap(&file.demo);
+  Py_XDECREF(indexPath);
+  Py_DECREF(path);
+  return result;
+}
+
+/*
+ * Writes the records of a cut or a join, or raises ValueError with its
+ * error.  Returns the number of messages written.
+ */
+static PyObject *
+q3huff_WriteDemo(PyObject *outPath, const demoParse_t *out)
+{
+  qboolean ok;
+
+  if (out->error[0]) {
+    PyErr_SetString(PyExc_ValueError, out->error);
+    return NULL;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  ok = Demo_WriteFile(PyBytes_AS_STRING(outPath), out->records.data, out->records.size);
+  Py_END_ALLOW_THREADS
+  if (!ok) {
+    PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, outPath);
+    return NULL;
+  }
+  return PyLong_FromLong(out->numRecords);
+}
+
+static PyObject *
+q3huff_CutDemo(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"path", "out_path", "start_time", "end_time", "index_path", NULL};
+  PyObject *path, *outPath, *endObj = Py_None, *indexObj = Py_None, *indexPath = NULL, *result = NULL;
+  demoFile_t demo, index;
+  demoKeyframe_t key;
+  demoParse_t out;
+  size_t start = 0;
+  int startTime, endTime = INT_MAX;
+  long value;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&O&i|OO", kwlist, PyUnicode_FSConverter, &path,
+                                   PyUnicode_FSConverter, &outPath, &startTime, &endObj, &indexObj)) {
+    return NULL;
+  }
+
+  memset(&demo, 0, sizeof(demo));
+  memset(&index, 0, sizeof(index));
+  memset(&out, 0, sizeof(out));
+  if (endObj != Py_None) {
+    value = PyLong_AsLong(endObj);
+    if (value == -1 && PyErr_Occurred()) {
+      goto done;
+    }
+    endTime = value < INT_MIN ? INT_MIN : value > INT_MAX ? INT_MAX : value;
+  }
+  if (q3huff_MapDemo(path, &demo) < 0) {
+    goto done;
+  }
+
+  // the cut needs the client state from the gamestate on, so an index only
+  // saves parsing the games before it
+  if (indexObj != Py_None) {
+    if (!(indexPath = q3huff_IndexPath(path, indexObj)) || q3huff_MapDemo(indexPath, &index) < 0) {
+      goto done;
+    }
+    if (!CL_FindKeyframe(index.data, index.size, demo.size, startTime, &key)) {
+      PyErr_SetString(PyExc_ValueError, "index does not belong to the demo");
+      goto done;
+    }
+    if (key.gamestate != DEMO_NO_GAMESTATE) {
+      start = key.gamestate;
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  CL_CutDemo(&demo, start, startTime, endTime, &out);
+  Py_END_ALLOW_THREADS
+
+  result = q3huff_WriteDemo(outPath, &out);
+
+done:
+  CL_FreeDemoParse(&out);
+  Demo_Unmap(&index);
+  Demo_Unmap(&demo);
+  Py_XDECREF(indexPath);
+  Py_DECREF(outPath);
+  Py_DECREF(path);
+  return result;
+}
+
+static PyObject *
+q3huff_ConcatDemos(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"paths", "out_path", NULL};
+  PyObject *pathsObj, *outPath, *seq = NULL, *path, *result = NULL;
+  demoFile_t *demos = NULL;
+  demoParse_t out;
+  int i, count = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO&", kwlist, &pathsObj, PyUnicode_FSConverter, &outPath)) {
+    return NULL;
+  }
+
+  memset(&out, 0, sizeof(out));
+  if (!(seq = PySequence_Fast(pathsObj, "paths must be a sequence"))) {
+    goto done;
+  }
+
+  demos = PyMem_Calloc(PySequence_Fast_GET_SIZE(seq) + 1, sizeof(*demos));
+  if (!demos) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  for (count = 0; count < PySequence_Fast_GET_SIZE(seq); count++) {
+    if (!PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(seq, count), &path)) {
+      goto done;
+    }
+    if (q3huff_MapDemo(path, &demos[count]) < 0) {
+      Py_DECREF(path);
+      goto done;
+    }
+    Py_DECREF(path);
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  CL_ConcatDemos(demos, count, &out);
+  Py_END_ALLOW_THREADS
+
+  result = q3huff_WriteDemo(outPath, &out);
+
+done:
+  CL_FreeDemoParse(&out);
+  for (i = 0; demos && i < count; i++) {
+    Demo_Unmap(&demos[i]);
+  }
+  PyMem_Free(demos);
+  Py_XDECREF(seq);
+  Py_DECREF(outPath);
+  return result;
+}
+
+/*
+ * The string of a command, as str or bytes.
+ */
+static const char *
+q3huff_CommandString(PyObject *obj)
+{
+  if (PyBytes_Check(obj)) {
+    return PyBytes_AS_STRING(obj);
+  }
+  if (PyUnicode_Check(obj)) {
+    return PyUnicode_AsUTF8(obj);
+  }
+  PyErr_SetString(PyExc_TypeError, "commands must be str or bytes");
+  return NULL;
+}
+
+/*
+ * Points ring at the MAX_RELIABLE_COMMANDS strings of a sequence.  Returns
+ * the fast sequence holding them, or NULL with an exception set.
+ */
+static PyObject *
+q3huff_CommandRing(PyObject *commandsObj, const char **ring)
+{
+  PyObject *seq;
+  int i;
+
+  if (!(seq = PySequence_Fast(commandsObj, "commands must be a sequence"))) {
+    return NULL;
+  }
+  if (PySequence_Fast_GET_SIZE(seq) != MAX_RELIABLE_COMMANDS) {
+    PyErr_Format(PyExc_ValueError, "commands must hold %d strings", MAX_RELIABLE_COMMANDS);
+    Py_DECREF(seq);
+    return NULL;
+  }
+  for (i = 0; i < MAX_RELIABLE_COMMANDS; i++) {
+    if (!(ring[i] = q3huff_CommandString(PySequence_Fast_GET_ITEM(seq, i)))) {
+      Py_DECREF(seq);
+      return NULL;
+    }
+  }
+  return seq;
+}
+
+static msg_t *
+q3huff_WriterMsg(PyObject *obj)
+{
+  if (!PyObject_TypeCheck(obj, &q3huff_WriterType)) {
+    PyErr_SetString(PyExc_TypeError, "expected a Writer");
+    return NULL;
+  }
+  if (Writer_CheckIdle((q3huff_WriterObject *)obj) < 0) {
+    return NULL;
+  }
+  return &((q3huff_WriterObject *)obj)->msgBuf;
+}
+
+/*
+ * A reader's message to change in place.  A reader that reads another
+ * object's memory, like bytes given to Netchan.process(), gets a copy of
+ * its own first.
+ */
+static msg_t *
+q3huff_ReaderMsg(PyObject *obj)
+{
+  q3huff_ReaderObject *reader = (q3huff_ReaderObject *)obj;
+  byte *buf;
+
+  if (!PyObject_TypeCheck(obj, &q3huff_ReaderType)) {
+    PyErr_SetString(PyExc_TypeError, "expected a Reader");
+    return NULL;
+  }
+  if (reader->owner) {
+    if (!(buf = PyMem_Malloc(reader->msgBuf.cursize ? reader->msgBuf.cursize : 1))) {
+      PyErr_NoMemory();
+      return NULL;
+    }
+    memcpy(buf, reader->msgBuf.data, reader->msgBuf.cursize);
+    reader->buf = buf;
+    reader->msgBuf.data = buf;
+    Py_CLEAR(reader->owner);
+  }
+  return &reader->msgBuf;
+}
+
+static PyObject *
+q3huff_ClientEncode(PyObject *self, PyObject *args)
+{
+  PyObject *writerObj, *commandsObj, *seq;
+  const char *ring[MAX_RELIABLE_COMMANDS];
+  msg_t *msg;
+  int challenge;
+
+  if (!PyArg_ParseTuple(args, "OiO", &writerObj, &challenge, &commandsObj)) {
+    return NULL;
+  }
+  if (!(msg = q3huff_WriterMsg(writerObj)) || !(seq = q3huff_CommandRing(commandsObj, ring))) {
+    return NULL;
+  }
+  CL_Netchan_Encode(msg, challenge, ring);
+  Py_DECREF(seq);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+q3huff_ClientDecode(PyObject *self, PyObject *args)
+{
+  PyObject *readerObj, *commandsObj, *seq;
+  const char *ring[MAX_RELIABLE_COMMANDS];
+  msg_t *msg;
+  int challenge;
+
+  if (!PyArg_ParseTuple(args, "OiO", &readerObj, &challenge, &commandsObj)) {
+    return NULL;
+  }
+  if (!(seq = q3huff_CommandRing(commandsObj, ring))) {
+    return NULL;
+  }
+  if (!(msg = q3huff_ReaderMsg(readerObj))) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+  if (msg->cursize >= 4) {
+    CL_Netchan_Decode(msg, challenge, ring);
+  }
+  Py_DECREF(seq);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+q3huff_ServerEncode(PyObject *self, PyObject *args)
+{
+  PyObject *writerObj, *commandObj;
+  const char *command;
+  msg_t *msg;
+  int challenge, sequence;
+
+  if (!PyArg_ParseTuple(args, "OiiO", &writerObj, &challenge, &sequence, &commandObj)) {
+    return NULL;
+  }
+  if (!(msg = q3huff_WriterMsg(writerObj)) || !(command = q3huff_CommandString(commandObj))) {
+    return NULL;
+  }
+  SV_Netchan_Encode(msg, challenge, sequence, command);
+  Py_RETURN_NONE;
+}
+
+static PyObject *
+q3huff_ServerDecode(PyObject *self, PyObject *args)
+{
+  PyObject *readerObj, *commandsObj, *seq;
+  const char *ring[MAX_RELIABLE_COMMANDS];
+  msg_t *msg;
+  int challenge;
+
+  if (!PyArg_ParseTuple(args, "OiO", &readerObj, &challenge, &commandsObj)) {
+    return NULL;
+  }
+  if (!(seq = q3huff_CommandRing(commandsObj, ring))) {
+    return NULL;
+  }
+  if (!(msg = q3huff_ReaderMsg(readerObj))) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+  SV_Netchan_Decode(msg, challenge, ring);
+  Py_DECREF(seq);
+  Py_RETURN_NONE;
+}
+
+#ifdef __linux__
+
+/*
+ * Fills in the sockaddr for an (host, port) or (host, port, flowinfo,
+ * scope_id) tuple with a numeric host, as the socket module takes them.
+ */
+static int
+q3huff_ParseAddress(PyObject *addressObj, byte *address, int *length)
+{
+  struct sockaddr_in *sin = (struct sockaddr_in *)address;
+  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)address;
+  unsigned int flowinfo = 0, scopeId = 0;
+  const char *host;
+  int port;
+
+  if (!PyTuple_Check(addressObj)) {
+    PyErr_SetString(PyExc_TypeError, "address must be a tuple or None");
+    return -1;
+  }
+  if (!PyArg_ParseTuple(addressObj, "si|II;address must be (host, port)", &host, &port, &flowinfo, &scopeId)) {
+    return -1;
+  }
+  if (port < 0 || port > 0xffff) {
+    PyErr_SetString(PyExc_ValueError, "port must be 0-65535");
+    return -1;
+  }
+
+  memset(address, 0, NET_ADDRESS_SIZE);
+  if (PyTuple_GET_SIZE(addressObj) == 2 && inet_pton(AF_INET, host, &sin->sin_addr) == 1) {
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    *length = sizeof(*sin);
+    return 0;
+  }
+  if (inet_pton(AF_INET6, host, &sin6->sin6_addr) == 1) {
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(port);
+    sin6->sin6_flowinfo = htonl(flowinfo);
+    sin6->sin6_scope_id = scopeId;
+    *length = sizeof(*sin6);
+    return 0;
+  }
+  PyErr_Format(PyExc_ValueError, "%s is not a numeric IP address", host);
+  return -1;
+}
+
+typedef struct {
+  const byte *data;
+  int length;
+  Py_buffer view;
+  q3huff_WriterObject *writer;  // sent straight from its buffer, or NULL
+  netchan_t *chan;
+  byte header[PACKET_HEADER];
+  byte address[NET_ADDRESS_SIZE];
+  int addressLength;
+  byte *fragments;  // packets of a message too long for one, or NULL
+} q3huff_Datagram;
+
+/*
+ * Checks one (address, message[, chan]) item and fills in d, without
+ * touching the channel.  Returns the number of packets it makes, or -1 with
+ * an exception set.
+ */
+static int
+q3huff_PrepareDatagram(PyObject *item, q3huff_Datagram *d)
+{
+  PyObject *addressObj, *messageObj, *chanObj = Py_None;
+  int count;
+
+  if (!PyTuple_Check(item) || !PyArg_ParseTuple(item, "OO|O", &addressObj, &messageObj, &chanObj)) {
+    PyErr_Clear();
+    PyErr_SetString(PyExc_TypeError, "packets must be (address, message) or (address, message, chan) tuples");
+    return -1;
+  }
+
+  if (addressObj != Py_None && q3huff_ParseAddress(addressObj, d->address, &d->addressLength) < 0) {
+    return -1;
+  }
+
+  // a Writer is sent straight from its buffer
+  if (PyObject_TypeCheck(messageObj, &q3huff_WriterType)) {
+    d->writer = (q3huff_WriterObject *)messageObj;
+    if (Writer_CheckIdle(d->writer) < 0) {
+      return -1;
+    }
+    if (d->writer->msgBuf.overflowed) {
+      PyErr_SetString(PyExc_ValueError, "writer has overflowed");
+      return -1;
+    }
+    d->data = d->writer->msgBuf.data;
+    d->length = d->writer->msgBuf.cursize;
+  } else {
+    if (PyObject_GetBuffer(messageObj, &d->view, PyBUF_SIMPLE) < 0) {
+      return -1;
+    }
+    d->data = d->view.buf;
+    d->length = d->view.len > INT_MAX ? INT_MAX : (int)d->view.len;
+  }
+
+  if (chanObj == Py_None) {
+    return 1;
+  }
+  if (!PyObject_TypeCheck(chanObj, &q3huff_NetchanType)) {
+    PyErr_SetString(PyExc_TypeError, "chan must be a Netchan or None");
+    return -1;
+  }
+  d->chan = &((q3huff_NetchanObject *)chanObj)->chan;
+  if (d->chan->unsentFragments) {
+    PyErr_SetString(PyExc_ValueError, "fragments of the last message are still unsent");
+    return -1;
+  }
+  if (d->length > MAX_MSGLEN) {
+    PyErr_Format(PyExc_ValueError, "message is longer than %d bytes", MAX_MSGLEN);
+    return -1;
+  }
+  if (d->length < FRAGMENT_SIZE) {
+    return 1;
+  }
+
+  // the last fragment is shorter than the others, even if that means empty
+  count = d->length / FRAGMENT_SIZE + 1;
+  if (!(d->fragments = PyMem_Malloc(count * MAX_PACKETLEN))) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  return count;
+}
+
+static PyObject *
+q3huff_SendBatch(PyObject *self, PyObject *args, PyObject *kwds)
+{
+  static char *kwlist[] = {"sock", "packets", NULL};
+  PyObject *sockObj, *packetsObj, *seq, *result = NULL;
+  q3huff_Datagram *datagrams;
+  netPacket_t *packets = NULL, *p;
+  Py_ssize_t i, count;
+  int fd, numPackets, n, sent, error;
+  byte *fragment;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO", kwlist, &sockObj, &packetsObj)) {
+    return NULL;
+  }
+  if ((fd = PyObject_AsFileDescriptor(sockObj)) < 0) {
+    return NULL;
+  }
+  // a copy, so nothing sent from can go away with the GIL released
+  if (!(seq = PySequence_Tuple(packetsObj))) {
+    return NULL;
+  }
+  count = PyTuple_GET_SIZE(seq);
+  if (!(datagrams = PyMem_Calloc(count ? count : 1, sizeof(*datagrams)))) {
+    Py_DECREF(seq);
+    return PyErr_NoMemory();
+  }
+
+  // everything is checked before any channel is numbered
+  numPackets = 0;
+  for (i = 0; i < count; i++) {
+    if ((n = q3huff_PrepareDatagram(PyTuple_GET_ITEM(seq, i), &datagrams[i])) < 0) {
+      goto done;
+    }
+    numPackets += n;
+  }
+  if (!(packets = PyMem_Calloc(numPackets ? numPackets : 1, sizeof(*packets)))) {
+    PyErr_NoMemory();
+    goto done;
+  }
+
+  p = packets;
+  for (i = 0; i < count; i++) {
+    q3huff_Datagram *d = &datagrams[i];
+
+    if (d->fragments) {
+      // every fragment goes in this batch
+      fragment = d->fragments;
+      n = Netchan_Transmit(d->chan, d->length, d->data, fragment);
+      for (;;) {
+        p->data[1] = fragment;
+        p->length[1] = n;
+        p->address = d->addressLength ? d->address : NULL;
+        p->addressLength = d->addressLength;
+        p++;
+        if (!d->chan->unsentFragments) {
+          break;
+        }
+        fragment += MAX_PACKETLEN;
+        n = Netchan_TransmitNextFragment(d->chan, fragment);
+      }
+      continue;
+    }
+    if (d->chan) {
+      p->data[0] = d->header;
+      p->length[0] = Netchan_TransmitHeader(d->chan, d->header);
+    }
+    p->data[1] = d->data;
+    p->length[1] = d->length;
+    p->address = d->addressLength ? d->address : NULL;
+    p->addressLength = d->addressLength;
+    p++;
+  }
+
+  // the writers' buffers are read without the GIL, keep other threads off them
+  for (i = 0; i < count; i++) {
+    if (datagrams[i].writer) {
+      datagrams[i].writer->busy = 1;
+    }
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  sent = numPackets ? NET_SendBatch(fd, packets, numPackets, &error) : 0;
+  Py_END_ALLOW_THREADS
+
+  for (i = 0; i < count; i++) {
+    if (datagrams[i].writer) {
+      datagrams[i].writer->busy = 0;
+    }
+  }
+
+  if (!sent && numPackets) {
+    errno = error;
+    PyErr_SetFromErrno(PyExc_OSError);
+  } else {
+    result = PyLong_FromLong(sent);
+  }
+
+done:
+  for (i = 0; i < count; i++) {
+    PyBuffer_Release(&datagrams[i].view);
+    PyMem_Free(datagrams[i].fragments);
+  }
+  PyMem_Free(datagrams);
+  PyMem_Free(packets);
+  Py_DECREF(seq);
+  return result;
+}
+
+#endif // __linux__
+
+static PyMethodDef q3huff_methods[] = {
+  {"compress", (PyCFunction)q3huff_Compress, METH_VARARGS | METH_KEYWORDS, compress__doc__},
+  {"decompress", (PyCFunction)q3huff_Decompress, METH_VARARGS | METH_KEYWORDS, decompress__doc__},
+  {"compressed_size", (PyCFunction)q3huff_CompressedSize, METH_VARARGS | METH_KEYWORDS, compressed_size__doc__},
+  {"train_histogram", (PyCFunction)q3huff_TrainHistogram, METH_VARARGS|METH_KEYWORDS, train_histogram__doc__},
+  {"entity_change_masks", (PyCFunction)q3huff_EntityChangeMasks, METH_VARARGS, entity_change_masks__doc__},
+  {"build_snapshots", (PyCFunction)q3huff_BuildSnapshots, METH_VARARGS|METH_KEYWORDS, build_snapshots__doc__},
+  {"process_demos", (PyCFunction)q3huff_ProcessDemos, METH_VARARGS|METH_KEYWORDS, process_demos__doc__},
+  {"index_demo", (PyCFunction)q3huff_IndexDemo, METH_VARARGS|METH_KEYWORDS, index_demo__doc__},
+  {"read_demo", (PyCFunction)q3huff_ReadDemo, METH_VARARGS|METH_KEYWORDS, read_demo__doc__},
+  {"cut_demo", (PyCFunction)q3huff_CutDemo, METH_VARARGS|METH_KEYWORDS, cut_demo__doc__},
+  {"concat_demos", (PyCFunction)q3huff_ConcatDemos, METH_VARARGS|METH_KEYWORDS, concat_demos__doc__},
+  {"client_encode", (PyCFunction)q3huff_ClientEncode, METH_VARARGS, client_encode__doc__},
+  {"client_decode", (PyCFunction)q3huff_ClientDecode, METH_VARARGS, client_decode__doc__},
+  {"server_encode", (PyCFunction)q3huff_ServerEncode, METH_VARARGS, server_encode__doc__},
+  {"server_decode", (PyCFunction)q3huff_ServerDecode, METH_VARARGS, server_decode__doc__},
+#ifdef __linux__
+  {"send_batch", (PyCFunction)q3huff_SendBatch, METH_VARARGS|METH_KEYWORDS, send_batch__doc__},
+#endif
+  {NULL}
+};
+
+static PyModuleDef HuffmanModule = {
+  PyModuleDef_HEAD_INIT,
   "huffman",
   "A python wrapper for huffman compression used in ioquake3.",
   -1,
@@ -757,21 +4854,86 @@ PyInit_q3huff(void)
 
   MSG_initHuffman();
 
+  if (PyType_Ready(&q3huff_HuffmanTableType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&q3huff_HuffmanDictionaryType) < 0)
+    return NULL;
+
   if (PyType_Ready(&q3huff_WriterType) < 0)
     return NULL;
 
   if (PyType_Ready(&q3huff_ReaderType) < 0)
     return NULL;
 
+  if (PyType_Ready(&q3huff_DemoReaderType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&q3huff_DemoWriterType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&q3huff_DeltaCacheType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&q3huff_SnapshotRingType) < 0)
+    return NULL;
+
+  if (PyType_Ready(&q3huff_NetchanType) < 0)
+    return NULL;
+
+#ifdef __linux__
+  if (PyType_Ready(&q3huff_ReceiverType) < 0)
+    return NULL;
+#endif
+
   m = PyModule_Create(&HuffmanModule);
   if (m == NULL)
     return NULL;
 
+  Py_INCREF(&q3huff_HuffmanTableType);
+  PyModule_AddObject(m, "HuffmanTable", (PyObject *)&q3huff_HuffmanTableType);
+
+  Py_INCREF(&q3huff_HuffmanDictionaryType);
+  PyModule_AddObject(m, "HuffmanDictionary", (PyObject *)&q3huff_HuffmanDictionaryType);
+
   Py_INCREF(&q3huff_WriterType);
   PyModule_AddObject(m, "Writer", (PyObject *)&q3huff_WriterType);
 
   Py_INCREF(&q3huff_ReaderType);
   PyModule_AddObject(m, "Reader", (PyObject *)&q3huff_ReaderType);
 
+  Py_INCREF(&q3huff_DemoReaderType);
+  PyModule_AddObject(m, "DemoReader", (PyObject *)&q3huff_DemoReaderType);
+
+  Py_INCREF(&q3huff_DemoWriterType);
+  PyModule_AddObject(m, "DemoWriter", (PyObject *)&q3huff_DemoWriterType);
+
+  Py_INCREF(&q3huff_DeltaCacheType);
+  PyModule_AddObject(m, "DeltaCache", (PyObject *)&q3huff_DeltaCacheType);
+
+  Py_INCREF(&q3huff_SnapshotRingType);
+  PyModule_AddObject(m, "SnapshotRing", (PyObject *)&q3huff_SnapshotRingType);
+
+  Py_INCREF(&q3huff_NetchanType);
+  PyModule_AddObject(m, "Netchan", (PyObject *)&q3huff_NetchanType);
+
+#ifdef __linux__
+  Py_INCREF(&q3huff_ReceiverType);
+  PyModule_AddObject(m, "Receiver", (PyObject *)&q3huff_ReceiverType);
+#endif
+
+  PyModule_AddIntConstant(m, "MAX_MSGLEN", MAX_MSGLEN);
+  PyModule_AddIntConstant(m, "MODE_Q3", MODE_Q3);
+  PyModule_AddIntConstant(m, "MODE_CANONICAL", MODE_CANONICAL);
+  PyModule_AddIntConstant(m, "MODE_INTERLEAVED", MODE_INTERLEAVED);
+  PyModule_AddIntConstant(m, "ENTITYSTATE_SIZE", sizeof(entityState_t));
+  PyModule_AddIntConstant(m, "PLAYERSTATE_SIZE", sizeof(playerState_t));
+  PyModule_AddIntConstant(m, "GENTITYNUM_BITS", GENTITYNUM_BITS);
+  PyModule_AddIntConstant(m, "MAX_GENTITIES", MAX_GENTITIES);
+  PyModule_AddIntConstant(m, "PACKET_BACKUP", PACKET_BACKUP);
+  PyModule_AddIntConstant(m, "MAX_PACKETLEN", MAX_PACKETLEN);
+  PyModule_AddIntConstant(m, "FRAGMENT_SIZE", FRAGMENT_SIZE);
+  PyModule_AddIntConstant(m, "MAX_RELIABLE_COMMANDS", MAX_RELIABLE_COMMANDS);
+
   return m;
 }
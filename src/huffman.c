@@ -24,20 +24,22 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  * Compression book.  The ranks are not actually stored, but implicitly defined
  * by the location of a node within a doubly-linked list */
 
+#include <stddef.h>
 #include <string.h>
 #include "q_shared.h"
 #include "qcommon.h"
 
-static int			bloc = 0;
+// only used by Huff_Receive and Huff_transmit, everything else passes the
+// bit offset around so messages can be coded on several threads at once
+static Q_THREADLOCAL int	bloc = 0;
 
 void	Huff_putBit( int bit, byte *fout, int *offset) {
-	bloc = *offset;
-	if ((bloc&7) == 0) {
-		fout[(bloc>>3)] = 0;
+	int	b = *offset;
+	if ((b&7) == 0) {
+		fout[(b>>3)] = 0;
 	}
-	fout[(bloc>>3)] |= bit << (bloc&7);
-	bloc++;
-	*offset = bloc;
+	fout[(b>>3)] |= bit << (b&7);
+	*offset = b + 1;
 }
 
 int		Huff_getBloc(void)
@@ -51,28 +53,27 @@ void	Huff_setBloc(int _bloc)
 }
 
 int		Huff_getBit( byte *fin, int *offset) {
-	int t;
-	bloc = *offset;
-	t = (fin[(bloc>>3)] >> (bloc&7)) & 0x1;
-	bloc++;
-	*offset = bloc;
+	int t, b = *offset;
+	t = (fin[(b>>3)] >> (b&7)) & 0x1;
+	*offset = b + 1;
 	return t;
 }
 
 /* Add a bit to the output file (buffered) */
-static void add_bit (char bit, byte *fout) {
-	if ((bloc&7) == 0) {
-		fout[(bloc>>3)] = 0;
+static void add_bit (char bit, byte *fout, int *offset) {
+	int b = *offset;
+	if ((b&7) == 0) {
+		fout[(b>>3)] = 0;
 	}
-	fout[(bloc>>3)] |= bit << (bloc&7);
-	bloc++;
+	fout[(b>>3)] |= bit << (b&7);
+	*offset = b + 1;
 }
 
 /* Receive one bit from the input file (buffered) */
-static int get_bit (byte *fin) {
-	int t;
-	t = (fin[(bloc>>3)] >> (bloc&7)) & 0x1;
-	bloc++;
+static int get_bit (byte *fin, int *offset) {
+	int t, b = *offset;
+	t = (fin[(b>>3)] >> (b&7)) & 0x1;
+	*offset = b + 1;
 	return t;
 }
 
@@ -264,9 +265,9 @@ void Huff_addRef(huff_t* huff, byte ch) {
 }
 
 /* Get a symbol */
-int Huff_Receive (node_t *node, int *ch, byte *fin) {
+static int receive (node_t *node, int *ch, byte *fin, int *offset) {
 	while (node && node->symbol == INTERNAL_NODE) {
-		if (get_bit(fin)) {
+		if (get_bit(fin, offset)) {
 			node = node->right;
 		} else {
 			node = node->left;
@@ -280,10 +281,20 @@ int Huff_Receive (node_t *node, int *ch, byte *fin) {
 }
 
 /* Get a symbol */
-void Huff_offsetReceive (node_t *node, int *ch, byte *fin, int *offset) {
-	bloc = *offset;
+int Huff_Receive (node_t *node, int *ch, byte *fin) {
+	return receive(node, ch, fin, &bloc);
+}
+
+/* Get a symbol, without reading at or past bit maxoffset */
+void Huff_offsetReceive (node_t *node, int *ch, byte *fin, int *offset, int maxoffset) {
+	int b = *offset;
 	while (node && node->symbol == INTERNAL_NODE) {
-		if (get_bit(fin)) {
+		if (b >= maxoffset) {
+			*ch = 0;
+			*offset = maxoffset + 1;
+			return;
+		}
+		if (get_bit(fin, &b)) {
 			node = node->right;
 		} else {
 			node = node->left;
@@ -295,45 +306,54 @@ void Huff_offsetReceive (node_t *node, int *ch, byte *fin, int *offset) {
 //		Com_Error(ERR_DROP, "Illegal tree!");
 	}
 	*ch = node->symbol;
-	*offset = bloc;
+	*offset = b;
 }
 
 /* Send the prefix code for this node */
-static void send(node_t *node, node_t *child, byte *fout) {
+static void send(node_t *node, node_t *child, byte *fout, int *offset) {
 	if (node->parent) {
-		send(node->parent, node, fout);
+		send(node->parent, node, fout, offset);
 	}
 	if (child) {
 		if (node->right == child) {
-			add_bit(1, fout);
+			add_bit(1, fout, offset);
 		} else {
-			add_bit(0, fout);
+			add_bit(0, fout, offset);
 		}
 	}
 }
 
 /* Send a symbol */
-void Huff_transmit (huff_t *huff, int ch, byte *fout) {
+static void transmit (huff_t *huff, int ch, byte *fout, int *offset) {
 	int i;
 	if (huff->loc[ch] == NULL) { 
 		/* node_t hasn't been transmitted, send a NYT, then the symbol */
-		Huff_transmit(huff, NYT, fout);
+		transmit(huff, NYT, fout, offset);
 		for (i = 7; i >= 0; i--) {
-			add_bit((char)((ch >> i) & 0x1), fout);
+			add_bit((char)((ch >> i) & 0x1), fout, offset);
 		}
 	} else {
-		send(huff->loc[ch], NULL, fout);
+		send(huff->loc[ch], NULL, fout, offset);
 	}
 }
 
+/* Send a symbol */
+void Huff_transmit (huff_t *huff, int ch, byte *fout) {
+	transmit(huff, ch, fout, &bloc);
+}
+
 void Huff_offsetTransmit (huff_t *huff, int ch, byte *fout, int *offset) {
-	bloc = *offset;
-	send(huff->loc[ch], NULL, fout);
-	*offset = bloc;
+	send(huff->loc[ch], NULL, fout, offset);
 }
 
 void Huff_Decompress(msg_t *mbuf, int offset) {
-	int			ch, cch, i, j, size;
+	Huff_DecompressFrom(mbuf, offset, NULL);
+}
+
+/* Huff_Decompress starting from the adaptive state dictionary, or from just
+ * the NYT node if it is NULL.  Must match the Huff_CompressFrom dictionary. */
+void Huff_DecompressFrom(msg_t *mbuf, int offset, const huff_t *dictionary) {
+	int			ch, cch, i, j, size, bloc;
 	byte		seq[65536];
 	byte*		buffer;
 	huff_t		huff;
@@ -345,13 +365,17 @@ void Huff_Decompress(msg_t *mbuf, int offset) {
 		return;
 	}
 
-	memset(&huff, 0, sizeof(huff_t));
-	// Initialize the tree & list with the NYT node 
-	huff.tree = huff.lhead = huff.ltail = huff.loc[NYT] = &(huff.nodeList[huff.blocNode++]);
-	huff.tree->symbol = NYT;
-	huff.tree->weight = 0;
-	huff.lhead->next = huff.lhead->prev = NULL;
-	huff.tree->parent = huff.tree->left = huff.tree->right = NULL;
+	if ( dictionary ) {
+		Huff_Copy(&huff, dictionary);
+	} else {
+		memset(&huff, 0, sizeof(huff_t));
+		// Initialize the tree & list with the NYT node 
+		huff.tree = huff.lhead = huff.ltail = huff.loc[NYT] = &(huff.nodeList[huff.blocNode++]);
+		huff.tree->symbol = NYT;
+		huff.tree->weight = 0;
+		huff.lhead->next = huff.lhead->prev = NULL;
+		huff.tree->parent = huff.tree->left = huff.tree->right = NULL;
+	}
 
 	cch = buffer[0]*256 + buffer[1];
 	// don't overflow with bad messages
@@ -368,11 +392,11 @@ void Huff_Decompress(msg_t *mbuf, int offset) {
 			seq[j] = 0;
 			break;
 		}
-		Huff_Receive(huff.tree, &ch, buffer);				/* Get a character */
+		receive(huff.tree, &ch, buffer, &bloc);			/* Get a character */
 		if ( ch == NYT ) {								/* We got a NYT, get the symbol associated with it */
 			ch = 0;
 			for ( i = 0; i < 8; i++ ) {
-				ch = (ch<<1) + get_bit(buffer);
+				ch = (ch<<1) + get_bit(buffer, &bloc);
 			}
 		}
     
@@ -387,7 +411,14 @@ void Huff_Decompress(msg_t *mbuf, int offset) {
 extern 	int oldsize;
 
 void Huff_Compress(msg_t *mbuf, int offset) {
-	int			i, ch, size;
+	Huff_CompressFrom(mbuf, offset, NULL);
+}
+
+/* Huff_Compress starting from the adaptive state dictionary instead of a tree
+ * holding only the NYT node, so bytes it has seen never go out raw.  NULL
+ * gives the plain Huff_Compress output. */
+void Huff_CompressFrom(msg_t *mbuf, int offset, const huff_t *dictionary) {
+	int			i, ch, size, bloc;
 	byte		seq[65536];
 	byte*		buffer;
 	huff_t		huff;
@@ -399,13 +430,17 @@ void Huff_Compress(msg_t *mbuf, int offset) {
 		return;
 	}
 
-	memset(&huff, 0, sizeof(huff_t));
-	// Add the NYT (not yet transmitted) node into the tree/list */
-	huff.tree = huff.lhead = huff.loc[NYT] =  &(huff.nodeList[huff.blocNode++]);
-	huff.tree->symbol = NYT;
-	huff.tree->weight = 0;
-	huff.lhead->next = huff.lhead->prev = NULL;
-	huff.tree->parent = huff.tree->left = huff.tree->right = NULL;
+	if (dictionary) {
+		Huff_Copy(&huff, dictionary);
+	} else {
+		memset(&huff, 0, sizeof(huff_t));
+		// Add the NYT (not yet transmitted) node into the tree/list */
+		huff.tree = huff.lhead = huff.loc[NYT] =  &(huff.nodeList[huff.blocNode++]);
+		huff.tree->symbol = NYT;
+		huff.tree->weight = 0;
+		huff.lhead->next = huff.lhead->prev = NULL;
+		huff.tree->parent = huff.tree->left = huff.tree->right = NULL;
+	}
 
 	seq[0] = (size>>8);
 	seq[1] = size&0xff;
@@ -414,7 +449,7 @@ void Huff_Compress(msg_t *mbuf, int offset) {
 
 	for (i=0; i<size; i++ ) {
 		ch = buffer[i];
-		Huff_transmit(&huff, ch, seq);						/* Transmit symbol */
+		transmit(&huff, ch, seq, &bloc);					/* Transmit symbol */
 		Huff_addRef(&huff, (byte)ch);								/* Do update */
 	}
 
@@ -424,6 +459,363 @@ void Huff_Compress(msg_t *mbuf, int offset) {
 	memcpy(mbuf->data+offset, seq, (bloc>>3));
 }
 
+/* Number of bits send() writes for a node */
+static int codeLength (node_t *node) {
+	int len;
+
+	for (len = 0; node->parent; node = node->parent) {
+		len++;
+	}
+	return len;
+}
+
+/*
+ * Size in bytes Huff_CompressFrom would turn size bytes of data into.  The
+ * adaptive tree is updated exactly as when compressing, but nothing is
+ * written.
+ */
+int Huff_CompressedSize(const byte *data, int size, const huff_t *dictionary) {
+	int			i, ch, bits;
+	huff_t		huff;
+
+	if (size<=0) {
+		return size < 0 ? 0 : size;
+	}
+
+	if (dictionary) {
+		Huff_Copy(&huff, dictionary);
+	} else {
+		memset(&huff, 0, sizeof(huff_t));
+		huff.tree = huff.lhead = huff.loc[NYT] =  &(huff.nodeList[huff.blocNode++]);
+		huff.tree->symbol = NYT;
+		huff.tree->weight = 0;
+		huff.lhead->next = huff.lhead->prev = NULL;
+		huff.tree->parent = huff.tree->left = huff.tree->right = NULL;
+	}
+
+	bits = 16;
+	for (i=0; i<size; i++ ) {
+		ch = data[i];
+		if (huff.loc[ch] == NULL) {
+			bits += codeLength(huff.loc[NYT]) + 8;
+		} else {
+			bits += codeLength(huff.loc[ch]);
+		}
+		Huff_addRef(&huff, (byte)ch);
+	}
+
+	return (bits + 8) >> 3;
+}
+
+/*
+ * Copies an adaptive state.  The nodes point at each other, and at block
+ * heads in nodePtrs, but never outside the huff_t, so every pointer moves by
+ * the same distance.  Only the nodes and heads handed out so far are copied;
+ * get_ppnode and Huff_addRef fill in the rest before use.
+ */
+void Huff_Copy(huff_t *dst, const huff_t *src) {
+	const node_t	*from;
+	node_t			*node;
+	ptrdiff_t		delta;
+	int				i;
+
+#define RELOCATE(p) ((p) ? (void *)((char *)(p) + delta) : NULL)
+	delta = (char *)dst - (const char *)src;
+	dst->blocNode = src->blocNode;
+	dst->blocPtrs = src->blocPtrs;
+	dst->tree = RELOCATE(src->tree);
+	dst->lhead = RELOCATE(src->lhead);
+	dst->ltail = RELOCATE(src->ltail);
+	dst->freelist = RELOCATE(src->freelist);
+	for (i = 0; i < HMAX+1; i++) {
+		dst->loc[i] = RELOCATE(src->loc[i]);
+	}
+	for (i = 0; i < src->blocNode; i++) {
+		from = &src->nodeList[i];
+		node = &dst->nodeList[i];
+		node->left = RELOCATE(from->left);
+		node->right = RELOCATE(from->right);
+		node->parent = RELOCATE(from->parent);
+		node->next = RELOCATE(from->next);
+		node->prev = RELOCATE(from->prev);
+		node->head = RELOCATE(from->head);
+		node->weight = from->weight;
+		node->symbol = from->symbol;
+	}
+	for (i = 0; i < src->blocPtrs; i++) {
+		dst->nodePtrs[i] = RELOCATE(src->nodePtrs[i]);
+	}
+#undef RELOCATE
+}
+
+/*
+ * Builds the adaptive state a compressor would have after seeing histogram[i]
+ * copies of each byte i, for use as a Huff_CompressFrom dictionary.  Totals
+ * above HUFF_DICT_MAX_REFS are scaled down so messages can still shift the
+ * tree; bytes with a zero count stay behind the NYT node.
+ */
+void Huff_InitDictionary(huff_t *huff, const int *histogram) {
+	double		total, scale;
+	int			i, j, count;
+
+	total = 0;
+	for (i = 0; i < 256; i++) {
+		total += histogram[i] > 0 ? histogram[i] : 0;
+	}
+	scale = total > HUFF_DICT_MAX_REFS ? HUFF_DICT_MAX_REFS / total : 1.0;
+
+	memset(huff, 0, sizeof(huff_t));
+	huff->tree = huff->lhead = huff->ltail = huff->loc[NYT] = &(huff->nodeList[huff->blocNode++]);
+	huff->tree->symbol = NYT;
+	huff->tree->weight = 0;
+	huff->lhead->next = huff->lhead->prev = NULL;
+	huff->tree->parent = huff->tree->left = huff->tree->right = NULL;
+
+	for (i = 0; i < 256; i++) {
+		if (histogram[i] <= 0) {
+			continue;
+		}
+		count = (int)(histogram[i] * scale);
+		if (count < 1) {
+			count = 1;
+		}
+		for (j = 0; j < count; j++) {
+			Huff_addRef(huff, (byte)i);
+		}
+	}
+}
+
+/*
+ * Adaptive state blobs.  Nodes are numbered by rank (their place in the
+ * list, starting at the NYT node), which makes next/prev implicit, and each
+ * is stored as
+ *
+ *   symbol (2)  weight (4)  head block (2)  [left (2)  right (2)]
+ *
+ * with the children only for internal nodes.  Parents, loc and the root
+ * follow from the children.  Block heads are numbered by first use and
+ * listed after the nodes with the node each points at.  Everything is
+ * little endian, 0xffff stands for none.
+ */
+#define HUFF_STATE_VERSION	1
+#define HUFF_NONE			0xffff
+
+static void putShort(byte *p, int v) {
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static int getShort(const byte *p) {
+	return p[0] | (p[1] << 8);
+}
+
+/* Writes the state of huff to data, returns the length or -1 if size is
+ * too small.  HUFF_STATE_MAX_SIZE is always enough. */
+int Huff_Serialize(const huff_t *huff, byte *data, int size) {
+	const node_t	*node;
+	node_t			**heads[2*HMAX+1];
+	int				rank[768];
+	int				i, j, count, numHeads, pos;
+
+	count = 0;
+	for (node = huff->lhead; node; node = node->next) {
+		if (count == 2*HMAX+1) {
+			return -1;	// not a valid state
+		}
+		rank[node - huff->nodeList] = count++;
+	}
+
+	numHeads = 0;
+	pos = 3;
+	for (node = huff->lhead; node; node = node->next) {
+		if (pos + 12 > size) {
+			return -1;
+		}
+		putShort(data + pos, node->symbol);
+		data[pos+2] = node->weight & 0xff;
+		data[pos+3] = (node->weight >> 8) & 0xff;
+		data[pos+4] = (node->weight >> 16) & 0xff;
+		data[pos+5] = (node->weight >> 24) & 0xff;
+		j = HUFF_NONE;
+		if (node->head) {
+			for (j = 0; j < numHeads && heads[j] != node->head; j++) {
+			}
+			if (j == numHeads) {
+				heads[numHeads++] = node->head;
+			}
+		}
+		putShort(data + pos + 6, j);
+		pos += 8;
+		if (node->symbol == INTERNAL_NODE) {
+			putShort(data + pos, rank[node->left - huff->nodeList]);
+			putShort(data + pos + 2, rank[node->right - huff->nodeList]);
+			pos += 4;
+		}
+	}
+
+	if (pos + 2 + 2*numHeads > size) {
+		return -1;
+	}
+	data[0] = HUFF_STATE_VERSION;
+	putShort(data + 1, count);
+	putShort(data + pos, numHeads);
+	pos += 2;
+	for (i = 0; i < numHeads; i++) {
+		node = *heads[i];
+		// a head slot holds a node, or chains the free list once released
+		if (node >= huff->nodeList && node < huff->nodeList + 768) {
+			putShort(data + pos, rank[node - huff->nodeList]);
+		} else {
+			putShort(data + pos, HUFF_NONE);
+		}
+		pos += 2;
+	}
+	return pos;
+}
+
+/* Rebuilds a state written by Huff_Serialize, returns qfalse and leaves huff
+ * unusable if data is not one. */
+qboolean Huff_Deserialize(huff_t *huff, const byte *data, int size) {
+	node_t	*node, *child;
+	int		i, j, count, numHeads, pos, v;
+
+	memset(huff, 0, sizeof(huff_t));
+	if (size < 5 || data[0] != HUFF_STATE_VERSION) {
+		return qfalse;
+	}
+	count = getShort(data + 1);
+	if (count < 1 || count > 2*HMAX+1) {
+		return qfalse;
+	}
+
+	// nodes, in rank order
+	pos = 3;
+	for (i = 0; i < count; i++) {
+		if (pos + 8 > size) {
+			return qfalse;
+		}
+		node = &huff->nodeList[i];
+		node->symbol = getShort(data + pos);
+		node->weight = (int)((unsigned)data[pos+2] | ((unsigned)data[pos+3] << 8) |
+			((unsigned)data[pos+4] << 16) | ((unsigned)data[pos+5] << 24));
+		v = getShort(data + pos + 6);
+		if (v != HUFF_NONE) {
+			if (v >= count) {
+				return qfalse;
+			}
+			node->head = &huff->nodePtrs[v];
+		} else if (i != 0) {
+			return qfalse;	// only the NYT node has no block
+		}
+		node->prev = i > 0 ? &huff->nodeList[i-1] : NULL;
+		node->next = i < count-1 ? &huff->nodeList[i+1] : NULL;
+		pos += 8;
+
+		if (node->symbol == INTERNAL_NODE) {
+			if (pos + 4 > size) {
+				return qfalse;
+			}
+			for (j = 0; j < 2; j++) {
+				v = getShort(data + pos + 2*j);
+				if (v >= count || v == i) {
+					return qfalse;
+				}
+				child = &huff->nodeList[v];
+				if (child->parent) {
+					return qfalse;
+				}
+				child->parent = node;
+				if (j == 0) {
+					node->left = child;
+				} else {
+					node->right = child;
+				}
+			}
+			pos += 4;
+		} else if (node->symbol >= 0 && node->symbol <= NYT) {
+			if (huff->loc[node->symbol] || (node->symbol == NYT) != (i == 0)) {
+				return qfalse;
+			}
+			huff->loc[node->symbol] = node;
+		} else {
+			return qfalse;
+		}
+	}
+
+	// block heads
+	if (pos + 2 > size) {
+		return qfalse;
+	}
+	numHeads = getShort(data + pos);
+	pos += 2;
+	if (numHeads > count || pos + 2*numHeads != size) {
+		return qfalse;
+	}
+	for (i = 0; i < numHeads; i++) {
+		v = getShort(data + pos + 2*i);
+		if (v != HUFF_NONE && v >= count) {
+			return qfalse;
+		}
+		huff->nodePtrs[i] = v == HUFF_NONE ? NULL : &huff->nodeList[v];
+	}
+	for (i = 1; i < count; i++) {
+		if (*huff->nodeList[i].head == NULL) {
+			return qfalse;
+		}
+	}
+
+	// exactly one root that every node hangs off
+	for (i = 0; i < count; i++) {
+		if (!huff->nodeList[i].parent) {
+			if (huff->tree) {
+				return qfalse;
+			}
+			huff->tree = &huff->nodeList[i];
+		}
+	}
+	if (!huff->tree) {
+		return qfalse;
+	}
+	for (i = 0; i < count; i++) {
+		j = 0;
+		for (node = &huff->nodeList[i]; node->parent; node = node->parent) {
+			if (++j >= count) {
+				return qfalse;	// a loop of parents
+			}
+		}
+	}
+
+	// the ranks must be those the coder keeps: weights never decrease along
+	// the list, parents rank above their children and weigh their sum, and
+	// each run of equal weights shares a head pointing at its last node
+	for (i = 0; i < count; i++) {
+		node = &huff->nodeList[i];
+		if (i == 0 ? node->weight != 0 : node->weight < 1) {
+			return qfalse;
+		}
+		if (node->next && node->next->weight < node->weight) {
+			return qfalse;
+		}
+		if (node->symbol == INTERNAL_NODE) {
+			if (node->left >= node || node->right >= node ||
+				(long long)node->left->weight + node->right->weight != node->weight) {
+				return qfalse;
+			}
+		}
+		if (i > 1 && (node->head == node->prev->head) != (node->weight == node->prev->weight)) {
+			return qfalse;
+		}
+		if (i > 0 && (!node->next || node->next->weight != node->weight) && *node->head != node) {
+			return qfalse;
+		}
+	}
+
+	huff->blocNode = count;
+	huff->blocPtrs = numHeads;
+	huff->lhead = huff->ltail = huff->loc[NYT] = &huff->nodeList[0];
+	return qtrue;
+}
+
 void Huff_Init(huffman_t *huff) {
 
 	memset(&huff->compressor, 0, sizeof(huff_t));
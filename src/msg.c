@@ -23,7 +23,9 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #include "q_shared.h"
 #include "qcommon.h"
 
-static huffman_t		msgHuff;
+static msgHuffTable_t	msgHuff;
+
+#define	MSG_TABLE(msg)	( (msg)->table ? (msg)->table : &msgHuff )
 
 static qboolean			msgInit = qfalse;
 
@@ -96,17 +98,30 @@ bit functions
 =============================================================================
 */
 
+/*
+==================
+MSG_RemainingBits
+
+Bits that can still be written without overflowing.  cursize always
+counts the byte at the bit cursor, so that byte has to fit too.
+==================
+*/
+int MSG_RemainingBits( msg_t *msg ) {
+	int		remaining;
+
+	if ( msg->oob ) {
+		remaining = ( msg->maxsize - msg->cursize ) << 3;
+	} else {
+		remaining = ( msg->maxsize << 3 ) - 1 - msg->bit;
+	}
+	return remaining < 0 ? 0 : remaining;
+}
+
 // negative bit values include signs
 void MSG_WriteBits( msg_t *msg, int value, int bits ) {
-	int	i;
+	int	i, remaining;
 //	FILE*	fp;
 
-	// this isn't an exact overflow check, but close enough
-	if ( msg->maxsize - msg->cursize < 4 ) {
-		msg->overflowed = qtrue;
-		return;
-	}
-
 	if ( bits == 0 || bits < -31 || bits > 32 ) {
 		return; //Com_Error( ERR_DROP, "MSG_WriteBits: bad bits %i", bits );
 	}
@@ -114,6 +129,16 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 	if ( bits < 0 ) {
 		bits = -bits;
 	}
+
+	// exact overflow check, the value is only sized near the end of the buffer
+	remaining = MSG_RemainingBits( msg );
+	if ( msg->oob ? bits > remaining :
+		remaining < 32 + 4 * MSG_TABLE( msg )->maxCodeLen &&
+		MSG_TableBitsCost( MSG_TABLE( msg ), value, bits ) > remaining ) {
+		msg->overflowed = qtrue;
+		return;
+	}
+
 	if (msg->oob) {
 		if(bits==8)
 		{
@@ -152,7 +177,7 @@ void MSG_WriteBits( msg_t *msg, int value, int bits ) {
 		if (bits) {
 			for(i=0;i<bits;i+=8) {
 //				fwrite(bp, 1, 1, fp);
-				Huff_offsetTransmit (&msgHuff.compressor, (value&0xff), msg->data, &msg->bit);
+				Huff_offsetTransmit (&MSG_TABLE( msg )->huff.compressor, (value&0xff), msg->data, &msg->bit);
 				value = (value>>8);
 			}
 		}
@@ -178,6 +203,11 @@ int MSG_ReadBits( msg_t *msg, int bits ) {
 	}
 
 	if (msg->oob) {
+		if (msg->readcount + (bits>>3) > msg->cursize) {
+			msg->readcount = msg->cursize + 1;
+			return 0;
+		}
+
 		if(bits==8)
 		{
 			value = msg->data[msg->readcount];
@@ -205,6 +235,10 @@ int MSG_ReadBits( msg_t *msg, int bits ) {
 		nbits = 0;
 		if (bits&7) {
 			nbits = bits&7;
+			if (msg->bit + nbits > msg->cursize << 3) {
+				msg->readcount = msg->cursize + 1;
+				return 0;
+			}
 			for(i=0;i<nbits;i++) {
 				value |= (Huff_getBit(msg->data, &msg->bit)<<i);
 			}
@@ -213,9 +247,13 @@ int MSG_ReadBits( msg_t *msg, int bits ) {
 		if (bits) {
 //			fp = fopen("c:\\netchan.bin", "a");
 			for(i=0;i<bits;i+=8) {
-				Huff_offsetReceive (msgHuff.decompressor.tree, &get, msg->data, &msg->bit);
+				Huff_offsetReceive (MSG_TABLE( msg )->huff.decompressor.tree, &get, msg->data, &msg->bit, msg->cursize<<3);
 //				fwrite(&get, 1, 1, fp);
 				value |= (get<<(i+nbits));
+				if (msg->bit > msg->cursize<<3) {
+					msg->readcount = msg->cursize + 1;
+					return 0;
+				}
 			}
 //			fclose(fp);
 		}
@@ -232,6 +270,98 @@ int MSG_ReadBits( msg_t *msg, int bits ) {
 
 
 
+/*
+==================
+MSG_Truncate
+
+Moves the write position back to an earlier bit and cursize.  The bits
+past it in the partially written byte are cleared, since the bit writers
+only OR into a byte once they are past its first bit, and so are the
+dropped bytes, as cursize counts a byte the bit writers may never touch.
+==================
+*/
+void MSG_Truncate( msg_t *msg, int bit, int cursize ) {
+	int		pos;
+
+	pos = bit >> 3;
+	if ( pos < msg->cursize ) {
+		if ( bit & 7 ) {
+			msg->data[pos++] &= ( 1 << ( bit & 7 ) ) - 1;
+		}
+		memset( msg->data + pos, 0, msg->cursize - pos );
+	}
+	msg->bit = bit;
+	msg->cursize = cursize;
+}
+
+// the bitstream is LSB first, so eight bytes read little endian are 64 bits in order
+static uint64_t MSG_LoadBits64( const byte *p ) {
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+		(uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static void MSG_StoreBits64( byte *p, uint64_t w ) {
+	int		i;
+
+	for ( i = 0 ; i < 8 ; i++, w >>= 8 ) {
+		p[i] = (byte)w;
+	}
+}
+
+/*
+==================
+MSG_AppendBits
+
+Appends bits already written by MSG_WriteBits to another bitstream, so the
+huffman codes are copied as they are rather than encoded again.  Unaligned
+appends are shifted into place 64 bits at a time.
+==================
+*/
+void MSG_AppendBits( msg_t *msg, const byte *data, int bits ) {
+	int			i, pos, last, shift, nbytes;
+	uint64_t	w, carry;
+
+	if ( bits <= 0 ) {
+		return;
+	}
+
+	if ( ( ( msg->bit + bits ) >> 3 ) + 1 > msg->maxsize ) {
+		msg->overflowed = qtrue;
+		return;
+	}
+
+	pos = msg->bit >> 3;
+	last = ( msg->bit + bits - 1 ) >> 3;
+	shift = msg->bit & 7;
+	nbytes = ( bits + 7 ) >> 3;
+
+	if ( !shift ) {
+		memcpy( msg->data + pos, data, nbytes );
+	} else {
+		carry = msg->data[pos] & ( ( 1 << shift ) - 1 );
+		for ( i = 0 ; i + 8 <= nbytes ; i += 8 ) {
+			w = MSG_LoadBits64( data + i );
+			MSG_StoreBits64( msg->data + pos + i, ( w << shift ) | carry );
+			carry = w >> ( 64 - shift );
+		}
+		for ( ; i < nbytes ; i++ ) {
+			msg->data[pos + i] = (byte)( ( data[i] << shift ) | carry );
+			carry = data[i] >> ( 8 - shift );
+		}
+		if ( pos + nbytes <= last ) {
+			msg->data[pos + nbytes] = (byte)carry;
+		}
+	}
+
+	msg->bit += bits;
+	// Huff_putBit ors into a partial byte, so clear what was copied past the end
+	if ( msg->bit & 7 ) {
+		msg->data[msg->bit >> 3] &= ( 1 << ( msg->bit & 7 ) ) - 1;
+	}
+	msg->cursize = ( msg->bit >> 3 ) + 1;
+}
+
+
 //================================================================================
 
 //
@@ -418,7 +548,7 @@ float MSG_ReadFloat( msg_t *msg ) {
 }
 
 char *MSG_ReadString( msg_t *msg ) {
-	static char	string[MAX_STRING_CHARS];
+	static Q_THREADLOCAL char	string[MAX_STRING_CHARS];
 	int		l,c;
 
 	l = 0;
@@ -446,7 +576,7 @@ char *MSG_ReadString( msg_t *msg ) {
 }
 
 char *MSG_ReadBigString( msg_t *msg ) {
-	static char	string[BIG_INFO_STRING];
+	static Q_THREADLOCAL char	string[BIG_INFO_STRING];
 	int		l,c;
 
 	l = 0;
@@ -474,7 +604,7 @@ char *MSG_ReadBigString( msg_t *msg ) {
 }
 
 char *MSG_ReadStringLine( msg_t *msg ) {
-	static char	string[MAX_STRING_CHARS];
+	static Q_THREADLOCAL char	string[MAX_STRING_CHARS];
 	int		l,c;
 
 	l = 0;
@@ -637,6 +767,1070 @@ float MSG_ReadDeltaKeyFloat( msg_t *msg, int key, float oldV ) {
 	return oldV;
 }
 
+/*
+============================================================================
+
+entityState_t communication
+  
+============================================================================
+*/
+
+typedef struct {
+	char	*name;
+	int		offset;
+	int		bits;		// 0 = float
+} netField_t;
+
+// using the stringizing operator to save typing...
+#define	NETF(x) #x,(size_t)&((entityState_t*)0)->x
+
+static netField_t	entityStateFields[] = 
+{
+{ NETF(pos.trTime), 32 },
+{ NETF(pos.trBase[0]), 0 },
+{ NETF(pos.trBase[1]), 0 },
+{ NETF(pos.trDelta[0]), 0 },
+{ NETF(pos.trDelta[1]), 0 },
+{ NETF(pos.trBase[2]), 0 },
+{ NETF(apos.trBase[1]), 0 },
+{ NETF(pos.trDelta[2]), 0 },
+{ NETF(apos.trBase[0]), 0 },
+{ NETF(event), 10 },
+{ NETF(angles2[1]), 0 },
+{ NETF(eType), 8 },
+{ NETF(torsoAnim), 8 },
+{ NETF(eventParm), 8 },
+{ NETF(legsAnim), 8 },
+{ NETF(groundEntityNum), GENTITYNUM_BITS },
+{ NETF(pos.trType), 8 },
+{ NETF(eFlags), 19 },
+{ NETF(otherEntityNum), GENTITYNUM_BITS },
+{ NETF(weapon), 8 },
+{ NETF(clientNum), 8 },
+{ NETF(angles[1]), 0 },
+{ NETF(pos.trDuration), 32 },
+{ NETF(apos.trType), 8 },
+{ NETF(origin[0]), 0 },
+{ NETF(origin[1]), 0 },
+{ NETF(origin[2]), 0 },
+{ NETF(solid), 24 },
+{ NETF(powerups), MAX_POWERUPS },
+{ NETF(modelindex), 8 },
+{ NETF(otherEntityNum2), GENTITYNUM_BITS },
+{ NETF(loopSound), 8 },
+{ NETF(generic1), 8 },
+{ NETF(origin2[2]), 0 },
+{ NETF(origin2[0]), 0 },
+{ NETF(origin2[1]), 0 },
+{ NETF(modelindex2), 8 },
+{ NETF(angles[0]), 0 },
+{ NETF(time), 32 },
+{ NETF(apos.trTime), 32 },
+{ NETF(apos.trDuration), 32 },
+{ NETF(apos.trBase[2]), 0 },
+{ NETF(apos.trDelta[0]), 0 },
+{ NETF(apos.trDelta[1]), 0 },
+{ NETF(apos.trDelta[2]), 0 },
+{ NETF(time2), 32 },
+{ NETF(angles[2]), 0 },
+{ NETF(angles2[0]), 0 },
+{ NETF(angles2[2]), 0 },
+{ NETF(constantLight), 32 },
+{ NETF(frame), 16 }
+};
+
+// if (int)f == f and (int)f + ( 1<<(FLOAT_INT_BITS-1) ) < ( 1 << FLOAT_INT_BITS )
+// the float will be sent with FLOAT_INT_BITS, otherwise all 32 bits will be sent
+#define	FLOAT_INT_BITS	13
+#define	FLOAT_INT_BIAS	(1<<(FLOAT_INT_BITS-1))
+
+/*
+=============================================================================
+
+entity change masks
+
+The entity state is compared as 52 raw 32 bit words, a vector at a time, which
+gives a mask in struct order.  That mask is then translated to entityStateFields
+order one byte at a time through lookup tables built by MSG_initChangeMasks.
+
+=============================================================================
+*/
+
+#define ENTITY_WORDS		(int)(sizeof(entityState_t)/4)
+#define ENTITY_MASK_BYTES	((ENTITY_WORDS+7)/8)
+
+// the word mask is a uint64_t, and the kernels compare whole words
+typedef char entityWordsCheck[( sizeof(entityState_t) % 4 == 0 && ENTITY_WORDS <= 64 ) ? 1 : -1];
+
+static uint64_t		entityFieldMask[ENTITY_MASK_BYTES][256];
+static byte			entityLastField[ENTITY_MASK_BYTES][256];
+
+// compares the words from first on one at a time, for what the vectors leave
+static uint64_t MSG_EntityWordMaskWords( const entityState_t *from, const entityState_t *to, int first ) {
+	const int	*fromW = (const int *)from;
+	const int	*toW = (const int *)to;
+	uint64_t	mask;
+	int			i;
+
+	mask = 0;
+	for ( i = first ; i < ENTITY_WORDS ; i++ ) {
+		if ( fromW[i] != toW[i] ) {
+			mask |= (uint64_t)1 << i;
+		}
+	}
+	return mask;
+}
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+
+static uint64_t MSG_EntityWordMaskSSE2( const entityState_t *from, const entityState_t *to ) {
+	const __m128i	*fromV = (const __m128i *)from;
+	const __m128i	*toV = (const __m128i *)to;
+	uint64_t		mask;
+	int				i, eq;
+
+	mask = 0;
+	for ( i = 0 ; i < ENTITY_WORDS/4 ; i++ ) {
+		eq = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32(
+				_mm_loadu_si128( fromV + i ), _mm_loadu_si128( toV + i ) ) ) );
+		mask |= (uint64_t)(eq ^ 0xf) << (i*4);
+	}
+	return mask | MSG_EntityWordMaskWords( from, to, i*4 );
+}
+#define MSG_EntityWordMaskDefault MSG_EntityWordMaskSSE2
+#else
+static uint64_t MSG_EntityWordMaskScalar( const entityState_t *from, const entityState_t *to ) {
+	return MSG_EntityWordMaskWords( from, to, 0 );
+}
+#define MSG_EntityWordMaskDefault MSG_EntityWordMaskScalar
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+// built for AVX2 regardless of the compiler flags, and only selected at
+// runtime when the CPU supports it
+__attribute__((target("avx2")))
+static uint64_t MSG_EntityWordMaskAVX2( const entityState_t *from, const entityState_t *to ) {
+	const __m256i	*fromV = (const __m256i *)from;
+	const __m256i	*toV = (const __m256i *)to;
+	uint64_t		mask;
+	int				i, eq;
+
+	mask = 0;
+	for ( i = 0 ; i < ENTITY_WORDS/8 ; i++ ) {
+		eq = _mm256_movemask_ps( _mm256_castsi256_ps( _mm256_cmpeq_epi32(
+				_mm256_loadu_si256( fromV + i ), _mm256_loadu_si256( toV + i ) ) ) );
+		mask |= (uint64_t)(eq ^ 0xff) << (i*8);
+	}
+	i *= 8;
+
+	// a half vector if ENTITY_WORDS % 8 leaves room for one, then single words
+	if ( ENTITY_WORDS % 8 >= 4 ) {
+		eq = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpeq_epi32(
+				_mm_loadu_si128( (const __m128i *)( (const int *)from + i ) ),
+				_mm_loadu_si128( (const __m128i *)( (const int *)to + i ) ) ) ) );
+		mask |= (uint64_t)(eq ^ 0xf) << i;
+		i += 4;
+	}
+	return mask | MSG_EntityWordMaskWords( from, to, i );
+}
+#endif
+
+static uint64_t (*MSG_EntityWordMask)( const entityState_t *from, const entityState_t *to ) = MSG_EntityWordMaskDefault;
+
+static void MSG_initChangeMasks( void ) {
+	int		word, field, b, i;
+	int		fieldOfWord[ENTITY_MASK_BYTES*8];
+
+	for ( word = 0 ; word < ENTITY_MASK_BYTES*8 ; word++ ) {
+		fieldOfWord[word] = -1;		// entityState_t::number isn't a field
+	}
+	for ( field = 0 ; field < (int)ARRAY_LEN( entityStateFields ) ; field++ ) {
+		fieldOfWord[entityStateFields[field].offset/4] = field;
+	}
+
+	for ( b = 0 ; b < ENTITY_MASK_BYTES ; b++ ) {
+		for ( i = 0 ; i < 256 ; i++ ) {
+			entityFieldMask[b][i] = 0;
+			entityLastField[b][i] = 0;
+			for ( word = 0 ; word < 8 ; word++ ) {
+				field = fieldOfWord[b*8 + word];
+				if ( !( i & ( 1 << word ) ) || field < 0 ) {
+					continue;
+				}
+				entityFieldMask[b][i] |= (uint64_t)1 << field;
+				if ( field + 1 > entityLastField[b][i] ) {
+					entityLastField[b][i] = field + 1;
+				}
+			}
+		}
+	}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports( "avx2" ) ) {
+		MSG_EntityWordMask = MSG_EntityWordMaskAVX2;
+	}
+#endif
+}
+
+static uint64_t MSG_EntityChangeMask( const entityState_t *from, const entityState_t *to, int *lastChanged ) {
+	uint64_t	wordMask, mask;
+	int			b, lc;
+	byte		bits;
+
+	wordMask = MSG_EntityWordMask( from, to );
+	mask = 0;
+	lc = 0;
+	for ( b = 0 ; b < ENTITY_MASK_BYTES ; b++ ) {
+		bits = (byte)( wordMask >> (b*8) );
+		mask |= entityFieldMask[b][bits];
+		if ( entityLastField[b][bits] > lc ) {
+			lc = entityLastField[b][bits];
+		}
+	}
+	*lastChanged = lc;
+	return mask;
+}
+
+/*
+==================
+MSG_EntityChangeMasks
+
+Fills in, for each of the count pairs of entity states, the mask of
+entityStateFields that differ and the number of fields MSG_WriteDeltaEntity
+will have to send (the index of the last changed field plus one)
+==================
+*/
+void MSG_EntityChangeMasks( const entityState_t *from, const entityState_t *to, int count,
+							uint64_t *masks, int *lastChanged ) {
+	int		i;
+
+	if (!msgInit) {
+		MSG_initHuffman();
+	}
+	for ( i = 0 ; i < count ; i++ ) {
+		masks[i] = MSG_EntityChangeMask( &from[i], &to[i], &lastChanged[i] );
+	}
+}
+
+/*
+==================
+MSG_WriteDeltaEntity
+
+Writes part of a packetentities message, including the entity number.
+Can delta from either a baseline or a previous packet_entity
+If to is NULL, a remove entity update will be sent
+If force is not set, then nothing at all will be generated if the entity is
+identical, under the assumption that the in-order delta code will catch it.
+==================
+*/
+void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entityState_s *to,
+						   qboolean force ) {
+	int			i, lc;
+	uint64_t	changed;
+	netField_t	*field;
+	int			trunc;
+	float		fullFloat;
+	int			*toF;
+
+	// a NULL to is a delta remove message
+	if ( to == NULL ) {
+		if ( from == NULL ) {
+			return;
+		}
+		MSG_WriteBits( msg, from->number, GENTITYNUM_BITS );
+		MSG_WriteBits( msg, 1, 1 );
+		return;
+	}
+
+	if ( to->number < 0 || to->number >= MAX_GENTITIES ) {
+		return; //Com_Error (ERR_FATAL, "MSG_WriteDeltaEntity: Bad entity number: %i", to->number );
+	}
+
+	// build the change vector
+	changed = MSG_EntityChangeMask( from, to, &lc );
+
+	if ( lc == 0 ) {
+		// nothing at all changed
+		if ( !force ) {
+			return;		// nothing at all
+		}
+		// write two bits for no change
+		MSG_WriteBits( msg, to->number, GENTITYNUM_BITS );
+		MSG_WriteBits( msg, 0, 1 );		// not removed
+		MSG_WriteBits( msg, 0, 1 );		// no delta
+		return;
+	}
+
+	MSG_WriteBits( msg, to->number, GENTITYNUM_BITS );
+	MSG_WriteBits( msg, 0, 1 );			// not removed
+	MSG_WriteBits( msg, 1, 1 );			// we have a delta
+
+	MSG_WriteByte( msg, lc );	// # of changes
+
+	for ( i = 0, field = entityStateFields ; i < lc ; i++, field++ ) {
+		if ( !( changed & ( (uint64_t)1 << i ) ) ) {
+			MSG_WriteBits( msg, 0, 1 );	// no change
+			continue;
+		}
+
+		toF = (int *)( (byte *)to + field->offset );
+
+		MSG_WriteBits( msg, 1, 1 );	// changed
+
+		if ( field->bits == 0 ) {
+			// float
+			fullFloat = *(float *)toF;
+			trunc = (int)fullFloat;
+
+			if (fullFloat == 0.0f) {
+				MSG_WriteBits( msg, 0, 1 );
+			} else {
+				MSG_WriteBits( msg, 1, 1 );
+				if ( trunc == fullFloat && trunc + FLOAT_INT_BIAS >= 0 && 
+					trunc + FLOAT_INT_BIAS < ( 1 << FLOAT_INT_BITS ) ) {
+					// send as small integer
+					MSG_WriteBits( msg, 0, 1 );
+					MSG_WriteBits( msg, trunc + FLOAT_INT_BIAS, FLOAT_INT_BITS );
+				} else {
+					// send as full floating point value
+					MSG_WriteBits( msg, 1, 1 );
+					MSG_WriteBits( msg, *toF, 32 );
+				}
+			}
+		} else {
+			if (*toF == 0) {
+				MSG_WriteBits( msg, 0, 1 );
+			} else {
+				MSG_WriteBits( msg, 1, 1 );
+				// integer
+				MSG_WriteBits( msg, *toF, field->bits );
+			}
+		}
+	}
+}
+
+/*
+=============================================================================
+
+bit costs
+
+The message huffman trees never change once they are built, so the number
+of bits MSG_WriteBits spends on a value only depends on the value: the raw
+odd bits plus the code length of every whole byte.  The code lengths are
+read off each tree once, which lets the server size updates without
+encoding them.
+
+=============================================================================
+*/
+
+/*
+==================
+MSG_InitHuffTable
+
+Builds a compressor/decompressor pair the way msgHuff is built, from a
+histogram of 256 byte counts.  Every byte gets a count of at least one so
+it has a code, and large histograms are scaled down to MSG_HUFF_MAX_REFS
+references to keep building cheap.
+==================
+*/
+void MSG_InitHuffTable( msgHuffTable_t *table, const int *histogram ) {
+	static int	lastId;
+	node_t		*node;
+	double		total, scale;
+	int			i, j, count, len;
+
+	total = 0;
+	for ( i = 0 ; i < 256 ; i++ ) {
+		total += histogram[i] > 1 ? histogram[i] : 1;
+	}
+	scale = total > MSG_HUFF_MAX_REFS ? MSG_HUFF_MAX_REFS / total : 1.0;
+
+	Huff_Init( &table->huff );
+	for ( i = 0 ; i < 256 ; i++ ) {
+		count = (int)( histogram[i] * scale );
+		if ( count < 1 ) {
+			count = 1;
+		}
+		for ( j = 0 ; j < count ; j++ ) {
+			Huff_addRef( &table->huff.compressor, (byte)i );		// Do update
+			Huff_addRef( &table->huff.decompressor, (byte)i );		// Do update
+		}
+	}
+
+	table->maxCodeLen = 0;
+	for ( i = 0 ; i < 256 ; i++ ) {
+		len = 0;
+		for ( node = table->huff.compressor.loc[i] ; node && node->parent ; node = node->parent ) {
+			len++;
+		}
+		table->codeLen[i] = len;
+		if ( len > table->maxCodeLen ) {
+			table->maxCodeLen = len;
+		}
+	}
+	table->id = table == &msgHuff ? 0 : ++lastId;
+}
+
+/*
+==================
+MSG_TableBitsCost
+
+Number of bits MSG_WriteBits( msg, value, bits ) adds to a compressed message
+using table
+==================
+*/
+int MSG_TableBitsCost( const msgHuffTable_t *table, int value, int bits ) {
+	unsigned	v;
+	int			i, cost;
+
+	if ( bits == 0 || bits < -31 || bits > 32 ) {
+		return 0;
+	}
+	if ( bits < 0 ) {
+		bits = -bits;
+	}
+
+	v = (unsigned)value & (0xffffffff>>(32-bits));
+	cost = bits&7;
+	v >>= cost;
+	for ( i = cost ; i < bits ; i += 8 ) {
+		cost += table->codeLen[v & 0xff];
+		v >>= 8;
+	}
+	return cost;
+}
+
+/*
+==================
+MSG_BitsCost
+
+Same as MSG_TableBitsCost, for the default msgHuff tables
+==================
+*/
+int MSG_BitsCost( int value, int bits ) {
+	if (!msgInit) {
+		MSG_initHuffman();
+	}
+	return MSG_TableBitsCost( &msgHuff, value, bits );
+}
+
+/*
+==================
+MSG_DataCost
+
+Number of bits MSG_WriteData( msg, data, length ) adds to a compressed message
+using table, NULL for msgHuff
+==================
+*/
+int MSG_DataCost( const msgHuffTable_t *table, const void *data, int length ) {
+	const byte	*p;
+	int			i, cost;
+
+	if (!msgInit) {
+		MSG_initHuffman();
+	}
+	if ( !table ) {
+		table = &msgHuff;
+	}
+
+	cost = 0;
+	for ( i = 0, p = data ; i < length ; i++ ) {
+		cost += table->codeLen[p[i]];
+	}
+	return cost;
+}
+
+/*
+==================
+MSG_DeltaEntityCost
+
+Number of bits MSG_WriteDeltaEntity( msg, from, to, force ) would write
+with table, NULL for msgHuff
+==================
+*/
+int MSG_DeltaEntityCost( const msgHuffTable_t *table, const entityState_t *from, const entityState_t *to,
+						 qboolean force ) {
+	int					i, lc, cost;
+	uint64_t			changed;
+	const netField_t	*field;
+	int					trunc;
+	float				fullFloat;
+	const int			*toF;
+
+	if (!msgInit) {
+		MSG_initHuffman();
+	}
+	if ( !table ) {
+		table = &msgHuff;
+	}
+
+	if ( to == NULL ) {
+		if ( from == NULL ) {
+			return 0;
+		}
+		return MSG_TableBitsCost( table, from->number, GENTITYNUM_BITS ) + 1;
+	}
+
+	if ( to->number < 0 || to->number >= MAX_GENTITIES ) {
+		return 0;
+	}
+
+	changed = MSG_EntityChangeMask( from, to, &lc );
+
+	if ( lc == 0 ) {
+		if ( !force ) {
+			return 0;
+		}
+		return MSG_TableBitsCost( table, to->number, GENTITYNUM_BITS ) + 2;
+	}
+
+	cost = MSG_TableBitsCost( table, to->number, GENTITYNUM_BITS ) + 2;
+	cost += MSG_TableBitsCost( table, lc, 8 );
+
+	for ( i = 0, field = entityStateFields ; i < lc ; i++, field++ ) {
+		cost++;		// changed bit
+		if ( !( changed & ( (uint64_t)1 << i ) ) ) {
+			continue;
+		}
+
+		toF = (const int *)( (const byte *)to + field->offset );
+		cost++;		// zero bit
+
+		if ( field->bits == 0 ) {
+			fullFloat = *(const float *)toF;
+			trunc = (int)fullFloat;
+
+			if ( fullFloat != 0.0f ) {
+				if ( trunc == fullFloat && trunc + FLOAT_INT_BIAS >= 0 && 
+					trunc + FLOAT_INT_BIAS < ( 1 << FLOAT_INT_BITS ) ) {
+					cost += 1 + MSG_TableBitsCost( table, trunc + FLOAT_INT_BIAS, FLOAT_INT_BITS );
+				} else {
+					cost += 1 + MSG_TableBitsCost( table, *toF, 32 );
+				}
+			}
+		} else if ( *toF != 0 ) {
+			cost += MSG_TableBitsCost( table, *toF, field->bits );
+		}
+	}
+	return cost;
+}
+
+/*
+==================
+MSG_ReadDeltaEntity
+
+The entity number has already been read from the message, which
+is how the from state is identified.
+
+If the delta removes the entity, entityState_t->number will be set to MAX_GENTITIES-1
+
+Can go from either a baseline or a previous packet_entity
+==================
+*/
+void MSG_ReadDeltaEntity( msg_t *msg, entityState_t *from, entityState_t *to, 
+						 int number) {
+	int			i, lc;
+	int			numFields;
+	netField_t	*field;
+	int			*fromF, *toF;
+	int			trunc;
+
+	if ( number < 0 || number >= MAX_GENTITIES) {
+		return; //Com_Error( ERR_DROP, "Bad delta entity number: %i", number );
+	}
+
+	// check for a remove
+	if ( MSG_ReadBits( msg, 1 ) == 1 ) {
+		memset( to, 0, sizeof( *to ) );	
+		to->number = MAX_GENTITIES - 1;
+		return;
+	}
+
+	// check for no delta
+	if ( MSG_ReadBits( msg, 1 ) == 0 ) {
+		*to = *from;
+		to->number = number;
+		return;
+	}
+
+	numFields = ARRAY_LEN( entityStateFields );
+	lc = MSG_ReadByte(msg);
+
+	if ( lc > numFields || lc < 0 ) {
+		return; //Com_Error( ERR_DROP, "invalid entityState field count" );
+	}
+
+	to->number = number;
+
+	for ( i = 0, field = entityStateFields ; i < lc ; i++, field++ ) {
+		fromF = (int *)( (byte *)from + field->offset );
+		toF = (int *)( (byte *)to + field->offset );
+
+		if ( ! MSG_ReadBits( msg, 1 ) ) {
+			// no change
+			*toF = *fromF;
+		} else {
+			if ( field->bits == 0 ) {
+				// float
+				if ( MSG_ReadBits( msg, 1 ) == 0 ) {
+					*(float *)toF = 0.0f; 
+				} else {
+					if ( MSG_ReadBits( msg, 1 ) == 0 ) {
+						// integral float
+						trunc = MSG_ReadBits( msg, FLOAT_INT_BITS );
+						// bias to allow equal parts positive and negative
+						trunc -= FLOAT_INT_BIAS;
+						*(float *)toF = trunc; 
+					} else {
+						// full floating point value
+						*toF = MSG_ReadBits( msg, 32 );
+					}
+				}
+			} else {
+				if ( MSG_ReadBits( msg, 1 ) == 0 ) {
+					*toF = 0;
+				} else {
+					// integer
+					*toF = MSG_ReadBits( msg, field->bits );
+				}
+			}
+		}
+	}
+	for ( i = lc, field = &entityStateFields[lc] ; i < numFields ; i++, field++ ) {
+		fromF = (int *)( (byte *)from + field->offset );
+		toF = (int *)( (byte *)to + field->offset );
+		// no change
+		*toF = *fromF;
+	}
+}
+
+/*
+============================================================================
+
+playerState_t communication
+
+============================================================================
+*/
+
+// using the stringizing operator to save typing...
+#define	PSF(x) #x,(size_t)&((playerState_t*)0)->x
+
+static netField_t	playerStateFields[] = 
+{
+{ PSF(commandTime), 32 },				
+{ PSF(origin[0]), 0 },
+{ PSF(origin[1]), 0 },
+{ PSF(bobCycle), 8 },
+{ PSF(velocity[0]), 0 },
+{ PSF(velocity[1]), 0 },
+{ PSF(viewangles[1]), 0 },
+{ PSF(viewangles[0]), 0 },
+{ PSF(weaponTime), -16 },
+{ PSF(origin[2]), 0 },
+{ PSF(velocity[2]), 0 },
+{ PSF(legsTimer), 8 },
+{ PSF(pm_time), -16 },
+{ PSF(eventSequence), 16 },
+{ PSF(torsoAnim), 8 },
+{ PSF(movementDir), 4 },
+{ PSF(events[0]), 8 },
+{ PSF(legsAnim), 8 },
+{ PSF(events[1]), 8 },
+{ PSF(pm_flags), 16 },
+{ PSF(groundEntityNum), GENTITYNUM_BITS },
+{ PSF(weaponstate), 4 },
+{ PSF(eFlags), 16 },
+{ PSF(externalEvent), 10 },
+{ PSF(gravity), 16 },
+{ PSF(speed), 16 },
+{ PSF(delta_angles[1]), 16 },
+{ PSF(externalEventParm), 8 },
+{ PSF(viewheight), -8 },
+{ PSF(damageEvent), 8 },
+{ PSF(damageYaw), 8 },
+{ PSF(damagePitch), 8 },
+{ PSF(damageCount), 8 },
+{ PSF(generic1), 8 },
+{ PSF(pm_type), 8 },					
+{ PSF(delta_angles[0]), 16 },
+{ PSF(delta_angles[2]), 16 },
+{ PSF(torsoTimer), 12 },
+{ PSF(eventParms[0]), 8 },
+{ PSF(eventParms[1]), 8 },
+{ PSF(clientNum), 8 },
+{ PSF(weapon), 5 },
+{ PSF(viewangles[2]), 0 },
+{ PSF(grapplePoint[0]), 0 },
+{ PSF(grapplePoint[1]), 0 },
+{ PSF(grapplePoint[2]), 0 },
+{ PSF(jumppad_ent), GENTITYNUM_BITS },
+{ PSF(loopSound), 16 }
+};
+
+/*
+=============
+MSG_WriteDeltaPlayerstate
+
+=============
+*/
+void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct playerState_s *to ) {
+	int				i;
+	playerState_t	dummy;
+	int				statsbits;
+	int				persistantbits;
+	int				ammobits;
+	int				powerupbits;
+	int				numFields;
+	netField_t		*field;
+	int				*fromF, *toF;
+	float			fullFloat;
+	int				trunc, lc;
+
+	if (!from) {
+		from = &dummy;
+		memset (&dummy, 0, sizeof(dummy));
+	}
+
+	numFields = ARRAY_LEN( playerStateFields );
+
+	lc = 0;
+	for ( i = 0, field = playerStateFields ; i < numFields ; i++, field++ ) {
+		fromF = (int *)( (byte *)from + field->offset );
+		toF = (int *)( (byte *)to + field->offset );
+		if ( *fromF != *toF ) {
+			lc = i+1;
+		}
+	}
+
+	MSG_WriteByte( msg, lc );	// # of changes
+
+	for ( i = 0, field = playerStateFields ; i < lc ; i++, field++ ) {
+		fromF = (int *)( (byte *)from + field->offset );
+		toF = (int *)( (byte *)to + field->offset );
+
+		if ( *fromF == *toF ) {
+			MSG_WriteBits( msg, 0, 1 );	// no change
+			continue;
+		}
+
+		MSG_WriteBits( msg, 1, 1 );	// changed
+
+		if ( field->bits == 0 ) {
+			// float
+			fullFloat = *(float *)toF;
+			trunc = (int)fullFloat;
+
+			if ( trunc == fullFloat && trunc + FLOAT_INT_BIAS >= 0 && 
+				trunc + FLOAT_INT_BIAS < ( 1 << FLOAT_INT_BITS ) ) {
+				// send as small integer
+				MSG_WriteBits( msg, 0, 1 );
+				MSG_WriteBits( msg, trunc + FLOAT_INT_BIAS, FLOAT_INT_BITS );
+			} else {
+				// send as full floating point value
+				MSG_WriteBits( msg, 1, 1 );
+				MSG_WriteBits( msg, *toF, 32 );
+			}
+		} else {
+			// integer
+			MSG_WriteBits( msg, *toF, field->bits );
+		}
+	}
+
+
+	//
+	// send the arrays
+	//
+	statsbits = 0;
+	for (i=0 ; i<MAX_STATS ; i++) {
+		if (to->stats[i] != from->stats[i]) {
+			statsbits |= 1<<i;
+		}
+	}
+	persistantbits = 0;
+	for (i=0 ; i<MAX_PERSISTANT ; i++) {
+		if (to->persistant[i] != from->persistant[i]) {
+			persistantbits |= 1<<i;
+		}
+	}
+	ammobits = 0;
+	for (i=0 ; i<MAX_WEAPONS ; i++) {
+		if (to->ammo[i] != from->ammo[i]) {
+			ammobits |= 1<<i;
+		}
+	}
+	powerupbits = 0;
+	for (i=0 ; i<MAX_POWERUPS ; i++) {
+		if (to->powerups[i] != from->powerups[i]) {
+			powerupbits |= 1<<i;
+		}
+	}
+
+	if (!statsbits && !persistantbits && !ammobits && !powerupbits) {
+		MSG_WriteBits( msg, 0, 1 );	// no change
+		return;
+	}
+	MSG_WriteBits( msg, 1, 1 );	// changed
+
+	if ( statsbits ) {
+		MSG_WriteBits( msg, 1, 1 );	// changed
+		MSG_WriteBits( msg, statsbits, MAX_STATS );
+		for (i=0 ; i<MAX_STATS ; i++)
+			if (statsbits & (1<<i) )
+				MSG_WriteShort (msg, to->stats[i]);
+	} else {
+		MSG_WriteBits( msg, 0, 1 );	// no change
+	}
+
+
+	if ( persistantbits ) {
+		MSG_WriteBits( msg, 1, 1 );	// changed
+		MSG_WriteBits( msg, persistantbits, MAX_PERSISTANT );
+		for (i=0 ; i<MAX_PERSISTANT ; i++)
+			if (persistantbits & (1<<i) )
+				MSG_WriteShort (msg, to->persistant[i]);
+	} else {
+		MSG_WriteBits( msg, 0, 1 );	// no change
+	}
+
+
+	if ( ammobits ) {
+		MSG_WriteBits( msg, 1, 1 );	// changed
+		MSG_WriteBits( msg, ammobits, MAX_WEAPONS );
+		for (i=0 ; i<MAX_WEAPONS ; i++)
+			if (ammobits & (1<<i) )
+				MSG_WriteShort (msg, to->ammo[i]);
+	} else {
+		MSG_WriteBits( msg, 0, 1 );	// no change
+	}
+
+
+	if ( powerupbits ) {
+		MSG_WriteBits( msg, 1, 1 );	// changed
+		MSG_WriteBits( msg, powerupbits, MAX_POWERUPS );
+		for (i=0 ; i<MAX_POWERUPS ; i++)
+			if (powerupbits & (1<<i) )
+				MSG_WriteLong( msg, to->powerups[i] );
+	} else {
+		MSG_WriteBits( msg, 0, 1 );	// no change
+	}
+}
+
+
+/*
+===================
+MSG_ReadDeltaPlayerstate
+===================
+*/
+void MSG_ReadDeltaPlayerstate (msg_t *msg, playerState_t *from, playerState_t *to ) {
+	int			i, lc;
+	int			bits;
+	netField_t	*field;
+	int			numFields;
+	int			*fromF, *toF;
+	int			trunc;
+	playerState_t	dummy;
+
+	if ( !from ) {
+		from = &dummy;
+		memset( &dummy, 0, sizeof( dummy ) );
+	}
+	*to = *from;
+
+	numFields = ARRAY_LEN( playerStateFields );
+	lc = MSG_ReadByte(msg);
+
+	if ( lc > numFields || lc < 0 ) {
+		return; //Com_Error( ERR_DROP, "invalid playerState field count" );
+	}
+
+	for ( i = 0, field = playerStateFields ; i < lc ; i++, field++ ) {
+		fromF = (int *)( (byte *)from + field->offset );
+		toF = (int *)( (byte *)to + field->offset );
+
+		if ( ! MSG_ReadBits( msg, 1 ) ) {
+			// no change
+			*toF = *fromF;
+		} else {
+			if ( field->bits == 0 ) {
+				// float
+				if ( MSG_ReadBits( msg, 1 ) == 0 ) {
+					// integral float
+					trunc = MSG_ReadBits( msg, FLOAT_INT_BITS );
+					// bias to allow equal parts positive and negative
+					trunc -= FLOAT_INT_BIAS;
+					*(float *)toF = trunc; 
+				} else {
+					// full floating point value
+					*toF = MSG_ReadBits( msg, 32 );
+				}
+			} else {
+				// integer
+				*toF = MSG_ReadBits( msg, field->bits );
+			}
+		}
+	}
+	for ( i=lc,field = &playerStateFields[lc];i<numFields; i++, field++) {
+		fromF = (int *)( (byte *)from + field->offset );
+		toF = (int *)( (byte *)to + field->offset );
+		// no change
+		*toF = *fromF;
+	}
+
+
+	// read the arrays
+	if (MSG_ReadBits( msg, 1 ) ) {
+		// parse stats
+		if ( MSG_ReadBits( msg, 1 ) ) {
+			LOG("PS_STATS");
+			bits = MSG_ReadBits (msg, MAX_STATS);
+			for (i=0 ; i<MAX_STATS ; i++) {
+				if (bits & (1<<i) ) {
+					to->stats[i] = MSG_ReadShort(msg);
+				}
+			}
+		}
+
+		// parse persistant stats
+		if ( MSG_ReadBits( msg, 1 ) ) {
+			LOG("PS_PERSISTANT");
+			bits = MSG_ReadBits (msg, MAX_PERSISTANT);
+			for (i=0 ; i<MAX_PERSISTANT ; i++) {
+				if (bits & (1<<i) ) {
+					to->persistant[i] = MSG_ReadShort(msg);
+				}
+			}
+		}
+
+		// parse ammo
+		if ( MSG_ReadBits( msg, 1 ) ) {
+			LOG("PS_AMMO");
+			bits = MSG_ReadBits (msg, MAX_WEAPONS);
+			for (i=0 ; i<MAX_WEAPONS ; i++) {
+				if (bits & (1<<i) ) {
+					to->ammo[i] = MSG_ReadShort(msg);
+				}
+			}
+		}
+
+		// parse powerups
+		if ( MSG_ReadBits( msg, 1 ) ) {
+			LOG("PS_POWERUPS");
+			bits = MSG_ReadBits (msg, MAX_POWERUPS);
+			for (i=0 ; i<MAX_POWERUPS ; i++) {
+				if (bits & (1<<i) ) {
+					to->powerups[i] = MSG_ReadLong(msg);
+				}
+			}
+		}
+	}
+}
+
+/*
+==================
+MSG_DeltaPlayerstateCost
+
+Number of bits MSG_WriteDeltaPlayerstate( msg, from, to ) would write
+with table, NULL for msgHuff
+==================
+*/
+int MSG_DeltaPlayerstateCost( const msgHuffTable_t *table, const playerState_t *from, const playerState_t *to ) {
+	playerState_t		dummy;
+	const netField_t	*field;
+	const int			*fromF, *toF;
+	const int			*fromA, *toA;
+	float				fullFloat;
+	int					trunc;
+	int					i, j, lc, cost, arraybits, arrayCost;
+	qboolean			changed;
+	static const struct {
+		size_t	offset;
+		int		count;
+		int		bits;	// per changed element
+	} arrays[] = {
+		{ offsetof( playerState_t, stats ), MAX_STATS, 16 },
+		{ offsetof( playerState_t, persistant ), MAX_PERSISTANT, 16 },
+		{ offsetof( playerState_t, ammo ), MAX_WEAPONS, 16 },
+		{ offsetof( playerState_t, powerups ), MAX_POWERUPS, 32 }
+	};
+
+	changed = qfalse;
+	if ( !from ) {
+		from = &dummy;
+		memset( &dummy, 0, sizeof( dummy ) );
+	}
+	if (!msgInit) {
+		MSG_initHuffman();
+	}
+	if ( !table ) {
+		table = &msgHuff;
+	}
+
+	lc = 0;
+	for ( i = 0, field = playerStateFields ; i < (int)ARRAY_LEN( playerStateFields ) ; i++, field++ ) {
+		fromF = (const int *)( (const byte *)from + field->offset );
+		toF = (const int *)( (const byte *)to + field->offset );
+		if ( *fromF != *toF ) {
+			lc = i+1;
+		}
+	}
+
+	cost = MSG_TableBitsCost( table, lc, 8 );
+
+	for ( i = 0, field = playerStateFields ; i < lc ; i++, field++ ) {
+		fromF = (const int *)( (const byte *)from + field->offset );
+		toF = (const int *)( (const byte *)to + field->offset );
+
+		cost++;		// changed bit
+		if ( *fromF == *toF ) {
+			continue;
+		}
+
+		if ( field->bits == 0 ) {
+			fullFloat = *(const float *)toF;
+			trunc = (int)fullFloat;
+
+			if ( trunc == fullFloat && trunc + FLOAT_INT_BIAS >= 0 && 
+				trunc + FLOAT_INT_BIAS < ( 1 << FLOAT_INT_BITS ) ) {
+				cost += 1 + MSG_TableBitsCost( table, trunc + FLOAT_INT_BIAS, FLOAT_INT_BITS );
+			} else {
+				cost += 1 + MSG_TableBitsCost( table, *toF, 32 );
+			}
+		} else {
+			cost += MSG_TableBitsCost( table, *toF, field->bits );
+		}
+	}
+
+	arrayCost = 0;
+	for ( i = 0 ; i < (int)ARRAY_LEN( arrays ) ; i++ ) {
+		fromA = (const int *)( (const byte *)from + arrays[i].offset );
+		toA = (const int *)( (const byte *)to + arrays[i].offset );
+		arraybits = 0;
+		for ( j = 0 ; j < arrays[i].count ; j++ ) {
+			if ( fromA[j] != toA[j] ) {
+				arraybits |= 1<<j;
+			}
+		}
+		arrayCost++;	// changed bit
+		if ( arraybits ) {
+			changed = qtrue;
+			arrayCost += MSG_TableBitsCost( table, arraybits, arrays[i].count );
+			for ( j = 0 ; j < arrays[i].count ; j++ ) {
+				if ( arraybits & (1<<j) ) {
+					arrayCost += MSG_TableBitsCost( table, toA[j], arrays[i].bits );
+				}
+			}
+		}
+	}
+
+	// a single bit when none of the arrays changed
+	cost += 1 + ( changed ? arrayCost : 0 );
+	return cost;
+}
+
 static int msg_hData[256] = {
 250315, 41193,  6292,   7106,   3730,   3750,   6110,   23283,
 33317,  6950,   7838,   9714,   9257,   17259,  3949,   1778,
@@ -673,14 +1867,7 @@ static int msg_hData[256] = {
 };
 
 void MSG_initHuffman( void ) {
-	int i,j;
-
 	msgInit = qtrue;
-	Huff_Init(&msgHuff);
-	for(i=0;i<256;i++) {
-		for (j=0;j<msg_hData[i];j++) {
-			Huff_addRef(&msgHuff.compressor,	(byte)i);			// Do update
-			Huff_addRef(&msgHuff.decompressor,	(byte)i);			// Do update
-		}
-	}
+	MSG_initChangeMasks();
+	MSG_InitHuffTable( &msgHuff, msg_hData );
 }
@@ -0,0 +1,663 @@
+// net_batch.c -- batched UDP sending, and receiving on a thread of its own
+
+/*
+ * A receiver reads datagrams from a UDP socket with recvmmsg, a batch per
+ * system call, into a slab of fixed size slots.  Its thread parses the
+ * packet headers and runs them through a netchan per remote end, so only
+ * whole messages come out, and hands those over in a single producer,
+ * single consumer ring:
+ *
+ *   receive thread  --ready-->  consumer
+ *                   <--free---
+ *
+ * The consumer gives every slot back through the free ring when it is done
+ * with the message in it, in any order.  A message put together from
+ * fragments is in a buffer of its own instead, freed by the consumer.
+ *
+ * An eventfd counts the batches made ready, so the consumer can wait for
+ * one with poll (or select, or an event loop).  When every slot is held by
+ * the consumer the thread stops reading and the socket's buffer fills.
+ *
+ * Sending is simpler: NET_SendBatch gives the kernel many packets per
+ * sendmmsg call, each gathered from a header and a message wherever they
+ * are.
+ */
+
+#ifdef __linux__
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "q_shared.h"
+#include "qcommon.h"
+
+typedef struct {
+	netchan_t	chan;
+	byte		address[NET_ADDRESS_SIZE];
+	int			addressLength;
+	int			qport;
+	unsigned	lastHeard;			// receiver->heard when it was last used
+	qboolean	inUse;
+} netChannel_t;
+
+struct netReceiver_s {
+	int				sock;
+	netsrc_t		source;
+	int				batch;
+
+	// slots of packetSize bytes, numSlots of them
+	int				packetSize;
+	int				numSlots;
+	byte			*slab;
+
+	// slots the receive thread holds, only it touches these
+	int				*freeSlots;
+	int				numFree;
+	struct mmsghdr	*headers;
+	struct iovec	*iovecs;
+	byte			*addresses;		// batch * NET_ADDRESS_SIZE
+
+	netChannel_t	*channels;
+	int				maxChannels;
+	unsigned		heard;
+
+	// receive thread to consumer
+	netMessage_t	*ready;
+	unsigned		readyMask;
+	unsigned		readyHead;		// written by the receive thread
+	unsigned		readyTail;		// written by the consumer
+
+	// consumer to receive thread
+	int				*returned;
+	unsigned		returnedMask;
+	unsigned		returnedHead;	// written by the consumer
+	unsigned		returnedTail;	// written by the receive thread
+	int				starved;		// the receive thread waits on wakeFd
+
+	int				readyFd;		// counts batches made ready
+	int				wakeFd;			// slots came back, or time to stop
+	int				stop;
+	int				stopped;		// the receive thread is done
+	int				error;			// errno that stopped it, 0 if it was asked to
+
+	int				received;
+	int				dropped;		// truncated, or no room in the ready ring
+
+	pthread_t		thread;
+	qboolean		running;
+};
+
+static unsigned NET_RingSize( int count ) {
+	unsigned	size;
+
+	for ( size = 1 ; size < (unsigned)count ; size <<= 1 ) {
+	}
+	return size;
+}
+
+static void NET_Signal( int fd ) {
+	uint64_t	one = 1;
+
+	// the counter can't overflow in practice, and a full one is still readable
+	while ( write( fd, &one, sizeof( one ) ) < 0 && errno == EINTR ) {
+	}
+}
+
+static void NET_ClearSignal( int fd ) {
+	uint64_t	count;
+
+	while ( read( fd, &count, sizeof( count ) ) < 0 && errno == EINTR ) {
+	}
+}
+
+/*
+==================
+NET_FindChannel
+
+Returns the channel of the remote end a packet came from, setting up a
+new one in place of the one heard from longest ago if there is none.
+==================
+*/
+static netChannel_t *NET_FindChannel( netReceiver_t *r, const byte *address, int addressLength, int qport ) {
+	netChannel_t	*c, *oldest;
+	int				i;
+
+	oldest = NULL;
+	for ( i = 0, c = r->channels ; i < r->maxChannels ; i++, c++ ) {
+		if ( !c->inUse ) {
+			if ( !oldest || oldest->inUse ) {
+				oldest = c;
+			}
+			continue;
+		}
+		if ( c->qport == qport && c->addressLength == addressLength
+			&& !memcmp( c->address, address, addressLength ) ) {
+			c->lastHeard = ++r->heard;
+			return c;
+		}
+		if ( !oldest || ( oldest->inUse && c->lastHeard < oldest->lastHeard ) ) {
+			oldest = c;
+		}
+	}
+
+	c = oldest;
+	free( c->chan.fragmentBuffer );
+	Netchan_Setup( r->source, &c->chan, qport );
+	memcpy( c->address, address, addressLength );
+	c->addressLength = addressLength;
+	c->qport = qport;
+	c->lastHeard = ++r->heard;
+	c->inUse = qtrue;
+	return c;
+}
+
+/*
+==================
+NET_FrameMessage
+
+Parses the datagram in a slot and fills in m if it makes a message,
+either in the slot or, when it was the last fragment of one, in the
+channel's fragment buffer, which then belongs to the message.
+==================
+*/
+static qboolean NET_FrameMessage( netReceiver_t *r, byte *data, int length,
+								  const byte *address, int addressLength, netMessage_t *m ) {
+	netChannel_t	*c;
+	msg_t			msg;
+	int				sequence, qport;
+	short			port;
+
+	// slots are packetSize apart, so the header need not be aligned
+	if ( length < 4 ) {
+		return qfalse;
+	}
+	memcpy( &sequence, data, 4 );
+	sequence = LittleLong( sequence );
+
+	memset( m, 0, sizeof( *m ) );
+	memcpy( m->address, address, addressLength );
+	m->addressLength = addressLength;
+
+	// connectionless packets are plain text after the -1
+	if ( sequence == -1 ) {
+		MSG_InitOOB( &m->msg, data, length );
+		m->msg.cursize = length;
+		m->msg.readcount = 4;
+		m->msg.bit = 32;
+		m->sequence = -1;
+		m->qport = -1;
+		m->oob = qtrue;
+		return qtrue;
+	}
+
+	qport = -1;
+	if ( r->source == NS_SERVER ) {
+		if ( length < 6 ) {
+			return qfalse;
+		}
+		memcpy( &port, data + 4, 2 );
+		qport = LittleShort( port ) & 0xffff;
+	}
+
+	c = NET_FindChannel( r, address, addressLength, qport );
+	if ( ( sequence & FRAGMENT_BIT ) && !c->chan.fragmentBuffer ) {
+		if ( !( c->chan.fragmentBuffer = malloc( 4 + MAX_MSGLEN ) ) ) {
+			return qfalse;
+		}
+	}
+
+	MSG_Init( &msg, data, length );
+	msg.cursize = length;
+	if ( !Netchan_Process( &c->chan, &msg ) ) {
+		return qfalse;
+	}
+
+	if ( msg.data == c->chan.fragmentBuffer ) {
+		c->chan.fragmentBuffer = NULL;
+	}
+	m->msg = msg;
+	m->sequence = c->chan.incomingSequence;
+	m->qport = qport;
+	return qtrue;
+}
+
+/*
+==================
+NET_ReceiveBatch
+
+Reads up to a batch of datagrams into free slots and makes the messages
+among them ready.  Returns qfalse with errno set if the socket failed.
+==================
+*/
+static qboolean NET_ReceiveBatch( netReceiver_t *r ) {
+	netMessage_t	*m;
+	struct msghdr	*h;
+	unsigned		head, tail;
+	int				i, count, slot, made;
+
+	count = r->numFree < r->batch ? r->numFree : r->batch;
+	for ( i = 0 ; i < count ; i++ ) {
+		slot = r->freeSlots[r->numFree - 1 - i];
+		r->iovecs[i].iov_base = r->slab + (size_t)slot * r->packetSize;
+		r->iovecs[i].iov_len = r->packetSize;
+		h = &r->headers[i].msg_hdr;
+		memset( h, 0, sizeof( *h ) );
+		h->msg_name = r->addresses + i * NET_ADDRESS_SIZE;
+		h->msg_namelen = NET_ADDRESS_SIZE;
+		h->msg_iov = &r->iovecs[i];
+		h->msg_iovlen = 1;
+	}
+
+	count = recvmmsg( r->sock, r->headers, count, MSG_DONTWAIT, NULL );
+	if ( count < 0 ) {
+		// a refused earlier send is reported here, on a connected socket
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED;
+	}
+
+	head = r->readyHead;
+	tail = __atomic_load_n( &r->readyTail, __ATOMIC_ACQUIRE );
+	made = 0;
+	for ( i = 0 ; i < count ; i++ ) {
+		h = &r->headers[i].msg_hdr;
+		if ( h->msg_flags & MSG_TRUNC || head - tail > r->readyMask ) {
+			__atomic_fetch_add( &r->dropped, 1, __ATOMIC_RELAXED );
+			continue;
+		}
+		m = &r->ready[head & r->readyMask];
+		if ( !NET_FrameMessage( r, (byte *)r->iovecs[i].iov_base, r->headers[i].msg_len,
+								(byte *)h->msg_name, h->msg_namelen, m ) ) {
+			continue;
+		}
+		head++;
+
+		// the slot goes with the message unless it was put together elsewhere,
+		// the ones that do are swapped to the top of the free list
+		if ( m->msg.data == r->iovecs[i].iov_base ) {
+			slot = r->freeSlots[r->numFree - 1 - made];
+			r->freeSlots[r->numFree - 1 - made] = r->freeSlots[r->numFree - 1 - i];
+			r->freeSlots[r->numFree - 1 - i] = slot;
+			made++;
+		}
+	}
+	r->numFree -= made;
+	__atomic_store_n( &r->received, r->received + count, __ATOMIC_RELAXED );
+
+	if ( head != r->readyHead ) {
+		__atomic_store_n( &r->readyHead, head, __ATOMIC_RELEASE );
+		NET_Signal( r->readyFd );
+	}
+	return qtrue;
+}
+
+/*
+==================
+NET_TakeBackSlots
+
+Moves slots the consumer is done with back to the free list.
+==================
+*/
+static void NET_TakeBackSlots( netReceiver_t *r ) {
+	unsigned	tail, head;
+
+	tail = r->returnedTail;
+	head = __atomic_load_n( &r->returnedHead, __ATOMIC_ACQUIRE );
+	while ( tail != head ) {
+		r->freeSlots[r->numFree++] = r->returned[tail++ & r->returnedMask];
+	}
+	__atomic_store_n( &r->returnedTail, tail, __ATOMIC_RELEASE );
+}
+
+static void *NET_ReceiveThread( void *arg ) {
+	netReceiver_t	*r = arg;
+	struct pollfd	fds[2];
+	int				error = 0;
+
+	fds[0].fd = r->wakeFd;
+	fds[0].events = POLLIN;
+	fds[1].fd = r->sock;
+	fds[1].events = POLLIN;
+
+	while ( !__atomic_load_n( &r->stop, __ATOMIC_ACQUIRE ) ) {
+		NET_TakeBackSlots( r );
+
+		// with every slot out, only wait for some to come back
+		if ( !r->numFree ) {
+			__atomic_store_n( &r->starved, 1, __ATOMIC_SEQ_CST );
+			NET_TakeBackSlots( r );
+			if ( !r->numFree && poll( fds, 1, -1 ) > 0 ) {
+				NET_ClearSignal( r->wakeFd );
+			}
+			__atomic_store_n( &r->starved, 0, __ATOMIC_SEQ_CST );
+			continue;
+		}
+
+		if ( poll( fds, 2, -1 ) < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			error = errno;
+			break;
+		}
+		if ( fds[0].revents ) {
+			NET_ClearSignal( r->wakeFd );
+		}
+		if ( fds[1].revents & POLLNVAL ) {
+			error = EBADF;
+			break;
+		}
+		if ( fds[1].revents && !NET_ReceiveBatch( r ) ) {
+			error = errno;
+			break;
+		}
+	}
+
+	r->error = error;
+	__atomic_store_n( &r->stopped, 1, __ATOMIC_RELEASE );
+	NET_Signal( r->readyFd );
+	return NULL;
+}
+
+/*
+==================
+NET_OpenReceiver
+
+Starts receiving from sock, a bound UDP socket, into numSlots slots of
+packetSize bytes.  source is NS_SERVER if the packets come from clients
+and carry their qport.  Returns NULL with errno set on failure.
+==================
+*/
+netReceiver_t *NET_OpenReceiver( int sock, netsrc_t source, int batch, int numSlots,
+								 int packetSize, int maxChannels ) {
+	netReceiver_t	*r;
+	int				i, error;
+
+	if ( !( r = calloc( 1, sizeof( *r ) ) ) ) {
+		return NULL;
+	}
+	r->sock = sock;
+	r->source = source;
+	r->batch = batch;
+	r->packetSize = packetSize;
+	r->numSlots = numSlots;
+	r->maxChannels = maxChannels;
+	r->readyFd = r->wakeFd = -1;
+
+	// fragments outside the slots can make more messages than there are slots
+	r->readyMask = NET_RingSize( numSlots * 2 ) - 1;
+	r->returnedMask = NET_RingSize( numSlots ) - 1;
+
+	r->slab = malloc( (size_t)numSlots * packetSize );
+	r->freeSlots = malloc( numSlots * sizeof( *r->freeSlots ) );
+	r->headers = calloc( batch, sizeof( *r->headers ) );
+	r->iovecs = calloc( batch, sizeof( *r->iovecs ) );
+	r->addresses = calloc( batch, NET_ADDRESS_SIZE );
+	r->channels = calloc( maxChannels, sizeof( *r->channels ) );
+	r->ready = calloc( r->readyMask + 1, sizeof( *r->ready ) );
+	r->returned = calloc( r->returnedMask + 1, sizeof( *r->returned ) );
+	if ( !r->slab || !r->freeSlots || !r->headers || !r->iovecs || !r->addresses
+		|| !r->channels || !r->ready || !r->returned ) {
+		NET_FreeReceiver( r );
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	// slot 0 is taken first
+	for ( i = 0 ; i < numSlots ; i++ ) {
+		r->freeSlots[i] = numSlots - 1 - i;
+	}
+	r->numFree = numSlots;
+
+	r->readyFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	r->wakeFd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+	if ( r->readyFd < 0 || r->wakeFd < 0 ) {
+		error = errno;
+		NET_FreeReceiver( r );
+		errno = error;
+		return NULL;
+	}
+
+	if ( ( error = pthread_create( &r->thread, NULL, NET_ReceiveThread, r ) ) != 0 ) {
+		NET_FreeReceiver( r );
+		errno = error;
+		return NULL;
+	}
+	r->running = qtrue;
+	return r;
+}
+
+int NET_ReceiverFd( netReceiver_t *r ) {
+	return r->readyFd;
+}
+
+void NET_ReceiverStats( netReceiver_t *r, int *received, int *dropped ) {
+	*received = __atomic_load_n( &r->received, __ATOMIC_RELAXED );
+	*dropped = __atomic_load_n( &r->dropped, __ATOMIC_RELAXED );
+}
+
+// the errno the receive thread stopped on, once NET_WaitMessage returned -2
+int NET_ReceiverError( netReceiver_t *r ) {
+	return r->error;
+}
+
+/*
+==================
+NET_NextMessage
+
+Takes the next ready message, if there is one, without waiting.  Hand
+its msg.data to NET_ReleaseMessage when done with it.
+==================
+*/
+qboolean NET_NextMessage( netReceiver_t *r, netMessage_t *m ) {
+	unsigned	tail;
+
+	tail = r->readyTail;
+	if ( tail == __atomic_load_n( &r->readyHead, __ATOMIC_ACQUIRE ) ) {
+		return qfalse;
+	}
+	*m = r->ready[tail & r->readyMask];
+	__atomic_store_n( &r->readyTail, tail + 1, __ATOMIC_RELEASE );
+	return qtrue;
+}
+
+/*
+==================
+NET_WaitMessage
+
+Takes the next ready message, waiting up to msec milliseconds (forever
+if negative) for one.  Returns 1 with m filled in, 0 if none came in
+time, -1 with errno set if the wait was interrupted, or -2 if the
+receive thread has stopped and nothing is left.
+==================
+*/
+int NET_WaitMessage( netReceiver_t *r, netMessage_t *m, int msec ) {
+	struct pollfd	fd;
+
+	if ( NET_NextMessage( r, m ) ) {
+		return 1;
+	}
+
+	// anything made ready after the signal was cleared signals again
+	NET_ClearSignal( r->readyFd );
+	if ( NET_NextMessage( r, m ) ) {
+		return 1;
+	}
+	if ( __atomic_load_n( &r->stopped, __ATOMIC_ACQUIRE ) ) {
+		return NET_NextMessage( r, m ) ? 1 : -2;
+	}
+	if ( !msec ) {
+		return 0;
+	}
+
+	fd.fd = r->readyFd;
+	fd.events = POLLIN;
+	if ( poll( &fd, 1, msec ) < 0 ) {
+		return -1;
+	}
+	if ( NET_NextMessage( r, m ) ) {
+		return 1;
+	}
+	return __atomic_load_n( &r->stopped, __ATOMIC_ACQUIRE ) ? -2 : 0;
+}
+
+/*
+==================
+NET_ReleaseMessage
+
+Gives back the memory of a message, data being its msg.data.  Messages
+can be released in any order, but only from one thread at a time.
+==================
+*/
+void NET_ReleaseMessage( netReceiver_t *r, byte *data ) {
+	unsigned	head;
+	size_t		offset;
+
+	offset = (size_t)( data - r->slab );
+	if ( data < r->slab || offset >= (size_t)r->numSlots * r->packetSize ) {
+		free( data );
+		return;
+	}
+
+	// there are never more slots out than fit
+	head = r->returnedHead;
+	r->returned[head & r->returnedMask] = (int)( offset / r->packetSize );
+	__atomic_store_n( &r->returnedHead, head + 1, __ATOMIC_SEQ_CST );
+	if ( __atomic_load_n( &r->starved, __ATOMIC_SEQ_CST ) ) {
+		NET_Signal( r->wakeFd );
+	}
+}
+
+/*
+==================
+NET_StopReceiver
+
+Stops the receive thread and waits for it.  Messages not yet taken are
+released; the ones taken stay valid until NET_FreeReceiver.
+==================
+*/
+void NET_StopReceiver( netReceiver_t *r ) {
+	netMessage_t	m;
+
+	if ( r->running ) {
+		__atomic_store_n( &r->stop, 1, __ATOMIC_RELEASE );
+		NET_Signal( r->wakeFd );
+		pthread_join( r->thread, NULL );
+		r->running = qfalse;
+	}
+	while ( NET_NextMessage( r, &m ) ) {
+		NET_ReleaseMessage( r, m.msg.data );
+	}
+}
+
+/*
+==================
+NET_FreeReceiver
+
+Stops the receiver if need be and frees it, and the memory of every
+message it made, which must no longer be in use.  The socket is left open.
+==================
+*/
+void NET_FreeReceiver( netReceiver_t *r ) {
+	int		i;
+
+	NET_StopReceiver( r );
+	if ( r->channels ) {
+		for ( i = 0 ; i < r->maxChannels ; i++ ) {
+			free( r->channels[i].chan.fragmentBuffer );
+		}
+	}
+	if ( r->readyFd >= 0 ) {
+		close( r->readyFd );
+	}
+	if ( r->wakeFd >= 0 ) {
+		close( r->wakeFd );
+	}
+	free( r->slab );
+	free( r->freeSlots );
+	free( r->headers );
+	free( r->iovecs );
+	free( r->addresses );
+	free( r->channels );
+	free( r->ready );
+	free( r->returned );
+	free( r );
+}
+
+/*
+==================
+NET_SendBatch
+
+Sends count packets from sock, up to NET_MAX_BATCH of them per system call.
+A packet that can't be sent is skipped, but sending stops early if the
+socket's buffer is full.  Returns how many were sent, with *error set to
+the errno of the first failure, or 0.
+==================
+*/
+int NET_SendBatch( int sock, const netPacket_t *packets, int count, int *error ) {
+	struct mmsghdr	*headers;
+	struct iovec	*iovecs;
+	struct msghdr	*h;
+	int				i, n, sent, result, size;
+
+	*error = 0;
+	size = count < NET_MAX_BATCH ? count : NET_MAX_BATCH;
+	headers = calloc( size, sizeof( *headers ) );
+	iovecs = calloc( size * 2, sizeof( *iovecs ) );
+	if ( !headers || !iovecs ) {
+		free( headers );
+		free( iovecs );
+		*error = ENOMEM;
+		return 0;
+	}
+
+	sent = 0;
+	while ( count > 0 ) {
+		n = count < size ? count : size;
+		for ( i = 0 ; i < n ; i++ ) {
+			iovecs[i * 2].iov_base = (void *)packets[i].data[0];
+			iovecs[i * 2].iov_len = packets[i].length[0];
+			iovecs[i * 2 + 1].iov_base = (void *)packets[i].data[1];
+			iovecs[i * 2 + 1].iov_len = packets[i].length[1];
+			h = &headers[i].msg_hdr;
+			memset( h, 0, sizeof( *h ) );
+			h->msg_name = (void *)packets[i].address;
+			h->msg_namelen = packets[i].addressLength;
+			h->msg_iov = &iovecs[i * 2];
+			h->msg_iovlen = 2;
+		}
+
+		result = sendmmsg( sock, headers, n, 0 );
+		if ( result < 0 ) {
+			if ( errno == EINTR ) {
+				continue;
+			}
+			if ( !*error ) {
+				*error = errno;
+			}
+			if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ) {
+				break;
+			}
+			// this one is bad, the rest may not be
+			result = 0;
+			packets++;
+			count--;
+		}
+		sent += result;
+		packets += result;
+		count -= result;
+	}
+
+	free( headers );
+	free( iovecs );
+	return sent;
+}
+
+#endif // __linux__
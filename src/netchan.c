@@ -0,0 +1,456 @@
+// netchan.c -- sequenced packets with fragmentation, as Quake 3 sends them
+
+/*
+ * A datagram starts with
+ *
+ *   sequence (4)  qport (2, client to server only)
+ *   [fragment start (2)  fragment length (2), when the sequence has FRAGMENT_BIT]
+ *
+ * as little endian ints, then the (huffman coded) message.  Messages too big
+ * for a packet are sent as FRAGMENT_SIZE pieces under one sequence, the last
+ * of them shorter than FRAGMENT_SIZE, even if that means empty.
+ */
+
+#include <string.h>
+#include "q_shared.h"
+#include "qcommon.h"
+
+/*
+==============
+Netchan_Setup
+
+called to open a channel to a remote system
+==============
+*/
+void Netchan_Setup( netsrc_t sock, netchan_t *chan, int qport ) {
+	memset( chan, 0, sizeof( *chan ) );
+
+	chan->sock = sock;
+	chan->qport = qport;
+	chan->incomingSequence = 0;
+	chan->outgoingSequence = 1;
+}
+
+/*
+=================
+Netchan_TransmitNextFragment
+
+Writes the next fragment of the message being sent into packet, which
+holds MAX_PACKETLEN bytes, and returns its length.  Send one fragment
+each frame, to avoid swamping the connection.
+=================
+*/
+int Netchan_TransmitNextFragment( netchan_t *chan, byte *packet ) {
+	msg_t		send;
+	int			fragmentLength;
+
+	// write the packet header
+	MSG_InitOOB (&send, packet, MAX_PACKETLEN);				// <-- only do the oob here
+
+	MSG_WriteLong( &send, chan->outgoingSequence | FRAGMENT_BIT );
+
+	// send the qport if we are a client
+	if ( chan->sock == NS_CLIENT ) {
+		MSG_WriteShort( &send, chan->qport );
+	}
+
+	// copy the reliable message to the packet first
+	fragmentLength = FRAGMENT_SIZE;
+	if ( chan->unsentFragmentStart  + fragmentLength > chan->unsentLength ) {
+		fragmentLength = chan->unsentLength - chan->unsentFragmentStart;
+	}
+
+	MSG_WriteShort( &send, chan->unsentFragmentStart );
+	MSG_WriteShort( &send, fragmentLength );
+	MSG_WriteData( &send, chan->unsentBuffer + chan->unsentFragmentStart, fragmentLength );
+
+	chan->unsentFragmentStart += fragmentLength;
+
+	// this exit condition is a little tricky, because a packet
+	// that is exactly the fragment length still needs to send
+	// a second packet of zero length so that the other side
+	// can tell there aren't more to follow
+	if ( chan->unsentFragmentStart == chan->unsentLength && fragmentLength != FRAGMENT_SIZE ) {
+		chan->outgoingSequence++;
+		chan->unsentFragments = qfalse;
+	}
+
+	return send.cursize;
+}
+
+/*
+===============
+Netchan_Transmit
+
+Writes the packet to send a message in into packet, which holds
+MAX_PACKETLEN bytes, and returns its length.  A message of FRAGMENT_SIZE
+or more is copied to the channel, and only its first fragment written:
+Netchan_TransmitNextFragment writes the rest while chan->unsentFragments
+is set.
+================
+*/
+int Netchan_Transmit( netchan_t *chan, int length, const byte *data, byte *packet ) {
+	int			headerLength;
+
+	chan->unsentFragmentStart = 0;
+
+	// fragment large reliable messages
+	if ( length >= FRAGMENT_SIZE ) {
+		chan->unsentFragments = qtrue;
+		chan->unsentLength = length;
+		memcpy( chan->unsentBuffer, data, length );
+
+		// only send the first fragment now
+		return Netchan_TransmitNextFragment( chan, packet );
+	}
+
+	headerLength = Netchan_TransmitHeader( chan, packet );
+	memcpy( packet + headerLength, data, length );
+
+	return headerLength + length;
+}
+
+/*
+===============
+Netchan_TransmitHeader
+
+Writes the header of the packet for a message shorter than FRAGMENT_SIZE
+into header, which holds PACKET_HEADER bytes, and returns its length.
+The message goes after it unchanged, so it can be sent from where it is.
+================
+*/
+int Netchan_TransmitHeader( netchan_t *chan, byte *header ) {
+	msg_t		send;
+
+	// write the packet header
+	MSG_InitOOB (&send, header, PACKET_HEADER);
+
+	MSG_WriteLong( &send, chan->outgoingSequence );
+	chan->outgoingSequence++;
+
+	// send the qport if we are a client
+	if ( chan->sock == NS_CLIENT ) {
+		MSG_WriteShort( &send, chan->qport );
+	}
+
+	return send.cursize;
+}
+
+/*
+=================
+Netchan_Process
+
+Returns qfalse if the message should not be processed due to being
+out of order or a fragment.
+
+Fragments are put together after the first four bytes of
+chan->fragmentBuffer, so a whole message is read from there in place:
+msg is pointed at it, starting with the sequence like a packet that was
+not fragmented.  The caller then has to give the channel another buffer
+(or be done reading msg) before the next packet.
+
+msg->readcount is left past the header, with msg->bit at the same place.
+=================
+*/
+qboolean Netchan_Process( netchan_t *chan, msg_t *msg ) {
+	int			sequence;
+	int			fragmentStart, fragmentLength;
+	qboolean	fragmented;
+
+	// get sequence numbers
+	MSG_BeginReadingOOB( msg );
+	sequence = MSG_ReadLong( msg );
+
+	// check for fragment information
+	if ( sequence & FRAGMENT_BIT ) {
+		sequence &= ~FRAGMENT_BIT;
+		fragmented = qtrue;
+	} else {
+		fragmented = qfalse;
+	}
+
+	// read the qport if we are a server, the caller found the channel by it
+	if ( chan->sock == NS_SERVER ) {
+		MSG_ReadShort( msg );
+	}
+
+	// read the fragment information
+	if ( fragmented ) {
+		fragmentStart = MSG_ReadShort( msg ) & 0xffff;
+		fragmentLength = MSG_ReadShort( msg ) & 0xffff;
+	} else {
+		fragmentStart = 0;		// stop warning message
+		fragmentLength = 0;
+	}
+
+	if ( msg->readcount > msg->cursize ) {
+		return qfalse;			// too short for the header
+	}
+
+	//
+	// discard out of order or duplicated packets
+	//
+	if ( sequence <= chan->incomingSequence ) {
+		return qfalse;
+	}
+
+	//
+	// dropped packets don't keep the message from being used
+	//
+	chan->dropped = sequence - (chan->incomingSequence+1);
+
+	//
+	// if this is the final framgent of a reliable message,
+	// bump incoming_reliable_sequence
+	//
+	if ( fragmented ) {
+		// TTimo
+		// make sure we add the fragments in correct order
+		// either a packet was dropped, or we received this one too soon
+		// we don't reconstruct the fragments. we will wait till this fragment gets to us again
+		// (NOTE: we could probably try to rebuild by out of order chunks if needed)
+		if ( sequence != chan->fragmentSequence ) {
+			chan->fragmentSequence = sequence;
+			chan->fragmentLength = 0;
+		}
+
+		// if we missed a fragment, dump the message
+		if ( fragmentStart != chan->fragmentLength ) {
+			return qfalse;
+		}
+
+		// copy the fragment to the fragment buffer
+		if ( msg->readcount + fragmentLength > msg->cursize ||
+			chan->fragmentLength + fragmentLength > MAX_MSGLEN ) {
+			return qfalse;
+		}
+
+		memcpy( chan->fragmentBuffer + 4 + chan->fragmentLength,
+			msg->data + msg->readcount, fragmentLength );
+
+		chan->fragmentLength += fragmentLength;
+
+		// if this wasn't the last fragment, don't process anything
+		if ( fragmentLength == FRAGMENT_SIZE ) {
+			return qfalse;
+		}
+
+		// read the whole message where it was put together
+		chan->fragmentBuffer[0] = (byte)sequence;
+		chan->fragmentBuffer[1] = (byte)( sequence >> 8 );
+		chan->fragmentBuffer[2] = (byte)( sequence >> 16 );
+		chan->fragmentBuffer[3] = (byte)( sequence >> 24 );
+		msg->data = chan->fragmentBuffer;
+		msg->maxsize = 4 + MAX_MSGLEN;
+		msg->cursize = 4 + chan->fragmentLength;
+		chan->fragmentLength = 0;
+		msg->readcount = 4;	// past the sequence number
+		msg->bit = 32;	// past the sequence number
+
+		// TTimo
+		// clients were not acking fragmented messages
+		chan->incomingSequence = sequence;
+
+		return qtrue;
+	}
+
+	//
+	// the message can now be read from the current message pointer
+	//
+	chan->incomingSequence = sequence;
+
+	return qtrue;
+}
+
+/*
+=============================================================================
+
+message scrambling
+
+The game XORs the body of each message with a key that changes at every
+byte, by a character of the last reliable command acknowledged.  That key
+stream does not depend on the data: it repeats every two passes over the
+string (four for an odd length), so a period of it is worked out a byte at
+a time and then applied a word at a time.
+
+=============================================================================
+*/
+
+static void Netchan_XorBlock( byte *data, const byte *stream, int count ) {
+	uint64_t	a, b;
+	int			i;
+
+	for ( i = 0 ; i + 8 <= count ; i += 8 ) {
+		memcpy( &a, data + i, 8 );
+		memcpy( &b, stream + i, 8 );
+		a ^= b;
+		memcpy( data + i, &a, 8 );
+	}
+	for ( ; i < count ; i++ ) {
+		data[i] ^= stream[i];
+	}
+}
+
+/*
+=================
+Netchan_Scramble
+
+Same as the loops of CL_Netchan_Encode and the others, from byte start of
+the message on.  Commands are kept in MAX_STRING_CHARS buffers by the
+game, so longer strings are cut short like they would be there.
+=================
+*/
+static void Netchan_Scramble( msg_t *msg, int start, byte key, const char *string ) {
+	byte	stream[4 * MAX_STRING_CHARS];
+	byte	c;
+	int		i, index, length, period, count;
+
+	if ( start >= msg->cursize ) {
+		return;
+	}
+	count = msg->cursize - start;
+
+	for ( length = 0 ; length < MAX_STRING_CHARS - 1 && string[length] ; length++ ) {
+	}
+	// an empty string is used as a single NUL, which leaves the key as it is
+	period = 2 * ( length > 1 ? length : 1 ) * ( length & 1 ? 2 : 1 );
+	if ( period > count ) {
+		period = count;
+	}
+
+	index = 0;
+	for ( i = 0 ; i < period ; i++ ) {
+		// modify the key with the last received and acknowledged command
+		if ( index >= length ) {
+			index = 0;
+		}
+		c = length ? (byte)string[index] : 0;
+		if ( c > 127 || c == '%' ) {
+			c = '.';
+		}
+		key ^= c << ( ( start + i ) & 1 );
+		index++;
+		stream[i] = key;
+	}
+
+	for ( i = 0 ; i < count ; i += period ) {
+		Netchan_XorBlock( msg->data + start + i, stream, count - i < period ? count - i : period );
+	}
+}
+
+/*
+=================
+Netchan_ReadLongs
+
+Reads the longs a message starts with from the bitstream at byte offset,
+leaving msg as it was.
+=================
+*/
+static void Netchan_ReadLongs( msg_t *msg, int offset, int *longs, int count ) {
+	int			srdc, sbit, soob, i;
+
+	srdc = msg->readcount;
+	sbit = msg->bit;
+	soob = msg->oob;
+
+	msg->oob = qfalse;
+	msg->readcount = offset;
+	msg->bit = offset << 3;
+	for ( i = 0 ; i < count ; i++ ) {
+		longs[i] = MSG_ReadLong( msg );
+	}
+
+	msg->oob = soob;
+	msg->bit = sbit;
+	msg->readcount = srdc;
+}
+
+/*
+==============
+CL_Netchan_Encode
+
+	// first 12 bytes of the data are always:
+	long serverId;
+	long messageAcknowledge;
+	long reliableAcknowledge;
+
+msg is the message as the client wrote it, before Netchan_Transmit.
+serverCommands are the last MAX_RELIABLE_COMMANDS commands received.
+==============
+*/
+void CL_Netchan_Encode( msg_t *msg, int challenge, const char * const *serverCommands ) {
+	int		longs[3];
+
+	if ( msg->cursize <= CL_ENCODE_START ) {
+		return;
+	}
+
+	Netchan_ReadLongs( msg, 0, longs, 3 );
+
+	Netchan_Scramble( msg, CL_ENCODE_START, (byte)( challenge ^ longs[0] ^ longs[1] ),
+		serverCommands[longs[2] & (MAX_RELIABLE_COMMANDS-1)] );
+}
+
+/*
+==============
+CL_Netchan_Decode
+
+	// first four bytes of the data are always:
+	long reliableAcknowledge;
+
+msg is as Netchan_Process left it, read up to the end of the header.
+reliableCommands are the last MAX_RELIABLE_COMMANDS commands sent.
+==============
+*/
+void CL_Netchan_Decode( msg_t *msg, int challenge, const char * const *reliableCommands ) {
+	int		reliableAcknowledge;
+
+	Netchan_ReadLongs( msg, msg->readcount, &reliableAcknowledge, 1 );
+
+	// xor the client challenge with the netchan sequence number (need something that changes every message),
+	// only its low byte counts
+	Netchan_Scramble( msg, msg->readcount + CL_DECODE_START, (byte)( challenge ^ msg->data[0] ),
+		reliableCommands[reliableAcknowledge & (MAX_RELIABLE_COMMANDS-1)] );
+}
+
+/*
+==============
+SV_Netchan_Encode
+
+	// first four bytes of the data are always:
+	long reliableAcknowledge;
+
+msg is the message as the server wrote it, to be sent with
+outgoingSequence.  lastClientCommand is the last command the client sent.
+==============
+*/
+void SV_Netchan_Encode( msg_t *msg, int challenge, int outgoingSequence, const char *lastClientCommand ) {
+	if ( msg->cursize < SV_ENCODE_START ) {
+		return;
+	}
+
+	// xor the client challenge with the netchan sequence number
+	Netchan_Scramble( msg, SV_ENCODE_START, (byte)( challenge ^ outgoingSequence ), lastClientCommand );
+}
+
+/*
+==============
+SV_Netchan_Decode
+
+	// first 12 bytes of the data are always:
+	long serverId;
+	long messageAcknowledge;
+	long reliableAcknowledge;
+
+msg is as Netchan_Process left it, read up to the end of the header.
+reliableCommands are the last MAX_RELIABLE_COMMANDS commands sent.
+==============
+*/
+void SV_Netchan_Decode( msg_t *msg, int challenge, const char * const *reliableCommands ) {
+	int		longs[3];
+
+	Netchan_ReadLongs( msg, msg->readcount, longs, 3 );
+
+	Netchan_Scramble( msg, msg->readcount + SV_DECODE_START, (byte)( challenge ^ longs[0] ^ longs[1] ),
+		reliableCommands[longs[2] & (MAX_RELIABLE_COMMANDS-1)] );
+}
@@ -2,6 +2,7 @@
 #define __Q_SHARED_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define Q3_LITTLE_ENDIAN
 
@@ -38,6 +39,12 @@ float FloatSwap (const float *f);
 #error "Byte order not supported"
 #endif
 
+#if defined(_MSC_VER)
+#define Q_THREADLOCAL __declspec(thread)
+#else
+#define Q_THREADLOCAL __thread
+#endif
+
 typedef unsigned char 		byte;
 
 typedef enum {qfalse, qtrue}	qboolean;
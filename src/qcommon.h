@@ -32,6 +32,7 @@ typedef struct {
 	int		cursize;
 	int		readcount;
 	int		bit;				// for bitwise reads and writes
+	struct msgHuffTable_s	*table;	// NULL for the default msgHuff tables
 } msg_t;
 
 void MSG_initHuffman( void );
@@ -49,6 +50,8 @@ void MSG_Bitstream( msg_t *buf );
 void MSG_Copy(msg_t *buf, byte *data, int length, msg_t *src);
 
 void MSG_WriteBits( msg_t *msg, int value, int bits );
+void MSG_AppendBits( msg_t *msg, const byte *data, int bits );
+void MSG_Truncate( msg_t *msg, int bit, int cursize );
 
 void MSG_WriteChar (msg_t *sb, int c);
 void MSG_WriteByte (msg_t *sb, int c);
@@ -89,9 +92,303 @@ int MSG_ReadDeltaKey( msg_t *msg, int key, int oldV, int bits );
 void MSG_WriteDeltaKeyFloat( msg_t *msg, int key, float oldV, float newV );
 float MSG_ReadDeltaKeyFloat( msg_t *msg, int key, float oldV );
 
+void MSG_EntityChangeMasks( const entityState_t *from, const entityState_t *to, int count,
+							uint64_t *masks, int *lastChanged );
+void MSG_WriteDeltaEntity( msg_t *msg, struct entityState_s *from, struct entityState_s *to,
+						   qboolean force );
+void MSG_ReadDeltaEntity( msg_t *msg, entityState_t *from, entityState_t *to,
+						 int number );
+void MSG_WriteDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct playerState_s *to );
+void MSG_ReadDeltaPlayerstate( msg_t *msg, struct playerState_s *from, struct playerState_s *to );
+int MSG_RemainingBits( msg_t *msg );
+int MSG_BitsCost( int value, int bits );
+int MSG_DeltaEntityCost( const struct msgHuffTable_s *table, const entityState_t *from,
+						 const entityState_t *to, qboolean force );
+int MSG_DeltaPlayerstateCost( const struct msgHuffTable_s *table, const playerState_t *from,
+							  const playerState_t *to );
+
+//
+// snapshot.c
+//
+
+typedef struct {
+	int		number;				// -1 for an empty slot
+	int		fromFrame;
+	int		toFrame;
+	qboolean	force;
+	int		tableId;			// msgHuffTable_t id the bits were encoded with
+	int		bits;
+	int		offset;				// into deltaCache_t->pool
+} deltaCacheEntry_t;
+
+#define	DELTA_CACHE_AVERAGE	64	// pool bytes reserved per entry
+
+typedef struct {
+	deltaCacheEntry_t	*entries;
+	int		numSlots;			// power of two
+	int		numEntries;
+	int		maxEntries;
+	byte	*pool;
+	int		poolSize;
+	int		poolUsed;
+	int		hits;
+	int		misses;
+	int		evictions;			// times the cache was full and flushed
+} deltaCache_t;
+
+qboolean SV_DeltaCacheInit( deltaCache_t *cache, int maxEntries );
+void SV_DeltaCacheFree( deltaCache_t *cache );
+void SV_DeltaCacheClear( deltaCache_t *cache );
+void SV_DeltaCacheWriteEntity( deltaCache_t *cache, msg_t *msg, int fromFrame, int toFrame,
+								  entityState_t *from, entityState_t *to, qboolean force );
+
+#define	PACKET_BACKUP	32	// number of old messages that must be kept on client and
+							// server for delta compression and ping estimation
+#define	MAX_SNAPSHOT_ENTITIES	256
+
+typedef struct {
+	int				frame;			// -1 for an empty slot
+	int				numEntities;
+	playerState_t	ps;
+	entityState_t	*entities;		// sorted by number, maxEntities long
+} snapshotFrame_t;
+
+typedef struct {
+	int				numFrames;
+	int				maxEntities;
+	snapshotFrame_t	*frames;
+	entityState_t	*entities;		// numFrames * maxEntities
+	entityState_t	*baselines;		// MAX_GENTITIES, for frames sent without delta
+} snapshotRing_t;
+
+qboolean SV_RingInit( snapshotRing_t *ring, int numFrames, int maxEntities );
+void SV_RingFree( snapshotRing_t *ring );
+snapshotFrame_t *SV_RingFrame( snapshotRing_t *ring, int frame );
+snapshotFrame_t *SV_RingStore( snapshotRing_t *ring, int frame );
+entityState_t *SV_RingFindEntity( snapshotFrame_t *f, int number );
+qboolean SV_RingSetEntity( snapshotRing_t *ring, snapshotFrame_t *f, const entityState_t *es );
+qboolean SV_RingRemoveEntity( snapshotFrame_t *f, int number );
+void SV_EmitPacketEntities( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to, msg_t *msg );
+int SV_PacketEntitiesCost( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to,
+						   const struct msgHuffTable_s *table );
+int SV_SnapshotCost( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to,
+					 const struct msgHuffTable_s *table );
+int SV_BestDeltaFrame( snapshotRing_t *ring, snapshotFrame_t *to, const int *candidates,
+					   int numCandidates, const struct msgHuffTable_s *table, int *bestCost );
+void SV_BuildClientSnapshot( snapshotRing_t *ring, int frame, int deltaFrame,
+							 const entityState_t *world, int numWorld, const byte *visible,
+							 const playerState_t *ps, msg_t *msg );
+int SV_ScheduleEntities( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to,
+						 int budgetBits, const float *priorities, const struct msgHuffTable_s *table,
+						 int *deferred );
+
+//
+// sys_thread.c
+//
+
+typedef void (*workFunc_t)( void *data, int index );
+
+int Sys_NumCPUs( void );
+void Sys_ParallelFor( int numThreads, workFunc_t func, void *data, int count );
+
+//
+// netchan.c
+//
+
+#define	MAX_PACKETLEN		1400		// max size of a network packet
+
 #define MAX_MSGLEN        16384   // max length of a message, which may
                       // be fragmented into multiple packets
 
+#define	FRAGMENT_SIZE		(MAX_PACKETLEN - 100)
+#define	PACKET_HEADER		10			// two ints and a short
+
+#define	FRAGMENT_BIT	(1<<31)
+
+typedef enum {
+	NS_CLIENT,
+	NS_SERVER
+} netsrc_t;
+
+typedef struct {
+	netsrc_t	sock;
+
+	int			dropped;			// between last packet and previous
+
+	int			qport;				// qport value to write when transmitting
+
+	// sequencing variables
+	int			incomingSequence;
+	int			outgoingSequence;
+
+	// incoming fragment assembly buffer
+	int			fragmentSequence;
+	int			fragmentLength;
+	byte		*fragmentBuffer;	// 4 + MAX_MSGLEN, see Netchan_Process
+
+	// outgoing fragment buffer
+	// we need to space out the sending of large fragmented messages
+	qboolean	unsentFragments;
+	int			unsentFragmentStart;
+	int			unsentLength;
+	byte		unsentBuffer[MAX_MSGLEN];
+} netchan_t;
+
+void		Netchan_Setup( netsrc_t sock, netchan_t *chan, int qport );
+int			Netchan_Transmit( netchan_t *chan, int length, const byte *data, byte *packet );
+int			Netchan_TransmitNextFragment( netchan_t *chan, byte *packet );
+int			Netchan_TransmitHeader( netchan_t *chan, byte *header );
+qboolean	Netchan_Process( netchan_t *chan, msg_t *msg );
+
+#define	MAX_RELIABLE_COMMANDS	64			// max string commands buffered for restransmit
+
+#define	CL_ENCODE_START		12
+#define	CL_DECODE_START		4
+#define	SV_ENCODE_START		4
+#define	SV_DECODE_START		12
+
+void		CL_Netchan_Encode( msg_t *msg, int challenge, const char * const *serverCommands );
+void		CL_Netchan_Decode( msg_t *msg, int challenge, const char * const *reliableCommands );
+void		SV_Netchan_Encode( msg_t *msg, int challenge, int outgoingSequence, const char *lastClientCommand );
+void		SV_Netchan_Decode( msg_t *msg, int challenge, const char * const *reliableCommands );
+
+//
+// net_batch.c
+//
+
+#ifdef __linux__
+
+#define	NET_ADDRESS_SIZE	128			// sizeof( struct sockaddr_storage )
+#define	NET_MAX_BATCH		1024		// UIO_MAXIOV, the most packets per system call
+
+typedef struct netReceiver_s netReceiver_t;
+
+typedef struct {
+	msg_t		msg;				// positioned after the packet header
+	int			sequence;			// -1 for a connectionless packet
+	int			qport;				// -1 unless received by a server
+	qboolean	oob;
+	byte		address[NET_ADDRESS_SIZE];
+	int			addressLength;
+} netMessage_t;
+
+netReceiver_t	*NET_OpenReceiver( int sock, netsrc_t source, int batch, int numSlots,
+								   int packetSize, int maxChannels );
+int			NET_ReceiverFd( netReceiver_t *r );
+void		NET_ReceiverStats( netReceiver_t *r, int *received, int *dropped );
+int			NET_ReceiverError( netReceiver_t *r );
+qboolean	NET_NextMessage( netReceiver_t *r, netMessage_t *m );
+int			NET_WaitMessage( netReceiver_t *r, netMessage_t *m, int msec );
+void		NET_ReleaseMessage( netReceiver_t *r, byte *data );
+void		NET_StopReceiver( netReceiver_t *r );
+void		NET_FreeReceiver( netReceiver_t *r );
+
+typedef struct {
+	const byte	*data[2];			// header and message, either may be empty
+	int			length[2];
+	const byte	*address;			// NULL on a connected socket
+	int			addressLength;
+} netPacket_t;
+
+int			NET_SendBatch( int sock, const netPacket_t *packets, int count, int *error );
+
+#endif
+
+//
+// demo.c
+//
+
+typedef struct {
+  const byte  *data;
+  size_t      size;
+#ifdef _WIN32
+  void        *mapping;
+#endif
+} demoFile_t;
+
+typedef enum {
+  DEMO_MESSAGE,
+  DEMO_END,         // end marker, or end of file
+  DEMO_TRUNCATED,   // last record cut short, the demo ends before it
+  DEMO_ERROR        // message longer than MAX_MSGLEN
+} demoRecord_t;
+
+qboolean      Demo_Map( demoFile_t *demo, const char *path );
+void          Demo_Unmap( demoFile_t *demo );
+demoRecord_t  Demo_NextMessage( const demoFile_t *demo, size_t *offset, int *sequence, const byte **data, int *length );
+qboolean      Demo_WriteFile( const char *path, const byte *data, size_t size );
+
+typedef struct {
+  int     fd;
+  byte    *buffer;
+  size_t  used;
+  size_t  size;
+  size_t  syncBytes;  // fsync after this many bytes, 0 for only when asked
+  size_t  unsynced;
+  size_t  offset;     // bytes written, buffered ones included
+} demoWriter_t;
+
+qboolean      Demo_OpenWriter( demoWriter_t *w, const char *path, size_t bufferSize, size_t syncBytes, qboolean append );
+qboolean      Demo_WriteMessage( demoWriter_t *w, int sequence, const byte *data, int length );
+qboolean      Demo_FlushWriter( demoWriter_t *w, qboolean sync );
+qboolean      Demo_CloseWriter( demoWriter_t *w, qboolean end );
+
+//
+// cl_parse.c
+//
+
+typedef struct {
+  byte    *data;
+  size_t  size;
+  size_t  capacity;
+} growBuf_t;
+
+typedef struct {
+  int   firstSnapshot;    // index of the first snapshot after it
+  int   clientNum;
+  int   serverCommandSequence;
+  int   checksumFeed;
+} demoGamestate_t;
+
+typedef struct {
+  growBuf_t serverTimes;    // int per snapshot
+  growBuf_t playerStates;   // playerState_t per snapshot
+  growBuf_t entityCounts;   // int per snapshot
+  growBuf_t entities;       // entityState_t, entityCounts[i] for snapshot i
+  growBuf_t commands;       // int sequence, then the NUL terminated command
+  growBuf_t gamestates;     // demoGamestate_t
+  growBuf_t configstrings;  // int gamestate, int index, then the NUL terminated string
+  growBuf_t keyframes;      // index records, see cl_parse.c
+  growBuf_t records;        // demo written by CL_CutDemo or CL_ConcatDemos
+  int       numSnapshots;
+  int       numGamestates;
+  int       numKeyframes;
+  int       numRecords;
+  qboolean  truncated;      // CL_ResumeDemo reached a record cut short
+  char      error[128];     // empty unless the parse stopped early
+} demoParse_t;
+
+#define DEMO_INDEX_HEADER   20
+#define DEMO_NO_GAMESTATE   ((size_t)-1)
+
+typedef struct {
+  int         time;         // server time of the first snapshot after it
+  size_t      offset;       // of the message to resume at
+  size_t      gamestate;    // of the gamestate in effect, or DEMO_NO_GAMESTATE
+  const byte  *checkpoint;  // empty if there is nothing to restore
+  int         checkpointLength;
+} demoKeyframe_t;
+
+int       CL_DemoSegments( const demoFile_t *demo, size_t **segments, size_t *end, demoRecord_t *status );
+qboolean  CL_ParseDemo( const demoFile_t *demo, size_t start, size_t end, demoParse_t *out );
+void      CL_FreeDemoParse( demoParse_t *out );
+qboolean  CL_IndexDemo( const demoFile_t *demo, size_t start, size_t end, int interval, demoParse_t *out );
+void      CL_IndexHeader( byte *header, size_t demoSize, int numKeyframes );
+qboolean  CL_FindKeyframe( const byte *index, size_t size, size_t demoSize, int time, demoKeyframe_t *key );
+qboolean  CL_ResumeDemo( const demoFile_t *demo, const demoKeyframe_t *key, int startTime, int endTime, demoParse_t *out );
+qboolean  CL_CutDemo( const demoFile_t *demo, size_t start, int startTime, int endTime, demoParse_t *out );
+qboolean  CL_ConcatDemos( const demoFile_t *demos, int count, demoParse_t *out );
+
 /* This is based on the Adaptive Huffman algorithm described in Sayood's Data
  * Compression book.  The ranks are not actually stored, but implicitly defined
  * by the location of a node within a doubly-linked list */
@@ -128,17 +425,64 @@ typedef struct {
   huff_t    decompressor;
 } huffman_t;
 
+// a static compressor/decompressor pair for message bitstreams
+typedef struct msgHuffTable_s {
+  huffman_t huff;
+  int       codeLen[256];   // bits of the code of each byte
+  int       maxCodeLen;
+  int       id;             // unique per built table, 0 for the default one
+} msgHuffTable_t;
+
+#define MSG_HUFF_MAX_REFS (1<<21)   // histograms are scaled down to this total
+
+void  MSG_InitHuffTable(msgHuffTable_t *table, const int *histogram);
+int   MSG_TableBitsCost(const msgHuffTable_t *table, int value, int bits);
+int   MSG_DataCost(const msgHuffTable_t *table, const void *data, int length);
+
+#define HUFF_DICT_MAX_REFS (1<<16)  // dictionary histograms are scaled down to this total
+
 void  Huff_Compress(msg_t *buf, int offset);
+void  Huff_CompressFrom(msg_t *buf, int offset, const huff_t *dictionary);
+int   Huff_CompressedSize(const byte *data, int size, const huff_t *dictionary);
 void  Huff_Decompress(msg_t *buf, int offset);
+void  Huff_DecompressFrom(msg_t *buf, int offset, const huff_t *dictionary);
+void  Huff_Copy(huff_t *dst, const huff_t *src);
+void  Huff_InitDictionary(huff_t *huff, const int *histogram);
+
+#define HUFF_STATE_MAX_SIZE (5 + (2*HMAX+1) * 14)   // largest Huff_Serialize blob
+
+int       Huff_Serialize(const huff_t *huff, byte *data, int size);
+qboolean  Huff_Deserialize(huff_t *huff, const byte *data, int size);
 void  Huff_Init(huffman_t *huff);
 void  Huff_addRef(huff_t* huff, byte ch);
 int   Huff_Receive (node_t *node, int *ch, byte *fin);
 void  Huff_transmit (huff_t *huff, int ch, byte *fout);
-void  Huff_offsetReceive (node_t *node, int *ch, byte *fin, int *offset);
+void  Huff_offsetReceive (node_t *node, int *ch, byte *fin, int *offset, int maxoffset);
 void  Huff_offsetTransmit (huff_t *huff, int ch, byte *fout, int *offset);
 void  Huff_putBit( int bit, byte *fout, int *offset);
 int   Huff_getBit( byte *fout, int *offset);
 
+//
+// canonical.c
+//
+
+#define HUFF_CANON_TAG      0xC1  // first byte of canonical data, never a Huff_Compress size
+#define HUFF_CANON_MAX_LEN  12    // longest code, bits
+#define HUFF_CANON_HEADER   (1 + 4 + 128)
+
+int   Huff_CanonicalCompressedSize(const byte *data, int size);
+int   Huff_CanonicalCompress(const byte *data, int size, byte *out, int maxsize);
+int   Huff_CanonicalSize(const byte *data, int size, byte tag);
+int   Huff_CanonicalDecompress(const byte *data, int size, byte *out, int maxsize);
+
+#define HUFF_INTERLEAVED_TAG    0xC4  // canonical code split over HUFF_STREAMS streams
+#define HUFF_STREAMS            4
+#define HUFF_INTERLEAVED_HEADER (HUFF_CANON_HEADER + 4 * (HUFF_STREAMS - 1))
+
+int   Huff_InterleavedCompressedSize(const byte *data, int size);
+int   Huff_InterleavedCompress(const byte *data, int size, byte *out, int maxsize);
+int   Huff_InterleavedDecompress(const byte *data, int size, byte *out, int maxsize);
+
 // don't use if you don't know what you're doing.
 int   Huff_getBloc(void);
 void  Huff_setBloc(int _bloc);
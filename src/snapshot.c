@@ -0,0 +1,642 @@
+// snapshot.c -- server side helpers for building client snapshots
+
+#include <stdlib.h>
+#include <string.h>
+#include "q_shared.h"
+#include "qcommon.h"
+
+/*
+=============================================================================
+
+delta cache
+
+When many clients acknowledged the same frame, the delta of an entity
+between two frames is the same bitstream for all of them.  The cache keeps
+the encoded bits keyed by (entity, from frame, to frame), and appends them to
+each client message with MSG_AppendBits.
+
+=============================================================================
+*/
+
+#define	DELTA_CACHE_SCRATCH	1024	// comfortably more than a full entity delta
+
+static unsigned SV_DeltaCacheHash( int number, int fromFrame, int toFrame, qboolean force, int tableId ) {
+	unsigned	hash;
+
+	hash = (unsigned)number * 0x9e3779b1u;
+	hash ^= (unsigned)tableId * 0x165667b1u;
+	hash ^= (unsigned)fromFrame * 0x85ebca6bu;
+	hash ^= (unsigned)toFrame * 0xc2b2ae35u;
+	hash ^= force ? 0x27d4eb2fu : 0;
+	return hash ^ ( hash >> 15 );
+}
+
+qboolean SV_DeltaCacheInit( deltaCache_t *cache, int maxEntries ) {
+	int		numSlots;
+
+	memset( cache, 0, sizeof( *cache ) );
+
+	// keep the table at most 3/4 full
+	numSlots = 16;
+	while ( numSlots < maxEntries + maxEntries / 3 ) {
+		numSlots <<= 1;
+	}
+
+	cache->entries = malloc( numSlots * sizeof( *cache->entries ) );
+	cache->poolSize = maxEntries * DELTA_CACHE_AVERAGE;
+	cache->pool = malloc( cache->poolSize );
+	if ( !cache->entries || !cache->pool ) {
+		SV_DeltaCacheFree( cache );
+		return qfalse;
+	}
+	cache->numSlots = numSlots;
+	cache->maxEntries = maxEntries;
+	SV_DeltaCacheClear( cache );
+	return qtrue;
+}
+
+void SV_DeltaCacheFree( deltaCache_t *cache ) {
+	free( cache->entries );
+	free( cache->pool );
+	memset( cache, 0, sizeof( *cache ) );
+}
+
+void SV_DeltaCacheClear( deltaCache_t *cache ) {
+	int		i;
+
+	for ( i = 0 ; i < cache->numSlots ; i++ ) {
+		cache->entries[i].number = -1;
+	}
+	cache->numEntries = 0;
+	cache->poolUsed = 0;
+}
+
+/*
+==================
+SV_DeltaCacheWriteEntity
+
+Same as MSG_WriteDeltaEntity, but the bits are taken from the cache when
+the same delta has already been encoded
+==================
+*/
+void SV_DeltaCacheWriteEntity( deltaCache_t *cache, msg_t *msg, int fromFrame, int toFrame,
+								  entityState_t *from, entityState_t *to, qboolean force ) {
+	deltaCacheEntry_t	*entry;
+	msg_t				scratch;
+	byte				buf[DELTA_CACHE_SCRATCH];
+	int					number, tableId;
+	unsigned			slot;
+
+	if ( to ) {
+		number = to->number;
+	} else if ( from ) {
+		number = from->number;
+	} else {
+		return;
+	}
+
+	// the same delta is a different bitstream under another huffman table
+	tableId = msg->table ? msg->table->id : 0;
+
+	slot = SV_DeltaCacheHash( number, fromFrame, toFrame, force, tableId ) & ( cache->numSlots - 1 );
+	for ( ;; slot = ( slot + 1 ) & ( cache->numSlots - 1 ) ) {
+		entry = &cache->entries[slot];
+		if ( entry->number == -1 ) {
+			break;
+		}
+		if ( entry->number == number && entry->fromFrame == fromFrame &&
+			 entry->toFrame == toFrame && entry->force == force && entry->tableId == tableId ) {
+			cache->hits++;
+			MSG_AppendBits( msg, cache->pool + entry->offset, entry->bits );
+			return;
+		}
+	}
+
+	cache->misses++;
+
+	MSG_Init( &scratch, buf, sizeof( buf ) );
+	scratch.table = msg->table;
+	MSG_WriteDeltaEntity( &scratch, from, to, force );
+
+	// when full, drop everything: stale frames are never asked for again,
+	// and the deltas of the current frame quickly repopulate the cache
+	if ( scratch.cursize <= cache->poolSize ) {
+		if ( cache->numEntries >= cache->maxEntries ||
+			 cache->poolUsed + scratch.cursize > cache->poolSize ) {
+			SV_DeltaCacheClear( cache );
+			cache->evictions++;
+			entry = &cache->entries[SV_DeltaCacheHash( number, fromFrame, toFrame, force, tableId ) & ( cache->numSlots - 1 )];
+		}
+
+		entry->number = number;
+		entry->fromFrame = fromFrame;
+		entry->toFrame = toFrame;
+		entry->force = force;
+		entry->tableId = tableId;
+		entry->bits = scratch.bit;
+		entry->offset = cache->poolUsed;
+		memcpy( cache->pool + cache->poolUsed, buf, scratch.cursize );
+		cache->poolUsed += scratch.cursize;
+		cache->numEntries++;
+	}
+
+	MSG_AppendBits( msg, buf, scratch.bit );
+}
+
+/*
+=============================================================================
+
+snapshot ring
+
+Holds the entity sets and player states of the last frames sent to a client,
+indexed by frame number modulo the ring size.  The entities of each frame are
+kept sorted by number in a fixed slice of one big array, so nothing is
+allocated after SV_RingInit.
+
+=============================================================================
+*/
+
+qboolean SV_RingInit( snapshotRing_t *ring, int numFrames, int maxEntities ) {
+	int		i;
+
+	memset( ring, 0, sizeof( *ring ) );
+
+	ring->frames = malloc( numFrames * sizeof( *ring->frames ) );
+	ring->entities = malloc( (size_t)numFrames * maxEntities * sizeof( *ring->entities ) );
+	ring->baselines = calloc( MAX_GENTITIES, sizeof( *ring->baselines ) );
+	if ( !ring->frames || !ring->entities || !ring->baselines ) {
+		SV_RingFree( ring );
+		return qfalse;
+	}
+
+	ring->numFrames = numFrames;
+	ring->maxEntities = maxEntities;
+	for ( i = 0 ; i < numFrames ; i++ ) {
+		ring->frames[i].frame = -1;
+		ring->frames[i].numEntities = 0;
+		ring->frames[i].entities = ring->entities + (size_t)i * maxEntities;
+	}
+	for ( i = 0 ; i < MAX_GENTITIES ; i++ ) {
+		ring->baselines[i].number = i;
+	}
+	return qtrue;
+}
+
+void SV_RingFree( snapshotRing_t *ring ) {
+	free( ring->frames );
+	free( ring->entities );
+	free( ring->baselines );
+	memset( ring, 0, sizeof( *ring ) );
+}
+
+snapshotFrame_t *SV_RingFrame( snapshotRing_t *ring, int frame ) {
+	snapshotFrame_t	*f;
+
+	if ( frame < 0 ) {
+		return NULL;
+	}
+	f = &ring->frames[frame % ring->numFrames];
+	if ( f->frame != frame ) {
+		return NULL;
+	}
+	return f;
+}
+
+/*
+==================
+SV_RingStore
+
+Claims the slot of frame, dropping whatever older frame was stored there
+==================
+*/
+snapshotFrame_t *SV_RingStore( snapshotRing_t *ring, int frame ) {
+	snapshotFrame_t	*f;
+
+	if ( frame < 0 ) {
+		return NULL;
+	}
+	f = &ring->frames[frame % ring->numFrames];
+	f->frame = frame;
+	f->numEntities = 0;
+	memset( &f->ps, 0, sizeof( f->ps ) );
+	return f;
+}
+
+// returns the index of number in the frame, or where it would be inserted
+static int SV_RingSearch( const snapshotFrame_t *f, int number ) {
+	int		lo, hi, mid;
+
+	lo = 0;
+	hi = f->numEntities;
+	while ( lo < hi ) {
+		mid = ( lo + hi ) >> 1;
+		if ( f->entities[mid].number < number ) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+entityState_t *SV_RingFindEntity( snapshotFrame_t *f, int number ) {
+	int		i;
+
+	i = SV_RingSearch( f, number );
+	if ( i < f->numEntities && f->entities[i].number == number ) {
+		return &f->entities[i];
+	}
+	return NULL;
+}
+
+/*
+==================
+SV_RingSetEntity
+
+Replaces the entity with the same number, or inserts it in order.
+Returns qfalse if the frame is full.
+==================
+*/
+qboolean SV_RingSetEntity( snapshotRing_t *ring, snapshotFrame_t *f, const entityState_t *es ) {
+	int		i;
+
+	i = SV_RingSearch( f, es->number );
+	if ( i < f->numEntities && f->entities[i].number == es->number ) {
+		f->entities[i] = *es;
+		return qtrue;
+	}
+
+	if ( f->numEntities >= ring->maxEntities ) {
+		return qfalse;
+	}
+	memmove( &f->entities[i + 1], &f->entities[i], ( f->numEntities - i ) * sizeof( *es ) );
+	f->entities[i] = *es;
+	f->numEntities++;
+	return qtrue;
+}
+
+qboolean SV_RingRemoveEntity( snapshotFrame_t *f, int number ) {
+	int		i;
+
+	i = SV_RingSearch( f, number );
+	if ( i >= f->numEntities || f->entities[i].number != number ) {
+		return qfalse;
+	}
+	memmove( &f->entities[i], &f->entities[i + 1], ( f->numEntities - i - 1 ) * sizeof( f->entities[0] ) );
+	f->numEntities--;
+	return qtrue;
+}
+
+/*
+==================
+SV_EmitPacketEntities
+
+Writes a delta update of an entityState_t list to the message.
+A NULL from frame sends every entity from its baseline.
+==================
+*/
+void SV_EmitPacketEntities( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to, msg_t *msg ) {
+	entityState_t	*oldent, *newent;
+	int		oldindex, newindex;
+	int		oldnum, newnum;
+	int		from_num_entities;
+
+	// generate the delta update
+	if ( !from ) {
+		from_num_entities = 0;
+	} else {
+		from_num_entities = from->numEntities;
+	}
+
+	newent = NULL;
+	oldent = NULL;
+	newindex = 0;
+	oldindex = 0;
+	while ( newindex < to->numEntities || oldindex < from_num_entities ) {
+		if ( newindex >= to->numEntities ) {
+			newnum = 9999;
+		} else {
+			newent = &to->entities[newindex];
+			newnum = newent->number;
+		}
+
+		if ( oldindex >= from_num_entities ) {
+			oldnum = 9999;
+		} else {
+			oldent = &from->entities[oldindex];
+			oldnum = oldent->number;
+		}
+
+		if ( newnum == oldnum ) {
+			// delta update from old position
+			// because the force parm is qfalse, this will not result
+			// in any bytes being emited if the entity has not changed at all
+			MSG_WriteDeltaEntity (msg, oldent, newent, qfalse );
+			oldindex++;
+			newindex++;
+			continue;
+		}
+
+		if ( newnum < oldnum ) {
+			// this is a new entity, send it from the baseline
+			MSG_WriteDeltaEntity (msg, &ring->baselines[newnum], newent, qtrue );
+			newindex++;
+			continue;
+		}
+
+		if ( newnum > oldnum ) {
+			// the old entity isn't present in the new message
+			MSG_WriteDeltaEntity (msg, oldent, NULL, qtrue );
+			oldindex++;
+			continue;
+		}
+	}
+
+	MSG_WriteBits( msg, (MAX_GENTITIES-1), GENTITYNUM_BITS );	// end of packetentities
+}
+
+// bits of the end of packetentities marker
+static int SV_EndMarkerCost( const msgHuffTable_t *table ) {
+	if ( !table ) {
+		return MSG_BitsCost( MAX_GENTITIES-1, GENTITYNUM_BITS );
+	}
+	return MSG_TableBitsCost( table, MAX_GENTITIES-1, GENTITYNUM_BITS );
+}
+
+/*
+==================
+SV_PacketEntitiesCost
+
+Number of bits SV_EmitPacketEntities( ring, from, to, msg ) would write
+with table, NULL for msgHuff
+==================
+*/
+int SV_PacketEntitiesCost( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to,
+						   const msgHuffTable_t *table ) {
+	int		oldindex, newindex;
+	int		oldnum, newnum;
+	int		from_num_entities;
+	int		cost;
+
+	from_num_entities = from ? from->numEntities : 0;
+
+	cost = 0;
+	oldindex = 0;
+	newindex = 0;
+	while ( newindex < to->numEntities || oldindex < from_num_entities ) {
+		newnum = newindex < to->numEntities ? to->entities[newindex].number : 9999;
+		oldnum = oldindex < from_num_entities ? from->entities[oldindex].number : 9999;
+
+		if ( newnum == oldnum ) {
+			cost += MSG_DeltaEntityCost( table, &from->entities[oldindex], &to->entities[newindex], qfalse );
+			oldindex++;
+			newindex++;
+		} else if ( newnum < oldnum ) {
+			cost += MSG_DeltaEntityCost( table, &ring->baselines[newnum], &to->entities[newindex], qtrue );
+			newindex++;
+		} else {
+			cost += MSG_DeltaEntityCost( table, &from->entities[oldindex], NULL, qtrue );
+			oldindex++;
+		}
+	}
+
+	return cost + SV_EndMarkerCost( table );
+}
+
+/*
+==================
+SV_SnapshotCost
+
+Bits of the playerstate and packet entities of a snapshot deltaed
+from "from", NULL for no delta, with table, NULL for msgHuff
+==================
+*/
+int SV_SnapshotCost( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to,
+					 const msgHuffTable_t *table ) {
+	return MSG_DeltaPlayerstateCost( table, from ? &from->ps : NULL, &to->ps ) +
+		SV_PacketEntitiesCost( ring, from, to, table );
+}
+
+/*
+==================
+SV_BestDeltaFrame
+
+Picks the cheapest of the candidate frames to delta the to frame from.
+A negative candidate stands for no delta at all, candidates that are no
+longer in the ring are skipped.  Returns the frame, or -2 when none of
+them can be used, and its cost in bits with table, NULL for msgHuff.
+
+The snapshot header carries a single delta frame, so this is chosen for
+the whole snapshot rather than per entity.
+==================
+*/
+int SV_BestDeltaFrame( snapshotRing_t *ring, snapshotFrame_t *to, const int *candidates,
+					   int numCandidates, const msgHuffTable_t *table, int *bestCost ) {
+	snapshotFrame_t	*from;
+	int		i, cost, best;
+
+	best = -2;
+	*bestCost = 0;
+	for ( i = 0 ; i < numCandidates ; i++ ) {
+		if ( candidates[i] < 0 ) {
+			from = NULL;
+		} else {
+			from = SV_RingFrame( ring, candidates[i] );
+			if ( !from || from == to ) {
+				continue;
+			}
+		}
+		cost = SV_SnapshotCost( ring, from, to, table );
+		if ( best == -2 || cost < *bestCost ) {
+			best = from ? candidates[i] : -1;
+			*bestCost = cost;
+		}
+	}
+	return best;
+}
+
+/*
+==================
+SV_BuildClientSnapshot
+
+Stores the entities of world flagged in the visible bit array (all of
+them when it is NULL) as the client's frame, then writes its playerstate
+and packet entities delta from deltaFrame, or from the baselines if
+deltaFrame is not in the ring.  The snapshot header is up to the caller.
+
+Nothing here touches shared state, so clients can be built in parallel
+as long as each has its own ring and message.
+==================
+*/
+void SV_BuildClientSnapshot( snapshotRing_t *ring, int frame, int deltaFrame,
+							 const entityState_t *world, int numWorld, const byte *visible,
+							 const playerState_t *ps, msg_t *msg ) {
+	snapshotFrame_t	*from, *to;
+	int		i;
+
+	// look up the old frame first, storing the new one may reuse its slot
+	from = deltaFrame == frame ? NULL : SV_RingFrame( ring, deltaFrame );
+	if ( from && ( frame - deltaFrame ) % ring->numFrames == 0 ) {
+		from = NULL;
+	}
+
+	to = SV_RingStore( ring, frame );
+	if ( !to ) {
+		return;
+	}
+	to->ps = *ps;
+	for ( i = 0 ; i < numWorld && to->numEntities < ring->maxEntities ; i++ ) {
+		if ( visible && !( visible[world[i].number >> 3] & ( 1 << ( world[i].number & 7 ) ) ) ) {
+			continue;
+		}
+		to->entities[to->numEntities++] = world[i];
+	}
+
+	MSG_WriteDeltaPlayerstate( msg, from ? &from->ps : NULL, &to->ps );
+	SV_EmitPacketEntities( ring, from, to, msg );
+}
+
+/*
+=============================================================================
+
+rate scheduling
+
+Fits the entity updates of a snapshot into a bit budget, most important
+first.  Every update is sized exactly with MSG_DeltaEntityCost instead of
+being encoded and thrown away.  Updates that don't make it are taken back
+out of the to frame, so the stored frame is what the client will really
+have and the next snapshot picks them up again.
+
+=============================================================================
+*/
+
+typedef enum {
+	UPDATE_CHANGED,
+	UPDATE_NEW,
+	UPDATE_REMOVED
+} updateType_t;
+
+typedef struct {
+	int				number;
+	updateType_t	type;
+	int				cost;
+	float			priority;
+	entityState_t	*oldent, *newent;
+} entityUpdate_t;
+
+static int SV_CompareUpdates( const void *a, const void *b ) {
+	const entityUpdate_t	*ua = a, *ub = b;
+
+	if ( ua->priority != ub->priority ) {
+		return ua->priority > ub->priority ? -1 : 1;
+	}
+	return ua->number - ub->number;
+}
+
+/*
+==================
+SV_ScheduleEntities
+
+Defers the lowest priority entity updates from "from" (NULL for the
+baselines) to "to" that don't fit in budgetBits, end marker included.
+priorities is indexed by entity number.  The numbers of the deferred
+entities are written to deferred, which must have room for the entities
+of both frames.  The updates are sized for table, NULL for msgHuff.
+Returns how many there are, or -1 if out of memory.
+==================
+*/
+int SV_ScheduleEntities( snapshotRing_t *ring, snapshotFrame_t *from, snapshotFrame_t *to,
+						 int budgetBits, const float *priorities, const msgHuffTable_t *table,
+						 int *deferred ) {
+	entityUpdate_t	*updates, *u;
+	entityState_t	*oldent, *newent;
+	int		oldindex, newindex;
+	int		oldnum, newnum;
+	int		from_num_entities;
+	int		i, numUpdates, numDeferred, freeSlots;
+
+	from_num_entities = from ? from->numEntities : 0;
+	updates = malloc( ( from_num_entities + to->numEntities + 1 ) * sizeof( *updates ) );
+	if ( !updates ) {
+		return -1;
+	}
+
+	// same walk as SV_EmitPacketEntities
+	numUpdates = 0;
+	oldindex = 0;
+	newindex = 0;
+	while ( newindex < to->numEntities || oldindex < from_num_entities ) {
+		newent = newindex < to->numEntities ? &to->entities[newindex] : NULL;
+		oldent = oldindex < from_num_entities ? &from->entities[oldindex] : NULL;
+		newnum = newent ? newent->number : 9999;
+		oldnum = oldent ? oldent->number : 9999;
+
+		u = &updates[numUpdates];
+		if ( newnum == oldnum ) {
+			u->type = UPDATE_CHANGED;
+			u->cost = MSG_DeltaEntityCost( table, oldent, newent, qfalse );
+			oldindex++;
+			newindex++;
+		} else if ( newnum < oldnum ) {
+			u->type = UPDATE_NEW;
+			u->cost = MSG_DeltaEntityCost( table, &ring->baselines[newnum], newent, qtrue );
+			oldent = NULL;
+			newindex++;
+		} else {
+			u->type = UPDATE_REMOVED;
+			u->cost = MSG_DeltaEntityCost( table, oldent, NULL, qtrue );
+			newent = NULL;
+			oldindex++;
+		}
+
+		if ( u->cost == 0 ) {
+			continue;	// unchanged, costs nothing to keep
+		}
+		u->number = newent ? newent->number : oldent->number;
+		u->priority = priorities ? priorities[u->number] : 0.0f;
+		u->oldent = oldent;
+		u->newent = newent;
+		numUpdates++;
+	}
+
+	qsort( updates, numUpdates, sizeof( *updates ), SV_CompareUpdates );
+
+	budgetBits -= SV_EndMarkerCost( table );
+	freeSlots = ring->maxEntities - to->numEntities;
+	numDeferred = 0;
+	for ( i = 0, u = updates ; i < numUpdates ; i++, u++ ) {
+		if ( u->cost <= budgetBits ) {
+			budgetBits -= u->cost;
+			continue;
+		}
+		if ( u->type == UPDATE_REMOVED && freeSlots == 0 ) {
+			// no room to keep it around, the removal has to go out
+			budgetBits -= u->cost;
+			continue;
+		}
+		if ( u->type == UPDATE_CHANGED ) {
+			*u->newent = *u->oldent;
+		} else if ( u->type == UPDATE_NEW ) {
+			freeSlots++;
+		} else {
+			freeSlots--;
+		}
+		deferred[numDeferred++] = u->number;
+		u->cost = -1;	// mark as deferred
+	}
+
+	// entity pointers into to are stale once it is resized
+	for ( i = 0, u = updates ; i < numUpdates ; i++, u++ ) {
+		if ( u->cost == -1 && u->type == UPDATE_NEW ) {
+			SV_RingRemoveEntity( to, u->number );
+		}
+	}
+	for ( i = 0, u = updates ; i < numUpdates ; i++, u++ ) {
+		if ( u->cost == -1 && u->type == UPDATE_REMOVED ) {
+			SV_RingSetEntity( ring, to, u->oldent );
+		}
+	}
+
+	free( updates );
+	return numDeferred;
+}
@@ -0,0 +1,248 @@
+// sys_thread.c -- minimal portable worker threads
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "q_shared.h"
+#include "qcommon.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#define	MAX_WORKER_THREADS	64
+
+typedef struct {
+	workFunc_t	func;
+	void		*data;
+	int			count;
+	volatile long	next;	// next unclaimed work item
+} workQueue_t;
+
+static int Sys_NextWorkItem( workQueue_t *queue ) {
+#ifdef _WIN32
+	return (int)InterlockedIncrement( &queue->next ) - 1;
+#else
+	return (int)__atomic_fetch_add( &queue->next, 1, __ATOMIC_RELAXED );
+#endif
+}
+
+static void Sys_WorkerLoop( workQueue_t *queue ) {
+	int		i;
+
+	while ( ( i = Sys_NextWorkItem( queue ) ) < queue->count ) {
+		queue->func( queue->data, i );
+	}
+}
+
+/*
+=============================================================================
+
+worker pool
+
+The workers are started the first time they are needed and then sleep until
+the next Sys_ParallelFor, which wakes them by bumping the generation.
+
+=============================================================================
+*/
+
+#ifdef _WIN32
+static SRWLOCK				poolLock = SRWLOCK_INIT;
+static CONDITION_VARIABLE	poolWake = CONDITION_VARIABLE_INIT;
+static CONDITION_VARIABLE	poolDone = CONDITION_VARIABLE_INIT;
+
+#define	Sys_PoolLock()		AcquireSRWLockExclusive( &poolLock )
+#define	Sys_PoolUnlock()	ReleaseSRWLockExclusive( &poolLock )
+#define	Sys_PoolWait( c )	SleepConditionVariableSRW( c, &poolLock, INFINITE, 0 )
+#define	Sys_PoolSignal( c )	WakeConditionVariable( c )
+#define	Sys_PoolBroadcast( c )	WakeAllConditionVariable( c )
+#else
+static pthread_mutex_t		poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		poolWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		poolDone = PTHREAD_COND_INITIALIZER;
+
+#define	Sys_PoolLock()		pthread_mutex_lock( &poolLock )
+#define	Sys_PoolUnlock()	pthread_mutex_unlock( &poolLock )
+#define	Sys_PoolWait( c )	pthread_cond_wait( c, &poolLock )
+#define	Sys_PoolSignal( c )	pthread_cond_signal( c )
+#define	Sys_PoolBroadcast( c )	pthread_cond_broadcast( c )
+#endif
+
+static struct {
+	int			numWorkers;		// started so far, never stopped
+	qboolean	inUse;			// a Sys_ParallelFor owns the workers
+	workQueue_t	*queue;
+	unsigned	generation;		// bumped for every job
+	int			wanted;			// workers below this index take part in the job
+	int			active;			// of those, still working
+} pool;
+
+static void Sys_PoolWorker( int index ) {
+	unsigned	seen;
+	workQueue_t	*queue;
+
+	// a worker started late for a job still takes part in it: the caller
+	// counted it in active and waits for it
+	seen = 0;
+
+	Sys_PoolLock();
+	for ( ;; ) {
+		while ( seen == pool.generation ) {
+			Sys_PoolWait( &poolWake );
+		}
+		seen = pool.generation;
+		if ( index >= pool.wanted ) {
+			continue;
+		}
+
+		queue = pool.queue;
+		Sys_PoolUnlock();
+		Sys_WorkerLoop( queue );
+		Sys_PoolLock();
+
+		if ( --pool.active == 0 ) {
+			Sys_PoolSignal( &poolDone );
+		}
+	}
+}
+
+#ifdef _WIN32
+static DWORD WINAPI Sys_WorkerThread( LPVOID arg ) {
+	Sys_PoolWorker( (int)(intptr_t)arg );
+	return 0;
+}
+
+static qboolean Sys_StartWorker( int index ) {
+	HANDLE	thread;
+
+	thread = CreateThread( NULL, 0, Sys_WorkerThread, (LPVOID)(intptr_t)index, 0, NULL );
+	if ( !thread ) {
+		return qfalse;
+	}
+	CloseHandle( thread );
+	return qtrue;
+}
+#else
+static void *Sys_WorkerThread( void *arg ) {
+	Sys_PoolWorker( (int)(intptr_t)arg );
+	return NULL;
+}
+
+// only the forking thread survives in the child, so it starts over
+static void Sys_PoolAfterFork( void ) {
+	pthread_mutex_init( &poolLock, NULL );
+	pthread_cond_init( &poolWake, NULL );
+	pthread_cond_init( &poolDone, NULL );
+	memset( &pool, 0, sizeof( pool ) );
+}
+
+static qboolean Sys_StartWorker( int index ) {
+	static qboolean	registered;
+	pthread_t		thread;
+
+	if ( !registered ) {
+		pthread_atfork( NULL, NULL, Sys_PoolAfterFork );
+		registered = qtrue;
+	}
+	if ( pthread_create( &thread, NULL, Sys_WorkerThread, (void *)(intptr_t)index ) != 0 ) {
+		return qfalse;
+	}
+	pthread_detach( thread );
+	return qtrue;
+}
+#endif
+
+int Sys_NumCPUs( void ) {
+#ifdef _WIN32
+	SYSTEM_INFO	info;
+
+	GetSystemInfo( &info );
+	return info.dwNumberOfProcessors > 0 ? (int)info.dwNumberOfProcessors : 1;
+#else
+	long	n;
+
+	n = sysconf( _SC_NPROCESSORS_ONLN );
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+/*
+==================
+Sys_ParallelFor
+
+Calls func( data, i ) for every i in [0, count) on up to numThreads
+threads, the calling thread included.  Items are handed out one at a
+time so uneven jobs balance themselves.  Returns when all are done.
+A numThreads of 0 or less uses one thread per CPU.
+
+The threads come from the worker pool.  While one call has them, other
+calls, including nested ones, run on their calling thread alone.
+==================
+*/
+void Sys_ParallelFor( int numThreads, workFunc_t func, void *data, int count ) {
+	workQueue_t	queue;
+
+	if ( numThreads <= 0 ) {
+		numThreads = Sys_NumCPUs();
+	}
+	if ( numThreads > count ) {
+		numThreads = count;
+	}
+	if ( numThreads > MAX_WORKER_THREADS ) {
+		numThreads = MAX_WORKER_THREADS;
+	}
+
+	queue.func = func;
+	queue.data = data;
+	queue.count = count;
+	queue.next = 0;
+
+	if ( numThreads <= 1 ) {
+		Sys_WorkerLoop( &queue );
+		return;
+	}
+
+	Sys_PoolLock();
+
+	// another call, or a work item of this one, has the workers: rather
+	// than wait for them, do the work on this thread
+	if ( pool.inUse ) {
+		Sys_PoolUnlock();
+		Sys_WorkerLoop( &queue );
+		return;
+	}
+	pool.inUse = qtrue;
+
+	// if a thread can't be started the ones that did, and this one,
+	// simply pick up more of the work
+	while ( pool.numWorkers < numThreads - 1 && Sys_StartWorker( pool.numWorkers ) ) {
+		pool.numWorkers++;
+	}
+
+	pool.queue = &queue;
+	pool.wanted = pool.numWorkers < numThreads - 1 ? pool.numWorkers : numThreads - 1;
+	pool.active = pool.wanted;
+	if ( ++pool.generation == 0 ) {
+		pool.generation = 1;	// new workers start out having seen 0
+	}
+	Sys_PoolBroadcast( &poolWake );
+	Sys_PoolUnlock();
+
+	Sys_WorkerLoop( &queue );
+
+	// the queue lives on this stack, so wait until no worker uses it
+	Sys_PoolLock();
+	while ( pool.active > 0 ) {
+		Sys_PoolWait( &poolDone );
+	}
+	pool.queue = NULL;
+	pool.inUse = qfalse;
+	Sys_PoolUnlock();
+}
@@ -0,0 +1,293 @@
+#!/usr/bin/env python
+
+import array
+import itertools
+import q3huff
+import random
+import struct
+import threading
+import unittest
+
+ENTITY_WORDS = q3huff.ENTITYSTATE_SIZE // 4
+PLAYER_WORDS = q3huff.PLAYERSTATE_SIZE // 4
+
+def entity(number, **words):
+    state = array.array('i', [0] * ENTITY_WORDS)
+    state[0] = number
+    for index, value in words.items():
+        state[int(index[1:])] = value
+    return state.tobytes()
+
+def random_entity(number):
+    state = array.array('i', [0] * ENTITY_WORDS)
+    state[0] = number
+    for i in random.sample(range(1, ENTITY_WORDS), random.randint(0, 8)):
+        state[i] = random.randint(0, 255)
+    # pos.trBase[0] is sent as a float
+    struct.pack_into('<f', state, 6 * 4, random.choice([0.0, 12.0, 1.5]))
+    return state.tobytes()
+
+def random_playerstate():
+    state = array.array('i', [0] * PLAYER_WORDS)
+    # everything up to jumppad_ent but externalEventTime goes over the wire
+    for i in random.sample([i for i in range(113) if i != 34], random.randint(0, 12)):
+        # small enough for the narrowest (4 bit) fields
+        state[i] = random.randint(0, 15)
+    return state.tobytes()
+
+def bit_length(write, table=None):
+    # the writer only exposes whole bytes, so find where a prefix of 1-7
+    # raw bits pushes the output into the next byte
+    lengths = []
+    for prefix in range(8):
+        writer = q3huff.Writer(table)
+        if prefix:
+            writer.write_bits(0, prefix)
+        write(writer)
+        lengths.append(len(writer.data))
+    for prefix in range(1, 8):
+        if lengths[prefix] > lengths[0]:
+            return 8 * (lengths[0] - 1) + 8 - prefix
+    return 8 * (lengths[0] - 1)
+
+class Q3HuffTestCase(unittest.TestCase):
+    def test_change_masks(self):
+        # pos.trTime is the first field, frame is the last
+        frm = entity(5) * 4
+        to = entity(5) + entity(5, w4=1) + entity(5, w43=1) + entity(6)
+        masks, last_changed = q3huff.entity_change_masks(frm, to)
+        assert masks == [0, 1, 1 << 50, 0]
+        assert last_changed == [0, 1, 51, 0]
+
+    def test_roundtrip(self):
+        for _ in range(100):
+            frm = [random_entity(n) for n in range(16)]
+            to = [random_entity(n) for n in range(16)]
+
+            writer = q3huff.Writer()
+            for i in range(16):
+                writer.write_delta_entity(frm[i], to[i], True)
+            writer.write_delta_entity(frm[0], None)
+            writer.write_bits(q3huff.MAX_GENTITIES - 1, q3huff.GENTITYNUM_BITS)
+
+            reader = q3huff.Reader(writer.data)
+            for i in range(16):
+                number = reader.read_bits(q3huff.GENTITYNUM_BITS)
+                assert number == i
+                assert reader.read_delta_entity(frm[i], number) == to[i]
+            number = reader.read_bits(q3huff.GENTITYNUM_BITS)
+            removed = reader.read_delta_entity(frm[0], number)
+            assert struct.unpack_from('<i', removed)[0] == q3huff.MAX_GENTITIES - 1
+            assert reader.read_bits(q3huff.GENTITYNUM_BITS) == q3huff.MAX_GENTITIES - 1
+
+    def test_delta_cache(self):
+        cache = q3huff.DeltaCache()
+        frm = [random_entity(n) for n in range(32)]
+        to = [random_entity(n) for n in range(32)]
+
+        for prefix_bits in range(1, 9):
+            direct = q3huff.Writer()
+            cached = q3huff.Writer()
+            for writer in (direct, cached):
+                writer.write_bits(0x55, prefix_bits)
+            for i in range(32):
+                direct.write_delta_entity(frm[i], to[i])
+                cache.write_delta_entity(cached, 10, 11, frm[i], to[i])
+            direct.write_bits(3, 2)
+            cached.write_bits(3, 2)
+            assert direct.data == cached.data
+
+        assert cache.misses == 32
+        assert cache.hits == 32 * 7
+        assert len(cache) == 32
+        cache.clear()
+        assert len(cache) == 0
+
+        # a full cache is flushed and keeps caching
+        small = q3huff.DeltaCache(max_entries=8)
+        for frame in range(4):
+            writer = q3huff.Writer()
+            for i in range(32):
+                small.write_delta_entity(writer, frame, frame + 1, frm[i], to[i])
+            assert len(small) <= 8
+        assert small.evictions > 0
+        writer = q3huff.Writer()
+        small.write_delta_entity(writer, 3, 4, frm[31], to[31])
+        assert small.hits == 1
+
+    def test_snapshot_ring(self):
+        ring = q3huff.SnapshotRing()
+        ring.store(1, None, entity(1, w4=1) + entity(2, w4=2) + entity(5, w4=5))
+        ring.store(2, None, entity(1, w4=9) + entity(2, w4=2))
+        ring.set_entity(2, entity(7, w43=3))
+        assert 1 in ring and 2 in ring and 3 not in ring
+        assert ring.get_entity(2, 7) == entity(7, w43=3)
+        assert ring.get_entity(2, 5) is None
+
+        ring.store(1 + q3huff.PACKET_BACKUP, None)
+        assert 1 not in ring
+        self.assertRaises(KeyError, ring.get_entities, 1)
+        ring.store(1, None, entity(1, w4=1) + entity(2, w4=2) + entity(5, w4=5))
+        # a rejected store leaves the frame in the slot alone
+        for bad in (entity(2) + entity(1), entity(1) + b'x', entity(1) * 257):
+            self.assertRaises(ValueError, ring.store, 1 + q3huff.PACKET_BACKUP, None, bad)
+        assert 1 in ring and 1 + q3huff.PACKET_BACKUP not in ring
+        assert ring.get_entity(1, 5) == entity(5, w4=5)
+
+        writer = q3huff.Writer()
+        ring.write_packet_entities(writer, 1, 2)
+        reader = q3huff.Reader(writer.data)
+        updates = {}
+        while True:
+            number = reader.read_bits(q3huff.GENTITYNUM_BITS)
+            if number == q3huff.MAX_GENTITIES - 1:
+                break
+            frm = ring.get_entity(1, number) or ring.get_baseline(number)
+            updates[number] = reader.read_delta_entity(frm, number)
+        assert sorted(updates) == [1, 5, 7]
+        assert updates[1] == entity(1, w4=9)
+        assert updates[5][:4] == entity(q3huff.MAX_GENTITIES - 1)[:4]
+        assert updates[7] == entity(7, w43=3)
+
+    def test_playerstate_roundtrip(self):
+        for _ in range(100):
+            frm = random_playerstate()
+            to = random_playerstate()
+            writer = q3huff.Writer()
+            writer.write_delta_playerstate(frm, to)
+            writer.write_delta_playerstate(None, to)
+            reader = q3huff.Reader(writer.data)
+            assert reader.read_delta_playerstate(frm) == to
+            assert reader.read_delta_playerstate(None) == to
+
+    def test_build_snapshots(self):
+        world = [b''.join(random_entity(n) for n in range(64)) for _ in range(2)]
+        serial = [q3huff.SnapshotRing() for _ in range(8)]
+        threaded = [q3huff.SnapshotRing() for _ in range(8)]
+        visible = [set(random.sample(range(64), 40)) for _ in range(8)]
+        visible[0] = None
+        playerstates = [random_playerstate() for _ in range(8)]
+
+        for ring in serial + threaded:
+            ring.store(1, None, world[0])
+
+        jobs = []
+        expected = []
+        for i in range(8):
+            delta = 1 if i % 2 else -1
+            entities = b''.join(world[1][n * q3huff.ENTITYSTATE_SIZE:(n + 1) * q3huff.ENTITYSTATE_SIZE]
+                                for n in range(64) if visible[i] is None or n in visible[i])
+            serial[i].store(2, playerstates[i], entities)
+            writer = q3huff.Writer()
+            if delta < 0:
+                writer.write_delta_playerstate(None, playerstates[i])
+            else:
+                writer.write_delta_playerstate(serial[i].get_playerstate(delta), playerstates[i])
+            serial[i].write_packet_entities(writer, delta, 2)
+            expected.append(writer.data)
+            jobs.append((threaded[i], delta, visible[i], playerstates[i], q3huff.Writer()))
+
+        q3huff.build_snapshots(2, world[1], jobs, threads=4)
+        for i, job in enumerate(jobs):
+            assert job[4].data == expected[i]
+            assert threaded[i].get_entities(2) == serial[i].get_entities(2)
+
+        # from a world that isn't aligned for entity states
+        jobs = [job[:4] + (q3huff.Writer(),) for job in jobs]
+        q3huff.build_snapshots(2, memoryview(b'\0' + world[1])[1:], jobs, threads=4)
+        assert [job[4].data for job in jobs] == expected
+
+        self.assertRaises(KeyError, q3huff.build_snapshots, 3, world[1], [(threaded[0], 0, None, None, q3huff.Writer())])
+        self.assertRaises(ValueError, q3huff.build_snapshots, 3, world[1], [jobs[0], jobs[0]])
+
+        # concurrent calls share the worker pool
+        def build(index):
+            rings = [q3huff.SnapshotRing() for _ in range(8)]
+            for ring in rings:
+                ring.store(1, None, world[0])
+            own = [(rings[i],) + job[1:4] + (q3huff.Writer(),) for i, job in enumerate(jobs)]
+            for _ in range(10):
+                q3huff.build_snapshots(2, world[1], own, threads=4)
+                results[index].append([job[4].data for job in own])
+                for job in own:
+                    job[4].reset()
+        results = [[] for _ in range(4)]
+        workers = [threading.Thread(target=build, args=(i,)) for i in range(4)]
+        for worker in workers:
+            worker.start()
+        for worker in workers:
+            worker.join()
+        assert all(result == [expected] * 10 for result in results)
+
+        # and raise, rather than race, when they share a ring or a writer
+        def share():
+            for frame in range(3, 103):
+                try:
+                    q3huff.build_snapshots(frame, world[1], [(threaded[0], -1, None, None, writer)])
+                    writer.reset()
+                except RuntimeError as e:
+                    errors.append(e)
+        writer = q3huff.Writer()
+        errors = []
+        workers = [threading.Thread(target=share) for _ in range(4)]
+        for worker in workers:
+            worker.start()
+        for worker in workers:
+            worker.join()
+        assert all('in use by another thread' in str(e) for e in errors)
+
+    def test_schedule(self):
+        ring = q3huff.SnapshotRing()
+        ring.store(1, None, b''.join(random_entity(n) for n in range(48)))
+        table = q3huff.HuffmanTable([random.randint(1, 1000) for _ in range(256)])
+        for budget, table in itertools.product((0, 40, 120, 400, 4000), (None, table)):
+            ring.store(2, None, b''.join(random_entity(n) for n in range(16, 64)))
+            priorities = {n: n for n in range(64)}
+            deferred = ring.schedule(1, 2, budget, priorities, table)
+
+            writer = q3huff.Writer(table)
+            ring.write_packet_entities(writer, 1, 2)
+            assert len(writer.data) <= max(budget, 2) + 1
+            assert not deferred or budget < 4000
+            if budget == 0:
+                # only unchanged entities are left
+                assert ring.get_entities(2) == ring.get_entities(1)
+
+            reader = q3huff.Reader(writer.data, table)
+            received = {n: ring.get_entity(1, n) for n in range(48)}
+            while True:
+                number = reader.read_bits(q3huff.GENTITYNUM_BITS)
+                if number == q3huff.MAX_GENTITIES - 1:
+                    break
+                state = reader.read_delta_entity(received.get(number) or ring.get_baseline(number), number)
+                if struct.unpack_from('<i', state)[0] == q3huff.MAX_GENTITIES - 1:
+                    del received[number]
+                else:
+                    received[number] = state
+            assert b''.join(received[n] for n in sorted(received)) == ring.get_entities(2)
+
+    def test_best_delta_frame(self):
+        ring = q3huff.SnapshotRing()
+        for frame in range(1, 5):
+            ring.store(frame, random_playerstate(), b''.join(random_entity(n) for n in range(frame * 8, 48)))
+        ring.set_baseline(random_entity(20))
+
+        # costs follow the table the snapshot is written with
+        for table in (None, q3huff.HuffmanTable([random.randint(1, 1000) for _ in range(256)])):
+            costs = {}
+            for frm in (-1, 1, 2, 3):
+                def write(writer):
+                    writer.write_delta_playerstate(ring.get_playerstate(frm) if frm >= 0 else None,
+                                                   ring.get_playerstate(4))
+                    ring.write_packet_entities(writer, frm, 4)
+                costs[frm] = ring.delta_cost(frm, 4, table)
+                assert costs[frm] == bit_length(write, table)
+
+            frame, bits = ring.best_delta_frame(4, [-1, 1, 2, 3, 30], table=table)
+            assert bits == min(costs.values())
+            assert costs[frame] == bits
+        self.assertRaises(KeyError, ring.best_delta_frame, 4, [30, 4])
+        self.assertRaises(TypeError, ring.delta_cost, 1, 4, table=q3huff.Writer())
+
+if __name__ == '__main__':
+    unittest.main()
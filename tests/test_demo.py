@@ -0,0 +1,387 @@
+#!/usr/bin/env python
+
+import array
+import bisect
+import os
+import q3huff
+import random
+import struct
+import tempfile
+import unittest
+
+from tests.test_delta import random_entity, random_playerstate
+
+def random_message():
+    writer = q3huff.Writer()
+    values = [random.getrandbits(32) for _ in range(random.randint(0, 50))]
+    for value in values:
+        writer.write_long(value)
+    writer.write_string('end')
+    return writer.data, values
+
+def demo_bytes(messages, end=True):
+    data = b''.join(struct.pack('<ii', sequence, len(message)) + message for sequence, message in messages)
+    if end:
+        data += struct.pack('<ii', -1, -1)
+    return data
+
+def gamestate_message(configstrings, client_num, command_sequence=1):
+    writer = q3huff.Writer()
+    writer.write_long(0)
+    writer.write_byte(5)  # svc_serverCommand
+    writer.write_long(command_sequence)
+    writer.write_string('print "hello"')
+    writer.write_byte(2)  # svc_gamestate
+    writer.write_long(command_sequence)
+    for index, string in sorted(configstrings.items()):
+        writer.write_byte(3)  # svc_configstring
+        writer.write_short(index)
+        writer.write_bigstring(string)
+    writer.write_byte(8)  # svc_EOF
+    writer.write_long(client_num)
+    writer.write_long(1234)
+    writer.write_byte(8)
+    return writer.data
+
+def snapshot_message(ring, sequence, delta, server_time, playerstate, delta_num=None, commands=()):
+    writer = q3huff.Writer()
+    writer.write_long(0)
+    for command_sequence, command in commands:
+        writer.write_byte(5)  # svc_serverCommand
+        writer.write_long(command_sequence)
+        writer.write_string(command)
+    writer.write_byte(7)  # svc_snapshot
+    writer.write_long(server_time)
+    if delta_num is None:
+        delta_num = sequence - delta if delta >= 0 else 0
+    writer.write_byte(delta_num)
+    writer.write_byte(0)
+    writer.write_byte(0)
+    writer.write_delta_playerstate(ring.get_playerstate(delta) if delta >= 0 else None, playerstate)
+    ring.write_packet_entities(writer, delta, sequence)
+    writer.write_byte(8)
+    return writer.data
+
+def random_game(first_sequence, count, changes=0):
+    """A gamestate then count snapshots, with the messages and what
+    process_demos should make of them.  The commands are (server_time,
+    sequence, command), with changes of configstrings sent as commands."""
+    ring = q3huff.SnapshotRing()
+    configstrings = {i: 'cs %d' % random.getrandbits(32) for i in random.sample(range(1024), 20)}
+    messages = [(first_sequence, gamestate_message(configstrings, 3, first_sequence))]
+    commands = [(0, first_sequence, 'print "hello"')]
+    changed = set(random.sample(range(first_sequence + 2, first_sequence + 1 + count), min(changes, count - 1)))
+    expected = []
+    entities = {n: random_entity(n) for n in random.sample(range(64), 20)}
+    for sequence in range(first_sequence + 1, first_sequence + 1 + count):
+        for n in random.sample(range(64), 5):
+            if n in entities and random.random() < 0.5:
+                del entities[n]
+            else:
+                entities[n] = random_entity(n)
+        state = b''.join(entities[n] for n in sorted(entities))
+        playerstate = random_playerstate()
+        ring.store(sequence, playerstate, state)
+        if sequence == first_sequence + 1:
+            # from a frame that was never received, dropped like the client does
+            messages.append((sequence, snapshot_message(ring, sequence, -1, 0, playerstate, delta_num=1)))
+            continue
+        sent = []
+        if sequence in changed:
+            sent.append((commands[-1][1] + 1, 'cs %d "changed %d"' % (random.choice(list(configstrings)), sequence)))
+            commands.append((sequence * 50,) + sent[-1])
+        delta = random.choice([-1] + [d for d in (sequence - 1, sequence - 2) if d > first_sequence + 1])
+        messages.append((sequence, snapshot_message(ring, sequence, delta, sequence * 50, playerstate, commands=sent)))
+        expected.append((sequence * 50, playerstate, len(entities), state))
+    return messages, configstrings, expected, commands
+
+class DemoTestCase(unittest.TestCase):
+    def setUp(self):
+        fd, self.path = tempfile.mkstemp(suffix='.dm_68')
+        os.close(fd)
+
+    def tearDown(self):
+        os.unlink(self.path)
+
+    def write_demo(self, data):
+        with open(self.path, 'wb') as f:
+            f.write(data)
+
+    def test_demo_reader(self):
+        messages = [random_message() for _ in range(100)]
+        self.write_demo(demo_bytes((i + 5, data) for i, (data, _) in enumerate(messages)) + b'trailing junk')
+        demo = q3huff.DemoReader(self.path)
+        readers = []
+        for i, (sequence, reader) in enumerate(demo):
+            assert sequence == i + 5
+            readers.append(reader)
+        assert len(readers) == len(messages) and not demo.truncated
+        assert demo.offset == demo.size - len(b'trailing junk') - 8
+        del demo
+        # readers keep the mapping alive
+        for reader, (_, values) in zip(readers, messages):
+            assert [reader.read_long() & 0xFFFFFFFF for _ in values] == values
+            assert reader.read_string() == 'end'
+            # reading on stops at the end of the message
+            for _ in range(4):
+                reader.read_long()
+            assert reader.read_byte() == -1
+
+    def test_truncated(self):
+        messages = [(i, random_message()[0]) for i in range(3)]
+        data = demo_bytes(messages, end=False)
+        # inside the header and inside the body of the first message
+        for cut in (0, 4, 8 + len(messages[0][1]) - 1, len(data) - 1, len(data)):
+            self.write_demo(data[:cut])
+            demo = q3huff.DemoReader(self.path)
+            count = len(list(demo))
+            assert demo.truncated == (cut not in (0, len(data)))
+            assert count == (3 if cut == len(data) else 2 if cut == len(data) - 1 else 0)
+        self.write_demo(struct.pack('<ii', 0, q3huff.MAX_MSGLEN + 1) + bytes(q3huff.MAX_MSGLEN + 1))
+        with self.assertRaises(ValueError):
+            list(q3huff.DemoReader(self.path))
+        with self.assertRaises(OSError):
+            q3huff.DemoReader(self.path + '.missing')
+
+    def test_demo_writer(self):
+        messages = []
+        for i in range(300):
+            writer = q3huff.Writer()
+            for _ in range(random.choice([1, 10, 400])):
+                writer.write_long(random.getrandbits(32))
+            messages.append((i + 7, writer))
+        expected = demo_bytes((sequence, writer.data) for sequence, writer in messages)
+        for buffer_size in (0, 100, 4096, 1 << 20):
+            sync_bytes = random.choice([0, 1000])
+            with q3huff.DemoWriter(self.path, buffer_size=buffer_size, sync_bytes=sync_bytes) as demo:
+                for sequence, writer in messages:
+                    # writers and plain buffers alike
+                    demo.write(sequence, writer if sequence % 2 else writer.data)
+                    if sequence % 50 == 0:
+                        demo.flush(sync=True)
+                assert demo.offset == len(expected) - 8
+            assert demo.closed
+            with open(self.path, 'rb') as f:
+                assert f.read() == expected
+        # appending to a demo left without its end marker
+        demo = q3huff.DemoWriter(self.path)
+        demo.write(*messages[0])
+        demo.close(end=False)
+        with self.assertRaises(ValueError):
+            demo.write(*messages[1])
+        with q3huff.DemoWriter(self.path, append=True) as demo:
+            demo.write(*messages[1])
+        with open(self.path, 'rb') as f:
+            assert f.read() == demo_bytes((sequence, writer.data) for sequence, writer in messages[:2])
+        writer = q3huff.Writer()
+        while not writer.overflow:
+            writer.write_long(random.getrandbits(32))
+        with q3huff.DemoWriter(self.path) as demo:
+            with self.assertRaises(ValueError):
+                demo.write(0, writer)
+            with self.assertRaises(ValueError):
+                demo.write(0, bytes(q3huff.MAX_MSGLEN + 1))
+        with self.assertRaises(OSError):
+            q3huff.DemoWriter(os.path.join(self.path + '.missing', 'demo'))
+
+    def check_processed(self, result, games):
+        snapshots = [s for _, _, expected, _ in games for s in expected]
+        assert struct.unpack('<%di' % len(snapshots), result['server_times']) == tuple(s[0] for s in snapshots)
+        assert result['playerstates'] == b''.join(s[1] for s in snapshots)
+        assert struct.unpack('<%di' % len(snapshots), result['entity_counts']) == tuple(s[2] for s in snapshots)
+        assert result['entities'] == b''.join(s[3] for s in snapshots)
+        assert result['commands'] == [c[1:] for g in games for c in g[3]]
+        first = 0
+        for gamestate, (_, configstrings, expected, _) in zip(result['gamestates'], games):
+            assert gamestate == (first, 3, configstrings)
+            first += len(expected)
+        assert len(result['gamestates']) == len(games)
+
+    def test_process_demos(self):
+        paths = []
+        games = []
+        try:
+            for i in range(4):
+                fd, path = tempfile.mkstemp(suffix='.dm_68')
+                os.close(fd)
+                paths.append(path)
+                games.append([random_game(100 * j + 10, random.randint(2, 40), random.randint(0, 3)) for j in range(i + 1)])
+                with open(path, 'wb') as f:
+                    f.write(demo_bytes(m for messages, _, _, _ in games[-1] for m in messages))
+            for threads in (1, 4):
+                results = q3huff.process_demos(paths, threads=threads)
+                assert len(results) == len(paths)
+                for result, file_games in zip(results, games):
+                    assert result['error'] is None and not result['truncated']
+                    self.check_processed(result, file_games)
+        finally:
+            for path in paths:
+                os.unlink(path)
+        with self.assertRaises(OSError):
+            q3huff.process_demos([self.path + '.missing'])
+
+    def test_process_errors(self):
+        games = [random_game(100 * j + 10, 10) for j in range(3)]
+        messages = [m for g in games for m in g[0]]
+        # a bad command byte in the second game ends the demo there
+        bad = len(games[0][0]) + 4
+        writer = q3huff.Writer()
+        writer.write_long(0)
+        writer.write_byte(42)
+        messages[bad] = (messages[bad][0], writer.data)
+        data = demo_bytes(messages)
+        self.write_demo(data)
+        result, = q3huff.process_demos([self.path])
+        assert result['error'] is not None and 'illegible' in result['error']
+        kept = games[1][2][:2]
+        self.check_processed(result, [games[0], (None, games[1][1], kept, games[1][3])])
+        self.write_demo(data[:-20])
+        result, = q3huff.process_demos([self.path])
+        assert result['truncated']
+
+        # configstrings of a gamestate that fails to parse are dropped with it
+        writer = q3huff.Writer()
+        writer.write_long(0)
+        writer.write_byte(2)  # svc_gamestate
+        writer.write_long(1)
+        for index, string in sorted(games[1][1].items()):
+            writer.write_byte(3)  # svc_configstring
+            writer.write_short(index)
+            writer.write_bigstring(string)
+        writer.write_byte(42)
+        messages = games[0][0] + [(games[1][0][0][0], writer.data)] + games[1][0][1:]
+        self.write_demo(demo_bytes(messages))
+        for threads in (1, 4):
+            result, = q3huff.process_demos([self.path], threads=threads)
+            assert result['error'] is not None and 'gamestate' in result['error']
+            assert [gs[2] for gs in result['gamestates']] == [games[0][1]]
+        try:
+            q3huff.index_demo(self.path)
+            result = q3huff.read_demo(self.path, 0, 10 ** 9)
+            assert [gs[2] for gs in result['gamestates']] == [games[0][1]]
+        finally:
+            os.unlink(self.path + '.idx')
+
+    def test_demo_index(self):
+        games = [random_game(1000 * j + 10, 100) for j in range(3)]
+        self.write_demo(demo_bytes(m for g in games for m in g[0]))
+        try:
+            assert q3huff.index_demo(self.path, interval=500, threads=2) > 3 * 4
+            full, = q3huff.process_demos([self.path])
+            times = array.array('i', full['server_times'])
+            counts = array.array('i', full['entity_counts'])
+            for start in [0, 600, 2400, 15000, 51234, 100500, 10 ** 9]:
+                end = start + random.randint(0, 3000)
+                result = q3huff.read_demo(self.path, start, end)
+                assert result['error'] is None
+                first = bisect.bisect_left(times, start)
+                last = bisect.bisect_left(times, end)
+                assert result['server_times'] == times[first:last].tobytes()
+                assert result['entity_counts'] == counts[first:last].tobytes()
+                size = q3huff.PLAYERSTATE_SIZE
+                assert result['playerstates'] == full['playerstates'][first * size:last * size]
+                size = q3huff.ENTITYSTATE_SIZE
+                assert result['entities'] == full['entities'][sum(counts[:first]) * size:sum(counts[:last]) * size]
+                # the gamestates in effect come along
+                if last > first:
+                    assert result['gamestates'][-1][2] == games[times[last - 1] // 50000][1]
+        finally:
+            os.unlink(self.path + '.idx')
+
+        index = os.path.join(os.path.dirname(self.path), 'other.idx')
+        try:
+            q3huff.index_demo(self.path, index_path=index)
+            self.write_demo(demo_bytes(games[0][0]))
+            with self.assertRaises(ValueError):
+                q3huff.read_demo(self.path, 0, index_path=index)
+        finally:
+            os.unlink(index)
+        with self.assertRaises(OSError):
+            q3huff.read_demo(self.path, 0)
+
+    def check_slice(self, result, full, first, last):
+        times = array.array('i', full['server_times'])
+        counts = array.array('i', full['entity_counts'])
+        assert result['server_times'] == times[first:last].tobytes()
+        assert result['entity_counts'] == counts[first:last].tobytes()
+        size = q3huff.PLAYERSTATE_SIZE
+        assert result['playerstates'] == full['playerstates'][first * size:last * size]
+        size = q3huff.ENTITYSTATE_SIZE
+        assert result['entities'] == full['entities'][sum(counts[:first]) * size:sum(counts[:last]) * size]
+
+    def test_cut_demo(self):
+        games = [random_game(1000 * j + 10, 60, 8) for j in range(3)]
+        data = demo_bytes(m for g in games for m in g[0])
+        self.write_demo(data)
+        out = self.path + '.cut'
+        full, = q3huff.process_demos([self.path])
+        times = array.array('i', full['server_times'])
+        try:
+            q3huff.index_demo(self.path, interval=500)
+            for start in [0, 600, 1234, 51500, 52900, 100660, 102000, 150000]:
+                end = random.choice([None, start + random.randint(1, 3000)])
+                first = bisect.bisect_left(times, start)
+                last = len(times) if end is None else bisect.bisect_left(times, end)
+                for index_path in (None, self.path + '.idx'):
+                    if first == last:
+                        with self.assertRaises(ValueError):
+                            q3huff.cut_demo(self.path, out, start, end, index_path=index_path)
+                        continue
+                    assert q3huff.cut_demo(self.path, out, start, end, index_path=index_path) >= 2
+                    assert os.path.getsize(out) < len(data)
+                    result, = q3huff.process_demos([out])
+                    assert result['error'] is None and not result['truncated']
+                    self.check_slice(result, full, first, last)
+                    # the configstrings as changed up to the cut
+                    game = games[times[first] // 50000]
+                    configstrings = dict(game[1])
+                    for time, _, command in game[3]:
+                        if 0 < time <= times[first]:
+                            index, string = command.split(' ', 2)[1:]
+                            configstrings[int(index)] = string.strip('"')
+                    assert result['gamestates'][0] == (0, 3, configstrings)
+                    # then the commands from the cut on, with the gamestates
+                    # of the games started before the end
+                    last_game = len(games) if last == len(times) else times[last] // 50000 + 1
+                    assert result['commands'] == [
+                        c[1:] for j, g in enumerate(games) for c in g[3]
+                        if times[first] <= c[0] <= times[last - 1] or not c[0] and g is not game and j < last_game
+                        and times[first] < g[2][0][0]]
+            with self.assertRaises(ValueError):
+                q3huff.cut_demo(self.path, out, 10 ** 9)
+        finally:
+            os.unlink(self.path + '.idx')
+            if os.path.exists(out):
+                os.unlink(out)
+
+    def test_concat_demos(self):
+        games = [random_game(random.randint(10, 200), random.randint(2, 40)) for _ in range(3)]
+        paths = [self.path + '.%d' % i for i in range(len(games))]
+        try:
+            for path, game in zip(paths, games):
+                with open(path, 'wb') as f:
+                    f.write(demo_bytes(game[0]))
+            assert q3huff.concat_demos(paths, self.path) == sum(len(g[0]) for g in games)
+            # the sequences go on from one demo to the next
+            sequences = [sequence for sequence, _ in q3huff.DemoReader(self.path)]
+            assert sequences == sorted(set(sequences))
+            result, = q3huff.process_demos([self.path])
+            assert result['error'] is None
+            snapshots = [s for g in games for s in g[2]]
+            assert result['server_times'] == struct.pack('<%di' % len(snapshots), *(s[0] for s in snapshots))
+            assert result['playerstates'] == b''.join(s[1] for s in snapshots)
+            assert result['entities'] == b''.join(s[3] for s in snapshots)
+            assert [gamestate[2] for gamestate in result['gamestates']] == [g[1] for g in games]
+            # every part has to start with a gamestate
+            with open(paths[1], 'wb') as f:
+                f.write(demo_bytes(games[1][0][1:]))
+            with self.assertRaises(ValueError):
+                q3huff.concat_demos(paths, self.path)
+            with self.assertRaises(OSError):
+                q3huff.concat_demos([self.path + '.missing'], self.path)
+        finally:
+            for path in paths:
+                os.unlink(path)
+
+if __name__ == '__main__':
+    unittest.main()
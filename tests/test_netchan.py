@@ -0,0 +1,376 @@
+#!/usr/bin/env python
+
+import q3huff
+import random
+import select
+import socket
+import struct
+import unittest
+
+FRAGMENT_BIT = 1 << 31
+
+def random_message(count):
+    writer = q3huff.Writer()
+    values = [random.getrandbits(32) for _ in range(count)]
+    for value in values:
+        writer.write_long(value)
+    return writer.data, values
+
+def datagrams(sequence, data, qport=None, fragment_size=q3huff.FRAGMENT_SIZE):
+    """The packets a message is sent as, like Netchan_Transmit."""
+    header = (lambda s: struct.pack('<I', s) + (b'' if qport is None else struct.pack('<H', qport)))
+    if len(data) < fragment_size:
+        return [header(sequence) + data]
+    packets = []
+    start = 0
+    while True:
+        length = min(fragment_size, len(data) - start)
+        packets.append(header(sequence | FRAGMENT_BIT) + struct.pack('<HH', start, length) +
+                       data[start:start + length])
+        start += length
+        if length < fragment_size:
+            return packets
+
+def check_reader(reader, values):
+    assert [reader.read_long() & 0xFFFFFFFF for _ in values] == values
+
+def scramble(data, start, key, string):
+    """The loop of CL_Netchan_Encode and the others, a byte at a time."""
+    # an empty command reads on into the zeroed rest of its buffer
+    string = string.encode() + b'\0\0'
+    index = 0
+    for i in range(start, len(data)):
+        if not string[index]:
+            index = 0
+        c = string[index]
+        if c > 127 or c == ord('%'):
+            c = ord('.')
+        key = (key ^ (c << (i & 1))) & 0xFF
+        index += 1
+        data[i] ^= key
+    return data
+
+def random_command():
+    return ''.join(random.choice('abc %\xe9') for _ in range(random.choice([0, 1, 2, 7, 30])))
+
+class NetchanTestCase(unittest.TestCase):
+    def test_process(self):
+        for server in (False, True):
+            chan = q3huff.Netchan(server=server)
+            qport = random.getrandbits(16) if server else None
+            for sequence in range(1, 20):
+                data, values = random_message(random.randint(0, 20))
+                packet, = datagrams(sequence, data, qport)
+                reader = chan.process(packet if sequence % 2 else bytearray(packet))
+                check_reader(reader, values)
+                assert chan.incoming_sequence == sequence and chan.dropped == 0
+                # duplicates and late packets are dropped
+                assert chan.process(packet) is None
+            data, values = random_message(5)
+            check_reader(chan.process(datagrams(25, data, qport)[0]), values)
+            assert chan.dropped == 5
+            assert chan.process(datagrams(22, data, qport)[0]) is None
+            # too short for a header
+            assert chan.process(b'\x1a\x00\x00') is None
+            assert chan.incoming_sequence == 25
+
+    def test_fragments(self):
+        chan = q3huff.Netchan(server=True)
+        sequence = 1
+        for count in (300, 325, 1000, 3000):
+            data, values = random_message(count)
+            packets = datagrams(sequence, data, 1234)
+            assert len(packets) > 1 or len(data) < q3huff.FRAGMENT_SIZE
+            if len(data) % q3huff.FRAGMENT_SIZE == 0:
+                assert packets[-1][-4:] == struct.pack('<HH', len(data), 0)
+            for packet in packets[:-1]:
+                assert chan.process(packet) is None
+            reader = chan.process(packets[-1])
+            check_reader(reader, values)
+            assert chan.incoming_sequence == sequence
+            sequence += 1
+
+        # a lost fragment loses the message, the next one still gets through
+        data, values = random_message(1000)
+        packets = datagrams(sequence, data, 1234)
+        assert len(packets) > 2
+        for packet in packets[:1] + packets[2:]:
+            assert chan.process(packet) is None
+        data, values = random_message(1000)
+        for packet in datagrams(sequence + 1, data, 1234):
+            reader = chan.process(packet)
+        check_reader(reader, values)
+        assert chan.dropped == 1
+
+        # readers keep their message while fragments of the next come in
+        readers = []
+        for i in range(3):
+            data, values = random_message(1000)
+            for packet in datagrams(sequence + 2 + i, data, 1234):
+                reader = chan.process(packet)
+            readers.append((reader, values))
+        for reader, values in readers:
+            check_reader(reader, values)
+
+        # a message too long to put together is dropped
+        packets = datagrams(sequence + 10, bytes(q3huff.MAX_MSGLEN + 100), 1234)
+        assert all(chan.process(packet) is None for packet in packets)
+
+    def test_transmit(self):
+        client = q3huff.Netchan(qport=4321)
+        server = q3huff.Netchan(server=True)
+        buffer = bytearray(8 * q3huff.MAX_PACKETLEN)
+        for sequence in range(1, 30):
+            size = random.choice([0, 10, 324, 325, 1000, 3000])
+            writer = q3huff.Writer()
+            values = [random.getrandbits(32) for _ in range(size)]
+            for value in values:
+                writer.write_long(value)
+            if sequence % 5 == 0:
+                # exactly fragment sized, ended by an empty fragment
+                writer = bytes(q3huff.FRAGMENT_SIZE * random.randint(1, 3))
+            data = writer if isinstance(writer, bytes) else writer.data
+            expected = datagrams(sequence, data, 4321)
+
+            how = sequence % 3
+            if how == 0:
+                # a fragment a frame, as the server sends them
+                packets = client.transmit(writer)
+                assert len(packets) == 1
+                assert client.unsent_fragments == (len(data) >= q3huff.FRAGMENT_SIZE)
+                while client.unsent_fragments:
+                    with self.assertRaises(ValueError):
+                        client.transmit(writer)
+                    packets.append(client.transmit_next_fragment())
+                assert client.transmit_next_fragment() is None
+            elif how == 1:
+                packets = client.transmit(writer, fragments=None)
+            else:
+                packets = client.transmit(writer, buffer, fragments=2)
+                assert all(isinstance(packet, memoryview) for packet in packets)
+                packets = [bytes(packet) for packet in packets]
+                while client.unsent_fragments:
+                    packets.append(bytes(client.transmit_next_fragment(buffer)))
+            assert packets == expected
+            assert not client.unsent_fragments and client.outgoing_sequence == sequence + 1
+
+            for packet in packets:
+                reader = server.process(packet)
+            if isinstance(writer, bytes):
+                reader.oob = True
+                assert reader.read_data(len(data)) == data
+            else:
+                check_reader(reader, values)
+            assert server.incoming_sequence == sequence
+
+        # the server end sends no qport
+        packet, = server.transmit(b'hello')
+        assert packet == struct.pack('<i', 1) + b'hello'
+        with self.assertRaises(ValueError):
+            client.transmit(bytes(q3huff.MAX_MSGLEN + 1))
+        with self.assertRaises(ValueError):
+            client.transmit(bytes(3000), bytearray(q3huff.MAX_PACKETLEN - 1))
+        # a buffer too small for all of them sends none
+        sequence = client.outgoing_sequence
+        data = bytes(range(256)) * 9
+        with self.assertRaises(ValueError):
+            client.transmit(data, bytearray(1500), fragments=None)
+        assert client.outgoing_sequence == sequence and not client.unsent_fragments
+        packets = [bytes(packet) for packet in client.transmit(data, bytearray(1500))]
+        while client.unsent_fragments:
+            packets.append(client.transmit_next_fragment())
+        assert packets == datagrams(sequence, data, 4321)
+
+    def test_scramble(self):
+        client = q3huff.Netchan(qport=7)
+        server = q3huff.Netchan(server=True)
+        challenge = random.getrandbits(31)
+        client_commands = [random_command() for _ in range(q3huff.MAX_RELIABLE_COMMANDS)]
+        server_commands = [random_command() for _ in range(q3huff.MAX_RELIABLE_COMMANDS)]
+        for _ in range(30):
+            # client to server, after serverId, messageAcknowledge and reliableAcknowledge
+            values = [random.getrandbits(31) for _ in range(3)]
+            values += [random.getrandbits(32) for _ in range(random.randint(0, 500))]
+            writer = q3huff.Writer()
+            for value in values:
+                writer.write_long(value)
+            plain = bytearray(writer.data)
+            q3huff.client_encode(writer, challenge, server_commands)
+            key = (challenge ^ values[0] ^ values[1]) & 0xFF
+            command = server_commands[values[2] % q3huff.MAX_RELIABLE_COMMANDS]
+            assert writer.data == scramble(plain, 12, key, command)
+            for packet in client.transmit(writer, fragments=None):
+                reader = server.process(packet)
+            q3huff.server_decode(reader, challenge, server_commands)
+            check_reader(reader, values)
+
+            # server to client, after reliableAcknowledge
+            values = [random.getrandbits(31)]
+            values += [random.getrandbits(32) for _ in range(random.randint(0, 500))]
+            writer = q3huff.Writer()
+            for value in values:
+                writer.write_long(value)
+            plain = bytearray(writer.data)
+            command = client_commands[values[0] % q3huff.MAX_RELIABLE_COMMANDS]
+            q3huff.server_encode(writer, challenge, server.outgoing_sequence, command)
+            key = (challenge ^ server.outgoing_sequence) & 0xFF
+            assert writer.data == scramble(plain, 4, key, command)
+            for packet in server.transmit(writer, fragments=None):
+                reader = client.process(packet)
+            q3huff.client_decode(reader, challenge, client_commands)
+            check_reader(reader, values)
+
+        # a reader of the datagram itself is decoded in a copy
+        values = [5, 1, 2, 3]
+        writer = q3huff.Writer()
+        for value in values:
+            writer.write_long(value)
+        q3huff.server_encode(writer, challenge, client.incoming_sequence + 1, client_commands[5])
+        packet = struct.pack('<i', client.incoming_sequence + 1) + writer.data
+        copy = bytes(packet)
+        reader = client.process(packet)
+        q3huff.client_decode(reader, challenge, client_commands)
+        check_reader(reader, values)
+        assert packet == copy
+        with self.assertRaises(ValueError):
+            q3huff.client_decode(reader, challenge, client_commands[1:])
+        with self.assertRaises(TypeError):
+            q3huff.server_encode(reader, challenge, 1, '')
+
+    @unittest.skipUnless(hasattr(q3huff, 'Receiver'), 'needs recvmmsg')
+    def test_receiver(self):
+        server = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        server.bind(('127.0.0.1', 0))
+        clients = [socket.socket(socket.AF_INET, socket.SOCK_DGRAM) for _ in range(2)]
+        for client in clients:
+            client.bind(('127.0.0.1', 0))
+        chans = [q3huff.Netchan(qport=100), q3huff.Netchan(qport=200)]
+        with server, q3huff.Receiver(server, server=True, batch=4, slots=8) as receiver:
+            expected = []
+            sent = 1
+            for i in range(12):
+                n = i % 2
+                data, values = random_message(random.choice([0, 10, 1000]))
+                for packet in chans[n].transmit(data, fragments=None):
+                    clients[n].sendto(packet, server.getsockname())
+                    sent += 1
+                expected.append((clients[n].getsockname(), 100 * (n + 1), i // 2 + 1, values))
+            clients[1].sendto(b'\xff\xff\xff\xffgetstatus', server.getsockname())
+
+            assert select.select([receiver], [], [], 5)[0] == [receiver]
+            # received in order, but readers let go of as they come
+            for address, qport, sequence, values in expected:
+                got = receiver.get(timeout=5)
+                assert got[:3] == (address, qport, sequence)
+                check_reader(got[3], values)
+            address, qport, sequence, reader = receiver.get(timeout=5)
+            assert (address, qport, sequence) == (clients[1].getsockname(), None, -1)
+            assert reader.oob and reader.read_data(9) == b'getstatus'
+            assert receiver.get(timeout=0) is None
+            del got, reader
+
+            # with every slot held, the rest wait in the socket until one comes back
+            held = []
+            for i in range(12):
+                data, values = random_message(5)
+                clients[0].sendto(datagrams(7 + i, data, 100)[0], server.getsockname())
+                held.append(values)
+            readers = []
+            for _ in range(8):
+                readers += receiver.get_batch(max_count=100, timeout=5)
+                if len(readers) == 8:
+                    break
+            assert len(readers) == 8 and receiver.get(timeout=0.2) is None
+            for (_, _, sequence, reader), values in zip(readers, held):
+                check_reader(reader, values)
+            del readers, reader
+            readers = []
+            for _ in range(4):
+                readers += receiver.get_batch(timeout=5)
+                if len(readers) == 4:
+                    break
+            assert [item[2] for item in readers] == list(range(15, 19))
+            assert receiver.received == sent + 12 and receiver.dropped == 0
+        assert receiver.closed
+        # readers outlive the receiver
+        check_reader(readers[-1][3], held[-1])
+        with self.assertRaises(ValueError):
+            receiver.get()
+
+        # the client end gets no qport
+        with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as sock:
+            sock.bind(('127.0.0.1', 0))
+            receiver = q3huff.Receiver(sock)
+            data, values = random_message(3)
+            clients[0].sendto(datagrams(1, data)[0], sock.getsockname())
+            address, qport, sequence, reader = receiver.get(timeout=5)
+            assert qport is None and sequence == 1
+            check_reader(reader, values)
+            receiver.close()
+        for client in clients:
+            client.close()
+
+    @unittest.skipUnless(hasattr(q3huff, 'send_batch'), 'needs sendmmsg')
+    def test_send_batch(self):
+        with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as server, \
+             socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as client:
+            server.bind(('127.0.0.1', 0))
+            server.settimeout(5)
+            address = server.getsockname()
+            chans = [q3huff.Netchan(qport=random.getrandbits(16)) for _ in range(3)]
+            packets, expected = [], []
+            # numbered in order, even with several messages on a channel
+            sequences = {chan: chan.outgoing_sequence for chan in chans}
+            for i in range(20):
+                chan = random.choice(chans + [None])
+                writer = q3huff.Writer()
+                for _ in range(random.choice([0, 10, 400, 1000])):
+                    writer.write_long(random.getrandbits(32))
+                message = random.choice([writer, writer.data, bytearray(writer.data)])
+                if chan:
+                    expected += datagrams(sequences[chan], writer.data, chan.qport)
+                    sequences[chan] += 1
+                    packets.append((address, message, chan))
+                else:
+                    expected.append(writer.data)
+                    packets.append((address, message))
+            assert q3huff.send_batch(client, packets) == len(expected)
+            assert [server.recv(65536) for _ in expected] == expected
+            assert not any(chan.unsent_fragments for chan in chans)
+
+            # nothing is sent or numbered unless all of it is good
+            sequences = [chan.outgoing_sequence for chan in chans]
+            chans[2].transmit(bytes(3000))
+            for bad in [[(address, b'x', chans[0]), (address, b'y', chans[2])],
+                        [(address, b'x', chans[0]), (address, bytes(q3huff.MAX_MSGLEN + 1), chans[1])],
+                        [(address, b'x', chans[0]), ('127.0.0.1', b'x')],
+                        [(address, b'x', chans[0]), (('localhost', 1), b'x')],
+                        [(address, b'x', chans[0]), (address, 'x')],
+                        [(address, b'x', 'chan')]]:
+                with self.assertRaises((TypeError, ValueError)):
+                    q3huff.send_batch(client, bad)
+            assert [chan.outgoing_sequence for chan in chans[:2]] == sequences[:2]
+
+            # a connected socket needs no address, and a receiver puts it back together
+            client.connect(address)
+            with q3huff.Receiver(server, server=True) as receiver:
+                data, values = random_message(2000)
+                sequence = chans[0].outgoing_sequence
+                assert q3huff.send_batch(client, [(None, data, chans[0])]) > 1
+                _, qport, got, reader = receiver.get(timeout=5)
+                assert (qport, got) == (chans[0].qport, sequence)
+                check_reader(reader, values)
+            with self.assertRaises(OSError):
+                q3huff.send_batch(client, [(None, bytes(70000))])
+
+    def test_table(self):
+        table = q3huff.HuffmanTable([random.randint(1, 100) for _ in range(256)])
+        writer = q3huff.Writer(table=table)
+        writer.write_string('hello')
+        chan = q3huff.Netchan(table=table)
+        reader = chan.process(struct.pack('<i', 1) + writer.data)
+        assert reader.table is table
+        assert reader.read_string() == 'hello'
+
+if __name__ == '__main__':
+    unittest.main()
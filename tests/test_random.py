@@ -1,5 +1,6 @@
 #!/usr/bin/env python
 
+import copy
 import os
 import q3huff
 import random
@@ -10,8 +11,77 @@ class Q3HuffTestCase(unittest.TestCase):
         for _ in range(1000):
             random_bytes = os.urandom(random.randint(0, 1000))
             compressed = q3huff.compress(random_bytes)
+            assert q3huff.compressed_size(random_bytes) == len(compressed)
             decompressed = q3huff.decompress(compressed)
             assert random_bytes == decompressed
 
+    def test_canonical(self):
+        self.check_canonical(q3huff.MODE_CANONICAL, 0xC1)
+
+    def test_interleaved(self):
+        self.check_canonical(q3huff.MODE_INTERLEAVED, 0xC4)
+        payload = os.urandom(1000)
+        with self.assertRaises(ValueError):
+            q3huff.decompress(q3huff.compress(payload, mode=q3huff.MODE_CANONICAL), mode=q3huff.MODE_INTERLEAVED)
+
+    def check_canonical(self, mode, tag):
+        for _ in range(200):
+            alphabet = os.urandom(random.randint(1, 256))
+            weights = [2 ** random.randint(0, 20) for _ in alphabet]
+            payload = bytes(random.choices(alphabet, weights, k=random.choice([random.randint(0, 20), random.randint(0, 20000)])))
+            compressed = q3huff.compress(payload, mode=mode)
+            assert compressed[0] == tag
+            assert q3huff.compressed_size(payload, mode=mode) == len(compressed)
+            assert q3huff.decompress(compressed, mode=mode) == payload
+        assert q3huff.decompress(q3huff.compress(b'', mode=mode), mode=mode) == b''
+        with self.assertRaises(ValueError):
+            q3huff.decompress(q3huff.compress(b'abc'), mode=mode)
+        with self.assertRaises(ValueError):
+            q3huff.decompress(compressed[:-1], mode=mode)
+        with self.assertRaises(ValueError):
+            q3huff.compress(b'abc', q3huff.HuffmanDictionary([1] * 256), mode=mode)
+
+    def test_dictionary(self):
+        payloads = [bytes(random.choice(b'abcdef\x00\xff') for _ in range(random.randint(0, 64))) for _ in range(100)]
+        dictionary = q3huff.HuffmanDictionary(q3huff.train_histogram(payloads))
+        for payload in payloads + [os.urandom(random.randint(0, 1000)) for _ in range(100)]:
+            compressed = q3huff.compress(payload, dictionary)
+            assert q3huff.compressed_size(payload, dictionary=dictionary) == len(compressed)
+            assert q3huff.decompress(compressed, dictionary) == payload
+        payload = b'abcabcdef\x00\x00\xff' * 3
+        assert len(q3huff.compress(payload, dictionary)) < len(q3huff.compress(payload))
+        assert len(q3huff.compress(payload, dictionary)) < len(payload)
+        with self.assertRaises(TypeError):
+            q3huff.compress(payload, dictionary=q3huff.HuffmanTable([1] * 256))
+
+    def test_dictionary_serialize(self):
+        histogram = [random.choice([0, 1, 2, 100, 100000]) for _ in range(256)]
+        dictionary = q3huff.HuffmanDictionary(histogram)
+        state = dictionary.serialize()
+        restored = q3huff.HuffmanDictionary.deserialize(state)
+        assert restored.serialize() == state
+        for _ in range(100):
+            payload = os.urandom(random.randint(0, 1000))
+            compressed = q3huff.compress(payload, dictionary)
+            assert q3huff.compress(payload, restored) == compressed
+            assert q3huff.decompress(compressed, restored) == payload
+        for data in (b'', state[:-1], state + b'\0', b'\2' + state[1:]):
+            with self.assertRaises(ValueError):
+                q3huff.HuffmanDictionary.deserialize(data)
+
+    def test_dictionary_copy(self):
+        parent = q3huff.HuffmanDictionary([0] * 256)
+        for _ in range(50):
+            parent.update(bytes(random.choice(b'0123456789:;\\') for _ in range(random.randint(0, 200))))
+        child = copy.copy(parent)
+        assert child.serialize() == parent.serialize()
+        payload = b'\\name\\player\\rate\\25000'
+        compressed = q3huff.compress(payload, parent)
+        assert q3huff.compress(payload, child) == compressed
+        child.update(os.urandom(1000))
+        assert child.serialize() != parent.serialize()
+        assert q3huff.decompress(compressed, parent.copy()) == payload
+        assert q3huff.HuffmanDictionary.deserialize(child.serialize()).serialize() == child.serialize()
+
 if __name__ == '__main__':
     unittest.main()
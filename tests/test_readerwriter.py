@@ -49,6 +49,133 @@ class Q3HuffTestCase(unittest.TestCase):
         reader.oob = True
         assert reader.read_string() == 'end of message'
 
+    def test_cost_of(self):
+        writer = q3huff.Writer()
+        bits = 0
+        for _ in range(1000):
+            if random.randint(0, 9) == 0:
+                data = os.urandom(random.randint(0, 8))
+                bits += writer.cost_of_data(data)
+                writer.write_data(data)
+            else:
+                num_bits = random.randint(1, 32)
+                value = random.getrandbits(num_bits)
+                bits += writer.cost_of(value, num_bits)
+                writer.write_bits(value, num_bits)
+            # nothing is written until the first bit
+            assert len(writer.data) == ((bits >> 3) + 1 if bits else 0)
+
+        writer.oob = True
+        assert writer.cost_of(-1, 16) == 16
+        assert writer.cost_of_data(b'abc') == 24
+
+    def test_checkpoint(self):
+        values = [(random.getrandbits(n), n) for n in (random.randint(1, 32) for _ in range(200))]
+        for split in (0, 1, 57, 100):
+            direct = q3huff.Writer()
+            speculative = q3huff.Writer()
+            for writer in (direct, speculative):
+                for value, num_bits in values[:split]:
+                    writer.write_bits(value, num_bits)
+            token = speculative.checkpoint()
+            for value, num_bits in values[split:]:
+                speculative.write_bits(value ^ 0xffffffff, num_bits)
+            speculative.rollback(token)
+            for writer in (direct, speculative):
+                for value, num_bits in values[split:]:
+                    writer.write_bits(value, num_bits)
+            assert direct.data == speculative.data
+        self.assertRaises(ValueError, direct.rollback, (1 << 30, 0, False))
+
+    def test_remaining_bits(self):
+        writer = q3huff.Writer()
+        while True:
+            value, num_bits = random.getrandbits(32), 32
+            fits = writer.cost_of(value, num_bits) <= writer.remaining_bits
+            data = writer.data
+            writer.write_bits(value, num_bits)
+            assert writer.overflow != fits
+            if not fits:
+                assert writer.data == data
+                break
+        assert len(writer.data) <= 16384
+        token = writer.checkpoint()
+        writer.rollback(token)
+        assert writer.overflow
+
+    def test_append_bits(self):
+        def random_values():
+            return [(random.getrandbits(n), n) for n in (random.randint(1, 32) for _ in range(random.randint(0, 60)))]
+        for _ in range(200):
+            head, tail = random_values(), random_values()
+            direct = q3huff.Writer()
+            spliced = q3huff.Writer()
+            fragment = q3huff.Writer()
+            for value, num_bits in head:
+                direct.write_bits(value, num_bits)
+                spliced.write_bits(value, num_bits)
+            for value, num_bits in tail:
+                direct.write_bits(value, num_bits)
+                fragment.write_bits(value, num_bits)
+            if random.randint(0, 1):
+                spliced.append_bits(fragment)
+            else:
+                spliced.append_bits(fragment.data, fragment.bit_length)
+            assert spliced.bit_length == direct.bit_length
+            assert spliced.data == direct.data
+
+        writer = q3huff.Writer()
+        writer.write_bits(5, 3)
+        writer.append_bits(writer)
+        writer.append_bits(b'\xff', 2)
+        assert writer.bit_length == 8
+        assert writer.data == b'\xed\x00'
+        self.assertRaises(ValueError, writer.append_bits, b'\xff', 9)
+
+    def test_huffman_table(self):
+        payloads = [bytes(random.choice(b'abc\x00') for _ in range(100)) for _ in range(20)]
+        histogram = q3huff.train_histogram(payloads)
+        assert sum(histogram) == 2000 and histogram[ord('z')] == 0
+        assert q3huff.train_histogram(payloads, histogram) == [n * 2 for n in histogram]
+
+        table = q3huff.HuffmanTable(histogram)
+        assert max(table.code_lengths()[c] for c in b'abc\x00') <= 3
+        default = q3huff.Writer()
+        trained = q3huff.Writer(table=table)
+        assert trained.table is table and default.table is None
+        bits = 0
+        for payload in payloads:
+            default.write_data(payload)
+            bits += trained.cost_of_data(payload)
+            trained.write_data(payload)
+        trained.write_data(b'xyz')
+        assert trained.bit_length == bits + trained.cost_of_data(b'xyz')
+        assert len(trained.data) < len(default.data) // 2
+
+        reader = q3huff.Reader(trained.data, table=table)
+        for payload in payloads:
+            assert reader.read_data(len(payload)) == payload
+        assert reader.read_data(3) == b'xyz'
+
+        # the cache must not hand out bits encoded with another table
+        cache = q3huff.DeltaCache()
+        frm, to = bytes(q3huff.ENTITYSTATE_SIZE), b'\x00' * 4 + b'\x01' * (q3huff.ENTITYSTATE_SIZE - 4)
+        for writer in (q3huff.Writer(), q3huff.Writer(table=table)):
+            cache.write_delta_entity(writer, 1, 2, frm, to)
+            direct = q3huff.Writer(table=writer.table)
+            direct.write_delta_entity(frm, to)
+            assert writer.data == direct.data
+        assert cache.misses == 2
+
+        trained.table = None
+        trained.reset()
+        assert trained.table is None
+        reader.reset(default.data)
+        reader.table = None
+        assert reader.read_data(100) == payloads[0]
+        self.assertRaises(TypeError, q3huff.Writer, table=histogram)
+        self.assertRaises(ValueError, q3huff.HuffmanTable, histogram[:-1])
+
 if __name__ == '__main__':
     unittest.main()
 